@@ -0,0 +1,440 @@
+/*********************************************************
+ * Copyright (C) 2026 old-vmware-modules contributors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * vmci_dgram.c --
+ *
+ *      Concurrent datagram dispatch microbenchmark for the vmci module.
+ *
+ *      Opens /dev/vmci once per context and registers each file as a VM
+ *      context, the way the VMX does. Worker threads, each pinned to its
+ *      own CPU, own a share of the contexts. In every round a worker
+ *      sends one datagram from each of its contexts to the next context
+ *      in turn, so that all contexts talk to all others, then drains the
+ *      receive queues of its contexts. Every dispatch looks up the
+ *      source and the destination context, so with many contexts and
+ *      many workers this loads the context lookup from all CPUs at once.
+ *
+ *      The default mode receives with IOCTL_VMCI_DATAGRAM_RECEIVE, which
+ *      every vmci module supports, so the same binary measures the module
+ *      before and after a change. -b uses IOCTL_VMCI_DATAGRAM_RECEIVE_BATCH
+ *      instead, which only newer modules implement.
+ *
+ *      Usage: vmci_dgram [-c contexts] [-w workers] [-s payload] [-t seconds] [-b]
+ *
+ *      Reports the datagrams dispatched, the datagrams received and the
+ *      sends refused because the destination queue was full, per second.
+ *      Run it as root, with the module loaded.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "vmci_defs.h"
+#include "vmci_call_defs.h"
+#include "vmci_iocontrols.h"
+
+#define DG_FIRST_CID     0x10000 // clear of the reserved and usual VM cids
+#define DG_RESOURCE      1
+#define DG_CACHE_LINE    64
+
+typedef struct DgContext {
+   int    fd;
+   VMCIId cid;
+   int    next;                 // index of the next destination
+} DgContext;
+
+typedef struct DgWorker {
+   int       index;
+   int       cpu;
+   uint64    sent;              // owned by the worker thread
+   uint64    full;
+   uint64    failed;
+   uint64    received;
+   char      pad[DG_CACHE_LINE];
+} DgWorker;
+
+static volatile int dgStop;
+static pthread_barrier_t dgStart;
+static DgContext *dgContexts;
+static int dgNumContexts = 64;
+static int dgNumWorkers;
+static unsigned dgPayload = 64;
+static int dgBatch;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DgOpenContext --
+ *
+ *      Opens /dev/vmci and registers the file as a context, asking for
+ *      cid. The driver picks another cid if that one is taken.
+ *
+ * Results:
+ *      0 on success, -1 with a message printed on failure.
+ *
+ * Side effects:
+ *      ctx->fd is open and ctx->cid set on success.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DgOpenContext(VMCIId cid,     // IN
+              DgContext *ctx) // OUT
+{
+   int version = VMCI_VERSION;
+   VMCIInitBlock initBlock;
+
+   ctx->fd = open("/dev/vmci", O_RDWR);
+   if (ctx->fd < 0) {
+      fprintf(stderr, "open /dev/vmci: %s\n", strerror(errno));
+      return -1;
+   }
+
+   /* A context needs the user version set before it can be created. */
+   memset(&initBlock, 0, sizeof initBlock);
+   initBlock.cid = cid;
+   if (ioctl(ctx->fd, IOCTL_VMCI_VERSION2, &version) < 0 ||
+       ioctl(ctx->fd, IOCTL_VMCI_INIT_CONTEXT, &initBlock) < 0) {
+      fprintf(stderr, "creating context 0x%x: %s\n", cid, strerror(errno));
+      close(ctx->fd);
+      ctx->fd = -1;
+      return -1;
+   }
+   ctx->cid = initBlock.cid;
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DgPin --
+ *
+ *      Pins the calling thread to cpu.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Changes the affinity of the thread, warns if that fails.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DgPin(int cpu) // IN
+{
+   cpu_set_t set;
+
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0) {
+      fprintf(stderr, "warning: cannot pin to CPU %d\n", cpu);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DgSend --
+ *
+ *      Sends one datagram from ctx to the next context in turn.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the send counters of worker.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DgSend(DgWorker *worker,  // IN/OUT
+       DgContext *ctx,    // IN/OUT
+       VMCIDatagram *dg)  // IN/OUT
+{
+   VMCIDatagramSendRecvInfo sendInfo;
+   DgContext *dst;
+
+   ctx->next = (ctx->next + 1) % dgNumContexts;
+   if (&dgContexts[ctx->next] == ctx) {
+      ctx->next = (ctx->next + 1) % dgNumContexts;
+   }
+   dst = &dgContexts[ctx->next];
+
+   dg->dst = VMCI_MAKE_HANDLE(dst->cid, DG_RESOURCE);
+   dg->src = VMCI_MAKE_HANDLE(ctx->cid, DG_RESOURCE);
+
+   sendInfo.addr = (VA64)(uintptr_t)dg;
+   sendInfo.len = VMCI_DG_SIZE(dg);
+   sendInfo.result = 0;
+   if (ioctl(ctx->fd, IOCTL_VMCI_DATAGRAM_SEND, &sendInfo) < 0) {
+      worker->failed++;
+   } else if (sendInfo.result >= VMCI_SUCCESS) {
+      worker->sent++;
+   } else if (sendInfo.result == VMCI_ERROR_NO_RESOURCES) {
+      worker->full++;
+   } else {
+      worker->failed++;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DgDrain --
+ *
+ *      Receives the datagrams queued on ctx, at most a batch worth.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the receive counter of worker.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DgDrain(DgWorker *worker, // IN/OUT
+        DgContext *ctx,   // IN
+        char *buf,        // OUT: scratch
+        uint32 bufLen)    // IN
+{
+   VMCIDatagramSendRecvInfo recvInfo;
+   VMCIDatagramRecvBatchInfo batchInfo;
+   int i;
+
+   if (dgBatch) {
+      memset(&batchInfo, 0, sizeof batchInfo);
+      batchInfo.addr = (VA64)(uintptr_t)buf;
+      batchInfo.len = bufLen;
+      if (ioctl(ctx->fd, IOCTL_VMCI_DATAGRAM_RECEIVE_BATCH, &batchInfo) == 0 &&
+          batchInfo.result >= VMCI_SUCCESS) {
+         worker->received += batchInfo.count;
+      }
+      return;
+   }
+
+   for (i = 0; i < VMCI_MAX_DG_RECV_BATCH; i++) {
+      recvInfo.addr = (VA64)(uintptr_t)buf;
+      recvInfo.len = bufLen;
+      recvInfo.result = 0;
+      if (ioctl(ctx->fd, IOCTL_VMCI_DATAGRAM_RECEIVE, &recvInfo) < 0 ||
+          recvInfo.result < VMCI_SUCCESS) {
+         return;
+      }
+      worker->received++;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DgWorkerMain --
+ *
+ *      Worker thread: sends from and drains the contexts it owns, those
+ *      whose index modulo the number of workers is its own, until told
+ *      to stop.
+ *
+ * Results:
+ *      NULL.
+ *
+ * Side effects:
+ *      Updates the worker counters.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void *
+DgWorkerMain(void *arg) // IN: DgWorker
+{
+   DgWorker *worker = arg;
+   uint32 bufLen = VMCI_MAX_DG_RECV_BATCH *
+                   ((sizeof (VMCIDatagram) + dgPayload + 7) & ~7);
+   VMCIDatagram *dg = calloc(1, sizeof *dg + dgPayload);
+   char *buf = malloc(bufLen);
+   int i;
+
+   if (dg == NULL || buf == NULL) {
+      dgStop = 1;
+   } else {
+      dg->payloadSize = dgPayload;
+   }
+
+   DgPin(worker->cpu);
+   pthread_barrier_wait(&dgStart);
+
+   while (!dgStop) {
+      for (i = worker->index; i < dgNumContexts; i += dgNumWorkers) {
+         DgSend(worker, &dgContexts[i], dg);
+      }
+      for (i = worker->index; i < dgNumContexts; i += dgNumWorkers) {
+         DgDrain(worker, &dgContexts[i], buf, bufLen);
+      }
+   }
+
+   free(buf);
+   free(dg);
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DgUsage --
+ *
+ *      Prints the command line syntax and exits.
+ *
+ * Results:
+ *      Does not return.
+ *
+ * Side effects:
+ *      Exits the process.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DgUsage(const char *prog) // IN
+{
+   fprintf(stderr,
+           "usage: %s [-c contexts] [-w workers] [-s payload] [-t seconds] "
+           "[-b]\n"
+           "  -c contexts  VM contexts to create, at least 2 (default 64)\n"
+           "  -w workers   worker threads, one per CPU (default CPUs)\n"
+           "  -s payload   datagram payload in bytes, up to %u (default 64)\n"
+           "  -t seconds   measurement time (default 10)\n"
+           "  -b           receive with IOCTL_VMCI_DATAGRAM_RECEIVE_BATCH\n",
+           prog, (unsigned)VMCI_MAX_DG_PAYLOAD_SIZE);
+   exit(2);
+}
+
+
+int
+main(int argc,     // IN
+     char **argv)  // IN
+{
+   int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   int seconds = 10;
+   DgWorker *workers;
+   pthread_t *threads;
+   struct timespec start;
+   struct timespec end;
+   uint64 sent = 0;
+   uint64 full = 0;
+   uint64 failed = 0;
+   uint64 received = 0;
+   double elapsed;
+   int opt;
+   int i;
+
+   dgNumWorkers = ncpu;
+   while ((opt = getopt(argc, argv, "c:w:s:t:b")) != -1) {
+      switch (opt) {
+      case 'c': dgNumContexts = atoi(optarg); break;
+      case 'w': dgNumWorkers = atoi(optarg); break;
+      case 's': dgPayload = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'b': dgBatch = 1; break;
+      default:  DgUsage(argv[0]);
+      }
+   }
+   if (dgNumContexts < 2 || dgNumWorkers < 1 || seconds < 1 ||
+       dgPayload > VMCI_MAX_DG_PAYLOAD_SIZE) {
+      DgUsage(argv[0]);
+   }
+   if (dgNumWorkers > dgNumContexts) {
+      dgNumWorkers = dgNumContexts;
+   }
+
+   dgContexts = calloc(dgNumContexts, sizeof *dgContexts);
+   workers = calloc(dgNumWorkers, sizeof *workers);
+   threads = calloc(dgNumWorkers, sizeof *threads);
+   if (dgContexts == NULL || workers == NULL || threads == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+
+   for (i = 0; i < dgNumContexts; i++) {
+      if (DgOpenContext(DG_FIRST_CID + i, &dgContexts[i]) < 0) {
+         return 1;
+      }
+      dgContexts[i].next = i;
+   }
+
+   pthread_barrier_init(&dgStart, NULL, dgNumWorkers + 1);
+   for (i = 0; i < dgNumWorkers; i++) {
+      workers[i].index = i;
+      workers[i].cpu = i % ncpu;
+      if (pthread_create(&threads[i], NULL, DgWorkerMain, &workers[i])) {
+         fprintf(stderr, "cannot create threads\n");
+         return 1;
+      }
+   }
+
+   pthread_barrier_wait(&dgStart);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   sleep(seconds);
+   dgStop = 1;
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   for (i = 0; i < dgNumWorkers; i++) {
+      pthread_join(threads[i], NULL);
+      sent += workers[i].sent;
+      full += workers[i].full;
+      failed += workers[i].failed;
+      received += workers[i].received;
+   }
+   for (i = 0; i < dgNumContexts; i++) {
+      close(dgContexts[i].fd);
+   }
+
+   elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   printf("vmci: %d contexts, %d workers on %d CPUs, %u byte payload, %s\n",
+          dgNumContexts, dgNumWorkers, ncpu, dgPayload,
+          dgBatch ? "batched receive" : "single receive");
+   printf("dispatched %12.0f datagrams/s\n", sent / elapsed);
+   printf("received   %12.0f datagrams/s\n", received / elapsed);
+   printf("queue full %12.0f sends/s\n", full / elapsed);
+   if (failed != 0) {
+      printf("failed     %12llu sends\n", (unsigned long long)failed);
+   }
+
+   free(threads);
+   free(workers);
+   free(dgContexts);
+   return 0;
+}
@@ -0,0 +1,469 @@
+/*********************************************************
+ * Copyright (C) 2026 old-vmware-modules contributors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * vmnet_fwd.c --
+ *
+ *      Multi-core forwarding microbenchmark for the vmnet module.
+ *
+ *      Opens pairs of userif ports on one hub (/dev/vmnetN), gives every
+ *      port its own MAC address and brings it up, then runs a sender
+ *      and a receiver thread per pair, each pinned to its own CPU. The
+ *      sender pushes unicast frames to its receiver through the hub as
+ *      fast as it can; every frame crosses VNetSend twice (port to hub
+ *      jack, hub jack to port), so all pairs together load the peer
+ *      lookup and the jack statistics from all CPUs at once.
+ *
+ *      The default mode uses plain write() and read(), which every vmnet
+ *      module supports, so the same binary measures the module before
+ *      and after a change. -b uses SIOCSENDBATCH and SIOCRECVBATCH
+ *      instead, which only newer modules implement.
+ *
+ *      Usage: vmnet_fwd [-n vnet] [-p pairs] [-s size] [-t seconds] [-b batch]
+ *
+ *      Reports the frames offered by the senders and the frames the
+ *      receivers got, per second, and the delivered throughput. Run it
+ *      as root, with the module loaded, on an otherwise idle hub.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+
+#include "vnet.h"
+
+#define FWD_ETHERTYPE    0x88B5  // IEEE local experimental
+#define FWD_MIN_FRAME    60
+#define FWD_CACHE_LINE   64
+
+typedef struct FwdPort {
+   int           fd;
+   unsigned char mac[6];
+   int           cpu;
+   uint64        frames;       // sent or received, owned by the thread
+   uint64        bytes;
+   char          pad[FWD_CACHE_LINE];
+} FwdPort;
+
+typedef struct FwdPair {
+   FwdPort tx;
+   FwdPort rx;
+} FwdPair;
+
+static volatile int fwdStop;
+static pthread_barrier_t fwdStart;
+static unsigned fwdFrameSize = FWD_MIN_FRAME;
+static unsigned fwdBatch;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FwdBuildFrame --
+ *
+ *      Fills in an Ethernet frame from src to dst of fwdFrameSize bytes.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FwdBuildFrame(unsigned char *frame,     // OUT
+              const unsigned char *dst, // IN
+              const unsigned char *src) // IN
+{
+   memset(frame, 0, fwdFrameSize);
+   memcpy(frame, dst, 6);
+   memcpy(frame + 6, src, 6);
+   frame[12] = FWD_ETHERTYPE >> 8;
+   frame[13] = FWD_ETHERTYPE & 0xff;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FwdOpenPort --
+ *
+ *      Opens a userif port on hub vnet, sets its MAC address and brings
+ *      it up.
+ *
+ * Results:
+ *      0 on success, -1 with a message printed on failure.
+ *
+ * Side effects:
+ *      port->fd is open on success.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+FwdOpenPort(int vnet,      // IN
+            FwdPort *port) // IN/OUT
+{
+   char path[32];
+   VNet_SetMacAddrIOCTL macAddr;
+   uint32 flags = IFF_UP | IFF_BROADCAST;
+
+   snprintf(path, sizeof path, "/dev/vmnet%d", vnet);
+   port->fd = open(path, O_RDWR | O_NONBLOCK);
+   if (port->fd < 0) {
+      fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+      return -1;
+   }
+
+   memset(&macAddr, 0, sizeof macAddr);
+   macAddr.version = 1;
+   memcpy(macAddr.addr, port->mac, sizeof macAddr.addr);
+   if (ioctl(port->fd, SIOCSETMACADDR, &macAddr) < 0 ||
+       ioctl(port->fd, SIOCSIFFLAGS, &flags) < 0) {
+      fprintf(stderr, "setting up %s: %s\n", path, strerror(errno));
+      close(port->fd);
+      port->fd = -1;
+      return -1;
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FwdPin --
+ *
+ *      Pins the calling thread to cpu.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Changes the affinity of the thread, warns if that fails.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FwdPin(int cpu) // IN
+{
+   cpu_set_t set;
+
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0) {
+      fprintf(stderr, "warning: cannot pin to CPU %d\n", cpu);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FwdSender --
+ *
+ *      Sender thread: writes frames to the pair's receiver until told to
+ *      stop. Frames the hub or the receiver drops still count as sent.
+ *
+ * Results:
+ *      NULL.
+ *
+ * Side effects:
+ *      Updates pair->tx counters.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void *
+FwdSender(void *arg) // IN: FwdPair
+{
+   FwdPair *pair = arg;
+   FwdPort *port = &pair->tx;
+   unsigned frameLen = VNET_BATCH_FRAME_SIZE(fwdFrameSize);
+   unsigned count = fwdBatch ? fwdBatch : 1;
+   unsigned char *buf = calloc(count, frameLen);
+   VNet_SendBatch batch;
+   unsigned i;
+
+   if (buf == NULL) {
+      fwdStop = 1;
+   } else if (fwdBatch) {
+      for (i = 0; i < count; i++) {
+         VNet_BatchFrame *hdr = (VNet_BatchFrame *)(buf + i * frameLen);
+
+         hdr->len = fwdFrameSize;
+         FwdBuildFrame((unsigned char *)(hdr + 1), pair->rx.mac, port->mac);
+      }
+   } else {
+      FwdBuildFrame(buf, pair->rx.mac, port->mac);
+   }
+
+   FwdPin(port->cpu);
+   pthread_barrier_wait(&fwdStart);
+
+   while (!fwdStop) {
+      if (fwdBatch) {
+         memset(&batch, 0, sizeof batch);
+         batch.version = VNET_SENDBATCH_VERSION;
+         batch.numPackets = count;
+         batch.buf = (VA64)(uintptr_t)buf;
+         batch.bufLen = count * frameLen;
+         if (ioctl(port->fd, SIOCSENDBATCH, &batch) < 0) {
+            continue;
+         }
+         port->frames += batch.numSent;
+         port->bytes += (uint64)batch.numSent * fwdFrameSize;
+      } else if (write(port->fd, buf, fwdFrameSize) == fwdFrameSize) {
+         port->frames++;
+         port->bytes += fwdFrameSize;
+      }
+   }
+
+   free(buf);
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FwdReceiver --
+ *
+ *      Receiver thread: drains the pair's receive port until told to
+ *      stop, waiting in poll() whenever the queue is empty.
+ *
+ * Results:
+ *      NULL.
+ *
+ * Side effects:
+ *      Updates pair->rx counters.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void *
+FwdReceiver(void *arg) // IN: FwdPair
+{
+   FwdPair *pair = arg;
+   FwdPort *port = &pair->rx;
+   unsigned count = fwdBatch ? fwdBatch : 1;
+   unsigned bufLen = count * VNET_BATCH_FRAME_SIZE(VNET_MTU);
+   unsigned char *buf = malloc(bufLen);
+   struct pollfd pfd = { .fd = port->fd, .events = POLLIN };
+   VNet_RecvBatch batch;
+   ssize_t len;
+
+   if (buf == NULL) {
+      fwdStop = 1;
+   }
+
+   FwdPin(port->cpu);
+   pthread_barrier_wait(&fwdStart);
+
+   while (!fwdStop) {
+      if (fwdBatch) {
+         memset(&batch, 0, sizeof batch);
+         batch.version = VNET_RECVBATCH_VERSION;
+         batch.maxPackets = count;
+         batch.buf = (VA64)(uintptr_t)buf;
+         batch.bufLen = bufLen;
+         if (ioctl(port->fd, SIOCRECVBATCH, &batch) == 0 &&
+             batch.numPackets != 0) {
+            port->frames += batch.numPackets;
+            port->bytes += batch.bytesUsed -
+                           batch.numPackets * sizeof (VNet_BatchFrame);
+            continue;
+         }
+      } else {
+         len = read(port->fd, buf, bufLen);
+         if (len > 0) {
+            port->frames++;
+            port->bytes += len;
+            continue;
+         }
+      }
+      poll(&pfd, 1, 100);
+   }
+
+   free(buf);
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FwdUsage --
+ *
+ *      Prints the command line syntax and exits.
+ *
+ * Results:
+ *      Does not return.
+ *
+ * Side effects:
+ *      Exits the process.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FwdUsage(const char *prog) // IN
+{
+   fprintf(stderr,
+           "usage: %s [-n vnet] [-p pairs] [-s size] [-t seconds] "
+           "[-b batch]\n"
+           "  -n vnet     hub to use, /dev/vmnet<vnet> (default 0)\n"
+           "  -p pairs    sender/receiver port pairs (default CPUs / 2)\n"
+           "  -s size     frame size in bytes, %d..%d (default %d)\n"
+           "  -t seconds  measurement time (default 10)\n"
+           "  -b batch    frames per SIOCSENDBATCH/SIOCRECVBATCH call,\n"
+           "              0 for write()/read() (default 0)\n",
+           prog, FWD_MIN_FRAME, VNET_MTU, FWD_MIN_FRAME);
+   exit(2);
+}
+
+
+int
+main(int argc,     // IN
+     char **argv)  // IN
+{
+   int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   int vnet = 0;
+   int pairs = ncpu > 1 ? ncpu / 2 : 1;
+   int seconds = 10;
+   FwdPair *pair;
+   pthread_t *threads;
+   unsigned char *frame;
+   struct timespec start;
+   struct timespec end;
+   uint64 txFrames = 0;
+   uint64 rxFrames = 0;
+   uint64 rxBytes = 0;
+   double elapsed;
+   int opt;
+   int i;
+
+   while ((opt = getopt(argc, argv, "n:p:s:t:b:")) != -1) {
+      switch (opt) {
+      case 'n': vnet = atoi(optarg); break;
+      case 'p': pairs = atoi(optarg); break;
+      case 's': fwdFrameSize = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'b': fwdBatch = atoi(optarg); break;
+      default:  FwdUsage(argv[0]);
+      }
+   }
+   if (pairs < 1 || pairs > 255 || seconds < 1 ||
+       fwdFrameSize < FWD_MIN_FRAME || fwdFrameSize > VNET_MTU ||
+       fwdBatch > VNET_SENDBATCH_MAX) {
+      FwdUsage(argv[0]);
+   }
+
+   pair = calloc(pairs, sizeof *pair);
+   threads = calloc(2 * pairs, sizeof *threads);
+   frame = calloc(1, VNET_MTU);
+   if (pair == NULL || threads == NULL || frame == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+
+   /*
+    * Locally administered addresses 02:00:00:00:<pair>:<0 tx, 1 rx>.
+    * Senders and receivers alternate over the CPUs, so with pairs equal
+    * to half the CPUs every CPU runs one thread.
+    */
+
+   for (i = 0; i < pairs; i++) {
+      FwdPort *tx = &pair[i].tx;
+      FwdPort *rx = &pair[i].rx;
+
+      tx->mac[0] = rx->mac[0] = 0x02;
+      tx->mac[4] = rx->mac[4] = i;
+      rx->mac[5] = 1;
+      tx->cpu = (2 * i) % ncpu;
+      rx->cpu = (2 * i + 1) % ncpu;
+      if (FwdOpenPort(vnet, tx) < 0 || FwdOpenPort(vnet, rx) < 0) {
+         return 1;
+      }
+
+      /*
+       * Let a learning hub see the receiver's address first, otherwise
+       * the first frames of every pair are flooded to all ports.
+       */
+
+      FwdBuildFrame(frame, tx->mac, rx->mac);
+      if (write(rx->fd, frame, fwdFrameSize) != fwdFrameSize) {
+         fprintf(stderr, "warning: learning frame not sent: %s\n",
+                 strerror(errno));
+      }
+   }
+
+   pthread_barrier_init(&fwdStart, NULL, 2 * pairs + 1);
+   for (i = 0; i < pairs; i++) {
+      if (pthread_create(&threads[2 * i], NULL, FwdReceiver, &pair[i]) ||
+          pthread_create(&threads[2 * i + 1], NULL, FwdSender, &pair[i])) {
+         fprintf(stderr, "cannot create threads\n");
+         return 1;
+      }
+   }
+
+   pthread_barrier_wait(&fwdStart);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   sleep(seconds);
+   fwdStop = 1;
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   for (i = 0; i < 2 * pairs; i++) {
+      pthread_join(threads[i], NULL);
+   }
+
+   elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   for (i = 0; i < pairs; i++) {
+      txFrames += pair[i].tx.frames;
+      rxFrames += pair[i].rx.frames;
+      rxBytes += pair[i].rx.bytes;
+      close(pair[i].tx.fd);
+      close(pair[i].rx.fd);
+   }
+
+   printf("vmnet%d: %d pairs on %d CPUs, %u byte frames, %s\n",
+          vnet, pairs, ncpu, fwdFrameSize,
+          fwdBatch ? "batched ioctls" : "read/write");
+   printf("offered   %12.0f frames/s\n", txFrames / elapsed);
+   printf("delivered %12.0f frames/s %10.1f Mbit/s (%.1f%% of offered)\n",
+          rxFrames / elapsed, rxBytes * 8 / elapsed / 1e6,
+          txFrames ? 100.0 * rxFrames / txFrames : 0.0);
+
+   free(frame);
+   free(threads);
+   free(pair);
+   return 0;
+}
@@ -46,12 +46,17 @@
  *  itself may be allocated from paged memory. We shadow the size of
  *  the datagram in the non-paged queue entry as this size is used
  *  while holding the same spinlock as above.
+ *
+ *  The context datagram queues allocate the entry and the datagram
+ *  together, see VMCIContext_AllocDatagram: dg then directly follows
+ *  the entry and sizeClass tells which pool the block came from.
  */
 
 typedef struct DatagramQueueEntry {
    ListItem       listItem;  /* For queuing. */
    size_t         dgSize;    /* Size of datagram. */
    VMCIDatagram   *dg;       /* Pending datagram. */
+   int            sizeClass; /* Pool of entry and dg, -1 for none. */
 } DatagramQueueEntry;
 
 struct VMCIProcess {
@@ -70,6 +75,7 @@ struct VMCIDatagramProcess {
 
 struct VMCIContext {
    ListItem           listItem;         /* For global VMCI list. */
+   struct VMCIContext *hashNext;        /* Next in CID hash chain. */
    VMCIId             cid;
    Atomic_uint32      refCount;
    ListItem           *datagramQueue;   /* Head of per VM queue. */
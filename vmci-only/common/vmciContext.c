@@ -57,20 +57,45 @@
 
 static void VMCIContextFreeContext(VMCIContext *context);
 static Bool VMCIContextExists(VMCIId cid);
+static VMCIContext *VMCIContextLookup(VMCIId cid);
 static int VMCIContextFireNotification(VMCIId contextID,
                                        VMCIPrivilegeFlags privFlags,
                                        const char *domain);
 
 /*
- * List of current VMCI contexts.
+ * List of current VMCI contexts. The contexts are also hashed by cid,
+ * so that looking one up, which happens for every datagram, does not
+ * walk the list. The hash chains are read-mostly data: lookups take no
+ * lock on Linux, changes are made under contextList.lock.
  */
 
+#define VMCI_CONTEXT_HASH_BITS 8
+#define VMCI_CONTEXT_HASH_SIZE (1 << VMCI_CONTEXT_HASH_BITS)
+#define VMCI_CONTEXT_HASH(_cid) \
+   ((uint32)((_cid) * 0x9e370001U) >> (32 - VMCI_CONTEXT_HASH_BITS))
+
 static struct {
    ListItem *head;
+   VMCIContext *hash[VMCI_CONTEXT_HASH_SIZE];
    VMCILock lock;
    VMCILock firingLock;
 } contextList;
 
+/*
+ * Queued datagrams are allocated together with their queue entry from
+ * pools of a few block sizes, see VMCIContext_AllocDatagram. Blocks
+ * larger than the largest class come from the kernel heap.
+ */
+
+#define VMCI_DG_NUM_SIZE_CLASSES 5
+#define VMCI_DG_MIN_CLASS_SIZE   256
+
+static VMCIMemPool *dgPool[VMCI_DG_NUM_SIZE_CLASSES];
+static const char *dgPoolName[VMCI_DG_NUM_SIZE_CLASSES] = {
+   "vmci_dg_256", "vmci_dg_512", "vmci_dg_1024", "vmci_dg_2048",
+   "vmci_dg_4096",
+};
+
 
 /*
  *----------------------------------------------------------------------
@@ -199,7 +224,8 @@ VMCIContextGetDomainName(VMCIContext *context) // IN
  *      Initializes the VMCI context module.
  *
  * Results:
- *      None.
+ *      VMCI_SUCCESS, or VMCI_ERROR_NO_MEM if the datagram pools could
+ *      not be created.
  *
  * Side effects:
  *      None.
@@ -210,7 +236,24 @@ VMCIContextGetDomainName(VMCIContext *context) // IN
 int
 VMCIContext_Init(void)
 {
+   int i;
+
+   for (i = 0; i < VMCI_DG_NUM_SIZE_CLASSES; i++) {
+      dgPool[i] = VMCI_CreateMemPool(dgPoolName[i],
+                                     VMCI_DG_MIN_CLASS_SIZE << i);
+      if (dgPool[i] == NULL) {
+         VMCILOG((LGPFX"Failed to create datagram pool %s.\n",
+                  dgPoolName[i]));
+         while (i-- > 0) {
+            VMCI_DestroyMemPool(dgPool[i]);
+            dgPool[i] = NULL;
+         }
+         return VMCI_ERROR_NO_MEM;
+      }
+   }
+
    contextList.head = NULL;
+   memset(contextList.hash, 0, sizeof contextList.hash);
    VMCI_InitLock(&contextList.lock, "VMCIContextListLock",
 		 VMCI_LOCK_RANK_HIGHER);
    VMCI_InitLock(&contextList.firingLock, "VMCIContextFiringLock",
@@ -239,8 +282,96 @@ VMCIContext_Init(void)
 void
 VMCIContext_Exit(void)
 {
+   int i;
+
    VMCI_CleanupLock(&contextList.firingLock);
    VMCI_CleanupLock(&contextList.lock);
+   for (i = 0; i < VMCI_DG_NUM_SIZE_CLASSES; i++) {
+      VMCI_DestroyMemPool(dgPool[i]);
+      dgPool[i] = NULL;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_AllocDatagram --
+ *
+ *      Allocates room for a datagram of dgSize bytes that is to be
+ *      passed to VMCIContext_EnqueueDatagram. The queue entry and the
+ *      datagram share one block, which comes from the smallest pool
+ *      that fits it, so that routing a datagram to a context costs a
+ *      single allocation from a per-CPU cache in the common case.
+ *
+ * Results:
+ *      The datagram, or NULL if out of memory.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VMCIDatagram *
+VMCIContext_AllocDatagram(size_t dgSize) // IN: size of the datagram
+{
+   DatagramQueueEntry *dqEntry;
+   size_t size = sizeof *dqEntry + dgSize;
+   int sizeClass;
+
+   for (sizeClass = 0; sizeClass < VMCI_DG_NUM_SIZE_CLASSES; sizeClass++) {
+      if (size <= (VMCI_DG_MIN_CLASS_SIZE << sizeClass)) {
+         break;
+      }
+   }
+
+   if (sizeClass < VMCI_DG_NUM_SIZE_CLASSES) {
+      dqEntry = VMCI_AllocFromMemPool(dgPool[sizeClass],
+                                      VMCI_MEMORY_NONPAGED);
+   } else {
+      sizeClass = -1;
+      dqEntry = VMCI_AllocKernelMem(size, VMCI_MEMORY_NONPAGED);
+   }
+   if (dqEntry == NULL) {
+      return NULL;
+   }
+
+   dqEntry->dg = (VMCIDatagram *)(dqEntry + 1);
+   dqEntry->dgSize = dgSize;
+   dqEntry->sizeClass = sizeClass;
+   return dqEntry->dg;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_FreeDatagram --
+ *
+ *      Frees a datagram allocated with VMCIContext_AllocDatagram,
+ *      including one returned by VMCIContext_DequeueDatagram.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VMCIContext_FreeDatagram(VMCIDatagram *dg) // IN
+{
+   DatagramQueueEntry *dqEntry = (DatagramQueueEntry *)dg - 1;
+
+   ASSERT(dqEntry->dg == dg);
+   if (dqEntry->sizeClass >= 0) {
+      VMCI_FreeToMemPool(dgPool[dqEntry->sizeClass], dqEntry);
+   } else {
+      VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry + dqEntry->dgSize);
+   }
 }
 
 
@@ -269,6 +400,7 @@ VMCIContext_InitContext(VMCIId cid,                   // IN
 {
    VMCILockFlags flags;
    VMCIContext *context;
+   uint32 bucket;
    int result;
 
    if (privFlags & ~VMCI_PRIVILEGE_ALL_FLAGS) {
@@ -328,6 +460,13 @@ VMCIContext_InitContext(VMCIId cid,                   // IN
    
    context->privFlags = privFlags;
 
+#ifndef VMX86_SERVER
+   context->notify = NULL;
+#  ifdef __linux__
+   context->notifyPage = NULL;
+#  endif
+#endif
+
    /* 
     * If we collide with an existing context we generate a new and use it 
     * instead. The VMX will determine if regeneration is okay. Since there
@@ -353,6 +492,9 @@ VMCIContext_InitContext(VMCIId cid,                   // IN
    context->cid = cid;
    
    LIST_QUEUE(&context->listItem, &contextList.head);
+   bucket = VMCI_CONTEXT_HASH(cid);
+   context->hashNext = contextList.hash[bucket];
+   VMCI_PublishPointer(contextList.hash[bucket], context);
    VMCI_ReleaseLock(&contextList.lock, flags);
 
 #ifdef VMKERNEL
@@ -362,13 +504,6 @@ VMCIContext_InitContext(VMCIId cid,                   // IN
    VMCIContext_SetDomainName(context, "");
 #endif
 
-#ifndef VMX86_SERVER
-   context->notify = NULL;
-#  ifdef __linux__
-   context->notifyPage = NULL;
-#  endif
-#endif
-
    *outContext = context;
    return VMCI_SUCCESS;
 
@@ -395,13 +530,15 @@ error:
  *
  * VMCIContext_ReleaseContext --
  *
- *      Cleans up a VMCI context.
+ *      Cleans up a VMCI context. Once lookups in progress are done with
+ *      the context, its queue pairs are detached and the reference of
+ *      the context list is dropped.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      May block.
  *
  *----------------------------------------------------------------------
  */
@@ -410,13 +547,51 @@ void
 VMCIContext_ReleaseContext(VMCIContext *context)   // IN
 {
    VMCILockFlags flags;
+   VMCIContext **prev;
+#ifndef VMKERNEL
+   VMCIHandle tempHandle;
+#endif
 
    /* Dequeue VMCI context. */
 
    VMCI_GrabLock(&contextList.lock, &flags);
    LIST_DEL(&context->listItem, &contextList.head);
+   prev = &contextList.hash[VMCI_CONTEXT_HASH(context->cid)];
+   while (*prev != context) {
+      ASSERT(*prev);
+      prev = &(*prev)->hashNext;
+   }
+   VMCI_PublishPointer(*prev, context->hashNext);
    VMCI_ReleaseLock(&contextList.lock, flags);
 
+   VMCI_WaitForReaders();
+
+#ifndef VMKERNEL
+   /*
+    * Cleanup all queue pair resources attached to context.  If the VM dies
+    * without cleaning up, this code will make sure that no resources are
+    * leaked. The context can no longer be looked up, so nothing attaches
+    * it to new queue pairs.
+    */
+
+   tempHandle = VMCIHandleArray_GetEntry(context->queuePairArray, 0);
+   while (!VMCI_HANDLE_EQUAL(tempHandle, VMCI_INVALID_HANDLE)) {
+      int result;
+
+      QueuePairList_Lock(tempHandle);
+      result = QueuePair_Detach(tempHandle, context, TRUE);
+      QueuePairList_Unlock(tempHandle);
+      if (result < VMCI_SUCCESS) {
+         /*
+          * When QueuePair_Detach() succeeds it removes the handle from the
+          * array.  If detach fails, we must remove the handle ourselves.
+          */
+         VMCIHandleArray_RemoveEntry(context->queuePairArray, tempHandle);
+      }
+      tempHandle = VMCIHandleArray_GetEntry(context->queuePairArray, 0);
+   }
+#endif /* !VMKERNEL */
+
    VMCIContext_Release(context);
 }
 
@@ -466,34 +641,17 @@ VMCIContextFreeContext(VMCIContext *context)  // IN
       tempHandle = VMCIHandleArray_RemoveTail(context->wellKnownArray);
    }
 
-#ifndef VMKERNEL
    /*
-    * Cleanup all queue pair resources attached to context.  If the VM dies
-    * without cleaning up, this code will make sure that no resources are
-    * leaked.
-    */
-
-   tempHandle = VMCIHandleArray_GetEntry(context->queuePairArray, 0);
-   while (!VMCI_HANDLE_EQUAL(tempHandle, VMCI_INVALID_HANDLE)) {
-      if (QueuePair_Detach(tempHandle, context, TRUE) < VMCI_SUCCESS) {
-         /*
-          * When QueuePair_Detach() succeeds it removes the handle from the
-          * array.  If detach fails, we must remove the handle ourselves.
-          */
-         VMCIHandleArray_RemoveEntry(context->queuePairArray, tempHandle);
-      }
-      tempHandle = VMCIHandleArray_GetEntry(context->queuePairArray, 0);
-   }
-#else
-   /*
-    * On ESX, all entries in the queuePairArray have been cleaned up
-    * either by the regular VMCI device destroy path or by the world
-    * cleanup destroy path. We assert that no resources are leaked.
+    * On hosted, all entries in the queuePairArray have been cleaned up by
+    * VMCIContext_ReleaseContext. On ESX, they have been cleaned up either
+    * by the regular VMCI device destroy path or by the world cleanup
+    * destroy path. We assert that no resources are leaked. The final
+    * reference may be dropped with a QueuePairList lock held, so the
+    * queue pairs cannot be detached here.
     */
 
    ASSERT(VMCI_HANDLE_EQUAL(VMCIHandleArray_GetEntry(context->queuePairArray, 0),
                             VMCI_INVALID_HANDLE));
-#endif /* !VMKERNEL */
 
    /*
     * Check that the context has been removed from all the groups it was a
@@ -519,8 +677,7 @@ VMCIContextFreeContext(VMCIContext *context)  // IN
       LIST_DEL(curr, &context->datagramQueue);
       ASSERT(dqEntry && dqEntry->dg);
       ASSERT(dqEntry->dgSize == VMCI_DG_SIZE(dqEntry->dg));
-      VMCI_FreeKernelMem(dqEntry->dg, dqEntry->dgSize);
-      VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
+      VMCIContext_FreeDatagram(dqEntry->dg);
    }
 
    VMCIHandleArray_Destroy(context->notifierArray);
@@ -607,7 +764,8 @@ VMCIContext_PendingDatagrams(VMCIId cid,      // IN
  * VMCIContext_EnqueueDatagram --
  *
  *      Queues a VMCI datagram for the appropriate target VM 
- *      context.
+ *      context. The datagram must have been allocated with
+ *      VMCIContext_AllocDatagram; on success the queue owns it.
  *
  * Results:
  *      Size of enqueued data on success, appropriate error code otherwise.
@@ -639,15 +797,9 @@ VMCIContext_EnqueueDatagram(VMCIId cid,        // IN: Target VM
       return VMCI_ERROR_INVALID_ARGS;
    }
 
-   /* Allocate guest call entry and add it to the target VM's queue. */
-   dqEntry = VMCI_AllocKernelMem(sizeof *dqEntry, VMCI_MEMORY_NONPAGED);
-   if (dqEntry == NULL) {
-      VMCILOG((LGPFX"Failed to allocate memory for datagram.\n"));
-      VMCIContext_Release(context);
-      return VMCI_ERROR_NO_MEM;
-   }
-   dqEntry->dg = dg;
-   dqEntry->dgSize = vmciDgSize;
+   /* The guest call entry was allocated along with the datagram. */
+   dqEntry = (DatagramQueueEntry *)dg - 1;
+   ASSERT(dqEntry->dg == dg && dqEntry->dgSize == vmciDgSize);
    dgSrc = dg->src;
 
    VMCI_GrabLock(&context->lock, &flags);
@@ -668,7 +820,6 @@ VMCIContext_EnqueueDatagram(VMCIId cid,        // IN: Target VM
          VMCI_MAX_DATAGRAM_AND_EVENT_QUEUE_SIZE)) {
       VMCI_ReleaseLock(&context->lock, flags);
       VMCIContext_Release(context);
-      VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
       VMCILOGThrottled((LGPFX"Context 0x%x receive queue is full.\n", cid));
       return VMCI_ERROR_NO_RESOURCES;
    }
@@ -687,6 +838,37 @@ VMCIContext_EnqueueDatagram(VMCIId cid,        // IN: Target VM
 #undef VMCI_MAX_DATAGRAM_AND_EVENT_QUEUE_SIZE
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContextLookup --
+ *
+ *      Internal helper to find the context with the specified context
+ *      ID. Assumes the contextList.lock or the read side of it is held.
+ *
+ * Results:
+ *      The context, or NULL if there is none with the given cid.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VMCIContext *
+VMCIContextLookup(VMCIId cid)    // IN
+{
+   VMCIContext *context;
+
+   context = VMCI_ReadPointerLocked(contextList.hash[VMCI_CONTEXT_HASH(cid)],
+                                    &contextList.lock);
+   while (context && context->cid != cid) {
+      context = VMCI_ReadPointerLocked(context->hashNext, &contextList.lock);
+   }
+   return context;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -708,18 +890,7 @@ VMCIContext_EnqueueDatagram(VMCIId cid,        // IN: Target VM
 static Bool
 VMCIContextExists(VMCIId cid)    // IN
 {
-   VMCIContext *context;
-   ListItem *next;
-   Bool rv = FALSE;
-
-   LIST_SCAN(next, contextList.head) {
-      context = LIST_CONTAINER(next, VMCIContext, listItem);
-      if (context->cid == cid) {
-         rv = TRUE;
-         break;
-      }
-   }
-   return rv;
+   return VMCIContextLookup(cid) != NULL;
 }
 
 
@@ -746,9 +917,9 @@ VMCIContext_Exists(VMCIId cid)    // IN
    VMCILockFlags flags;
    Bool rv;
 
-   VMCI_GrabLock(&contextList.lock, &flags);
+   VMCI_ReadLock(&contextList.lock, &flags);
    rv = VMCIContextExists(cid);
-   VMCI_ReleaseLock(&contextList.lock, flags);
+   VMCI_ReadUnlock(&contextList.lock, flags);
    return rv;
 }
 
@@ -772,36 +943,27 @@ VMCIContext_Exists(VMCIId cid)    // IN
 VMCIContext *
 VMCIContext_Get(VMCIId cid)  // IN
 {
-   VMCIContext *context = NULL;  
-   ListItem *next;
+   VMCIContext *context;
    VMCILockFlags flags;
 
-   VMCI_GrabLock(&contextList.lock, &flags);
-   if (LIST_EMPTY(contextList.head)) {
-      goto out;
-   }
-
-   LIST_SCAN(next, contextList.head) {
-      context = LIST_CONTAINER(next, VMCIContext, listItem);
-      if (context->cid == cid) {
-         /*
-          * At this point, we are sure that the reference count is
-          * larger already than zero. When starting the destruction of
-          * a context, we always remove it from the context list
-          * before decreasing the reference count. As we found the
-          * context here, it hasn't been destroyed yet. This means
-          * that we are not about to increase the reference count of
-          * something that is in the process of being destroyed.
-          */
+   VMCI_ReadLock(&contextList.lock, &flags);
+   context = VMCIContextLookup(cid);
+   if (context) {
+      /*
+       * At this point, we are sure that the reference count is
+       * larger already than zero. When starting the destruction of
+       * a context, we always remove it from the context list and
+       * wait for the lookups in progress to finish before decreasing
+       * the reference count. As we found the context here, it hasn't
+       * been destroyed yet. This means that we are not about to
+       * increase the reference count of something that is in the
+       * process of being destroyed.
+       */
 
-         Atomic_Inc(&context->refCount);
-         break;
-      }
+      Atomic_Inc(&context->refCount);
    }
-
-out:
-   VMCI_ReleaseLock(&contextList.lock, flags);
-   return (context && context->cid == cid) ? context : NULL;
+   VMCI_ReadUnlock(&contextList.lock, flags);
+   return context;
 }
 
 
@@ -850,7 +1012,8 @@ VMCIContext_Release(VMCIContext *context)  // IN
  *      it can handle and the datagram is only unqueued if the
  *      size is less than maxSize. If larger maxSize is set to
  *      the size of the datagram to give the caller a chance to
- *      set up a larger buffer for the guestcall.
+ *      set up a larger buffer for the guestcall. The caller frees
+ *      the datagram with VMCIContext_FreeDatagram.
  *
  * Results:
  *      On success:  0 if no more pending datagrams, otherwise the size of
@@ -867,15 +1030,60 @@ int
 VMCIContext_DequeueDatagram(VMCIContext *context, // IN
 			    size_t *maxSize,      // IN/OUT: max size of datagram caller can handle.
 			    VMCIDatagram **dg)    // OUT:
+{
+   size_t size = *maxSize;
+   uint32 numDgs = 1;
+   int rv;
+
+   rv = VMCIContext_DequeueDatagramBatch(context, &size, dg, &numDgs);
+   if (rv == VMCI_ERROR_NO_MEM) {
+      *maxSize = size;
+   }
+   return rv;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_DequeueDatagramBatch --
+ *
+ *      Dequeues as many of the pending datagrams as fit in a buffer of
+ *      *bufSize bytes, and at most *numDgs of them, taking the context
+ *      lock once. The datagrams are laid out in the buffer one after
+ *      another, each starting at a multiple of 8 bytes. If not even the
+ *      first pending datagram fits, *bufSize is set to its size. The
+ *      caller frees the datagrams with VMCIContext_FreeDatagram.
+ *
+ * Results:
+ *      On success:  0 if no more pending datagrams, otherwise the size of
+ *                   the next pending datagram. *numDgs is set to the
+ *                   number of datagrams returned in dgs and *bufSize to
+ *                   the buffer space they take.
+ *      On failure:  VMCI_ERROR_NO_MORE_DATAGRAMS if none are pending,
+ *                   VMCI_ERROR_NO_MEM if the first one does not fit.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VMCIContext_DequeueDatagramBatch(VMCIContext *context, // IN
+                                 size_t *bufSize,      // IN/OUT: buffer space
+                                 VMCIDatagram **dgs,   // OUT: dequeued datagrams
+                                 uint32 *numDgs)       // IN/OUT: entries in dgs
 {
    DatagramQueueEntry *dqEntry;
    ListItem *listItem;
    VMCILockFlags flags;
+   size_t used = 0;
+   uint32 count = 0;
    int rv;
 
-   ASSERT(context && dg);
+   ASSERT(context && dgs && *numDgs > 0);
 
-   /* Dequeue the next datagram entry. */
    VMCI_GrabLock(&context->lock, &flags);
    if (context->pendingDatagrams == 0) {
       VMCIHost_ClearCall(&context->hostContext);
@@ -885,24 +1093,33 @@ VMCIContext_DequeueDatagram(VMCIContext *context, // IN
       return VMCI_ERROR_NO_MORE_DATAGRAMS;
    }
 
-   listItem = LIST_FIRST(context->datagramQueue);
-   ASSERT (listItem != NULL);
+   while (context->pendingDatagrams > 0 && count < *numDgs) {
+      listItem = LIST_FIRST(context->datagramQueue);
+      ASSERT(listItem != NULL);
+      dqEntry = LIST_CONTAINER(listItem, DatagramQueueEntry, listItem);
+      ASSERT(dqEntry->dg);
 
-   dqEntry = LIST_CONTAINER(listItem, DatagramQueueEntry, listItem);
-   ASSERT(dqEntry->dg);
+      /* Check size of caller's buffer. */
+      if (used + dqEntry->dgSize > *bufSize) {
+         break;
+      }
 
-   /* Check size of caller's buffer. */
-   if (*maxSize < dqEntry->dgSize) {
-      *maxSize = dqEntry->dgSize;
+      LIST_DEL(listItem, &context->datagramQueue);
+      context->pendingDatagrams--;
+      context->datagramQueueSize -= dqEntry->dgSize;
+      ASSERT(dqEntry->dgSize == VMCI_DG_SIZE(dqEntry->dg));
+      dgs[count++] = dqEntry->dg;
+      used += VMCI_DG_SIZE_ALIGNED(dqEntry->dg);
+   }
+
+   if (count == 0) {
+      *bufSize = dqEntry->dgSize;
       VMCI_ReleaseLock(&context->lock, flags);
       VMCILOG((LGPFX"Caller's buffer is too small. It must be at "
-               "least %"FMTSZ"d bytes.\n", *maxSize));
+               "least %"FMTSZ"d bytes.\n", *bufSize));
       return VMCI_ERROR_NO_MEM;
    }
-   
-   LIST_DEL(listItem, &context->datagramQueue);
-   context->pendingDatagrams--;
-   context->datagramQueueSize -= dqEntry->dgSize;
+
    if (context->pendingDatagrams == 0) {
       VMCIHost_ClearCall(&context->hostContext);
       VMCIContextClearNotify(context);
@@ -911,26 +1128,21 @@ VMCIContext_DequeueDatagram(VMCIContext *context, // IN
       /*
        * Return the size of the next datagram.
        */
-      DatagramQueueEntry *nextEntry;
-
       listItem = LIST_FIRST(context->datagramQueue);
       ASSERT(listItem);
-      nextEntry = LIST_CONTAINER(listItem, DatagramQueueEntry, listItem);
-      ASSERT(nextEntry && nextEntry->dg);
+      dqEntry = LIST_CONTAINER(listItem, DatagramQueueEntry, listItem);
+      ASSERT(dqEntry && dqEntry->dg);
       /*
        * The following size_t -> int truncation is fine as the maximum size of
        * a (routable) datagram is 68KB.
        */
-      rv = (int)nextEntry->dgSize;
+      rv = (int)dqEntry->dgSize;
    }
    VMCI_ReleaseLock(&context->lock, flags);
 
-   /* Caller must free datagram. */
-   ASSERT(dqEntry->dgSize == VMCI_DG_SIZE(dqEntry->dg));
-   *dg = dqEntry->dg;
-   dqEntry->dg = NULL;
-   VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
-
+   /* Caller must free datagrams, which also frees the entries. */
+   *numDgs = count;
+   *bufSize = MIN(used, *bufSize);
    return rv;
 }
 
@@ -1666,3 +1878,130 @@ VMCIContext_SupportsHostQP(VMCIContext *context)    // IN: Context structure
 #endif
 }
 
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_CidSupportsHostQP --
+ *
+ *      Like VMCIContext_SupportsHostQP, for the context with the given
+ *      ID. No reference to the context is taken, so unlike a
+ *      VMCIContext_Get/VMCIContext_Release pair this may be called with
+ *      a QueuePairList lock held.
+ *
+ * Results:
+ *      TRUE if the context exists and supports host QPs, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+VMCIContext_CidSupportsHostQP(VMCIId cid)    // IN
+{
+   VMCILockFlags flags;
+   Bool rv;
+
+   VMCI_ReadLock(&contextList.lock, &flags);
+   rv = VMCIContext_SupportsHostQP(VMCIContextLookup(cid));
+   VMCI_ReadUnlock(&contextList.lock, flags);
+   return rv;
+}
+
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_QueuePairCreate --
+ *
+ *      Registers that the context is attached to the queue pair with
+ *      the given handle. Queue pairs of one context may be allocated
+ *      and detached concurrently, so the context lock protects the
+ *      array of its queue pairs.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VMCIContext_QueuePairCreate(VMCIContext *context, // IN: Context structure
+                            VMCIHandle handle)    // IN: Queue pair handle
+{
+   VMCILockFlags flags;
+
+   ASSERT(context);
+   VMCI_GrabLock(&context->lock, &flags);
+   VMCIHandleArray_AppendEntry(&context->queuePairArray, handle);
+   VMCI_ReleaseLock(&context->lock, flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_QueuePairDestroy --
+ *
+ *      Registers that the context is no longer attached to the queue
+ *      pair with the given handle.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VMCIContext_QueuePairDestroy(VMCIContext *context, // IN: Context structure
+                             VMCIHandle handle)    // IN: Queue pair handle
+{
+   VMCILockFlags flags;
+
+   ASSERT(context);
+   VMCI_GrabLock(&context->lock, &flags);
+   VMCIHandleArray_RemoveEntry(context->queuePairArray, handle);
+   VMCI_ReleaseLock(&context->lock, flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_QueuePairExists --
+ *
+ *      Checks whether the context is attached to the queue pair with
+ *      the given handle.
+ *
+ * Results:
+ *      TRUE if attached, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+VMCIContext_QueuePairExists(VMCIContext *context, // IN: Context structure
+                            VMCIHandle handle)    // IN: Queue pair handle
+{
+   VMCILockFlags flags;
+   Bool result;
+
+   ASSERT(context);
+   VMCI_GrabLock(&context->lock, &flags);
+   result = VMCIHandleArray_HasEntry(context->queuePairArray, handle);
+   VMCI_ReleaseLock(&context->lock, flags);
+
+   return result;
+}
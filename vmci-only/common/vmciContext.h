@@ -50,10 +50,18 @@ int VMCIContext_GetDomainName(VMCIId contextID, char *domainName,
                               size_t domainNameBufSize);
 #endif
 Bool VMCIContext_SupportsHostQP(VMCIContext *context);
+Bool VMCIContext_CidSupportsHostQP(VMCIId cid);
+void VMCIContext_QueuePairCreate(VMCIContext *context, VMCIHandle handle);
+void VMCIContext_QueuePairDestroy(VMCIContext *context, VMCIHandle handle);
+Bool VMCIContext_QueuePairExists(VMCIContext *context, VMCIHandle handle);
 void VMCIContext_ReleaseContext(VMCIContext *context);
+VMCIDatagram *VMCIContext_AllocDatagram(size_t dgSize);
+void VMCIContext_FreeDatagram(VMCIDatagram *dg);
 int VMCIContext_EnqueueDatagram(VMCIId cid, VMCIDatagram *dg);
 int VMCIContext_DequeueDatagram(VMCIContext *context, size_t *maxSize, 
 				VMCIDatagram **dg);
+int VMCIContext_DequeueDatagramBatch(VMCIContext *context, size_t *bufSize,
+                                     VMCIDatagram **dgs, uint32 *numDgs);
 int VMCIContext_PendingDatagrams(VMCIId cid, uint32 *pending);
 VMCIContext *VMCIContext_Get(VMCIId cid);
 void VMCIContext_Release(VMCIContext *context);
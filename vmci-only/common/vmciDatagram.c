@@ -1074,12 +1074,7 @@ VMCIDatagram_Dispatch(VMCIId contextID,  // IN:
       }
 
       /* We make a copy to enqueue. */
-#ifdef _WIN32
-      newDG = VMCI_AllocKernelMem(dgSize, VMCI_MEMORY_NONPAGED);
-#else // Linux, Mac OS, ESX cases below
-      newDG = VMCI_AllocKernelMem(dgSize, VMCI_MEMORY_NORMAL);
-#endif // _WIN32
-
+      newDG = VMCIContext_AllocDatagram(dgSize);
       if (newDG == NULL) {
 	 return VMCI_ERROR_NO_MEM;
       }
@@ -1087,7 +1082,7 @@ VMCIDatagram_Dispatch(VMCIId contextID,  // IN:
       retval = 
 	 VMCIContext_EnqueueDatagram(dstContext, newDG);
       if (retval < VMCI_SUCCESS) {
-	 VMCI_FreeKernelMem(newDG, dgSize);
+	 VMCIContext_FreeDatagram(newDG);
 	 return retval;
       }
    }
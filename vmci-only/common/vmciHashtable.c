@@ -50,8 +50,16 @@
 #include "vmciHashtable.h"
 #include "vmware.h"
 
-static int HashTableUnlinkEntry(VMCIHashTable *table, VMCIHashEntry *entry);
-static Bool VMCIHashTableEntryExistsLocked(VMCIHashTable *table,
+/* Largest number of buckets a partition grows to. */
+#define VMCI_HASHTABLE_MAX_PART_SIZE 4096
+
+#define VMCI_HASHTABLE_PART(_table, _hash) \
+   (&(_table)->parts[(_hash) & (VMCI_HASHTABLE_NUM_PARTS - 1)])
+#define VMCI_HASHTABLE_BUCKET(_part, _hash) \
+   (((_hash) >> VMCI_HASHTABLE_PART_BITS) & ((_part)->size - 1))
+
+static int HashTableUnlinkEntry(VMCIHashPart *part, VMCIHashEntry *entry);
+static Bool VMCIHashTableEntryExistsLocked(VMCIHashPart *part,
                                            VMCIHandle handle);
 
 
@@ -59,10 +67,12 @@ static Bool VMCIHashTableEntryExistsLocked(VMCIHashTable *table,
  *------------------------------------------------------------------------------
  *
  *  VMCIHashTable_Create --
+ *     Creates a hash table with room for about 'size' entries before it
+ *     grows. 'size' should be a power of 2.
  *     XXX Factor out the hashtable code to be shared amongst host and guest.
  * 
  *  Result:
- *     None.
+ *     The table, or NULL if out of memory.
  *     
  *------------------------------------------------------------------------------
  */
@@ -70,23 +80,41 @@ static Bool VMCIHashTableEntryExistsLocked(VMCIHashTable *table,
 VMCIHashTable *
 VMCIHashTable_Create(int size)
 {
-   VMCIHashTable *table = VMCI_AllocKernelMem(sizeof *table,
-                                              VMCI_MEMORY_NONPAGED);
+   VMCIHashTable *table;
+   uint32 partSize = 1;
+   int i;
+
+   while (partSize * VMCI_HASHTABLE_NUM_PARTS < (uint32)size) {
+      partSize <<= 1;
+   }
+
+   table = VMCI_AllocKernelMem(sizeof *table, VMCI_MEMORY_NONPAGED);
    if (table == NULL) {
       return NULL;
    }
 
-   table->entries = VMCI_AllocKernelMem(sizeof *table->entries * size,
-                                        VMCI_MEMORY_NONPAGED);
-   if (table->entries == NULL) {
-      VMCI_FreeKernelMem(table, sizeof *table);
-      return NULL;
+   for (i = 0; i < VMCI_HASHTABLE_NUM_PARTS; i++) {
+      VMCIHashPart *part = &table->parts[i];
+
+      part->entries = VMCI_AllocKernelMem(sizeof *part->entries * partSize,
+                                          VMCI_MEMORY_NONPAGED);
+      if (part->entries == NULL) {
+         while (i-- > 0) {
+            part = &table->parts[i];
+            VMCI_CleanupLock(&part->lock);
+            VMCI_FreeKernelMem(part->entries,
+                               sizeof *part->entries * part->size);
+         }
+         VMCI_FreeKernelMem(table, sizeof *table);
+         return NULL;
+      }
+      memset(part->entries, 0, sizeof *part->entries * partSize);
+      part->size = partSize;
+      part->count = 0;
+      VMCI_InitLock(&part->lock,
+                    "VMCIHashTableLock",
+                    VMCI_LOCK_RANK_HIGH);
    }
-   memset(table->entries, 0, sizeof *table->entries * size);
-   table->size = size;
-   VMCI_InitLock(&table->lock,
-                 "VMCIHashTableLock",
-                 VMCI_LOCK_RANK_HIGH);   
 
    return table;
 }
@@ -111,33 +139,19 @@ void
 VMCIHashTable_Destroy(VMCIHashTable *table)
 {
    VMCILockFlags flags;
-#if 0
-   DEBUG_ONLY(int i;)
-   DEBUG_ONLY(int leakingEntries = 0;)
-#endif
+   int i;
 
    ASSERT(table);
 
-   VMCI_GrabLock(&table->lock, &flags);
-#if 0
-#ifdef VMX86_DEBUG
-   for (i = 0; i < table->size; i++) {
-      VMCIHashEntry *head = table->entries[i];
-      while (head) {
-         leakingEntries++;
-         head = head->next;
-      }
-   }
-   if (leakingEntries) {
-      VMCILOG((LGPFX"Leaking %d hash table entries for table %p.\n",
-               leakingEntries, table));
+   for (i = 0; i < VMCI_HASHTABLE_NUM_PARTS; i++) {
+      VMCIHashPart *part = &table->parts[i];
+
+      VMCI_GrabLock(&part->lock, &flags);
+      VMCI_FreeKernelMem(part->entries, sizeof *part->entries * part->size);
+      part->entries = NULL;
+      VMCI_ReleaseLock(&part->lock, flags);
+      VMCI_CleanupLock(&part->lock);
    }
-#endif // VMX86_DEBUG
-#endif
-   VMCI_FreeKernelMem(table->entries, sizeof *table->entries * table->size);
-   table->entries = NULL;
-   VMCI_ReleaseLock(&table->lock, flags);
-   VMCI_CleanupLock(&table->lock);   
    VMCI_FreeKernelMem(table, sizeof *table);
 }
 
@@ -163,6 +177,56 @@ VMCIHashTable_InitEntry(VMCIHashEntry *entry,  // IN
 }
 
 
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIHashTableGrowLocked --
+ *
+ *     Doubles the number of buckets of a partition and rehashes its
+ *     entries. Assumes the partition lock is held. The partition keeps
+ *     its buckets if no memory is available, which only makes chains
+ *     longer.
+ *
+ *  Result:
+ *     None.
+ *
+ *------------------------------------------------------------------------------
+ */
+
+static void
+VMCIHashTableGrowLocked(VMCIHashPart *part) // IN
+{
+   VMCIHashEntry **entries;
+   uint32 size = part->size * 2;
+   uint32 i;
+
+   entries = VMCI_AllocKernelMem(sizeof *entries * size,
+                                 VMCI_MEMORY_NONPAGED | VMCI_MEMORY_ATOMIC);
+   if (entries == NULL) {
+      return;
+   }
+   memset(entries, 0, sizeof *entries * size);
+
+   for (i = 0; i < part->size; i++) {
+      VMCIHashEntry *cur = part->entries[i];
+
+      while (cur) {
+         VMCIHashEntry *next = cur->next;
+         uint32 idx = (VMCI_HashHandle(cur->handle) >>
+                       VMCI_HASHTABLE_PART_BITS) & (size - 1);
+
+         cur->next = entries[idx];
+         entries[idx] = cur;
+         cur = next;
+      }
+   }
+
+   VMCI_FreeKernelMem(part->entries, sizeof *part->entries * part->size);
+   part->entries = entries;
+   part->size = size;
+}
+
+
 /*
  *------------------------------------------------------------------------------
  *
@@ -179,28 +243,40 @@ int
 VMCIHashTable_AddEntry(VMCIHashTable *table,  // IN
                        VMCIHashEntry *entry)  // IN
 {
-   int idx;
+   VMCIHashPart *part;
+   uint32 hash;
+   uint32 idx;
    VMCILockFlags flags;
 
    ASSERT(entry);
    ASSERT(table);
 
-   VMCI_GrabLock(&table->lock, &flags);
-   if (VMCIHashTableEntryExistsLocked(table, entry->handle)) {
+   hash = VMCI_HashHandle(entry->handle);
+   part = VMCI_HASHTABLE_PART(table, hash);
+
+   VMCI_GrabLock(&part->lock, &flags);
+   if (VMCIHashTableEntryExistsLocked(part, entry->handle)) {
       VMCILOG((LGPFX"Entry's handle 0x%x:0x%x already exists.\n",
                entry->handle.context, entry->handle.resource));
-      VMCI_ReleaseLock(&table->lock, flags);
+      VMCI_ReleaseLock(&part->lock, flags);
       return VMCI_ERROR_DUPLICATE_ENTRY;
    }
 
-   idx = VMCI_Hash(entry->handle, table->size);
-   ASSERT(idx < table->size);
+   /* Keep the average chain at no more than two entries. */
+   if (part->count >= 2 * part->size &&
+       part->size < VMCI_HASHTABLE_MAX_PART_SIZE) {
+      VMCIHashTableGrowLocked(part);
+   }
+
+   idx = VMCI_HASHTABLE_BUCKET(part, hash);
+   ASSERT(idx < part->size);
 
    /* New entry is added to top/front of hash bucket. */
    entry->refCount++;
-   entry->next = table->entries[idx];
-   table->entries[idx] = entry;
-   VMCI_ReleaseLock(&table->lock, flags);
+   entry->next = part->entries[idx];
+   part->entries[idx] = entry;
+   part->count++;
+   VMCI_ReleaseLock(&part->lock, flags);
 
    return VMCI_SUCCESS;
 }
@@ -223,16 +299,18 @@ int
 VMCIHashTable_RemoveEntry(VMCIHashTable *table, // IN
                           VMCIHashEntry *entry) // IN
 {
+   VMCIHashPart *part;
    int result;
    VMCILockFlags flags;
 
    ASSERT(table);
    ASSERT(entry);
 
-   VMCI_GrabLock(&table->lock, &flags);
+   part = VMCI_HASHTABLE_PART(table, VMCI_HashHandle(entry->handle));
+   VMCI_GrabLock(&part->lock, &flags);
    
    /* First unlink the entry. */
-   result = HashTableUnlinkEntry(table, entry);
+   result = HashTableUnlinkEntry(part, entry);
    if (result != VMCI_SUCCESS) {
       /* We failed to find the entry. */
       goto done;
@@ -246,7 +324,7 @@ VMCIHashTable_RemoveEntry(VMCIHashTable *table, // IN
    }
    
   done:
-   VMCI_ReleaseLock(&table->lock, flags);
+   VMCI_ReleaseLock(&part->lock, flags);
    
    return result;
 }
@@ -257,7 +335,8 @@ VMCIHashTable_RemoveEntry(VMCIHashTable *table, // IN
  *
  *  VMCIHashTableGetEntryLocked --
  *     
- *       Looks up an entry in the hash table, that is already locked.
+ *       Looks up an entry in a partition of the hash table, that is
+ *       already locked.
  *
  *  Result:
  *       If the element is found, a pointer to the element is returned.
@@ -270,18 +349,16 @@ VMCIHashTable_RemoveEntry(VMCIHashTable *table, // IN
  */
 
 static INLINE VMCIHashEntry *
-VMCIHashTableGetEntryLocked(VMCIHashTable *table,  // IN
-                            VMCIHandle handle)     // IN
+VMCIHashTableGetEntryLocked(VMCIHashPart *part,  // IN
+                            VMCIHandle handle,   // IN
+                            uint32 hash)         // IN: hash of handle
 {
    VMCIHashEntry *cur = NULL;
-   int idx;
 
    ASSERT(!VMCI_HANDLE_EQUAL(handle, VMCI_INVALID_HANDLE));
-   ASSERT(table);
+   ASSERT(part);
 
-   idx = VMCI_Hash(handle, table->size);
-   
-   cur = table->entries[idx];
+   cur = part->entries[VMCI_HASHTABLE_BUCKET(part, hash)];
    while (TRUE) {
       if (cur == NULL) {
          break;
@@ -315,18 +392,22 @@ VMCIHashEntry *
 VMCIHashTable_GetEntry(VMCIHashTable *table,  // IN
                        VMCIHandle handle)     // IN
 {
+   VMCIHashPart *part;
    VMCIHashEntry *entry;
    VMCILockFlags flags;
+   uint32 hash;
 
    if (VMCI_HANDLE_EQUAL(handle, VMCI_INVALID_HANDLE)) {
      return NULL;
    }
 
    ASSERT(table);
-   
-   VMCI_GrabLock(&table->lock, &flags);
-   entry = VMCIHashTableGetEntryLocked(table, handle);
-   VMCI_ReleaseLock(&table->lock, flags);
+
+   hash = VMCI_HashHandle(handle);
+   part = VMCI_HASHTABLE_PART(table, hash);
+   VMCI_GrabLock(&part->lock, &flags);
+   entry = VMCIHashTableGetEntryLocked(part, handle, hash);
+   VMCI_ReleaseLock(&part->lock, flags);
 
    return entry;
 }
@@ -337,9 +418,8 @@ VMCIHashTable_GetEntry(VMCIHashTable *table,  // IN
  *
  *  VMCIHashTable_GetEntries --
  *     
- *       Multiple entries are gotten from a hash table. This amortizes
- *       the locking costs of getting multiple entries from the same
- *       hash table.
+ *       Multiple entries are gotten from a hash table. Handles in the
+ *       same partition are looked up under a single hold of its lock.
  *
  *  Result:
  *       None.
@@ -354,6 +434,7 @@ VMCIHashTable_GetEntries(VMCIHashTable *table,    // IN
                          VMCIHashEntry **entries) // OUT
                          
 {
+   VMCIHashPart *part = NULL;
    VMCILockFlags flags;
    size_t i;
 
@@ -361,16 +442,27 @@ VMCIHashTable_GetEntries(VMCIHashTable *table,    // IN
    ASSERT(handles);
    ASSERT(entries);
 
-   
-   VMCI_GrabLock(&table->lock, &flags);
    for (i = 0; i < len; i++) {
+      uint32 hash;
+
       if (VMCI_HANDLE_EQUAL(handles[i], VMCI_INVALID_HANDLE)) {
          entries[i] = NULL;
-      } else {
-         entries[i] = VMCIHashTableGetEntryLocked(table, handles[i]);
+         continue;
       }
+
+      hash = VMCI_HashHandle(handles[i]);
+      if (part != VMCI_HASHTABLE_PART(table, hash)) {
+         if (part) {
+            VMCI_ReleaseLock(&part->lock, flags);
+         }
+         part = VMCI_HASHTABLE_PART(table, hash);
+         VMCI_GrabLock(&part->lock, &flags);
+      }
+      entries[i] = VMCIHashTableGetEntryLocked(part, handles[i], hash);
+   }
+   if (part) {
+      VMCI_ReleaseLock(&part->lock, flags);
    }
-   VMCI_ReleaseLock(&table->lock, flags);
 }
 
 
@@ -380,7 +472,8 @@ VMCIHashTable_GetEntries(VMCIHashTable *table,    // IN
  *  VMCIHashTableReleaseEntryLocked --
  *      
  *       Releases an element previously obtained with
- *       VMCIHashTableGetEntryLocked.
+ *       VMCIHashTableGetEntryLocked. Assumes the lock of the entry's
+ *       partition is held.
  *
  *  Result:
  *       If the entry is removed from the hash table, VMCI_SUCCESS_ENTRY_DEAD
@@ -394,12 +487,12 @@ VMCIHashTable_GetEntries(VMCIHashTable *table,    // IN
  */
 
 static INLINE int
-VMCIHashTableReleaseEntryLocked(VMCIHashTable *table,  // IN
+VMCIHashTableReleaseEntryLocked(VMCIHashPart *part,    // IN
                                 VMCIHashEntry *entry)  // IN
 {
    int result = VMCI_SUCCESS;
 
-   ASSERT(table);
+   ASSERT(part);
    ASSERT(entry);
 
    entry->refCount--;
@@ -415,7 +508,7 @@ VMCIHashTableReleaseEntryLocked(VMCIHashTable *table,  // IN
        * it detaches.
        */
 
-      HashTableUnlinkEntry(table, entry);
+      HashTableUnlinkEntry(part, entry);
       result = VMCI_SUCCESS_ENTRY_DEAD;
    }
 
@@ -440,13 +533,15 @@ int
 VMCIHashTable_ReleaseEntry(VMCIHashTable *table,  // IN
                            VMCIHashEntry *entry)  // IN
 {
+   VMCIHashPart *part;
    VMCILockFlags flags;
    int result;
 
    ASSERT(table);
-   VMCI_GrabLock(&table->lock, &flags);
-   result = VMCIHashTableReleaseEntryLocked(table, entry);
-   VMCI_ReleaseLock(&table->lock, flags);
+   part = VMCI_HASHTABLE_PART(table, VMCI_HashHandle(entry->handle));
+   VMCI_GrabLock(&part->lock, &flags);
+   result = VMCIHashTableReleaseEntryLocked(part, entry);
+   VMCI_ReleaseLock(&part->lock, flags);
 
    return result;
 }
@@ -459,8 +554,8 @@ VMCIHashTable_ReleaseEntry(VMCIHashTable *table,  // IN
  *
  *       Multiple entries are released from the given hash table. The
  *       result of each release operation is returned in the results
- *       array. This function is intended to amortize locking costs
- *       when multiple entries are released.
+ *       array. Entries in the same partition are released under a
+ *       single hold of its lock.
  *
  *  Result:
  *       VMCI_SUCCESS_ENTRY_DEAD is returned, if any of the releases resulted
@@ -475,6 +570,7 @@ VMCIHashTable_ReleaseEntries(VMCIHashTable *table,    // IN
                              size_t len,              // IN: Length of arrays.
                              int *results)            // OUT
 {
+   VMCIHashPart *part = NULL;
    VMCILockFlags flags;
    int result = VMCI_SUCCESS;
    size_t i;
@@ -483,14 +579,25 @@ VMCIHashTable_ReleaseEntries(VMCIHashTable *table,    // IN
    ASSERT(entries);
    ASSERT(results);
 
-   VMCI_GrabLock(&table->lock, &flags);
    for (i = 0; i < len; i++) {
-      results[i] = VMCIHashTableReleaseEntryLocked(table, entries[i]);
+      VMCIHashPart *entryPart =
+         VMCI_HASHTABLE_PART(table, VMCI_HashHandle(entries[i]->handle));
+
+      if (part != entryPart) {
+         if (part) {
+            VMCI_ReleaseLock(&part->lock, flags);
+         }
+         part = entryPart;
+         VMCI_GrabLock(&part->lock, &flags);
+      }
+      results[i] = VMCIHashTableReleaseEntryLocked(part, entries[i]);
       if (results[i] == VMCI_SUCCESS_ENTRY_DEAD) {
          result = VMCI_SUCCESS_ENTRY_DEAD;
       }
    }
-   VMCI_ReleaseLock(&table->lock, flags);
+   if (part) {
+      VMCI_ReleaseLock(&part->lock, flags);
+   }
 
    return result;
 }
@@ -516,14 +623,16 @@ Bool
 VMCIHashTable_EntryExists(VMCIHashTable *table,  // IN
                           VMCIHandle handle)     // IN
 {
+   VMCIHashPart *part;
    Bool exists;
    VMCILockFlags flags;
 
    ASSERT(table);
 
-   VMCI_GrabLock(&table->lock, &flags);
-   exists = VMCIHashTableEntryExistsLocked(table, handle);
-   VMCI_ReleaseLock(&table->lock, flags);
+   part = VMCI_HASHTABLE_PART(table, VMCI_HashHandle(handle));
+   VMCI_GrabLock(&part->lock, &flags);
+   exists = VMCIHashTableEntryExistsLocked(part, handle);
+   VMCI_ReleaseLock(&part->lock, flags);
 
    return exists;
 }
@@ -534,7 +643,8 @@ VMCIHashTable_EntryExists(VMCIHashTable *table,  // IN
  *
  *  VMCIHashTableEntryExistsLocked --
  *     
- *     Unlocked version of VMCIHashTable_EntryExists.
+ *     Unlocked version of VMCIHashTable_EntryExists, for the partition
+ *     of the handle.
  *
  *  Result:
  *     TRUE if handle already in hashtable. FALSE otherwise.
@@ -546,18 +656,15 @@ VMCIHashTable_EntryExists(VMCIHashTable *table,  // IN
  */
 
 static Bool
-VMCIHashTableEntryExistsLocked(VMCIHashTable *table,  // IN
-                               VMCIHandle handle)     // IN
+VMCIHashTableEntryExistsLocked(VMCIHashPart *part,  // IN
+                               VMCIHandle handle)   // IN
 
 {
    VMCIHashEntry *entry;
-   int idx;
    
-   ASSERT(table);
-
-   idx = VMCI_Hash(handle, table->size);
+   ASSERT(part);
 
-   entry = table->entries[idx];
+   entry = part->entries[VMCI_HASHTABLE_BUCKET(part, VMCI_HashHandle(handle))];
    while (entry) {
       if (VMCI_HANDLE_EQUAL(entry->handle, handle)) {
          return TRUE;
@@ -575,7 +682,7 @@ VMCIHashTableEntryExistsLocked(VMCIHashTable *table,  // IN
  *  HashTableUnlinkEntry --
  *     XXX Factor out the hashtable code to shared amongst API and perhaps 
  *     host and guest.
- *     Assumes caller holds table lock.
+ *     Assumes caller holds the lock of the entry's partition.
  *
  *  Result:
  *     None.
@@ -584,17 +691,17 @@ VMCIHashTableEntryExistsLocked(VMCIHashTable *table,  // IN
  */
 
 static int
-HashTableUnlinkEntry(VMCIHashTable *table, // IN
+HashTableUnlinkEntry(VMCIHashPart *part,   // IN
                      VMCIHashEntry *entry) // IN 
 {
    int result;
    VMCIHashEntry *prev, *cur;
-   int idx;
+   uint32 idx;
 
-   idx = VMCI_Hash(entry->handle, table->size);
+   idx = VMCI_HASHTABLE_BUCKET(part, VMCI_HashHandle(entry->handle));
 
    prev = NULL;
-   cur = table->entries[idx];
+   cur = part->entries[idx];
    while (TRUE) {
       if (cur == NULL) {
          result = VMCI_ERROR_NOT_FOUND;
@@ -607,9 +714,11 @@ HashTableUnlinkEntry(VMCIHashTable *table, // IN
          if (prev) {
             prev->next = cur->next;
          } else {
-            table->entries[idx] = cur->next;
+            part->entries[idx] = cur->next;
          }
          cur->next = NULL;
+         ASSERT(part->count > 0);
+         part->count--;
          result = VMCI_SUCCESS;
          break;
       }
@@ -40,10 +40,25 @@ typedef struct VMCIHashEntry {
    struct VMCIHashEntry *next;
 } VMCIHashEntry;
 
-typedef struct VMCIHashTable {
+/*
+ * A table is split into partitions by the low bits of the hash of a
+ * handle. Each partition has its own lock and its own array of buckets,
+ * which grows as entries are added, so lookups of unrelated handles
+ * rarely contend and chains stay short.
+ */
+
+#define VMCI_HASHTABLE_PART_BITS 6
+#define VMCI_HASHTABLE_NUM_PARTS (1 << VMCI_HASHTABLE_PART_BITS)
+
+typedef struct VMCIHashPart {
    VMCIHashEntry **entries;
-   int             size; // Number of buckets in above array.
+   uint32          size;  // Number of buckets in above array.
+   uint32          count; // Number of entries in the partition.
    VMCILock        lock;
+} VMCIHashPart;
+
+typedef struct VMCIHashTable {
+   VMCIHashPart    parts[VMCI_HASHTABLE_NUM_PARTS];
 } VMCIHashTable;
 
 VMCIHashTable *VMCIHashTable_Create(int size);
@@ -103,9 +103,24 @@ typedef VMCIMutex VMCIQPLock;
 # define VMCIQPLock_Release(_l)  VMCIMutex_Release(_l)
 #endif
 
+/*
+ * The queue pairs are hashed by handle. Each bucket is protected by one
+ * of a smaller set of locks, so that operations on unrelated queue
+ * pairs do not serialize on a single lock.
+ */
+
+#define QP_HASH_BITS  8
+#define QP_HASH_SIZE  (1 << QP_HASH_BITS)
+#define QP_NUM_LOCKS  16  /* Must be a power of 2, <= QP_HASH_SIZE. */
+
+#define QP_HASH(_h) \
+   ((uint32)(((_h).context * 0x9e370001U) ^ ((_h).resource * 0x85ebca6bU)) >> \
+    (32 - QP_HASH_BITS))
+#define QP_LOCK_INDEX(_bucket) ((_bucket) & (QP_NUM_LOCKS - 1))
+
 typedef struct QueuePairList {
-   ListItem  *head;
-   VMCIQPLock lock;
+   ListItem  *head[QP_HASH_SIZE];
+   VMCIQPLock lock[QP_NUM_LOCKS];
 } QueuePairList;
 
 static QueuePairList queuePairList;
@@ -120,7 +135,6 @@ static int QueuePairAllocHost(VMCIHandle handle, VMCIId peer,
 static QueuePairEntry *QueuePairList_FindEntry(VMCIHandle handle);
 static void QueuePairList_AddEntry(QueuePairEntry *entry);
 static void QueuePairList_RemoveEntry(QueuePairEntry *entry);
-static QueuePairEntry *QueuePairList_GetHead(void);
 static int QueuePairNotifyPeer(Bool attach, VMCIHandle handle, VMCIId myId,
                                VMCIId peerId);
 
@@ -144,10 +158,19 @@ static int QueuePairNotifyPeer(Bool attach, VMCIHandle handle, VMCIId myId,
 static INLINE int
 QueuePairList_Init(void)
 {
-   int ret;
+   int ret = VMCI_SUCCESS;
+   int i;
 
    memset(&queuePairList, 0, sizeof queuePairList);
-   VMCIQPLock_Init(&queuePairList.lock, ret);
+   for (i = 0; i < QP_NUM_LOCKS; i++) {
+      VMCIQPLock_Init(&queuePairList.lock[i], ret);
+      if (ret < VMCI_SUCCESS) {
+         while (i-- > 0) {
+            VMCIQPLock_Destroy(&queuePairList.lock[i]);
+         }
+         break;
+      }
+   }
 
    return ret;
 }
@@ -158,7 +181,7 @@ QueuePairList_Init(void)
  *
  * QueuePairList_Exit --
  *
- *      Destroy the list's lock.
+ *      Destroy the list's locks.
  *
  * Results:
  *      None.
@@ -172,7 +195,11 @@ QueuePairList_Init(void)
 static INLINE void
 QueuePairList_Exit(void)
 {
-   VMCIQPLock_Destroy(&queuePairList.lock);
+   int i;
+
+   for (i = 0; i < QP_NUM_LOCKS; i++) {
+      VMCIQPLock_Destroy(&queuePairList.lock[i]);
+   }
    memset(&queuePairList, 0, sizeof queuePairList);
 }
 
@@ -182,7 +209,9 @@ QueuePairList_Exit(void)
  *
  * QueuePairList_Lock --
  *
- *      Acquires the lock protecting the QueuePair list.
+ *      Acquires the lock protecting the QueuePair with the given handle,
+ *      which must be held while the QueuePair is allocated, attached to,
+ *      given a page store or detached from.
  *
  * Results:
  *      None.
@@ -194,9 +223,9 @@ QueuePairList_Exit(void)
  */
 
 void
-QueuePairList_Lock(void)
+QueuePairList_Lock(VMCIHandle handle) // IN:
 {
-   VMCIQPLock_Acquire(&queuePairList.lock);
+   VMCIQPLock_Acquire(&queuePairList.lock[QP_LOCK_INDEX(QP_HASH(handle))]);
 }
 
 
@@ -205,7 +234,7 @@ QueuePairList_Lock(void)
  *
  * QueuePairList_Unlock --
  *
- *      Releases the lock protecting the QueuePair list.
+ *      Releases the lock protecting the QueuePair with the given handle.
  *
  * Results:
  *      None.
@@ -217,9 +246,9 @@ QueuePairList_Lock(void)
  */
 
 void
-QueuePairList_Unlock(void)
+QueuePairList_Unlock(VMCIHandle handle) // IN:
 {
-   VMCIQPLock_Release(&queuePairList.lock);
+   VMCIQPLock_Release(&queuePairList.lock[QP_LOCK_INDEX(QP_HASH(handle))]);
 }
 
 
@@ -229,7 +258,7 @@ QueuePairList_Unlock(void)
  * QueuePairList_FindEntry --
  *
  *      Finds the entry in the list corresponding to a given handle. Assumes
- *      that the list is locked.
+ *      that the lock for the handle is held.
  *
  * Results:
  *      Pointer to entry.
@@ -246,7 +275,7 @@ QueuePairList_FindEntry(VMCIHandle handle) // IN:
    ListItem *next;
 
    ASSERT(!VMCI_HANDLE_INVALID(handle));
-   LIST_SCAN(next, queuePairList.head) {
+   LIST_SCAN(next, queuePairList.head[QP_HASH(handle)]) {
       QueuePairEntry *entry = LIST_CONTAINER(next, QueuePairEntry, listItem);
 
       if (VMCI_HANDLE_EQUAL(entry->handle, handle)) {
@@ -263,7 +292,8 @@ QueuePairList_FindEntry(VMCIHandle handle) // IN:
  *
  * QueuePairList_AddEntry --
  *
- *      Adds the given entry to the list. Assumes that the list is locked.
+ *      Adds the given entry to the list. Assumes that the lock for the
+ *      entry's handle is held.
  *
  * Results:
  *      None.
@@ -278,7 +308,8 @@ static void
 QueuePairList_AddEntry(QueuePairEntry *entry) // IN:
 {
    if (entry) {
-      LIST_QUEUE(&entry->listItem, &queuePairList.head);
+      LIST_QUEUE(&entry->listItem,
+                 &queuePairList.head[QP_HASH(entry->handle)]);
    }
 }
 
@@ -288,7 +319,8 @@ QueuePairList_AddEntry(QueuePairEntry *entry) // IN:
  *
  * QueuePairList_RemoveEntry --
  *
- *      Removes the given entry from the list. Assumes that the list is locked.
+ *      Removes the given entry from the list. Assumes that the lock for
+ *      the entry's handle is held.
  *
  * Results:
  *      None.
@@ -303,39 +335,8 @@ static void
 QueuePairList_RemoveEntry(QueuePairEntry *entry) // IN:
 {
    if (entry) {
-      LIST_DEL(&entry->listItem, &queuePairList.head);
-   }
-}
-
-
-/*
- *-----------------------------------------------------------------------------
- *
- * QueuePairList_GetHead --
- *
- *      Returns the entry from the head of the list. Assumes that the list is
- *      locked.
- *
- * Results:
- *      Pointer to entry.
- *
- * Side effects:
- *      None.
- *
- *-----------------------------------------------------------------------------
- */
-
-static QueuePairEntry *
-QueuePairList_GetHead(void)
-{
-   ListItem *first = LIST_FIRST(queuePairList.head);
-
-   if (first) {
-      QueuePairEntry *entry = LIST_CONTAINER(first, QueuePairEntry, listItem);
-      return entry;
+      LIST_DEL(&entry->listItem, &queuePairList.head[QP_HASH(entry->handle)]);
    }
-
-   return NULL;
 }
 
 
@@ -428,15 +429,22 @@ void
 QueuePair_Exit(void)
 {
    QueuePairEntry *entry;
-
-   QueuePairList_Lock();
-
-   while ((entry = QueuePairList_GetHead())) {
-      QueuePairList_RemoveEntry(entry);
-      VMCI_FreeKernelMem(entry, sizeof *entry);
+   ListItem *first;
+   int bucket;
+   int i;
+
+   for (i = 0; i < QP_NUM_LOCKS; i++) {
+      VMCIQPLock_Acquire(&queuePairList.lock[i]);
+      for (bucket = i; bucket < QP_HASH_SIZE; bucket += QP_NUM_LOCKS) {
+         while ((first = LIST_FIRST(queuePairList.head[bucket])) != NULL) {
+            entry = LIST_CONTAINER(first, QueuePairEntry, listItem);
+            QueuePairList_RemoveEntry(entry);
+            VMCI_FreeKernelMem(entry, sizeof *entry);
+         }
+      }
+      VMCIQPLock_Release(&queuePairList.lock[i]);
    }
-   
-   QueuePairList_Unlock();
+
    QueuePairList_Exit();
 }
 
@@ -449,7 +457,7 @@ QueuePair_Exit(void)
  *      Does all the work for the QueuePairAlloc host driver call. Allocates a
  *      QueuePair entry if one does not exist. Attaches to one if it exists,
  *      and retrieves the page files backing that QueuePair.  Assumes that the
- *      QP list lock is held.
+ *      QP list lock for the handle is held.
  *
  * Results:
  *      Success or failure.
@@ -536,7 +544,7 @@ QueuePairAllocHost(VMCIHandle handle,             // IN:
    }
 #endif // VMKERNEL
 
-   if (VMCIHandleArray_HasEntry(context->queuePairArray, handle)) {
+   if (VMCIContext_QueuePairExists(context, handle)) {
       VMCILOG((LGPFX"Context %u already attached to queue pair 0x%x:0x%x.\n",
                contextId, handle.context, handle.resource));
       result = VMCI_ERROR_ALREADY_EXISTS;
@@ -716,19 +724,13 @@ QueuePairAllocHost(VMCIHandle handle,             // IN:
             goto out;
          }
       } else if (contextId == VMCI_HOST_CONTEXT_ID) {
-         VMCIContext *createContext;
-         Bool supportsHostQP;
-
          /*
           * Do not attach a host to a user created QP if that user
-          * doesn't support Host QP end points.
+          * doesn't support Host QP end points. The QueuePairList lock
+          * is held, so no context reference may be dropped here.
           */
 
-         createContext = VMCIContext_Get(entry->createId);
-         supportsHostQP = VMCIContext_SupportsHostQP(createContext);
-         VMCIContext_Release(createContext);
-
-         if (!supportsHostQP) {
+         if (!VMCIContext_CidSupportsHostQP(entry->createId)) {
             result = VMCI_ERROR_INVALID_RESOURCE;
             goto out;
          }
@@ -873,7 +875,7 @@ out:
       if (ent != NULL) {
          *ent = entry;
       }
-      VMCIHandleArray_AppendEntry(&context->queuePairArray, handle);
+      VMCIContext_QueuePairCreate(context, handle);
    }
    return result;
 }
@@ -885,7 +887,8 @@ out:
  * QueuePair_SetPageStore --
  *
  *      The creator of a QueuePair uses this to set the page file names for a
- *      given QueuePair.  Assumes that the QP list lock is held.
+ *      given QueuePair.  Assumes that the QP list lock for the handle is
+ *      held.
  *
  *      Note now that sometimes the client that attaches to a
  *      QueuePair will set the page file.  This happens on hosted
@@ -933,7 +936,7 @@ QueuePair_SetPageStore(VMCIHandle handle,             // IN:
       return VMCI_ERROR_INVALID_ARGS;
    }
 
-   if (!VMCIHandleArray_HasEntry(context->queuePairArray, handle)) {
+   if (!VMCIContext_QueuePairExists(context, handle)) {
       VMCILOG((LGPFX"Context %u not attached to queue pair 0x%x:0x%x.\n",
                contextId, handle.context, handle.resource));
       result = VMCI_ERROR_NOT_FOUND;
@@ -1100,7 +1103,7 @@ out:
  * QueuePair_Detach --
  *
  *      Detach a context from a given QueuePair handle.  Assumes that the QP
- *      list lock is held.  If the "detach" input parameter is FALSE, the QP
+ *      list lock for the handle is held.  If the "detach" input parameter is FALSE, the QP
  *      entry is not removed from the list of QPs, and the context is not
  *      detached from the given handle.  If "detach" is TRUE, the detach
  *      operation really happens.  With "detach" set to FALSE, the caller can
@@ -1138,7 +1141,7 @@ QueuePair_Detach(VMCIHandle  handle,   // IN:
       return VMCI_ERROR_INVALID_ARGS;
    }
 
-   if (!VMCIHandleArray_HasEntry(context->queuePairArray, handle)) {
+   if (!VMCIContext_QueuePairExists(context, handle)) {
       VMCILOG((LGPFX"Context %u not attached to queue pair 0x%x:0x%x.\n",
                contextId, handle.context, handle.resource));
       result = VMCI_ERROR_NOT_FOUND;
@@ -1302,7 +1305,7 @@ QueuePair_Detach(VMCIHandle  handle,   // IN:
 
 out:
    if (result >= VMCI_SUCCESS && detach) {
-      VMCIHandleArray_RemoveEntry(context->queuePairArray, handle);
+      VMCIContext_QueuePairDestroy(context, handle);
    }
    return result;
 }
@@ -1470,7 +1473,7 @@ VMCIQueuePair_AllocPriv(VMCIHandle *handle,           // IN/OUT
    ASSERT(context);
 
    entry = NULL;
-   QueuePairList_Lock();
+   QueuePairList_Lock(*handle);
    result = QueuePairAllocHost(*handle, peer,
                                flags, privFlags, produceSize,
                                consumeSize, NULL,
@@ -1492,7 +1495,7 @@ VMCIQueuePair_AllocPriv(VMCIHandle *handle,           // IN/OUT
       VMCILOG((LGPFX"QueuePairAllocHost() failed: %d.\n", result));
    }
 
-   QueuePairList_Unlock();
+   QueuePairList_Unlock(*handle);
    VMCIContext_Release(context);
    return result;
 }
@@ -1527,9 +1530,9 @@ VMCIQueuePair_Detach(VMCIHandle handle) // IN
 
    context = VMCIContext_Get(VMCI_HOST_CONTEXT_ID);
 
-   QueuePairList_Lock();
+   QueuePairList_Lock(handle);
    result = QueuePair_Detach(handle, context, TRUE);
-   QueuePairList_Unlock();
+   QueuePairList_Unlock(handle);
 
    VMCIContext_Release(context);
    return result;
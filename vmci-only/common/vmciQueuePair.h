@@ -68,10 +68,18 @@ typedef struct QueuePairPageStore {
 } QueuePairPageStore;
 #endif // VMKERNEL
 
+/*
+ * Lock order: a QueuePairList lock, then the lock of a context or
+ * contextList.lock. Peer notifications may drop the last reference to a
+ * context with a QueuePairList lock held, so freeing a context must not
+ * take QueuePairList locks: the queue pairs of a dying context are
+ * detached by VMCIContext_ReleaseContext instead.
+ */
+
 int QueuePair_Init(void);
 void QueuePair_Exit(void);
-void QueuePairList_Lock(void);
-void QueuePairList_Unlock(void);
+void QueuePairList_Lock(VMCIHandle handle);
+void QueuePairList_Unlock(VMCIHandle handle);
 int QueuePair_Alloc(VMCIHandle handle, VMCIId peer, uint32 flags,
                     VMCIPrivilegeFlags privFlags,
                     uint64 produceSize, uint64 consumeSize,
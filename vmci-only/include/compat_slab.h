@@ -53,6 +53,22 @@
 		kmem_cache_create(name, size, align, flags, ctor)
 #endif
 
+/*
+ * Since 4.16 hardened usercopy only lets copy_{to,from}_user touch the
+ * region of a slab object its cache whitelisted when it was created with
+ * kmem_cache_create_usercopy.  Older kernels check nothing of the sort.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define compat_kmem_cache_create_usercopy(name, size, align, flags, \
+                                          useroffset, usersize, ctor) \
+		kmem_cache_create_usercopy(name, size, align, flags, \
+		                           useroffset, usersize, ctor)
+#else
+#define compat_kmem_cache_create_usercopy(name, size, align, flags, \
+                                          useroffset, usersize, ctor) \
+		compat_kmem_cache_create(name, size, align, flags, ctor)
+#endif
+
 /*
  * Up to 2.6.23 kmem_cache constructor has three arguments - pointer to block to
  * prepare (aka "this"), from which cache it came, and some unused flags.  After
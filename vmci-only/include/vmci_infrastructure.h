@@ -61,6 +61,38 @@ typedef enum {
 #define VMCI_DEV_UNQUIESCE        0x04
 #define VMCI_DEV_QP_BREAK_SHARING 0x05
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ *  VMCI_HashHandle --
+ *
+ *     Hash function used by the VMCI hash tables. The handle is mixed
+ *     as a single 64 bit word, with the finalizer of MurmurHash3, so
+ *     that all bits of the result depend on all bits of the handle.
+ *
+ *  Result:
+ *     Returns the 32 bit hash of the handle.
+ *
+ *  Side effects:
+ *     None.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static INLINE uint32
+VMCI_HashHandle(VMCIHandle handle) // IN
+{
+   uint64 h = QWORD(handle.resource, handle.context);
+
+   h ^= h >> 33;
+   h *= CONST64U(0xff51afd7ed558ccd);
+   h ^= h >> 33;
+   h *= CONST64U(0xc4ceb9fe1a85ec53);
+   h ^= h >> 33;
+   return (uint32)h;
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -241,6 +241,7 @@ enum IOCTLCmd_VMCI {
 
    IOCTLCMD(FIRST2),
    IOCTLCMD(SET_NOTIFY) = IOCTLCMD(FIRST2), /* 1995 on Linux. */
+   IOCTLCMD(DATAGRAM_RECEIVE_BATCH),
    IOCTLCMD(LAST2),
 };
 
@@ -448,6 +449,23 @@ typedef struct VMCIDatagramSendRecvInfo {
    int32  result;
 } VMCIDatagramSendRecvInfo;
 
+/*
+ * Used to receive several datagrams at once. The datagrams are copied
+ * to addr one after another, each starting at a multiple of 8 bytes.
+ * result is the size of the next pending datagram, or 0 if there is
+ * none left, or an error. If the first pending datagram does not fit,
+ * result is VMCI_ERROR_NO_MEM and len is set to its size.
+ */
+#define VMCI_MAX_DG_RECV_BATCH 32
+
+typedef struct VMCIDatagramRecvBatchInfo {
+   VA64   addr;
+   uint32 len;       /* IN: size of buffer, OUT: bytes received. */
+   uint32 count;     /* OUT: number of datagrams received. */
+   int32  result;
+   uint32 _pad;
+} VMCIDatagramRecvBatchInfo;
+
 /* Used to create datagram endpoints in guest or host userlevel. */
 typedef struct VMCIDatagramCreateInfo {
    VMCIId      resourceID;
@@ -41,6 +41,7 @@
 #  include "compat_wait.h"
 #  include "compat_spinlock.h"
 #  include "compat_semaphore.h"
+#  include <linux/rcupdate.h>
 #endif // linux
 
 #ifdef __APPLE__
@@ -212,6 +213,40 @@ void VMCI_ReleaseLock(VMCILock *lock, VMCILockFlags flags);
 void VMCI_GrabLock_BH(VMCILock *lock, VMCILockFlags *flags);
 void VMCI_ReleaseLock_BH(VMCILock *lock, VMCILockFlags flags);
 
+/*
+ * Read-mostly data. Writers serialize on a lock, publish pointers with
+ * VMCI_PublishPointer and call VMCI_WaitForReaders before they free
+ * anything they unpublished. Readers bracket their accesses, which load
+ * published pointers with VMCI_ReadPointer, with VMCI_ReadLock and
+ * VMCI_ReadUnlock. On Linux readers run under RCU and take no lock, on
+ * the other platforms they take the writers' lock. Code that may run
+ * under either the read side or the writers' lock loads pointers with
+ * VMCI_ReadPointerLocked instead.
+ */
+
+#if defined(linux) && !defined(VMKERNEL)
+#  define VMCI_ReadLock(_lock, _flags) \
+      do { (void)(_lock); *(_flags) = 0; rcu_read_lock(); } while (0)
+#  define VMCI_ReadUnlock(_lock, _flags) \
+      do { (void)(_lock); (void)(_flags); rcu_read_unlock(); } while (0)
+#  define VMCI_ReadPointer(_p)          rcu_dereference(_p)
+#  if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 34)
+#     define VMCI_ReadPointerLocked(_p, _lock) \
+         rcu_dereference_check(_p, lockdep_is_held(_lock))
+#  else
+#     define VMCI_ReadPointerLocked(_p, _lock) rcu_dereference(_p)
+#  endif
+#  define VMCI_PublishPointer(_p, _v)   rcu_assign_pointer(_p, _v)
+#  define VMCI_WaitForReaders()         synchronize_rcu()
+#else
+#  define VMCI_ReadLock(_lock, _flags)   VMCI_GrabLock(_lock, _flags)
+#  define VMCI_ReadUnlock(_lock, _flags) VMCI_ReleaseLock(_lock, _flags)
+#  define VMCI_ReadPointer(_p)          (_p)
+#  define VMCI_ReadPointerLocked(_p, _lock) (_p)
+#  define VMCI_PublishPointer(_p, _v)   ((_p) = (_v))
+#  define VMCI_WaitForReaders()
+#endif
+
 void VMCIHost_InitContext(VMCIHost *hostContext, uintptr_t eventHnd);
 void VMCIHost_ReleaseContext(VMCIHost *hostContext);
 void VMCIHost_SignalCall(VMCIHost *hostContext);
@@ -226,6 +261,18 @@ int VMCIHost_ContextToHostVmID(VMCIHost *hostContext, VMCIHostVmID *hostVmID);
 
 void *VMCI_AllocKernelMem(size_t size, int flags);
 void VMCI_FreeKernelMem(void *ptr, size_t size);
+
+/*
+ * Pools of equally sized blocks of non-paged kernel memory, for objects
+ * that are allocated and freed at a high rate.
+ */
+
+typedef struct VMCIMemPool VMCIMemPool;
+
+VMCIMemPool *VMCI_CreateMemPool(const char *name, size_t size);
+void VMCI_DestroyMemPool(VMCIMemPool *pool);
+void *VMCI_AllocFromMemPool(VMCIMemPool *pool, int flags);
+void VMCI_FreeToMemPool(VMCIMemPool *pool, void *ptr);
 VMCIBuffer VMCI_AllocBuffer(size_t size, int flags);
 void *VMCI_MapBuffer(VMCIBuffer buf);
 void VMCI_ReleaseBuffer(void *ptr);
@@ -782,7 +782,11 @@ LinuxDriver_Ioctl(struct inode *inode,
 	 ASSERT(dg);
 	 retval = copy_to_user((void *) ((uintptr_t) recvInfo.addr), dg,
 			       VMCI_DG_SIZE(dg));
-	 VMCI_FreeKernelMem(dg, VMCI_DG_SIZE(dg));
+	 if (vmciLinux->ctType == VMCIOBJ_CONTEXT) {
+	    VMCIContext_FreeDatagram(dg);
+	 } else {
+	    VMCI_FreeKernelMem(dg, VMCI_DG_SIZE(dg));
+	 }
 	 if (retval != 0) {
 	    break;
 	 }
@@ -791,6 +795,63 @@ LinuxDriver_Ioctl(struct inode *inode,
       break;
    }
 
+   case IOCTL_VMCI_DATAGRAM_RECEIVE_BATCH: {
+      VMCIDatagramRecvBatchInfo batchInfo;
+      VMCIDatagram *dgs[VMCI_MAX_DG_RECV_BATCH];
+      size_t size;
+      size_t offset;
+      uint32 i;
+
+      if (vmciLinux->ctType != VMCIOBJ_CONTEXT) {
+         Log("VMCI: IOCTL_VMCI_DATAGRAM_RECEIVE_BATCH only valid for "
+             "contexts.\n");
+         retval = -EINVAL;
+         break;
+      }
+
+      retval = copy_from_user(&batchInfo, (void *)ioarg, sizeof batchInfo);
+      if (retval) {
+         retval = -EFAULT;
+         break;
+      }
+
+      ASSERT(vmciLinux->ct.context);
+      size = batchInfo.len;
+      batchInfo.count = ARRAYSIZE(dgs);
+      batchInfo.result =
+         VMCIContext_DequeueDatagramBatch(vmciLinux->ct.context, &size, dgs,
+                                          &batchInfo.count);
+      if (batchInfo.result == VMCI_ERROR_NO_MEM) {
+         batchInfo.len = size;
+      }
+      if (batchInfo.result < VMCI_SUCCESS) {
+         batchInfo.count = 0;
+      } else {
+         /* Datagrams that fail to copy out are lost, as with RECEIVE. */
+         offset = 0;
+         for (i = 0; i < batchInfo.count; i++) {
+            if (retval == 0) {
+               retval = copy_to_user((void *)(uintptr_t)(batchInfo.addr +
+                                                         offset),
+                                     dgs[i], VMCI_DG_SIZE(dgs[i]));
+            }
+            offset += VMCI_DG_SIZE_ALIGNED(dgs[i]);
+            VMCIContext_FreeDatagram(dgs[i]);
+         }
+         if (retval != 0) {
+            retval = -EFAULT;
+            break;
+         }
+         batchInfo.len = size;
+      }
+
+      retval = copy_to_user((void *)ioarg, &batchInfo, sizeof batchInfo);
+      if (retval) {
+         retval = -EFAULT;
+      }
+      break;
+   }
+
    case IOCTL_VMCI_QUEUEPAIR_ALLOC: {
       VMCIQueuePairAllocInfo queuePairAllocInfo;
       VMCIQueuePairAllocInfo *info = (VMCIQueuePairAllocInfo *)ioarg;
@@ -811,7 +872,7 @@ LinuxDriver_Ioctl(struct inode *inode,
       }
 
       cid = VMCIContext_GetId(vmciLinux->ct.context);
-      QueuePairList_Lock();
+      QueuePairList_Lock(queuePairAllocInfo.handle);
 
       {
 	 QueuePairPageStore pageStore = { TRUE,
@@ -843,7 +904,7 @@ LinuxDriver_Ioctl(struct inode *inode,
          }
       }
 
-      QueuePairList_Unlock();
+      QueuePairList_Unlock(queuePairAllocInfo.handle);
       break;
    }
 
@@ -902,7 +963,7 @@ LinuxDriver_Ioctl(struct inode *inode,
       retval = copy_to_user(&info->result, &result, sizeof result);
       if (retval == 0) {
          cid = VMCIContext_GetId(vmciLinux->ct.context);
-         QueuePairList_Lock();
+         QueuePairList_Lock(pageFileInfo.handle);
 
          {
             QueuePairPageStore pageStore = { TRUE,
@@ -917,7 +978,7 @@ LinuxDriver_Ioctl(struct inode *inode,
                                             &pageStore,
                                             vmciLinux->ct.context);
          }
-         QueuePairList_Unlock();
+         QueuePairList_Unlock(pageFileInfo.handle);
 
          if (result < VMCI_SUCCESS) {
             Log("VMCI: IOCTL_VMCI_QUEUEPAIR_SETPAGEFILE cid = %u result = %d.\n",
@@ -975,7 +1036,7 @@ LinuxDriver_Ioctl(struct inode *inode,
       }
 
       cid = VMCIContext_GetId(vmciLinux->ct.context);
-      QueuePairList_Lock();
+      QueuePairList_Lock(detachInfo.handle);
       result = QueuePair_Detach(detachInfo.handle, vmciLinux->ct.context,
                                 FALSE); /* Probe detach operation. */
       Log("VMCI: IOCTL_VMCI_QUEUEPAIR_DETACH cid = %u result = %d.\n",
@@ -1001,7 +1062,7 @@ LinuxDriver_Ioctl(struct inode *inode,
          }
       }
 
-      QueuePairList_Unlock();
+      QueuePairList_Unlock(detachInfo.handle);
       break;
    }
 
@@ -483,6 +483,106 @@ VMCI_FreeKernelMem(void *ptr,   // IN:
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_CreateMemPool
+ *
+ *      Creates a pool of blocks of the given size. On Linux the pool
+ *      is a slab cache, whose per-CPU free lists make most allocations
+ *      and frees take no lock. Blocks are copied straight to user space,
+ *      so the whole block is whitelisted for hardened usercopy.
+ *
+ * Results:
+ *      The pool or NULL on error.
+ *
+ * Side effects:
+ *      None.
+ *----------------------------------------------------------------------
+ */
+
+VMCIMemPool *
+VMCI_CreateMemPool(const char *name, // IN: must stay valid
+                   size_t size)      // IN: size of a block
+{
+   return (VMCIMemPool *)compat_kmem_cache_create_usercopy(name, size, 0,
+                                                           SLAB_HWCACHE_ALIGN,
+                                                           0, size, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_DestroyMemPool
+ *
+ *      Destroys a pool. All its blocks must have been freed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *----------------------------------------------------------------------
+ */
+
+void
+VMCI_DestroyMemPool(VMCIMemPool *pool) // IN
+{
+   if (pool) {
+      kmem_cache_destroy((compat_kmem_cache *)pool);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_AllocFromMemPool
+ *
+ *      Allocates a block from a pool.
+ *
+ * Results:
+ *      The address allocated or NULL on error.
+ *
+ * Side effects:
+ *      None.
+ *----------------------------------------------------------------------
+ */
+
+void *
+VMCI_AllocFromMemPool(VMCIMemPool *pool, // IN
+                      int flags)         // IN: VMCI_MEMORY_xxx
+{
+   return kmem_cache_alloc((compat_kmem_cache *)pool,
+                           (flags & VMCI_MEMORY_ATOMIC) != 0 ?
+                           GFP_ATOMIC : GFP_KERNEL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_FreeToMemPool
+ *
+ *      Returns a block to the pool it was allocated from.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *----------------------------------------------------------------------
+ */
+
+void
+VMCI_FreeToMemPool(VMCIMemPool *pool, // IN
+                   void *ptr)         // IN
+{
+   kmem_cache_free((compat_kmem_cache *)pool, ptr);
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
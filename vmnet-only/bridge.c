@@ -38,6 +38,7 @@
 
 #include <linux/proc_fs.h>
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/ip.h>
 #include <linux/tcp.h>
 #include <net/tcp.h>
@@ -55,7 +56,23 @@
 #include "vnetInt.h"
 #include "smac.h"
 
-#define VNET_BRIDGE_HISTORY    48
+/*
+ * Frames the bridge sends up to the host come back to it through
+ * VNetBridgeReceiveFromDev.  They are remembered in a direct-mapped table
+ * indexed by a hash of SKB_CLONE_KEY, so the receive path recognizes them
+ * with a single compare and, for the common case of a frame that is not
+ * ours, without taking any lock.  A new frame whose slot is taken simply
+ * replaces the older one.
+ */
+
+#define VNET_BRIDGE_HISTORY_BITS 8
+#define VNET_BRIDGE_HISTORY      (1 << VNET_BRIDGE_HISTORY_BITS)
+
+typedef struct VNetBridgeHistory {
+   spinlock_t               lock;           // protects 'key' and 'skb'
+   const void              *key;            // SKB_CLONE_KEY(skb), never dereferenced
+   struct sk_buff          *skb;            // frame sent up to the host, or NULL
+} VNetBridgeHistory;
 
 /*
  * Bytes reserved before start of packet.  As Ethernet header has 14 bytes,
@@ -82,8 +99,7 @@ struct VNetBridge {
    Bool                     enabledPromisc; // track if promisc enabled
    Bool                     warnPromisc;    // tracks if warning has been logged
    Bool                     forceSmac;      // whether to use smac unconditionally
-   struct sk_buff          *history[VNET_BRIDGE_HISTORY];  // avoid duplicate packets
-   spinlock_t		    historyLock;    // protects 'history'
+   VNetBridgeHistory        history[VNET_BRIDGE_HISTORY];  // avoid duplicate packets
    VNetPort                 port;           // connection to virtual hub
    Bool                     wirelessAdapter; // connected to wireless adapter?
    struct SMACState        *smac;           // device structure for wireless
@@ -122,6 +138,9 @@ static int  VNetBridgeProcRead(char *page, char **start, off_t off,
                                int count, int *eof, void *data);
 #endif
 static void VNetBridgeComputeHeaderPosIPv6(struct sk_buff *skb);
+static void VNetBridgeHistoryAdd(VNetBridge *bridge, struct sk_buff *skb);
+static Bool VNetBridgeHistoryTake(VNetBridge *bridge, struct sk_buff *skb);
+static void VNetBridgeHistoryFlush(VNetBridge *bridge);
 static PacketStatus VNetCallSMACFunc(struct SMACState *state,
                                      struct sk_buff **skb, void *startOfData,
                                      SMACFunc func, unsigned int len);
@@ -345,6 +364,7 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
    VNetBridge *bridge = NULL;
    static unsigned id = 0;
    int retval = 0;
+   int i;
 
    *ret = NULL;
 
@@ -373,7 +393,9 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
       goto out;
    }
    memset(bridge, 0, sizeof *bridge);
-   spin_lock_init(&bridge->historyLock);
+   for (i = 0; i < VNET_BRIDGE_HISTORY; i++) {
+      spin_lock_init(&bridge->history[i].lock);
+   }
    memcpy(bridge->name, devName, sizeof bridge->name);
    NULL_TERMINATE_STRING(bridge->name);
 
@@ -396,6 +418,7 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
    bridge->port.jack.cycleDetect = VNetBridgeCycleDetect;
    bridge->port.jack.portsChanged = VNetBridgePortsChanged;
    bridge->port.jack.isBridged = VNetBridgeIsBridged;
+   bridge->port.jack.isPromisc = NULL;
 
    /*
     * Make proc entry for this jack.
@@ -437,6 +460,9 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
    bridge->port.fileOpWrite = NULL;
    bridge->port.fileOpIoctl = NULL;
    bridge->port.fileOpPoll = NULL;
+   bridge->port.setApiFlags = NULL;
+   bridge->port.shaper[VNET_SHAPER_TX] = NULL;
+   bridge->port.shaper[VNET_SHAPER_RX] = NULL;
 
    /* misc. configuration */
    bridge->forceSmac = (flags & VNET_BRFLAG_FORCE_SMAC) ? TRUE : FALSE;
@@ -516,6 +542,7 @@ VNetBridgeFree(VNetJack *this) // IN: jack to free
       LOG(1, (KERN_DEBUG "bridge-%s: disabling the bridge\n", bridge->name));
       VNetBridgeDown(bridge, TRUE);
    }
+   VNetBridgeHistoryFlush(bridge);
 
    /* destroy event sender */
    VNetEvent_DestroySender(bridge->eventSender);
@@ -583,6 +610,159 @@ VNetCallSMACFunc(struct SMACState *state, // IN: pointer to state
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetBridgeHistorySlot --
+ *
+ *      Returns the history table slot for a frame and its clones.
+ *
+ * Results:
+ *      Pointer to the slot.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE VNetBridgeHistory *
+VNetBridgeHistorySlot(VNetBridge *bridge, // IN: bridge
+                      const void *key)    // IN: SKB_CLONE_KEY of frame
+{
+   return &bridge->history[hash_ptr((void *)key, VNET_BRIDGE_HISTORY_BITS)];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetBridgeHistoryAdd --
+ *
+ *      Remember a frame that is about to be sent up to the host.  The
+ *      history table takes over the caller's reference to 'skb'.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frees the frame previously held in the same slot, if any.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetBridgeHistoryAdd(VNetBridge *bridge,  // IN: bridge
+                     struct sk_buff *skb) // IN: frame sent up
+{
+   const void *key = SKB_CLONE_KEY(skb);
+   VNetBridgeHistory *slot = VNetBridgeHistorySlot(bridge, key);
+   struct sk_buff *old;
+   unsigned long flags;
+
+   spin_lock_irqsave(&slot->lock, flags);
+   old = slot->skb;
+   slot->skb = skb;
+   WRITE_ONCE(slot->key, key);
+   spin_unlock_irqrestore(&slot->lock, flags);
+
+   if (old != NULL) {
+      LOG(3, (KERN_DEBUG "bridge-%s: history slot %u replaced\n",
+              bridge->name, (unsigned)(slot - bridge->history)));
+      dev_kfree_skb(old);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetBridgeHistoryTake --
+ *
+ *      Check whether a received frame is one the bridge sent up to the
+ *      host itself, and if so forget it.  The slot key is compared
+ *      before taking the slot lock; it is only ever compared, never
+ *      dereferenced, and cannot be reused while the slot holds a
+ *      reference to the frame.
+ *
+ * Results:
+ *      TRUE if the frame (or a clone of it) was found, FALSE otherwise.
+ *
+ * Side effects:
+ *      Drops the history table's reference to the frame if found.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetBridgeHistoryTake(VNetBridge *bridge,  // IN: bridge
+                      struct sk_buff *skb) // IN: received frame
+{
+   const void *key = SKB_CLONE_KEY(skb);
+   VNetBridgeHistory *slot = VNetBridgeHistorySlot(bridge, key);
+   struct sk_buff *s = NULL;
+   unsigned long flags;
+
+   if (READ_ONCE(slot->key) != key) {
+      return FALSE;
+   }
+
+   spin_lock_irqsave(&slot->lock, flags);
+   if (slot->key == key) {
+      s = slot->skb;
+      slot->skb = NULL;
+      WRITE_ONCE(slot->key, NULL);
+   }
+   spin_unlock_irqrestore(&slot->lock, flags);
+
+   if (s == NULL) {
+      return FALSE;
+   }
+   dev_kfree_skb(s);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetBridgeHistoryFlush --
+ *
+ *      Forget all frames sent up to the host.  Called once the packet
+ *      handler is removed, as none of them can come back anymore.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frees all frames held in the history table.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetBridgeHistoryFlush(VNetBridge *bridge) // IN: bridge
+{
+   int i;
+
+   for (i = 0; i < VNET_BRIDGE_HISTORY; i++) {
+      VNetBridgeHistory *slot = &bridge->history[i];
+      struct sk_buff *s;
+      unsigned long flags;
+
+      spin_lock_irqsave(&slot->lock, flags);
+      s = slot->skb;
+      slot->skb = NULL;
+      WRITE_ONCE(slot->key, NULL);
+      spin_unlock_irqrestore(&slot->lock, flags);
+
+      if (s != NULL) {
+         dev_kfree_skb(s);
+      }
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -595,7 +775,7 @@ VNetCallSMACFunc(struct SMACState *state, // IN: pointer to state
  *      satisfies the host's packet filter.
  *
  *      When the function sends up it keeps a reference to the
- *      packet in a history list so that we can avoid handing
+ *      packet in the history table so that we can avoid handing
  *      a VM a copy of its own packet.
  *
  * Results:
@@ -729,9 +909,6 @@ VNetBridgeReceiveFromVNet(VNetJack        *this, // IN: jack
    if (VNetPacketMatch(dest, dev->dev_addr, allMultiFilter, dev->flags)) {
       clone = skb_clone(skb, GFP_ATOMIC);
       if (clone) {
-	 unsigned long flags;
-	 int i;
-
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
 	 refcount_inc(&clone->users);
 #else
@@ -740,52 +917,7 @@ VNetBridgeReceiveFromVNet(VNetJack        *this, // IN: jack
 
 	 clone->dev = dev;
 	 clone->protocol = eth_type_trans(clone, dev);
-	 spin_lock_irqsave(&bridge->historyLock, flags);
-	 for (i = 0; i < VNET_BRIDGE_HISTORY; i++) {
-	    if (bridge->history[i] == NULL) {
-	       bridge->history[i] = clone;
-#	       if LOGLEVEL >= 3
-	       {
-		  int j;
-		  int count = 0;
-		  for (j = 0; j < VNET_BRIDGE_HISTORY; j++) {
-		     if (bridge->history[j] != NULL) {
-			count++;
-		     }
-		  }
-		  LOG(3, (KERN_DEBUG "bridge-%s: host slot %d history %d\n",
-			  bridge->name, i, count));
-	       }
-#	       endif
-	       break;
-	    }
-	 }
-	 if (i >= VNET_BRIDGE_HISTORY) {
-	    LOG(1, (KERN_NOTICE "bridge-%s: history full\n",
-		    bridge->name));
-
-	    for (i = 0; i < VNET_BRIDGE_HISTORY; i++) {
-	       struct sk_buff *s = bridge->history[i];
-
-	       /*
-		* We special case 0 to avoid races with another thread on
-		* another cpu wanting to use the 0 entry. This could happen
-		* when we release the lock to free the former entry.
-		* See bug 11231 for details.
-		*/
-	       if (i == 0) {
-		  bridge->history[0] = clone;
-	       } else {
-		  bridge->history[i] = NULL;
-	       }
-	       if (s) {
-	       	  spin_unlock_irqrestore(&bridge->historyLock, flags);
-		  dev_kfree_skb(s);
-		  spin_lock_irqsave(&bridge->historyLock, flags);
-	       }
-	    }
-	 }
-         spin_unlock_irqrestore(&bridge->historyLock, flags);
+	 VNetBridgeHistoryAdd(bridge, clone);
 
          /*
           * We used to cli() before calling netif_rx() here. It was probably
@@ -1185,6 +1317,7 @@ VNetBridgeDown(VNetBridge *bridge, // IN: bridge
    }
    bridge->dev = NULL;
    dev_remove_pack(&bridge->pt);
+   VNetBridgeHistoryFlush(bridge);
    sk_free(bridge->sk);
    bridge->sk = NULL;
 
@@ -1524,7 +1657,43 @@ VNetBridgeComputeHeaderPos(struct sk_buff *skb) // IN: buffer to examine
  */
 #if defined(NETIF_F_GSO) || LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 18)
 #define VNetBridgeIsGSO(skb) skb_shinfo(skb)->gso_size
-#define VNetBridgeGSOSegment(skb) skb_gso_segment(skb, 0)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetBridgeGSOSegment --
+ *
+ *	Split a GSO sk_buff (TCP or UDP, over IPv4 or IPv6) into
+ *	frames that fit on the wire using the kernel's segmentation
+ *	code.  Called from VNetBridgeSendLargePacket().
+ *
+ *	Segments reference the pages of the original packet rather
+ *	than copying the payload.  Frames transmitted by the host
+ *	(PACKET_OUTGOING) also stay CHECKSUM_PARTIAL: the checksum is
+ *	computed during the copy to user space (VNetCopyDatagramToUser)
+ *	or by the device that transmits the frame, so the payload is
+ *	not walked twice.  Received frames get complete checksums here,
+ *	as nobody downstream fills them in for incoming frames.
+ *
+ * Results:
+ *	List of skbs created, or ERR_PTR.
+ *
+ * Side effects:
+ *	None.  The incoming packet is left to the caller.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static struct sk_buff *
+VNetBridgeGSOSegment(struct sk_buff *skb)        // IN: packet to split
+{
+   if (skb->pkt_type == PACKET_OUTGOING &&
+       skb->ip_summed == VM_TX_CHECKSUM_PARTIAL) {
+      return skb_gso_segment(skb, NETIF_F_SG | NETIF_F_HW_CSUM);
+   }
+   return skb_gso_segment(skb, NETIF_F_SG);
+}
 #elif defined(NETIF_F_TSO)
 #define VNetBridgeIsGSO(skb) skb_shinfo(skb)->tso_size
 
@@ -1667,8 +1836,8 @@ VNetBridgeGSOSegment(struct sk_buff *skb)        // IN: packet to split
  *
  * VNetBridgeSendLargePacket --
  *
- *      Split and send a large TCP/IPv4 sk_buff into multiple sk_buffs which
- *      fits on wire.  Called from VNetBridgeReceiveFromDev(), which is a
+ *      Split and send a large TCP/UDP sk_buff into multiple sk_buffs which
+ *      fit on wire.  Called from VNetBridgeReceiveFromDev(), which is a
  *	protocol handler called from the bottom half, so steady as she
  *	goes...
  *
@@ -1744,8 +1913,6 @@ VNetBridgeReceiveFromDev(struct sk_buff *skb,         // IN: packet to receive
 #endif
 {
    VNetBridge *bridge = list_entry(pt, VNetBridge, pt);
-   int i;
-   unsigned long flags;
 
    if (bridge->dev == NULL) {
       LOG(3, (KERN_DEBUG "bridge-%s: received %d closed\n",
@@ -1759,21 +1926,12 @@ VNetBridgeReceiveFromDev(struct sk_buff *skb,         // IN: packet to receive
     * so then don't bother to receive the packet.
     */
 
-   spin_lock_irqsave(&bridge->historyLock, flags);
-   for (i = 0; i < VNET_BRIDGE_HISTORY; i++) {
-      struct sk_buff *s = bridge->history[i];
-      if (s != NULL &&
-	  (s == skb || SKB_IS_CLONE_OF(skb, s))) {
-	 bridge->history[i] = NULL;
-	 spin_unlock_irqrestore(&bridge->historyLock, flags);
-	 dev_kfree_skb(s);
-	 LOG(3, (KERN_DEBUG "bridge-%s: receive %d self %d\n",
-		 bridge->name, (int) skb->len, i));
-	 dev_kfree_skb(skb);
-	 return 0;
-      }
+   if (VNetBridgeHistoryTake(bridge, skb)) {
+      LOG(3, (KERN_DEBUG "bridge-%s: receive %d self\n",
+	      bridge->name, (int) skb->len));
+      dev_kfree_skb(skb);
+      return 0;
    }
-   spin_unlock_irqrestore(&bridge->historyLock, flags);
 
 #  if LOGLEVEL >= 4
    {
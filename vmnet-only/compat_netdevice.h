@@ -184,6 +184,20 @@ compat_alloc_netdev(int priv_size,
 #   define compat_free_netdev(dev)                free_netdev(dev)
 #endif
 
+/*
+ * alloc_netdev_mqs() appeared in 2.6.38.  Older kernels get a single queue.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 17, 0)
+#   define compat_alloc_netdev_mq(size, mask, setup, queues) \
+      alloc_netdev_mqs(size, mask, NET_NAME_UNKNOWN, setup, queues, queues)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+#   define compat_alloc_netdev_mq(size, mask, setup, queues) \
+      alloc_netdev_mqs(size, mask, setup, queues, queues)
+#else
+#   define compat_alloc_netdev_mq(size, mask, setup, queues) \
+      compat_alloc_netdev(size, mask, setup)
+#endif
+
 /* netdev_priv() appeared in 2.6.3 */
 #if  LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 3)
 #   define compat_netdev_priv(netdev)   (netdev)->priv
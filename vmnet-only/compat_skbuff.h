@@ -20,6 +20,7 @@
 #   define __COMPAT_SKBUFF_H__
 
 #include <linux/skbuff.h>
+#include <linux/if_vlan.h>
 
 /*
  * When transition from mac/nh/h to skb_* accessors was made, also SKB_WITH_OVERHEAD
@@ -117,6 +118,26 @@ compat_skb_linearize(struct sk_buff *skb)
 #   define VM_TX_CHECKSUM_PARTIAL      CHECKSUM_PARTIAL
 #endif
 
+/* out-of-band (accelerated) 802.1Q tag */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+#   define compat_skb_vlan_tag_present(skb) skb_vlan_tag_present(skb)
+#   define compat_skb_vlan_tag_get(skb)     skb_vlan_tag_get(skb)
+#elif defined(vlan_tx_tag_present)
+#   define compat_skb_vlan_tag_present(skb) vlan_tx_tag_present(skb)
+#   define compat_skb_vlan_tag_get(skb)     vlan_tx_tag_get(skb)
+#else
+#   define compat_skb_vlan_tag_present(skb) 0
+#   define compat_skb_vlan_tag_get(skb)     0
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#   define compat_skb_vlan_tag_clear(skb)   __vlan_hwaccel_clear_tag(skb)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0) || \
+      defined(vlan_tx_tag_present)
+#   define compat_skb_vlan_tag_clear(skb)   ((skb)->vlan_tci = 0)
+#else
+#   define compat_skb_vlan_tag_clear(skb)   do { } while (0)
+#endif
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,1,0))
 #   define compat_kfree_skb(skb, type) kfree_skb(skb, type)
 #   define compat_dev_kfree_skb(skb, type) dev_kfree_skb(skb, type)
@@ -65,4 +65,20 @@ typedef struct {} spinlock_t;
 #endif
 
 
+/*
+ * READ_ONCE() and WRITE_ONCE() appeared in 3.19, replacing ACCESS_ONCE()
+ * (2.6.34), which is a plain volatile access. Both live in
+ * linux/compiler.h, which linux/spinlock.h pulls in.
+ */
+#ifndef READ_ONCE
+#   ifdef ACCESS_ONCE
+#      define READ_ONCE(x)     ACCESS_ONCE(x)
+#      define WRITE_ONCE(x, v) (ACCESS_ONCE(x) = (v))
+#   else
+#      define READ_ONCE(x)     (*(volatile typeof(x) *)&(x))
+#      define WRITE_ONCE(x, v) (*(volatile typeof(x) *)&(x) = (v))
+#   endif
+#endif
+
+
 #endif /* __COMPAT_SPINLOCK_H__ */
@@ -42,6 +42,7 @@
 
 #include <linux/proc_fs.h>
 #include <linux/file.h>
+#include <linux/crc32.h>
 #if defined(__x86_64__) && !defined(HAVE_COMPAT_IOCTL)
 #include <asm/ioctl32.h>
 #endif
@@ -99,23 +100,19 @@ const uint8 allMultiFilter[VNET_LADRF_LEN] = { 0xff, 0xff, 0xff, 0xff,
 const uint8 broadcast[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
 /*
- * All jack->peer accesses are guarded by this lock.
- *
- * This lock is acquired for read from interrupt context:
- * use write_lock_irqsave() to gain write access.
- *
- * If you are acquiring this lock for write, and you do
- * not have vnetStructureMutex already acquired,
- * it is most certainly a bug.
+ * All jack->peer accesses on the packet path are RCU protected.
+ *
+ * Readers (VNetSend and everything called from a jack's rcv
+ * function) run inside rcu_read_lock() and never take a lock
+ * shared between CPUs. The peer fields are only ever changed by
+ * VNetConnect and VNetDisconnect, with vnetStructureMutex held.
+ * VNetDisconnect waits for a grace period before it returns the
+ * old peer, so the caller may free it right away.
  */
-static DEFINE_RWLOCK(vnetPeerLock);
 
 /*
  * All concurrent changes to the network structure are
  * guarded by this mutex.
- *
- * For change to peer field you must own both
- * vnetStructureMutex and vnetPeerLock for write.
  */
 compat_define_mutex(vnetStructureMutex);
 compat_define_mutex(vnetMutex);
@@ -130,7 +127,10 @@ compat_define_mutex(vnetMutex);
  */
 static const unsigned int ioctl32_cmds[] = {
 	SIOCGBRSTATUS, SIOCSPEER, SIOCSPEER2, SIOCSBIND, SIOCGETAPIVERSION2,
-        SIOCSFILTERRULES, SIOCSUSERLISTENER, SIOCSPEER3, 0,
+        SIOCSFILTERRULES, SIOCSUSERLISTENER, SIOCSPEER3, SIOCRECVBATCH,
+        SIOCSENDBATCH, SIOCSETRING, SIOCUNSETRING, SIOCRINGKICK,
+        SIOCSETCOALESCE, SIOCSETQUEUELIMITS, SIOCSETVLAN,
+        SIOCSETSHAPER, SIOCSETTAP, 0,
 };
 #endif
 
@@ -157,6 +157,7 @@ int VNetRegister(int value);
 static int  VNetFileOpOpen(struct inode *inode, struct file *filp);
 static int  VNetFileOpClose(struct inode *inode, struct file *filp);
 static unsigned int VNetFileOpPoll(struct file *filp, poll_table *wait);
+static int  VNetFileOpMmap(struct file *filp, struct vm_area_struct *vma);
 static ssize_t  VNetFileOpRead(struct file *filp, char *buf, size_t count,
 			       loff_t *ppos);
 static ssize_t  VNetFileOpWrite(struct file *filp, const char *buf, size_t count,
@@ -491,6 +492,7 @@ init_module(void)
    vnetFileOps.read = VNetFileOpRead;
    vnetFileOps.write = VNetFileOpWrite;
    vnetFileOps.poll = VNetFileOpPoll;
+   vnetFileOps.mmap = VNetFileOpMmap;
 #ifdef HAVE_UNLOCKED_IOCTL
    vnetFileOps.unlocked_ioctl = VNetFileOpUnlockedIoctl;
 #else
@@ -793,6 +795,50 @@ VNetFileOpPoll(struct file *filp, // IN:
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFileOpMmap --
+ *
+ *      The virtual network's mmap file operation. Maps the capture
+ *      rings of the tap of the hub the port is connected to, see
+ *      SIOCSETTAP.
+ *
+ *      vnetStructureMutex keeps the port connected to the hub, and so
+ *      the hub allocated, until the tap is held. vnetMutex cannot be
+ *      used here: mmap_lock is held, and the ioctls take vnetMutex
+ *      before they fault on user memory.
+ *
+ * Results:
+ *      0 on success, else -errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFileOpMmap(struct file *filp,           // IN:
+               struct vm_area_struct *vma)  // IN:
+{
+   VNetPort *port;
+   int retval;
+
+   compat_mutex_lock(&vnetStructureMutex);
+   port = (VNetPort*)filp->private_data;
+   if (!port) {
+      compat_mutex_unlock(&vnetStructureMutex);
+      LOG(1, (KERN_DEBUG "/dev/vmnet: bad file pointer on mmap\n"));
+      return -EBADF;
+   }
+
+   retval = VNetHub_MmapTap(port->jack.peer, vma);
+   compat_mutex_unlock(&vnetStructureMutex);
+   return retval;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -819,6 +865,16 @@ VNetFileOpPoll(struct file *filp, // IN:
  *      SIOCSFILTERRULES - set host filter rules    - ioarg IN: VNet_Filter
  *      SIOCBRIDGE - (legacy see SIOCSPEER)
  *      SIOCSUSERLISTENER - set user listener - ioarg IN: VNet_SetUserListener
+ *      SIOCRECVBATCH - receive queued packets      - ioarg IN/OUT: VNet_RecvBatch
+ *      SIOCSENDBATCH - send several packets        - ioarg IN/OUT: VNet_SendBatch
+ *      SIOCSETRING - set up shared packet rings    - ioarg IN: VNet_RingSetup
+ *      SIOCUNSETRING - tear down shared rings
+ *      SIOCRINGKICK - send ready TX ring slots
+ *      SIOCSETCOALESCE - tune notification coalescing - ioarg IN: VNet_Coalesce
+ *      SIOCSETQUEUELIMITS - set receive queue limits - ioarg IN: VNet_QueueLimits
+ *      SIOCSETVLAN - set VLAN membership of the hub jack - ioarg IN: VNet_VlanConfig
+ *      SIOCSETSHAPER - set rate limit of the port   - ioarg IN: VNet_Shaper
+ *      SIOCSETTAP - attach a capture tap to the hub  - ioarg IN/OUT: VNet_TapSetup
  *
  *      Supported flags are (taken from if.h):
  *
@@ -979,6 +1035,40 @@ VNetFileOpIoctl(struct inode   *inode, // IN:
       return VNetSwitchToDifferentPeer(&port->jack, hubJack, FALSE, NULL, NULL, NULL);
       break;
 
+   case SIOCSETVLAN:
+      {
+         VNet_VlanConfig *vc = kmalloc(sizeof *vc, GFP_KERNEL);
+
+         if (vc == NULL) {
+            return -ENOMEM;
+         }
+         if (copy_from_user(vc, (void *)ioarg, sizeof *vc)) {
+            retval = -EFAULT;
+         } else {
+            retval = VNetHub_SetVlan(port->jack.peer, vc);
+         }
+         kfree(vc);
+         return retval;
+      }
+
+   case SIOCSETTAP:
+      {
+         VNet_TapSetup ts;
+
+         if (copy_from_user(&ts, (void *)ioarg, sizeof ts)) {
+            return -EFAULT;
+         }
+         /* A tap sees the traffic of every port on the hub. */
+         if (ts.ringSize != 0 && !capable(CAP_NET_ADMIN)) {
+            return -EACCES;
+         }
+         retval = VNetHub_SetTap(port->jack.peer, &ts);
+         if (retval == 0 && copy_to_user((void *)ioarg, &ts, sizeof ts)) {
+            return -EFAULT;
+         }
+         return retval;
+      }
+
    case SIOCSFILTERRULES:
 #ifdef CONFIG_NETFILTER
       if (copy_from_user(&ruleHeader, (void *)ioarg, sizeof ruleHeader)) {
@@ -1017,9 +1107,9 @@ VNetFileOpIoctl(struct inode   *inode, // IN:
       {
          uint32 flags;
 
-	 read_lock(&vnetPeerLock);
+	 rcu_read_lock();
          flags = VNetIsBridged(&port->jack);
-	 read_unlock(&vnetPeerLock);
+	 rcu_read_unlock();
 
          if (copy_to_user((void *)ioarg, &flags, sizeof flags)) {
             return -EFAULT;
@@ -1083,15 +1173,19 @@ VNetFileOpIoctl(struct inode   *inode, // IN:
    case SIOCGETAPIVERSION2:
       {
 	 uint32 verFromUser;
+	 uint32 verToUser = VNET_API_VERSION;
 	 if (copy_from_user(&verFromUser, (void *)ioarg, sizeof verFromUser)) {
 	    return -EFAULT;
 	 }
 	 /* Should we require verFromUser == VNET_API_VERSION? */
+	 if (port->setApiFlags) {
+	    verToUser |= port->setApiFlags(port, verFromUser & VNET_API_FLAGS);
+	 }
+	 if (copy_to_user((void*)ioarg, &verToUser, sizeof verToUser)) {
+	    return -EFAULT;
+	 }
       }
-      /* fall thru */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
-      fallthrough;
-#endif
+      break;
    case SIOCGETAPIVERSION:
       {
 	 uint32 verToUser = VNET_API_VERSION;
@@ -1113,6 +1207,39 @@ VNetFileOpIoctl(struct inode   *inode, // IN:
 
 
 #if defined(HAVE_COMPAT_IOCTL) || defined(HAVE_UNLOCKED_IOCTL)
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetIsDataPathIoctl --
+ *
+ *      Check whether the ioctl moves packets rather than changes the
+ *      network structure. Such ioctls are issued at packet rate, only
+ *      touch the port itself (like read and write do) and therefore
+ *      must not serialize on vnetMutex.
+ *
+ * Results:
+ *      TRUE for data path ioctls, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetIsDataPathIoctl(unsigned int iocmd) // IN:
+{
+   switch (iocmd) {
+   case SIOCRECVBATCH:
+   case SIOCSENDBATCH:
+   case SIOCRINGKICK:
+      return TRUE;
+   default:
+      return FALSE;
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1145,6 +1272,9 @@ VNetFileOpUnlockedIoctl(struct file    *filp,  // IN:
       inode = filp->f_dentry->d_inode;
    }
 #endif
+   if (VNetIsDataPathIoctl(iocmd)) {
+      return VNetFileOpIoctl(inode, filp, iocmd, ioarg);
+   }
    compat_mutex_lock(&vnetMutex);
    err = VNetFileOpIoctl(inode, filp, iocmd, ioarg);
    compat_mutex_unlock(&vnetMutex);
@@ -1257,6 +1387,35 @@ VNetSwitchToDifferentPeer(VNetJack *jack,              // IN: jack whose peer is
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetMulticastHash --
+ *
+ *      Compute the 6-bit logical address filter index of a multicast
+ *      MAC (like the one on the lance chipset). This is the 6 MSb of
+ *      the little endian Ethernet CRC of the address, which we get
+ *      from the kernel's table driven crc32_le().
+ *
+ *      (This is in the green AMD "Ethernet Controllers" book,
+ *      page 1-53.)
+ *
+ * Results:
+ *      Hash code in [0, 63].
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE uint8
+VNetMulticastHash(const uint8 *destAddr) // IN: multicast MAC
+{
+   return ether_crc_le(ETH_ALEN, destAddr) >> 26;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1269,10 +1428,8 @@ VNetSwitchToDifferentPeer(VNetJack *jack,              // IN: jack whose peer is
  *      We generate a hash value from the destination MAC address
  *      and see if it's in our filter.  Broadcast packets have
  *      already OK'd by PacketMatch, so we don't have to worry
- *      about that.
- *
- *      (This is in the green AMD "Ethernet Controllers" book,
- *      page 1-53.)
+ *      about that. Filters with all or no bits set, the common
+ *      cases, are decided without hashing.
  *
  * Results:
  *      TRUE if packet is in filter, FALSE if not.
@@ -1283,40 +1440,24 @@ VNetSwitchToDifferentPeer(VNetJack *jack,              // IN: jack whose peer is
  *----------------------------------------------------------------------
  */
 
-#define CRC_POLYNOMIAL_BE 0x04c11db7UL  /* Ethernet CRC, big endian */
-
 static INLINE_SINGLE_CALLER Bool
 VNetMulticastFilter(const uint8 *destAddr, // IN: multicast MAC
 		    const uint8 *ladrf)    // IN: multicast filter
 {
-   uint16 hashcode;
-   int32 crc;
-   int32 poly = CRC_POLYNOMIAL_BE;
-   int j;
-   int bit;
-   int byte;
-
-   crc = 0xffffffff;                  /* init CRC for each address */
-   for (byte = 0; byte < ETH_ALEN; byte++) { /* for each address byte */
-      /* process each address bit */
-      for (bit = *destAddr++, j = 0;
-	   j < VNET_LADRF_LEN;
-	   j++, bit >>= 1) {
-	 crc = (crc << 1) ^ ((((crc<0?1:0) ^ bit) & 0x01) ? poly : 0);
-      }
-   }
-   hashcode = (crc & 1);              /* hashcode is 6 LSb of CRC ... */
-   for (j = 0; j < 5; j++) {                /* ... in reverse order. */
-      hashcode = (hashcode << 1) | ((crc>>=1) & 1);
-   }
+   uint64 filter;
+   uint8 hashcode;
 
-   byte = hashcode >> 3;              /* bit[3-5] -> byte in filter */
-   bit = 1 << (hashcode & 0x07);      /* bit[0-2] -> bit in byte */
-   if (ladrf[byte] & bit) {
-      return TRUE;
-   } else {
+   memcpy(&filter, ladrf, sizeof filter);
+   if (filter == 0) {
       return FALSE;
    }
+   if (filter == ~(uint64)0) {
+      return TRUE;
+   }
+
+   hashcode = VNetMulticastHash(destAddr);
+   /* bit[3-5] -> byte in filter, bit[0-2] -> bit in byte */
+   return (ladrf[hashcode >> 3] & (1 << (hashcode & 0x07))) != 0;
 }
 
 
@@ -1423,7 +1564,6 @@ VNetConnect(VNetJack *jack1, // IN: jack
 {
    static int vnetGeneration = 0;
    Bool foundCycle;
-   unsigned long flags;
 
    vnetGeneration++;
 
@@ -1441,13 +1581,12 @@ VNetConnect(VNetJack *jack1, // IN: jack
    VNetFreeInterfaceList();
 
    /*
-    * Synchronize with peer readers
+    * Publish the new peers to the RCU readers. Both jacks are fully
+    * initialized by now.
     */
 
-   write_lock_irqsave(&vnetPeerLock, flags);
-   jack1->peer = jack2;
-   jack2->peer = jack1;
-   write_unlock_irqrestore(&vnetPeerLock, flags);
+   rcu_assign_pointer(jack1->peer, jack2);
+   rcu_assign_pointer(jack2->peer, jack1);
 
    if (jack2->numPorts) {
       VNetPortsChanged(jack1);
@@ -1473,7 +1612,7 @@ VNetConnect(VNetJack *jack1, // IN: jack
  *      Return the peer jack (returns NULL on error, or if no peer)
  *
  * Side effects:
- *      None.
+ *      Sleeps for an RCU grace period.
  *
  *----------------------------------------------------------------------
  */
@@ -1482,17 +1621,20 @@ VNetJack *
 VNetDisconnect(VNetJack *jack) // IN: jack
 {
    VNetJack *peer;
-   unsigned long flags;
 
-   write_lock_irqsave(&vnetPeerLock, flags);
    peer = jack->peer;
    if (!peer) {
-      write_unlock_irqrestore(&vnetPeerLock, flags);
       return NULL;
    }
-   jack->peer = NULL;
-   peer->peer = NULL;
-   write_unlock_irqrestore(&vnetPeerLock, flags);
+   rcu_assign_pointer(jack->peer, NULL);
+   rcu_assign_pointer(peer->peer, NULL);
+
+   /*
+    * Wait for senders that may still be inside either jack's rcv
+    * function, the caller is free to release the peer afterwards.
+    */
+
+   synchronize_rcu();
 
    if (peer->numPorts) {
       VNetPortsChanged(jack);
@@ -1608,13 +1750,53 @@ void
 VNetSend(const VNetJack *jack, // IN: jack
          struct sk_buff *skb)  // IN: packet
 {
-   read_lock(&vnetPeerLock);
-   if (jack && jack->peer && jack->peer->rcv) {
-      jack->peer->rcv(jack->peer, skb);
+   VNetJack *peer;
+
+   rcu_read_lock();
+   peer = jack ? rcu_dereference(jack->peer) : NULL;
+   if (peer && peer->rcv) {
+      peer->rcv(peer, skb);
    } else {
       dev_kfree_skb(skb);
    }
-   read_unlock(&vnetPeerLock);
+   rcu_read_unlock();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetSendList --
+ *
+ *      Send all packets on the list through this jack, looking up
+ *      the peer only once for the whole list.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The list is emptied, the skbs are no longer owned by us.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetSendList(const VNetJack      *jack, // IN: jack
+             struct sk_buff_head *list) // IN/OUT: packets (not locked)
+{
+   struct sk_buff *skb;
+   VNetJack *peer;
+
+   rcu_read_lock();
+   peer = jack ? rcu_dereference(jack->peer) : NULL;
+   while ((skb = __skb_dequeue(list)) != NULL) {
+      if (peer && peer->rcv) {
+         peer->rcv(peer, skb);
+      } else {
+         dev_kfree_skb(skb);
+      }
+   }
+   rcu_read_unlock();
 }
 
 
@@ -1683,12 +1865,14 @@ VNetPrintJack(const VNetJack *jack, // IN: jack
               char           *buf)  // OUT: info about jack
 #endif
 {
+   VNetJack *peer;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
    int len = 0;
 #endif
 
-   read_lock(&vnetPeerLock);
-   if (!jack->peer) {
+   rcu_read_lock();
+   peer = rcu_dereference(jack->peer);
+   if (!peer) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
       seq_printf(seqf, "connected not ");
 #else
@@ -1696,12 +1880,12 @@ VNetPrintJack(const VNetJack *jack, // IN: jack
 #endif
    } else {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
-      seq_printf(seqf, "connected %s ", jack->peer->name);
+      seq_printf(seqf, "connected %s ", peer->name);
 #else
-      len += sprintf(buf+len, "connected %s ", jack->peer->name);
+      len += sprintf(buf+len, "connected %s ", peer->name);
 #endif
    }
-   read_unlock(&vnetPeerLock);
+   rcu_read_unlock();
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
    return len;
@@ -1738,6 +1922,7 @@ VNetPrintPort(const VNetPort *port, // IN: port
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
    int len = 0;
 #endif
+   int dir;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
    VNetPrintJack(&port->jack, seqf);
@@ -1762,6 +1947,21 @@ VNetPrintPort(const VNetPort *port, // IN: port
                   port->ladrf[3], port->ladrf[4], port->ladrf[5],
                   port->ladrf[6], port->ladrf[7]);
 
+   rcu_read_lock();
+   for (dir = 0; dir < VNET_SHAPER_DIRS; dir++) {
+      const VNetShaper *shaper = rcu_dereference(port->shaper[dir]);
+
+      if (shaper) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+         VNetShaper_Print(shaper, dir == VNET_SHAPER_TX ? "tx" : "rx", seqf);
+#else
+         len += VNetShaper_Print(shaper, dir == VNET_SHAPER_TX ? "tx" : "rx",
+                                 buf+len);
+#endif
+      }
+   }
+   rcu_read_unlock();
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
    seq_printf(seqf, "flags IFF_RUNNING");
 #else
@@ -34,7 +34,19 @@
 
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
+#if defined(CONFIG_IPV6) || defined(CONFIG_IPV6_MODULE)
+#define VNET_FILTER_IPV6
+#include <linux/ipv6.h>
+#include <linux/netfilter_ipv6.h>
+#include <net/ipv6.h>
+#endif
 #include <linux/poll.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 
 #include "vnetFilter.h"
 #include "vnetFilterInt.h"
@@ -69,26 +81,126 @@ static struct nf_hook_ops vmnet_nf_ops[] = {
       compat_nf_hook_owner
       .pf = PF_INET,
       .hooknum = VMW_NF_INET_POST_ROUTING,
-      .priority = NF_IP_PRI_FILTER - 1, }
+      .priority = NF_IP_PRI_FILTER - 1, },
+#ifdef VNET_FILTER_IPV6
+   {  .hook = VNetFilterHookFn,
+      compat_nf_hook_owner
+      .pf = PF_INET6,
+      .hooknum = VMW_NF_INET_LOCAL_IN,
+      .priority = NF_IP6_PRI_FILTER - 1, },
+   {  .hook = VNetFilterHookFn,
+      compat_nf_hook_owner
+      .pf = PF_INET6,
+      .hooknum = VMW_NF_INET_POST_ROUTING,
+      .priority = NF_IP6_PRI_FILTER - 1, },
+#endif
 };
 
 /* track if we actually set a callback in IP's filter driver */
 static Bool installedFilterCallback = FALSE;
 
+/*
+ * Compiled form of the active rule set, used by the netfilter hook.
+ *
+ * Every rule is one bit of a uint64 (bit 0 is the first rule in the
+ * list), and every packet field maps to the mask of rules that may
+ * match it: the protocol through a direct table, the remote address
+ * and the ports through sorted arrays of elementary intervals. ANDing
+ * the masks gives the candidate rules, and the lowest set bit is the
+ * rule the old list walk would have stopped at. Rules whose lists can't
+ * be represented exactly this way (non-contiguous address masks, port
+ * lists constraining both local and remote ports in several entries)
+ * are flagged in verifyMask and rechecked against the Rule itself.
+ *
+ * IPv4 and IPv6 rules share the bit space; each family has its own
+ * address intervals, which only contain the rules of that family.
+ */
+
+#if MAX_RULES_PER_SET > 64
+#error "CompiledRuleSet needs one bit per rule"
+#endif
+
+typedef struct RuleInterval {
+   uint32 low;            /* first value of the interval (host order) */
+   uint64 match;          /* rules matching values in [low, next low) */
+} RuleInterval;
+
+typedef struct RuleIntervals {
+   RuleInterval *list;    /* sorted by low, list[0].low == 0 */
+   uint32 len;
+} RuleIntervals;
+
+typedef struct RuleInterval6 {
+   uint64 lowHi;          /* first address of the interval (host order) */
+   uint64 lowLo;
+   uint64 match;          /* rules matching addresses in [low, next low) */
+} RuleInterval6;
+
+typedef struct RuleIntervals6 {
+   RuleInterval6 *list;   /* sorted by low, list[0].low == 0 */
+   uint32 len;
+} RuleIntervals6;
+
+typedef struct CompiledRuleSet {
+   uint32 generation;             /* never 0, see FlowCacheEntry */
+   uint16 action;                 /* default action of the rule set */
+   uint64 directionMask[2];       /* indexed by transmit */
+   uint64 allowMask;              /* rules with VNET_FILTER_RULE_ALLOW */
+   uint64 verifyMask;             /* rules that need an exact recheck */
+   uint64 protoMask[256];         /* rules matching each IP protocol */
+   Bool hasIPv6;                  /* rule set has IPv6 rules */
+   RuleIntervals addr;            /* remote IPv4 address */
+   RuleIntervals6 addr6;          /* remote IPv6 address */
+   RuleIntervals localPort;
+   RuleIntervals remotePort;
+   Rule *rules[MAX_RULES_PER_SET];
+} CompiledRuleSet;
+
 /* rules to use for filtering */
 RuleSet *ruleSetHead = NULL;  /* linked list of all rules */
 int32 numRuleSets = 0;        /* number of rule sets in ruleSetHead's linked list */
-RuleSet *activeRule = NULL;   /* actual rule set for filter callback to use */
+RuleSet *activeRule = NULL;   /* rule set enabled by user space */
 
 /* locks to protect against concurrent accesses. */
 static compat_define_mutex(filterIoctlMutex); /* serialize ioctl()s from user space. */
 /*
- * user/netfilter hook concurrency lock.
- * This spinlock doesn't scale well if/when in the future the netfilter
- * callbacks can be concurrently executing on multiple threads on multiple
- * CPUs, so we should revisit locking for allowing for that in the future.
+ * Compiled activeRule for the netfilter hook. It is immutable once
+ * published: the hook reads it under rcu_read_lock(), and updates (done
+ * with filterIoctlMutex held) replace it and wait for a grace period
+ * before freeing the old copy. The Rules it points to therefore outlive
+ * any reader, as DeleteRuleSet() refuses enabled rule sets.
+ */
+static CompiledRuleSet *activeCompiled = NULL;
+static uint32 ruleGeneration = 0;   /* last CompiledRuleSet generation */
+
+/*
+ * Per-CPU cache of rule lookups for recent flows, so the packets of a
+ * long-lived connection after the first one cost a single probe. An
+ * entry is valid only for the CompiledRuleSet whose generation it
+ * carries: publishing a new rule set invalidates the whole cache
+ * without touching it.
  */
-DEFINE_SPINLOCK(activeRuleLock);
+
+#define FLOW_CACHE_SIZE 256  /* per CPU, must be a power of 2 */
+
+/* What rules look at in a packet, also the flow cache key. */
+typedef struct FilterKey {
+   uint32 remoteAddr[4];  /* network order, IPv4 only uses [0] */
+   uint16 localPort;      /* 0 if not TCP/UDP */
+   uint16 remotePort;     /* 0 if not TCP/UDP */
+   uint8 proto;           /* IP protocol / IPv6 upper layer header */
+   uint8 transmit;        /* TRUE for outgoing packets */
+   uint8 ipv6;            /* TRUE for IPv6 packets */
+   uint8 pad;             /* must be 0, keys are compared with memcmp */
+} FilterKey;
+
+typedef struct FlowCacheEntry {
+   uint32 generation;     /* 0 for an unused entry */
+   int32 rule;            /* matched rule, -1 for the default action */
+   FilterKey key;
+} FlowCacheEntry;
+
+static DEFINE_PER_CPU(FlowCacheEntry [FLOW_CACHE_SIZE], flowCache);
 
 /*
  * Logging.
@@ -111,6 +223,10 @@ static int ChangeRuleSet(uint32 id, Bool enable, Bool disable, uint32 action);
 static int AddIPv4Rule(uint32 id, VNet_AddIPv4Rule *rule,
                        VNet_IPv4Address *addressList,
                        VNet_IPv4Port *portList);
+static int AddIPv6Rule(uint32 id, VNet_AddIPv6Rule *rule,
+                       VNet_IPv6Address *addressList,
+                       VNet_IPv6Port *portList);
+static int PublishRuleSet(const RuleSet *ruleSet);
 
 
 /*
@@ -172,331 +288,675 @@ ForwardPacket(uint16 action,  // IN: reason code
 /*
  *----------------------------------------------------------------------
  *
- * VNetFilterHookFn --
+ * RuleIntervalsLookup --
  *
- *      Function is registered as a callback function with the host's
- *      IP stack.  This function can be used to filter on specified protocols
- *      IP addresses, and/or local and remote ports. It makes use of the Linux
- *      netfilter infrastructure, by inserting this function in netfilter at a
- *      priority 1 higher than iptables, so that we don't have to worry about
- *      any existing iptables based firewall rules on the Linux hosts.
+ *      Binary search for the interval containing a value.
  *
  * Results:
- *      NF_ACCEPT or NF_DROP.
+ *      Mask of the rules matching the value.
  *
  * Side effects:
- *      None besides those described above.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-#define DEBUG_HOST_FILTER 0
+static INLINE uint64
+RuleIntervalsLookup(const RuleIntervals *intervals, // IN: sorted intervals
+                    uint32 value)                   // IN: host order value
+{
+   uint32 lo = 0;
+   uint32 hi = intervals->len;
 
-#if DEBUG_HOST_FILTER
-#define HostFilterPrint(a) printk a
-#else
-#define HostFilterPrint(a)
-#endif
+   while (hi - lo > 1) {
+      uint32 mid = lo + (hi - lo) / 2;
 
-static unsigned int
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
-VNetFilterHookFn(void *priv,
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
-VNetFilterHookFn(const struct nf_hook_ops *ops,        // IN:
-#else
-VNetFilterHookFn(unsigned int hooknum,                 // IN:
-#endif
-#ifdef VMW_NFHOOK_USES_SKB
-                 struct sk_buff *skb,                  // IN:
-#else
-                 struct sk_buff **pskb,                // IN:
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
-                 const struct nf_hook_state *state)
-#else
-                 const struct net_device *in,          // IN:
-                 const struct net_device *out,         // IN:
-                 int (*okfn)(struct sk_buff *))        // IN:
-#endif
+      if (intervals->list[mid].low <= value) {
+         lo = mid;
+      } else {
+         hi = mid;
+      }
+   }
+   return intervals->list[lo].match;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RuleIntervals6Lookup --
+ *
+ *      Binary search for the interval containing an IPv6 address.
+ *
+ * Results:
+ *      Mask of the rules matching the address.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE uint64
+RuleIntervals6Lookup(const RuleIntervals6 *intervals, // IN: sorted intervals
+                     uint64 hi,                       // IN: address bits 127-64
+                     uint64 lo)                       // IN: address bits 63-0
 {
-#ifndef VMW_NFHOOK_USES_SKB
-   struct sk_buff *skb = *pskb;
-#endif
-   struct iphdr *ip;
-   uint32 remoteAddr;
-   uint16 localPort;
-   uint16 remotePort;
-   uint8 *packet;
-   uint8 *packetHeader;
-   int packetLength;
-   RuleSet *currRuleSet;
-   Bool blockByDefault;
-   Bool transmit; /* TRUE if transmitting, FALSE is receiving */
-   Rule *currRule;
-   unsigned int verdict = NF_ACCEPT;
-   unsigned long flags;
+   uint32 first = 0;
+   uint32 last = intervals->len;
 
+   while (last - first > 1) {
+      uint32 mid = first + (last - first) / 2;
+      const RuleInterval6 *interval = &intervals->list[mid];
 
-   /* Early checks to see  we should even care. */
-   if (skb->protocol != htons(ETH_P_IP)) {
-      return verdict;
+      if (interval->lowHi < hi ||
+          (interval->lowHi == hi && interval->lowLo <= lo)) {
+         first = mid;
+      } else {
+         last = mid;
+      }
    }
+   return intervals->list[first].match;
+}
 
-   spin_lock_irqsave(&activeRuleLock, flags);
 
-   currRuleSet = activeRule;
-   // ASSERT(currRuleSet);
+/*
+ *----------------------------------------------------------------------
+ *
+ * FilterKeyAddr6 --
+ *
+ *      Convert the remote IPv6 address of a key to two host order
+ *      64-bit halves, as used by RuleAddr6 and RuleInterval6.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-   /*
-    * Function uses a local copy of ruleSetHead so that we're
-    * not adversely affected by any rule changes that might occur
-    * while this function is running.
-    */
+static INLINE void
+FilterKeyAddr6(const FilterKey *key, // IN: IPv6 packet key
+               uint64 *hi,           // OUT: address bits 127-64
+               uint64 *lo)           // OUT: address bits 63-0
+{
+   *hi = (uint64)ntohl(key->remoteAddr[0]) << 32 | ntohl(key->remoteAddr[1]);
+   *lo = (uint64)ntohl(key->remoteAddr[2]) << 32 | ntohl(key->remoteAddr[3]);
+}
 
-   blockByDefault = currRuleSet->action == VNET_FILTER_RULE_BLOCK;
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * RuleMaskFirst --
+ *
+ *      Find the lowest set bit in a rule mask.
+ *
+ * Results:
+ *      Index of the first rule in the mask, which must not be 0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-   /* When the host transmits, hooknum is VMW_NF_INET_POST_ROUTING. */
-   /* When the host receives, hooknum is VMW_NF_INET_LOCAL_IN. */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
-   transmit = (state->hook == VMW_NF_INET_POST_ROUTING);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
-   transmit = (ops->hooknum == VMW_NF_INET_POST_ROUTING);
-#else
-   transmit = (hooknum == VMW_NF_INET_POST_ROUTING);
-#endif
+static INLINE uint32
+RuleMaskFirst(uint64 mask) // IN: non-zero rule mask
+{
+   uint32 low = (uint32)mask;
 
-   packetHeader = compat_skb_network_header(skb);
-   ip = (struct iphdr*)packetHeader;
+   return low ? __ffs(low) : 32 + __ffs((uint32)(mask >> 32));
+}
 
-   if (transmit) {
-      /* skb all set up for us. */
-      packet = compat_skb_transport_header(skb);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RuleMatchesExactly --
+ *
+ *      Check the address and port lists of a rule against a packet,
+ *      for the rules the compiled masks only approximate.
+ *
+ * Results:
+ *      TRUE if the rule matches, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+RuleMatchesExactly(const Rule *rule,     // IN: rule to check
+                   const FilterKey *key) // IN: packet
+{
+   Bool matched;
+   uint32 i;
+
+   /* empty list means don't care */
+   matched = (rule->addressListLen == 0);
+   if (key->ipv6) {
+      uint64 hi, lo;
+
+      FilterKeyAddr6(key, &hi, &lo);
+      for (i = 0; !matched && i < rule->addressListLen; ++i) {
+         const RuleAddr6 *addr = rule->address6List + i;
+
+         matched = (hi & addr->maskHi) == addr->addrHi &&
+                   (lo & addr->maskLo) == addr->addrLo;
+      }
    } else {
-      /* skb hasn't had a chance to be processed by TCP yet. */
-      packet = compat_skb_network_header(skb) + (ip->ihl << 2);
+      for (i = 0; !matched && i < rule->addressListLen; ++i) {
+         matched = (key->remoteAddr[0] & rule->addressList[i].ipv4Mask) ==
+                   rule->addressList[i].ipv4Addr;
+      }
+   }
+   if (!matched) {
+      return FALSE;
    }
 
-   HostFilterPrint(("PacketFilter: IP ver %d ihl %d tos %d len %d id %d\n"
-                    "              offset %d ttl %d proto %d xsum %d\n"
-                    "              src 0x%08x dest 0x%08x %s\n",
-                    ip->version, ip->ihl, ip->tos, ip->tot_len, ip->id,
-		    ip->frag_off, ip->ttl, ip->protocol, ip->check,
-                    ip->saddr, ip->daddr, transmit ? "OUTGOING":"INCOMING"));
+   if (rule->proto != IPPROTO_TCP && rule->proto != IPPROTO_UDP) {
+      return TRUE;
+   }
 
    /*
-    * For incoming packets, there should be a skb->dev associated with it, with
-    * a populated L2 address length.
+    * It's presumed that if portRule->localPortLow == ~0 then
+    * portRule->localPortHigh == ~0.  Similiar story for the
+    * remote ports.
     */
-   if (skb->dev && skb->dev->hard_header_len) {
-      packetLength = skb->len - skb->dev->hard_header_len - (ip->ihl << 2);
-   } else {
-      /*
-       * In certain cases, compat_skb_mac_header() has been observed to be NULL. Don't
-       * know why, but in such cases, this calculation will lead to a negative
-       * packetLength, and the packet to be dropped.
-       */
-      packetLength = skb->len - 
-                     (compat_skb_network_header(skb) - compat_skb_mac_header(skb)) - 
-                     (ip->ihl << 2);
+   matched = (rule->portListLen == 0);
+   for (i = 0; !matched && i < rule->portListLen; ++i) {
+      const RulePort *portRule = rule->portList + i;
+
+      matched = ((key->localPort >= portRule->localPortLow &&
+                  key->localPort <= portRule->localPortHigh) ||
+                 portRule->localPortLow == ~0) &&
+                ((key->remotePort >= portRule->remotePortLow &&
+                  key->remotePort <= portRule->remotePortHigh) ||
+                 portRule->remotePortLow == ~0);
    }
+   return matched;
+}
 
-   if (packetLength < 0) {
-      HostFilterPrint(("PacketFilter: ill formed packet for IPv4\n"));
-      HostFilterPrint(("skb: len %d h.raw %p nh.raw %p mac.raw %p, packetLength %d\n",
-                       skb->len, compat_skb_transport_header(skb),
-                       compat_skb_network_header(skb),
-                       compat_skb_mac_header(skb), packetLength));
-      verdict = NF_DROP;
-      DropPacket(VNET_FILTER_ACTION_DRP_SHORT, packetHeader, packet, 0);
-      goto out_unlock;
-   }
 
-   remoteAddr = transmit ? ip->daddr : ip->saddr;
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompiledRuleSetMatch --
+ *
+ *      Find the first rule of a compiled rule set matching a packet.
+ *
+ * Results:
+ *      Index of the matching rule, or -1 if no rule matches.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-   /* always allow 127/8. */
-   if ((remoteAddr & 0xff) == 127) {
-      HostFilterPrint(("PacketFilter: allowing %s loopback 0x%08x\n",
-                       transmit ? "outgoing" : "incoming",
-                       remoteAddr));
-      ForwardPacket(VNET_FILTER_ACTION_FWD_LOOP,
-                    packetHeader, packet, packetLength);
-      goto out_unlock;
-   }
+static INLINE int
+CompiledRuleSetMatch(const CompiledRuleSet *ruleSet, // IN: compiled rule set
+                     const FilterKey *key)           // IN: packet
+{
+   uint64 candidates;
 
-   /* If we're dealing with TCP or UDP, then extract the port information */
-   if (ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) {
-      uint16 srcPort, dstPort; /* used to extract port information from packet */
+   candidates = ruleSet->directionMask[key->transmit ? 1 : 0] &
+                ruleSet->protoMask[key->proto];
+   if (candidates != 0) {
+      if (key->ipv6) {
+         uint64 hi, lo;
 
-      if (packetLength < 4) {
-         HostFilterPrint(("PacketFilter: payload too short for "
-                          "TCP or UDP: %d\n", packetLength));
-         verdict = NF_DROP;
-         DropPacket(VNET_FILTER_ACTION_DRP_SHORT,
-                    packetHeader, packet, packetLength);
-         goto out_unlock;
+         FilterKeyAddr6(key, &hi, &lo);
+         candidates &= RuleIntervals6Lookup(&ruleSet->addr6, hi, lo);
+      } else {
+         candidates &= RuleIntervalsLookup(&ruleSet->addr,
+                                           ntohl(key->remoteAddr[0]));
       }
+   }
+   if (candidates != 0) {
+      candidates &= RuleIntervalsLookup(&ruleSet->localPort, key->localPort) &
+                    RuleIntervalsLookup(&ruleSet->remotePort, key->remotePort);
+   }
 
-      /* Retrieve UDP/TCP port info */
-      srcPort = *((uint16*)&packet[0]);
-      dstPort = *((uint16*)&packet[2]);
+   while (candidates != 0) {
+      uint32 i = RuleMaskFirst(candidates);
 
-      if (transmit) { /* transmit */
-         localPort = ntohs(srcPort);
-         remotePort = ntohs(dstPort);
-      } else { /* receive */
-         localPort = ntohs(dstPort);
-         remotePort = ntohs(srcPort);
+      if (!(ruleSet->verifyMask & ((uint64)1 << i)) ||
+          RuleMatchesExactly(ruleSet->rules[i], key)) {
+         return i;
       }
-
-      HostFilterPrint(("PacketFilter: got local port %d remote port %d\n",
-                       localPort, remotePort));
-   } else {
-      /* these mostly exist to silence compiler warning about uninit variables */
-      localPort = 0;
-      remotePort = 0;
+      candidates &= candidates - 1;
    }
+   return -1;
+}
 
-   currRule = currRuleSet->list;
-
-   /* traverse all the rules in the rule set */
-   while (currRule != NULL) {
-      uint32 i;
-      Bool matchedAddress;
-
-      /* if direction doesn't match rule, then skip */
-      if ((currRule->direction == VNET_FILTER_DIRECTION_IN && transmit) ||
-          (currRule->direction == VNET_FILTER_DIRECTION_OUT && !transmit)) {
-         HostFilterPrint(("PacketFilter: didn't match direction\n"));
-         /* wrong direction */
-         goto skipRule;
-      }
 
-      /*
-       * Check if the packet's address matches the rule.  If the list is empty
-       * then this means we don't care about address and it's considered a match.
-       */
+/*
+ *----------------------------------------------------------------------
+ *
+ * FilterMatch --
+ *
+ *      Find the first rule matching a packet, looking in this CPU's
+ *      flow cache first and filling it in on a miss.
+ *
+ * Results:
+ *      Index of the matching rule, or -1 if no rule matches.
+ *
+ * Side effects:
+ *      Updates the flow cache.
+ *
+ *----------------------------------------------------------------------
+ */
 
-      matchedAddress = (currRule->addressListLen == 0); /* empty list means don't care */
-      for (i = 0; i < currRule->addressListLen; ++i) {
-         if ((remoteAddr & currRule->addressList[i].ipv4Mask) ==
-             currRule->addressList[i].ipv4Addr) {
-            matchedAddress = TRUE;
-            HostFilterPrint(("PacketFilter: rule matched ip addr %u: "
-                             "0x%08x == 0x%08x\n", i, remoteAddr,
-                             currRule->addressList[i].ipv4Addr));
-            break;
-         } else {
-            HostFilterPrint(("PacketFilter: rule not match ip addr %u: "
-                             "0x%08x != 0x%08x\n", i, remoteAddr,
-                             currRule->addressList[i].ipv4Addr));
-         }
-      }
-      if (!matchedAddress) {
-         HostFilterPrint(("PacketFilter: rule didn't match ip addr 0x%08x\n",
-                          remoteAddr));
-         /* ip addr doesn't match */
-         goto skipRule;
-      }
+static int
+FilterMatch(const CompiledRuleSet *ruleSet, // IN: compiled rule set
+            const FilterKey *key)           // IN: packet, pad zeroed
+{
+   FlowCacheEntry *entry;
+   uint32 hash;
+   int rule;
+
+   hash = jhash2(key->remoteAddr, ARRAY_SIZE(key->remoteAddr),
+                 (uint32)key->localPort << 16 | key->remotePort) ^
+          (key->proto << 2 | key->ipv6 << 1 | key->transmit);
+
+   /* The hook runs in both process and softirq context. */
+   local_bh_disable();
+   entry = &per_cpu(flowCache, smp_processor_id())
+              [hash & (FLOW_CACHE_SIZE - 1)];
+   if (entry->generation == ruleSet->generation &&
+       memcmp(&entry->key, key, sizeof *key) == 0) {
+      rule = entry->rule;
+   } else {
+      rule = CompiledRuleSetMatch(ruleSet, key);
+      entry->generation = ruleSet->generation;
+      entry->key = *key;
+      entry->rule = rule;
+   }
+   local_bh_enable();
 
-      /*
-       * Check the protocol. ~0 (0xffff) means we don't care about the
-       * protocol and it's considered a match.
-       */
+   return rule;
+}
 
-      if (currRule->proto != 0xffff && currRule->proto != ip->protocol) {
-         HostFilterPrint(("PacketFilter: didn't match protocol: %u != %u\n",
-                          ip->protocol, currRule->proto));
-         /* protocol doesn't match */
-         goto skipRule;
-      }
 
-      /*
-       * If the protocol is TCP or UDP then check the port list.  If the list is empty
-       * then this means we don't care about ports and it's considered a match.
-       */
+#define DEBUG_HOST_FILTER 0
 
-      if (currRule->proto == IPPROTO_TCP || currRule->proto == IPPROTO_UDP) {
+#if DEBUG_HOST_FILTER
+#define HostFilterPrint(a) printk a
+#else
+#define HostFilterPrint(a)
+#endif
 
-         /* An empty list means the rule don't care about port numbers*/
-         Bool matchedPort = (currRule->portListLen == 0);
 
-         for (i = 0; i < currRule->portListLen; ++i) {
-            RulePort *portRule = currRule->portList + i;
-            Bool matchedLocal, matchedRemote; /* improves readability */
+/*
+ *----------------------------------------------------------------------
+ *
+ * FilterVerdict --
+ *
+ *      Apply the first matching rule of the active rule set, or its
+ *      default action, to an IPv4 or IPv6 packet.
+ *
+ * Results:
+ *      NF_ACCEPT or NF_DROP.
+ *
+ * Side effects:
+ *      Might log the packet.
+ *
+ *----------------------------------------------------------------------
+ */
 
-            /*
-             * It's presumed that if portRule->localPortLow == ~0 then
-             * portRule->localPortHigh == ~0.  Similiar story for the
-             * remote ports.
-             */
-            matchedLocal = (localPort >= portRule->localPortLow &&
-                            localPort <= portRule->localPortHigh) ||
-                           portRule->localPortLow == ~0;
-            matchedRemote = (remotePort >= portRule->remotePortLow &&
-                             remotePort <= portRule->remotePortHigh) ||
-                            portRule->remotePortLow == ~0;
-
-            if (matchedLocal && matchedRemote) {
-               HostFilterPrint(("PacketFilter: matched rule's "
-                                "port element %u\n", i));
-               matchedPort = TRUE;
-               break;
-            }
-            HostFilterPrint(("PacketFilter: didn't match rule's "
-                             "port element %u\n", i));
-            HostFilterPrint(("-- local  %4u not in range [%4u, %4u] or \n",
-                             localPort, portRule->localPortLow,
-                             portRule->localPortHigh));
-            HostFilterPrint(("-- remote %4u not in range [%4u, %4u]\n",
-                             remotePort, portRule->remotePortLow,
-                             portRule->remotePortHigh));
-         }
-         if (!matchedPort) {
-            HostFilterPrint(("PacketFilter: rule didn't match port "
-                             "(local %u remote %u)\n", localPort, remotePort));
-            /* port doesn't match */
-            goto skipRule;
-         }
-      }
+static unsigned int
+FilterVerdict(const CompiledRuleSet *ruleSet, // IN: active rule set
+              const FilterKey *key,           // IN: packet fields
+              uint8 *packetHeader,            // IN: IP header
+              uint8 *packet,                  // IN: IP payload
+              int packetLength)               // IN: length of packet
+{
+   int matchedRule = FilterMatch(ruleSet, key);
 
+   if (matchedRule >= 0) {
       /* rule matches so follow orders */
-
-      if (currRule->action == VNET_FILTER_RULE_ALLOW) {
-         HostFilterPrint(("PacketFilter: found match, forwarding\n"));
+      if (ruleSet->allowMask & ((uint64)1 << matchedRule)) {
+         HostFilterPrint(("PacketFilter: matched rule %d, forwarding\n",
+                          matchedRule));
          ForwardPacket(VNET_FILTER_ACTION_FWD_MATCH,
                        packetHeader, packet, packetLength);
+         return NF_ACCEPT;
+      }
+      HostFilterPrint(("PacketFilter: matched rule %d, dropping\n",
+                       matchedRule));
+      DropPacket(VNET_FILTER_ACTION_DRP_MATCH,
+                 packetHeader, packet, packetLength);
+      return NF_DROP;
+   }
+
+   /* Forward or drop packet based on the default rule */
+   HostFilterPrint(("PacketFilter: Didn't find match for %s IPv%d packet "
+                    "proto %u local port %u remote port %u, %s packet\n",
+                    key->transmit ? "outgoing" : "incoming",
+                    key->ipv6 ? 6 : 4, key->proto, key->localPort,
+                    key->remotePort,
+                    ruleSet->action == VNET_FILTER_RULE_BLOCK ?
+                    "drop" : "forward"));
+
+   if (ruleSet->action == VNET_FILTER_RULE_BLOCK) {
+      DropPacket(VNET_FILTER_ACTION_DRP_DEFAULT,
+                 packetHeader, packet, packetLength);
+      return NF_DROP;
+   }
+   ForwardPacket(VNET_FILTER_ACTION_FWD_DEFAULT,
+                 packetHeader, packet, packetLength);
+   return NF_ACCEPT;
+}
+
+
+#ifdef VNET_FILTER_IPV6
+/*
+ *----------------------------------------------------------------------
+ *
+ * FilterIPv6Packet --
+ *
+ *      IPv6 half of VNetFilterHookFn. Extension headers are skipped to
+ *      find the upper layer protocol and, for the first fragment of
+ *      TCP and UDP, the ports.
+ *
+ * Results:
+ *      NF_ACCEPT or NF_DROP.
+ *
+ * Side effects:
+ *      Might log the packet.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+FilterIPv6Packet(struct sk_buff *skb, // IN: packet
+                 Bool transmit)       // IN: outgoing packet
+{
+   const CompiledRuleSet *currRuleSet;
+   struct ipv6hdr *ip6;
+   const struct in6_addr *remoteAddr;
+   FilterKey key;
+   uint8 *packetHeader;
+   uint8 *packet;
+   int packetLength;
+   uint8 nexthdr;
+   int offset;
+   Bool firstFragment = TRUE;
+   unsigned int verdict = NF_ACCEPT;
+
+   rcu_read_lock();
+
+   /* Rule sets without IPv6 rules don't filter IPv6 traffic. */
+   currRuleSet = rcu_dereference(activeCompiled);
+   if (currRuleSet == NULL || !currRuleSet->hasIPv6) {
+      goto out_unlock;
+   }
+
+   packetHeader = compat_skb_network_header(skb);
+   ip6 = (struct ipv6hdr *)packetHeader;
+   remoteAddr = transmit ? &ip6->daddr : &ip6->saddr;
+
+   /* always allow ::1. */
+   if (ipv6_addr_loopback(remoteAddr)) {
+      ForwardPacket(VNET_FILTER_ACTION_FWD_LOOP, packetHeader, NULL, 0);
+      goto out_unlock;
+   }
+
+   nexthdr = ip6->nexthdr;
+   {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0)
+      __be16 fragOff;
+
+      offset = ipv6_skip_exthdr(skb, skb_network_offset(skb) + sizeof *ip6,
+                                &nexthdr, &fragOff);
+      firstFragment = (fragOff & htons(~0x7)) == 0;
+#else
+      offset = ipv6_skip_exthdr(skb, skb_network_offset(skb) + sizeof *ip6,
+                                &nexthdr);
+#endif
+   }
+   if (offset < 0) {
+      HostFilterPrint(("PacketFilter: ill formed packet for IPv6\n"));
+      verdict = NF_DROP;
+      DropPacket(VNET_FILTER_ACTION_DRP_SHORT, packetHeader, NULL, 0);
+      goto out_unlock;
+   }
+
+   /* Only log what's in the linear part of the skb. */
+   packet = skb->data + offset;
+   packetLength = max_t(int, skb_headlen(skb) - offset, 0);
+
+   memset(&key, 0, sizeof key);
+   memcpy(key.remoteAddr, remoteAddr, sizeof key.remoteAddr);
+   key.proto = nexthdr;
+   key.transmit = transmit;
+   key.ipv6 = TRUE;
+
+   if ((nexthdr == IPPROTO_TCP || nexthdr == IPPROTO_UDP) && firstFragment) {
+      __be16 portBuf[2];
+      const __be16 *ports;
+
+      ports = skb_header_pointer(skb, offset, sizeof portBuf, portBuf);
+      if (ports == NULL) {
+         HostFilterPrint(("PacketFilter: payload too short for "
+                          "TCP or UDP over IPv6\n"));
+         verdict = NF_DROP;
+         DropPacket(VNET_FILTER_ACTION_DRP_SHORT,
+                    packetHeader, packet, packetLength);
          goto out_unlock;
-      } else {
-         HostFilterPrint(("PacketFilter: found match, dropping\n"));
+      }
+      key.localPort = ntohs(ports[transmit ? 0 : 1]);
+      key.remotePort = ntohs(ports[transmit ? 1 : 0]);
+   }
+
+   verdict = FilterVerdict(currRuleSet, &key, packetHeader, packet,
+                           packetLength);
+
+out_unlock:
+   rcu_read_unlock();
+   return verdict;
+}
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterHookFn --
+ *
+ *      Function is registered as a callback function with the host's
+ *      IP stack.  This function can be used to filter on specified protocols
+ *      IP addresses, and/or local and remote ports. It makes use of the Linux
+ *      netfilter infrastructure, by inserting this function in netfilter at a
+ *      priority 1 higher than iptables, so that we don't have to worry about
+ *      any existing iptables based firewall rules on the Linux hosts.
+ *      It is registered for both IPv4 and IPv6.
+ *
+ * Results:
+ *      NF_ACCEPT or NF_DROP.
+ *
+ * Side effects:
+ *      None besides those described above.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+VNetFilterHookFn(void *priv,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+VNetFilterHookFn(const struct nf_hook_ops *ops,        // IN:
+#else
+VNetFilterHookFn(unsigned int hooknum,                 // IN:
+#endif
+#ifdef VMW_NFHOOK_USES_SKB
+                 struct sk_buff *skb,                  // IN:
+#else
+                 struct sk_buff **pskb,                // IN:
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+                 const struct nf_hook_state *state)
+#else
+                 const struct net_device *in,          // IN:
+                 const struct net_device *out,         // IN:
+                 int (*okfn)(struct sk_buff *))        // IN:
+#endif
+{
+#ifndef VMW_NFHOOK_USES_SKB
+   struct sk_buff *skb = *pskb;
+#endif
+   struct iphdr *ip;
+   uint32 remoteAddr;
+   uint16 localPort;
+   uint16 remotePort;
+   uint8 *packet;
+   uint8 *packetHeader;
+   int packetLength;
+   const CompiledRuleSet *currRuleSet;
+   Bool transmit; /* TRUE if transmitting, FALSE is receiving */
+   FilterKey key;
+   unsigned int verdict = NF_ACCEPT;
+
+
+   /* When the host transmits, hooknum is VMW_NF_INET_POST_ROUTING. */
+   /* When the host receives, hooknum is VMW_NF_INET_LOCAL_IN. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+   transmit = (state->hook == VMW_NF_INET_POST_ROUTING);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+   transmit = (ops->hooknum == VMW_NF_INET_POST_ROUTING);
+#else
+   transmit = (hooknum == VMW_NF_INET_POST_ROUTING);
+#endif
+
+#ifdef VNET_FILTER_IPV6
+   if (skb->protocol == htons(ETH_P_IPV6)) {
+      return FilterIPv6Packet(skb, transmit);
+   }
+#endif
+
+   /* Early checks to see  we should even care. */
+   if (skb->protocol != htons(ETH_P_IP)) {
+      return verdict;
+   }
+
+   rcu_read_lock();
+
+   /*
+    * The compiled rule set is never modified once published, so rule
+    * changes made while this function is running don't affect us.
+    */
+
+   currRuleSet = rcu_dereference(activeCompiled);
+   if (currRuleSet == NULL) {
+      goto out_unlock;
+   }
+
+   packetHeader = compat_skb_network_header(skb);
+   ip = (struct iphdr*)packetHeader;
+
+   if (transmit) {
+      /* skb all set up for us. */
+      packet = compat_skb_transport_header(skb);
+   } else {
+      /* skb hasn't had a chance to be processed by TCP yet. */
+      packet = compat_skb_network_header(skb) + (ip->ihl << 2);
+   }
+
+   HostFilterPrint(("PacketFilter: IP ver %d ihl %d tos %d len %d id %d\n"
+                    "              offset %d ttl %d proto %d xsum %d\n"
+                    "              src 0x%08x dest 0x%08x %s\n",
+                    ip->version, ip->ihl, ip->tos, ip->tot_len, ip->id,
+		    ip->frag_off, ip->ttl, ip->protocol, ip->check,
+                    ip->saddr, ip->daddr, transmit ? "OUTGOING":"INCOMING"));
+
+   /*
+    * For incoming packets, there should be a skb->dev associated with it, with
+    * a populated L2 address length.
+    */
+   if (skb->dev && skb->dev->hard_header_len) {
+      packetLength = skb->len - skb->dev->hard_header_len - (ip->ihl << 2);
+   } else {
+      /*
+       * In certain cases, compat_skb_mac_header() has been observed to be NULL. Don't
+       * know why, but in such cases, this calculation will lead to a negative
+       * packetLength, and the packet to be dropped.
+       */
+      packetLength = skb->len - 
+                     (compat_skb_network_header(skb) - compat_skb_mac_header(skb)) - 
+                     (ip->ihl << 2);
+   }
+
+   if (packetLength < 0) {
+      HostFilterPrint(("PacketFilter: ill formed packet for IPv4\n"));
+      HostFilterPrint(("skb: len %d h.raw %p nh.raw %p mac.raw %p, packetLength %d\n",
+                       skb->len, compat_skb_transport_header(skb),
+                       compat_skb_network_header(skb),
+                       compat_skb_mac_header(skb), packetLength));
+      verdict = NF_DROP;
+      DropPacket(VNET_FILTER_ACTION_DRP_SHORT, packetHeader, packet, 0);
+      goto out_unlock;
+   }
+
+   remoteAddr = transmit ? ip->daddr : ip->saddr;
+
+   /* always allow 127/8. */
+   if ((remoteAddr & 0xff) == 127) {
+      HostFilterPrint(("PacketFilter: allowing %s loopback 0x%08x\n",
+                       transmit ? "outgoing" : "incoming",
+                       remoteAddr));
+      ForwardPacket(VNET_FILTER_ACTION_FWD_LOOP,
+                    packetHeader, packet, packetLength);
+      goto out_unlock;
+   }
+
+   /* If we're dealing with TCP or UDP, then extract the port information */
+   if (ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) {
+      uint16 srcPort, dstPort; /* used to extract port information from packet */
+
+      if (packetLength < 4) {
+         HostFilterPrint(("PacketFilter: payload too short for "
+                          "TCP or UDP: %d\n", packetLength));
          verdict = NF_DROP;
-         DropPacket(VNET_FILTER_ACTION_DRP_MATCH,
+         DropPacket(VNET_FILTER_ACTION_DRP_SHORT,
                     packetHeader, packet, packetLength);
          goto out_unlock;
       }
 
-skipRule:
-      currRule = currRule->next;
-   }
-
-   /* Forward or drop packet based on the default rule */
-   HostFilterPrint(("PacketFilter: Didn't find match for %s "
-                    "%u.%u.%u.%u, %s packet\n",
-                    transmit ? "outgoing" : "incoming",
-                    remoteAddr & 0xff, (remoteAddr >> 8) & 0xff,
-                    (remoteAddr >> 16) & 0xff, (remoteAddr >> 24) & 0xff,
-                    blockByDefault ? "drop" : "forward"));
-
-   if (blockByDefault) {
-      verdict = NF_DROP;
-      DropPacket(VNET_FILTER_ACTION_DRP_DEFAULT,
-                 packetHeader, packet, packetLength);
+      /* Retrieve UDP/TCP port info */
+      srcPort = *((uint16*)&packet[0]);
+      dstPort = *((uint16*)&packet[2]);
+
+      if (transmit) { /* transmit */
+         localPort = ntohs(srcPort);
+         remotePort = ntohs(dstPort);
+      } else { /* receive */
+         localPort = ntohs(dstPort);
+         remotePort = ntohs(srcPort);
+      }
+
+      HostFilterPrint(("PacketFilter: got local port %d remote port %d\n",
+                       localPort, remotePort));
    } else {
-      ForwardPacket(VNET_FILTER_ACTION_FWD_DEFAULT,
-                    packetHeader, packet, packetLength);
+      /* these mostly exist to silence compiler warning about uninit variables */
+      localPort = 0;
+      remotePort = 0;
    }
+
+   memset(&key, 0, sizeof key);
+   key.remoteAddr[0] = remoteAddr;
+   key.localPort = localPort;
+   key.remotePort = remotePort;
+   key.proto = ip->protocol;
+   key.transmit = transmit;
+
+   verdict = FilterVerdict(currRuleSet, &key, packetHeader, packet,
+                           packetLength);
 out_unlock:
-   spin_unlock_irqrestore(&activeRuleLock, flags);
+   rcu_read_unlock();
    return verdict;
 }
 
@@ -661,75 +1121,413 @@ FindRuleSetById(uint32 id,          // IN: id to locate
          }
          return curr;
       }
-      prev = &curr->next;
-      curr = curr->next;
+      prev = &curr->next;
+      curr = curr->next;
+   }
+   LOG(2, (KERN_INFO "Didn't find ruleset with id %u\n", id));
+   /* won't overwrite *prevPtr with NULL */
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CreateRuleSet --
+ *
+ *      Function creates a new rule set with a specified ID and
+ *      default action.  Call will fail if failed to alloc memory,
+ *      or if ID is already in use, or if maximum number of
+ *      rule sets have already been created.
+ *
+ * Results:
+ *      Returns 0 on success, and otherwise returns errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CreateRuleSet(uint32 id,            // IN: requested ID for new rule set
+              uint32 defaultAction) // IN: default action for rule set
+{
+   RuleSet *newRuleSet;
+   RuleSet *curr;
+
+   /* check if too many rule sets already exist */
+   if (numRuleSets >= MAX_RULE_SETS) {
+      LOG(2, (KERN_INFO "filter already has all rules (%u of %u) allocated\n",
+              numRuleSets, MAX_RULE_SETS));
+      return -EOVERFLOW;
+   }
+
+   /* check if ID is already in use */
+   curr = FindRuleSetById(id, NULL);
+   if (curr != NULL) {
+      LOG(2, (KERN_INFO "filter already has id %u\n", id));
+      return -EEXIST;
+   }
+
+   /* allocate and init new rule set */
+   newRuleSet = kmalloc(sizeof *newRuleSet, GFP_USER);
+   if (newRuleSet == NULL) {
+      LOG(2, (KERN_INFO "filter mem alloc failed\n"));
+      return -ENOMEM;
+   }
+
+   memset(newRuleSet, 0, sizeof *newRuleSet);
+   newRuleSet->next = ruleSetHead;
+   newRuleSet->id = id;
+   newRuleSet->enabled = FALSE;
+   newRuleSet->action = (uint16)defaultAction;
+   newRuleSet->list = NULL;
+   newRuleSet->numRules = 0;
+   newRuleSet->tail = &newRuleSet->list;
+
+   /* add new rule set to head of linked list */
+   numRuleSets++;
+   ruleSetHead = newRuleSet;
+   LOG(2, (KERN_INFO "filter created ruleset with id %u\n", id));
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DeleteRule --
+ *
+ *      Function frees the memory in a Rule object.  This function
+ *      frees the arrays in the Rule, but not an elements that
+ *      are chained on the linked-list via 'next'.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DeleteRule(Rule *rule)          // IN: Rule to delete.
+{
+   // ASSERT(rule);
+
+   if (!rule) {
+      return;
+   }
+   if (rule->addressList) {
+      kfree(rule->addressList);
+      rule->addressList = NULL;
+   }
+   if (rule->address6List) {
+      kfree(rule->address6List);
+      rule->address6List = NULL;
+   }
+   if (rule->portList) {
+      kfree(rule->portList);
+      rule->portList = NULL;
+   }
+   kfree(rule);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DeleteRuleSet --
+ *
+ *      Function deletes a rule set with a specified ID. Call will fail
+ *      if ID not found or if the current rule set is being used for
+ *      filtering.
+ *
+ * Results:
+ *      Returns 0 on success, errno on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DeleteRuleSet(uint32 id) // IN: ID of new rule set to delete
+{
+   RuleSet **prev = NULL;
+   RuleSet *curr;
+   Rule *currRule;
+
+   /* locate the ruleset with the specified ID */
+   curr = FindRuleSetById(id, &prev);
+   if (curr == NULL) {
+      LOG(2, (KERN_INFO "filter did not find id %u to delete\n", id));
+      return -ESRCH;
+   }
+
+   LOG(2, (KERN_INFO "found id %u\n", id));
+
+   /* check if in use */
+   if (curr->enabled) {
+      LOG(2, (KERN_INFO "Can't delete id %u since enabled\n", id));
+      return -EBUSY;
+   }
+
+   /* remove item from linked list */
+   *prev = curr->next;
+
+   /* free rules in rule set */
+   currRule = curr->list;
+   curr->list = NULL; /* help mitigate any bugs or races */
+   while (currRule) {
+      Rule *temp = currRule->next;
+      currRule->next = NULL; /* help mitigate any bugs or races */
+      DeleteRule(currRule);
+      currRule = temp;
+   }
+
+   kfree(curr);
+   numRuleSets--;
+   // ASSERT(numRuleSets >= 0);
+   return 0;
+}
+
+
+/*
+ * Scratch state used while compiling a rule set: every address or port
+ * range of rule 'rule' becomes a +1 edge at its low end and a -1 edge
+ * just past its high end.
+ */
+
+typedef struct RuleEdge {
+   uint64 posHi;          /* 0 except for IPv6 addresses */
+   uint64 pos;
+   uint32 rule;
+   int32 delta;
+} RuleEdge;
+
+typedef struct RuleEdgeList {
+   RuleEdge *edges;
+   uint32 len;
+} RuleEdgeList;
+
+
+static int
+RuleEdgeCmp(const void *a, // IN
+            const void *b) // IN
+{
+   const RuleEdge *ea = a;
+   const RuleEdge *eb = b;
+
+   if (ea->posHi != eb->posHi) {
+      return ea->posHi < eb->posHi ? -1 : 1;
+   }
+   return ea->pos < eb->pos ? -1 : ea->pos > eb->pos;
+}
+
+
+static INLINE void
+RuleEdgeListAdd(RuleEdgeList *list, // IN/OUT: edge list
+                uint32 rule,        // IN: rule index
+                uint32 low,         // IN: first value of range
+                uint32 high)        // IN: last value of range
+{
+   list->edges[list->len].posHi = 0;
+   list->edges[list->len].pos = low;
+   list->edges[list->len].rule = rule;
+   list->edges[list->len].delta = 1;
+   list->len++;
+   list->edges[list->len].posHi = 0;
+   list->edges[list->len].pos = (uint64)high + 1;
+   list->edges[list->len].rule = rule;
+   list->edges[list->len].delta = -1;
+   list->len++;
+}
+
+
+static INLINE void
+RuleEdgeListAdd6(RuleEdgeList *list,    // IN/OUT: edge list
+                 uint32 rule,           // IN: rule index
+                 const RuleAddr6 *addr) // IN: IPv6 prefix
+{
+   uint64 highHi = addr->addrHi | ~addr->maskHi;
+   uint64 highLo = addr->addrLo | ~addr->maskLo;
+
+   list->edges[list->len].posHi = addr->addrHi;
+   list->edges[list->len].pos = addr->addrLo;
+   list->edges[list->len].rule = rule;
+   list->edges[list->len].delta = 1;
+   list->len++;
+
+   /* Nothing lies past ffff:...:ffff. */
+   if (highHi == ~(uint64)0 && highLo == ~(uint64)0) {
+      return;
+   }
+   list->edges[list->len].posHi = highLo == ~(uint64)0 ? highHi + 1 : highHi;
+   list->edges[list->len].pos = highLo + 1;
+   list->edges[list->len].rule = rule;
+   list->edges[list->len].delta = -1;
+   list->len++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RuleEdgeSweep --
+ *
+ *      Apply all the edges at the next position of a sorted edge list
+ *      to the per-rule range counts and the resulting rule mask.
+ *
+ * Results:
+ *      First edge at that position, NULL once all edges are applied.
+ *
+ * Side effects:
+ *      Advances *next, updates count and *mask.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const RuleEdge *
+RuleEdgeSweep(const RuleEdgeList *list, // IN: sorted edges
+              uint32 *next,             // IN/OUT: next edge to apply
+              int32 *count,             // IN/OUT: ranges covering each rule
+              uint64 *mask)             // IN/OUT: rules with count > 0
+{
+   const RuleEdge *first;
+
+   if (*next >= list->len) {
+      return NULL;
+   }
+   first = &list->edges[*next];
+   for (; *next < list->len && RuleEdgeCmp(first, &list->edges[*next]) == 0;
+        (*next)++) {
+      uint32 rule = list->edges[*next].rule;
+
+      count[rule] += list->edges[*next].delta;
+      if (count[rule] > 0) {
+         *mask |= (uint64)1 << rule;
+      } else {
+         *mask &= ~((uint64)1 << rule);
+      }
+   }
+   return first;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BuildRuleIntervals --
+ *
+ *      Sweep the sorted range edges of one packet field, producing the
+ *      elementary intervals of [0, maxValue] and the rules matching
+ *      each one. Adjacent intervals with identical rules are merged.
+ *
+ * Results:
+ *      Returns 0 on success, and otherwise returns errno.
+ *
+ * Side effects:
+ *      Sorts the edge list, allocates intervals->list.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BuildRuleIntervals(RuleEdgeList *list,         // IN: edges of the field
+                   uint64 maxValue,            // IN: largest field value
+                   RuleIntervals *intervals)   // OUT: intervals
+{
+   int32 count[MAX_RULES_PER_SET];
+   const RuleEdge *edge;
+   uint64 mask = 0;
+   uint32 i = 0;
+   uint32 n = 0;
+
+   memset(count, 0, sizeof count);
+   sort(list->edges, list->len, sizeof *list->edges, RuleEdgeCmp, NULL);
+
+   intervals->list = kmalloc((list->len + 1) * sizeof *intervals->list,
+                             GFP_KERNEL);
+   if (intervals->list == NULL) {
+      return -ENOMEM;
+   }
+
+   if (list->len == 0 || list->edges[0].pos != 0) {
+      intervals->list[n].low = 0;
+      intervals->list[n].match = 0;
+      n++;
+   }
+   while ((edge = RuleEdgeSweep(list, &i, count, &mask)) != NULL) {
+      if (edge->pos > maxValue) {
+         break;
+      }
+      if (n > 0 && intervals->list[n - 1].match == mask) {
+         continue;
+      }
+      intervals->list[n].low = (uint32)edge->pos;
+      intervals->list[n].match = mask;
+      n++;
    }
-   LOG(2, (KERN_INFO "Didn't find ruleset with id %u\n", id));
-   /* won't overwrite *prevPtr with NULL */
-   return NULL;
+   intervals->len = n;
+   return 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * CreateRuleSet --
+ * BuildRuleIntervals6 --
  *
- *      Function creates a new rule set with a specified ID and
- *      default action.  Call will fail if failed to alloc memory,
- *      or if ID is already in use, or if maximum number of
- *      rule sets have already been created.
+ *      BuildRuleIntervals() for the 128-bit IPv6 address space.
  *
  * Results:
  *      Returns 0 on success, and otherwise returns errno.
  *
  * Side effects:
- *      None.
+ *      Sorts the edge list, allocates intervals->list.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-CreateRuleSet(uint32 id,            // IN: requested ID for new rule set
-              uint32 defaultAction) // IN: default action for rule set
+BuildRuleIntervals6(RuleEdgeList *list,         // IN: IPv6 address edges
+                    RuleIntervals6 *intervals)  // OUT: intervals
 {
-   RuleSet *newRuleSet;
-   RuleSet *curr;
-
-   /* check if too many rule sets already exist */
-   if (numRuleSets >= MAX_RULE_SETS) {
-      LOG(2, (KERN_INFO "filter already has all rules (%u of %u) allocated\n",
-              numRuleSets, MAX_RULE_SETS));
-      return -EOVERFLOW;
+   int32 count[MAX_RULES_PER_SET];
+   const RuleEdge *edge;
+   uint64 mask = 0;
+   uint32 i = 0;
+   uint32 n = 0;
+
+   memset(count, 0, sizeof count);
+   sort(list->edges, list->len, sizeof *list->edges, RuleEdgeCmp, NULL);
+
+   intervals->list = kmalloc((list->len + 1) * sizeof *intervals->list,
+                             GFP_KERNEL);
+   if (intervals->list == NULL) {
+      return -ENOMEM;
    }
 
-   /* check if ID is already in use */
-   curr = FindRuleSetById(id, NULL);
-   if (curr != NULL) {
-      LOG(2, (KERN_INFO "filter already has id %u\n", id));
-      return -EEXIST;
+   if (list->len == 0 || list->edges[0].posHi != 0 || list->edges[0].pos != 0) {
+      intervals->list[n].lowHi = 0;
+      intervals->list[n].lowLo = 0;
+      intervals->list[n].match = 0;
+      n++;
    }
-
-   /* allocate and init new rule set */
-   newRuleSet = kmalloc(sizeof *newRuleSet, GFP_USER);
-   if (newRuleSet == NULL) {
-      LOG(2, (KERN_INFO "filter mem alloc failed\n"));
-      return -ENOMEM;
+   while ((edge = RuleEdgeSweep(list, &i, count, &mask)) != NULL) {
+      if (n > 0 && intervals->list[n - 1].match == mask) {
+         continue;
+      }
+      intervals->list[n].lowHi = edge->posHi;
+      intervals->list[n].lowLo = edge->pos;
+      intervals->list[n].match = mask;
+      n++;
    }
-
-   memset(newRuleSet, 0, sizeof *newRuleSet);
-   newRuleSet->next = ruleSetHead;
-   newRuleSet->id = id;
-   newRuleSet->enabled = FALSE;
-   newRuleSet->action = (uint16)defaultAction;
-   newRuleSet->list = NULL;
-   newRuleSet->numRules = 0;
-   newRuleSet->tail = &newRuleSet->list;
-
-   /* add new rule set to head of linked list */
-   numRuleSets++;
-   ruleSetHead = newRuleSet;
-   LOG(2, (KERN_INFO "filter created ruleset with id %u\n", id));
+   intervals->len = n;
    return 0;
 }
 
@@ -737,11 +1535,9 @@ CreateRuleSet(uint32 id,            // IN: requested ID for new rule set
 /*
  *----------------------------------------------------------------------
  *
- * DeleteRule --
+ * FreeCompiledRuleSet --
  *
- *      Function frees the memory in a Rule object.  This function
- *      frees the arrays in the Rule, but not an elements that
- *      are chained on the linked-list via 'next'.
+ *      Free a compiled rule set no reader can reference anymore.
  *
  * Results:
  *      None.
@@ -753,36 +1549,30 @@ CreateRuleSet(uint32 id,            // IN: requested ID for new rule set
  */
 
 static void
-DeleteRule(Rule *rule)          // IN: Rule to delete.
+FreeCompiledRuleSet(CompiledRuleSet *ruleSet) // IN: compiled rule set
 {
-   // ASSERT(rule);
-
-   if (!rule) {
+   if (ruleSet == NULL) {
       return;
    }
-   if (rule->addressList) {
-      kfree(rule->addressList);
-      rule->addressList = NULL;
-   }
-   if (rule->portList) {
-      kfree(rule->portList);
-      rule->portList = NULL;
-   }
-   kfree(rule);
+   kfree(ruleSet->addr.list);
+   kfree(ruleSet->addr6.list);
+   kfree(ruleSet->localPort.list);
+   kfree(ruleSet->remotePort.list);
+   kfree(ruleSet);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * DeleteRuleSet --
+ * CompileRuleSet --
  *
- *      Function deletes a rule set with a specified ID. Call will fail
- *      if ID not found or if the current rule set is being used for
- *      filtering.
+ *      Build the immutable lookup structure the netfilter hook uses
+ *      for a rule set. See the CompiledRuleSet comment at the top of
+ *      this file.
  *
  * Results:
- *      Returns 0 on success, errno on failure.
+ *      Returns 0 on success, and otherwise returns errno.
  *
  * Side effects:
  *      None.
@@ -791,43 +1581,215 @@ DeleteRule(Rule *rule)          // IN: Rule to delete.
  */
 
 static int
-DeleteRuleSet(uint32 id) // IN: ID of new rule set to delete
+CompileRuleSet(const RuleSet *ruleSet,     // IN: rule set to compile
+               CompiledRuleSet **result)   // OUT: compiled rule set
 {
-   RuleSet **prev = NULL;
-   RuleSet *curr;
-   Rule *currRule;
+   CompiledRuleSet *compiled;
+   RuleEdgeList addrEdges, addr6Edges, localEdges, remoteEdges;
+   RuleEdge *edges;
+   Rule *rule;
+   uint64 anyProto = 0;
+   uint32 addrMax = 0;
+   uint32 addr6Max = 0;
+   uint32 portMax = 0;
+   uint32 numEdges;
+   uint32 i;
+   int retval;
 
-   /* locate the ruleset with the specified ID */
-   curr = FindRuleSetById(id, &prev);
-   if (curr == NULL) {
-      LOG(2, (KERN_INFO "filter did not find id %u to delete\n", id));
-      return -ESRCH;
+   for (rule = ruleSet->list; rule != NULL; rule = rule->next) {
+      uint32 addrEdgeCount = 2 * (rule->addressListLen ? rule->addressListLen : 1);
+
+      if (rule->ipVersion == 6) {
+         addr6Max += addrEdgeCount;
+      } else {
+         addrMax += addrEdgeCount;
+      }
+      portMax += 2 * (rule->portListLen ? rule->portListLen : 1);
    }
+   numEdges = addrMax + addr6Max + 2 * portMax;
 
-   LOG(2, (KERN_INFO "found id %u\n", id));
+   compiled = kmalloc(sizeof *compiled, GFP_KERNEL);
+   edges = numEdges ? vmalloc(numEdges * sizeof *edges) : NULL;
+   if (compiled == NULL || (numEdges && edges == NULL)) {
+      retval = -ENOMEM;
+      goto out;
+   }
+   memset(compiled, 0, sizeof *compiled);
+   compiled->action = ruleSet->action;
+
+   addrEdges.edges = edges;
+   addrEdges.len = 0;
+   addr6Edges.edges = edges + addrMax;
+   addr6Edges.len = 0;
+   localEdges.edges = edges + addrMax + addr6Max;
+   localEdges.len = 0;
+   remoteEdges.edges = edges + addrMax + addr6Max + portMax;
+   remoteEdges.len = 0;
+
+   for (rule = ruleSet->list, i = 0; rule != NULL; rule = rule->next, i++) {
+      uint64 bit = (uint64)1 << i;
+      uint32 j;
+
+      compiled->rules[i] = rule;
+      if (rule->direction != VNET_FILTER_DIRECTION_OUT) {
+         compiled->directionMask[0] |= bit;
+      }
+      if (rule->direction != VNET_FILTER_DIRECTION_IN) {
+         compiled->directionMask[1] |= bit;
+      }
+      if (rule->action == VNET_FILTER_RULE_ALLOW) {
+         compiled->allowMask |= bit;
+      }
+      if (rule->proto == 0xffff) {
+         anyProto |= bit;
+      } else {
+         compiled->protoMask[rule->proto & 0xff] |= bit;
+      }
 
-   /* check if in use */
-   if (curr->enabled) {
-      LOG(2, (KERN_INFO "Can't delete id %u since enabled\n", id));
-      return -EBUSY;
+      /* Remote address: prefixes are ranges, anything else is rechecked. */
+      if (rule->ipVersion == 6) {
+         static const RuleAddr6 anyAddr6 = { 0, 0, 0, 0 };
+
+         compiled->hasIPv6 = TRUE;
+         if (rule->addressListLen == 0) {
+            RuleEdgeListAdd6(&addr6Edges, i, &anyAddr6);
+         }
+         for (j = 0; j < rule->addressListLen; j++) {
+            RuleEdgeListAdd6(&addr6Edges, i, rule->address6List + j);
+         }
+      } else {
+         if (rule->addressListLen == 0) {
+            RuleEdgeListAdd(&addrEdges, i, 0, 0xffffffff);
+         }
+         for (j = 0; j < rule->addressListLen; j++) {
+            uint32 mask = ntohl(rule->addressList[j].ipv4Mask);
+            uint32 addr = ntohl(rule->addressList[j].ipv4Addr) & mask;
+
+            if ((~mask & (~mask + 1)) == 0) {
+               RuleEdgeListAdd(&addrEdges, i, addr, addr | ~mask);
+            } else {
+               compiled->verifyMask |= bit;
+               RuleEdgeListAdd(&addrEdges, i, 0, 0xffffffff);
+            }
+         }
+      }
+
+      /*
+       * Ports: the per-field masks are exact unless several entries
+       * constrain both the local and the remote port.
+       */
+      if ((rule->proto == IPPROTO_TCP || rule->proto == IPPROTO_UDP) &&
+          rule->portListLen > 0) {
+         Bool anyLocal = TRUE;
+         Bool anyRemote = TRUE;
+
+         for (j = 0; j < rule->portListLen; j++) {
+            const RulePort *port = rule->portList + j;
+
+            if (port->localPortLow == ~0) {
+               RuleEdgeListAdd(&localEdges, i, 0, 0xffff);
+            } else {
+               RuleEdgeListAdd(&localEdges, i, port->localPortLow,
+                               port->localPortHigh);
+               anyLocal = FALSE;
+            }
+            if (port->remotePortLow == ~0) {
+               RuleEdgeListAdd(&remoteEdges, i, 0, 0xffff);
+            } else {
+               RuleEdgeListAdd(&remoteEdges, i, port->remotePortLow,
+                               port->remotePortHigh);
+               anyRemote = FALSE;
+            }
+         }
+         if (rule->portListLen > 1 && !anyLocal && !anyRemote) {
+            compiled->verifyMask |= bit;
+         }
+      } else {
+         RuleEdgeListAdd(&localEdges, i, 0, 0xffff);
+         RuleEdgeListAdd(&remoteEdges, i, 0, 0xffff);
+      }
+   }
+   for (i = 0; i < ARRAY_SIZE(compiled->protoMask); i++) {
+      compiled->protoMask[i] |= anyProto;
    }
 
-   /* remove item from linked list */
-   *prev = curr->next;
+   retval = BuildRuleIntervals(&addrEdges, 0xffffffff, &compiled->addr);
+   if (retval == 0) {
+      retval = BuildRuleIntervals6(&addr6Edges, &compiled->addr6);
+   }
+   if (retval == 0) {
+      retval = BuildRuleIntervals(&localEdges, 0xffff, &compiled->localPort);
+   }
+   if (retval == 0) {
+      retval = BuildRuleIntervals(&remoteEdges, 0xffff, &compiled->remotePort);
+   }
 
-   /* free rules in rule set */
-   currRule = curr->list;
-   curr->list = NULL; /* help mitigate any bugs or races */
-   while (currRule) {
-      Rule *temp = currRule->next;
-      currRule->next = NULL; /* help mitigate any bugs or races */
-      DeleteRule(currRule);
-      currRule = temp;
+   LOG(2, (KERN_INFO "vnet filter compiled ruleset %u: %u IPv4 address, "
+           "%u IPv6 address, %u local port, %u remote port intervals\n",
+           ruleSet->id, compiled->addr.len, compiled->addr6.len,
+           compiled->localPort.len, compiled->remotePort.len));
+
+out:
+   vfree(edges);
+   if (retval != 0) {
+      FreeCompiledRuleSet(compiled);
+      compiled = NULL;
    }
+   *result = compiled;
+   return retval;
+}
 
-   kfree(curr);
-   numRuleSets--;
-   // ASSERT(numRuleSets >= 0);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PublishRuleSet --
+ *
+ *      Compile a rule set and make it the one used by the netfilter
+ *      hook, or stop filtering if ruleSet is NULL. Must be called with
+ *      filterIoctlMutex held (or from shutdown).
+ *
+ * Results:
+ *      Returns 0 on success, and otherwise returns errno, in which case
+ *      the previously published rule set stays in effect.
+ *
+ * Side effects:
+ *      Waits for an RCU grace period before freeing the old compiled
+ *      rule set. Invalidates the flow cache.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+PublishRuleSet(const RuleSet *ruleSet) // IN: rule set to publish, or NULL
+{
+   CompiledRuleSet *newCompiled = NULL;
+   CompiledRuleSet *oldCompiled;
+
+   if (ruleSet != NULL) {
+      int retval = CompileRuleSet(ruleSet, &newCompiled);
+
+      if (retval != 0) {
+         LOG(2, (KERN_INFO "vnet filter failed to compile ruleset %u: %d\n",
+                 ruleSet->id, retval));
+         return retval;
+      }
+   }
+
+   if (newCompiled != NULL) {
+      /* Skip 0 so that unused flow cache entries never match. */
+      if (++ruleGeneration == 0) {
+         ++ruleGeneration;
+      }
+      newCompiled->generation = ruleGeneration;
+   }
+
+   oldCompiled = activeCompiled;
+   rcu_assign_pointer(activeCompiled, newCompiled);
+   if (oldCompiled != NULL) {
+      synchronize_rcu();
+      FreeCompiledRuleSet(oldCompiled);
+   }
    return 0;
 }
 
@@ -851,7 +1813,7 @@ DeleteRuleSet(uint32 id) // IN: ID of new rule set to delete
  *      Returns 0 on success, errno on failure.
  *
  * Side effects:
- *      May add/remove filter callback.
+ *      May add/remove filter callback, recompiles the active rule set.
  *
  *----------------------------------------------------------------------
  */
@@ -864,7 +1826,7 @@ ChangeRuleSet(uint32 id,     // IN: requested ID of rule set
 {
    RuleSet *curr;
    int retval;
-   unsigned long flags;
+   uint16 oldAction;
 
    // ASSERT(!enable || !disable); /* at most one can be set */
 
@@ -877,6 +1839,8 @@ ChangeRuleSet(uint32 id,     // IN: requested ID of rule set
       return -ESRCH;
    }
 
+   oldAction = curr->action;
+
    if (enable) {
       RuleSet *oldActive;
 
@@ -886,24 +1850,22 @@ ChangeRuleSet(uint32 id,     // IN: requested ID of rule set
          curr->action = (uint16)action;
       }
 
-      /* enable new rule */
-      curr->enabled = TRUE;
-
-      /* Grab activeRule spinlock. */
-      spin_lock_irqsave(&activeRuleLock, flags);
-
       LOG(2, (KERN_INFO "changing active rule from "
               "%p (%u) to %p (%u)\n", activeRule,
               activeRule ? activeRule->id : 0,
               curr, curr->id));
 
-      /* make rule active */
+      /* hand the new rule to the filter callback */
+      if ((retval = PublishRuleSet(curr)) != 0) {
+         curr->action = oldAction;
+         return retval;
+      }
+
+      /* enable new rule and make it active */
+      curr->enabled = TRUE;
       oldActive = activeRule;
       activeRule = curr;
 
-      /* Safe to release activeRule spinlock now. */
-      spin_unlock_irqrestore(&activeRuleLock, flags);
-
       /*
        * Mark old rule as not enabled, except if it's the same
        * as the newly enabled rule set.
@@ -942,41 +1904,153 @@ ChangeRuleSet(uint32 id,     // IN: requested ID of rule set
          return -EINVAL;
       }
 
-      // 5) deactive (and currently active)
-      LOG(2, (KERN_INFO "vnet filter deactivating %p (id %u)\n",
-              curr, id));
+      // 5) deactive (and currently active)
+      LOG(2, (KERN_INFO "vnet filter deactivating %p (id %u)\n",
+              curr, id));
+
+      RemoveHostFilterCallback();
+
+      // ASSERT(activeRule == curr);
+      PublishRuleSet(NULL);
+      activeRule = NULL;
+      curr->enabled = FALSE;
+      if (action != VNET_FILTER_RULE_NO_CHANGE) {
+         LOG(2, (KERN_INFO "vnet filter changing default action: "
+                 "%u (id %u)\n", action, id));
+         curr->action = (uint16)action;
+      }
+      retval = 0;
+
+   } else { /* !enable && !disable */
+
+      if (action == VNET_FILTER_RULE_NO_CHANGE) {
+         // 6) no activate change (and default not changed)
+         LOG(2, (KERN_INFO "vnet filter got nothing to change\n"));
+         return 0;
+      }
+
+      // 7) no activate change (but default action changed)
+      curr->action = (uint16)action;
+      retval = 0;
+      if (curr == activeRule && (retval = PublishRuleSet(curr)) != 0) {
+         curr->action = oldAction;
+         return retval;
+      }
+      LOG(2, (KERN_INFO "vnet filter changed action: %u\n", action));
+   }
+
+   return retval;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetRulePorts --
+ *
+ *      Copy the port list of an add rule request into a new Rule.
+ *      VNet_IPv6Port is the same as VNet_IPv4Port.
+ *
+ * Results:
+ *      Returns 0 on success, errno on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SetRulePorts(Rule *newRule,             // IN/OUT: rule being added
+             uint32 portListLen,        // IN: entries in portList
+             VNet_IPv4Port *portList)   // IN: list of ports
+{
+   // ASSERT(portListLen <= 255); /* double-check for data truncation */
+   newRule->portListLen = (uint8)portListLen;
+   if (newRule->portListLen == 1 &&
+       portList[0].localPortLow == ~0 &&
+       portList[0].localPortHigh == ~0 &&
+       portList[0].remotePortLow == ~0 &&
+       portList[0].remotePortHigh == ~0) {
+      newRule->portListLen = 0;
+      LOG(2, (KERN_INFO "vnet filter port has single don't care rule\n"));
+   }
+
+   if (newRule->portListLen > 0) {
+      uint32 i;
+
+      newRule->portList =
+         kmalloc(sizeof(*newRule->portList) * newRule->portListLen, GFP_USER);
+      if (newRule->portList == NULL) {
+         LOG(2, (KERN_INFO "vnet filter mem alloc failed for rule port\n"));
+         return -ENOMEM;
+      }
+
+      /* could use memcpy(), but this insulates against API changes */
+      for (i = 0; i < newRule->portListLen; ++i) {
+         newRule->portList[i].localPortLow   = portList[i].localPortLow;
+         newRule->portList[i].localPortHigh  = portList[i].localPortHigh;
+         newRule->portList[i].remotePortLow  = portList[i].remotePortLow;
+         newRule->portList[i].remotePortHigh = portList[i].remotePortHigh;
+      }
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendRule --
+ *
+ *      Add a fully built rule at the end of a rule set, recompiling
+ *      the rule set if it is the active one.
+ *
+ * Results:
+ *      Returns 0 on success, errno on failure, in which case the rule
+ *      has been freed.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AppendRule(RuleSet *curr,   // IN/OUT: rule set
+           Rule *newRule)   // IN: rule to add
+{
+   LOG(2, (KERN_INFO "adding IPv%u rule with %u addresses and %u ports\n",
+           newRule->ipVersion, newRule->addressListLen, newRule->portListLen));
 
-      RemoveHostFilterCallback();
+   /* add rule to rule set */
+   newRule->next = NULL;
+   *(curr->tail) = newRule;
+   curr->tail = &(newRule->next);
+   ++curr->numRules;
 
-      // ASSERT(activeRule == curr);
-      /* Grab activeRule spinlock. */
-      spin_lock_irqsave(&activeRuleLock, flags);
-      activeRule = NULL;
-      /* Safe to release activeRule spinlock now. */
-      spin_unlock_irqrestore(&activeRuleLock, flags);
-      curr->enabled = FALSE;
-      if (action != VNET_FILTER_RULE_NO_CHANGE) {
-         LOG(2, (KERN_INFO "vnet filter changing default action: "
-                 "%u (id %u)\n", action, id));
-         curr->action = (uint16)action;
-      }
-      retval = 0;
+   /* the filter callback only sees the rule once recompiled */
+   if (curr == activeRule) {
+      int retval = PublishRuleSet(curr);
 
-   } else { /* !enable && !disable */
+      if (retval != 0) {
+         Rule **prev = &curr->list;
 
-      if (action == VNET_FILTER_RULE_NO_CHANGE) {
-         // 6) no activate change (and default not changed)
-         LOG(2, (KERN_INFO "vnet filter got nothing to change\n"));
-         retval = 0;
+         while (*prev != newRule) {
+            prev = &(*prev)->next;
+         }
+         *prev = NULL;
+         curr->tail = prev;
+         --curr->numRules;
+         DeleteRule(newRule);
+         return retval;
       }
-
-      // 7) no activate change (but default action changed)
-      curr->action = (uint16)action;
-      LOG(2, (KERN_INFO "vnet filter changed action: %u\n", action));
-      retval = 0;
    }
 
-   return retval;
+   LOG(2, (KERN_INFO "Added rule %p to set %p, count now %u\n",
+           newRule, curr, curr->numRules));
+
+   return 0;
 }
 
 
@@ -994,7 +2068,7 @@ ChangeRuleSet(uint32 id,     // IN: requested ID of rule set
  *      Returns 0 on success, errno on failure.
  *
  * Side effects:
- *      None.
+ *      Recompiles the rule set if it is the active one.
  *
  *----------------------------------------------------------------------
  */
@@ -1035,6 +2109,7 @@ AddIPv4Rule(uint32 id,                       // IN: requested ID of rule set
    newRule->action = (uint16)rule->action;
    newRule->direction = (uint16)rule->direction;
    newRule->proto = (uint16)rule->proto;
+   newRule->ipVersion = 4;
 
    // ASSERT(rule->addressListLen <= 255); /* double-check for data truncation */
    newRule->addressListLen = (uint8)rule->addressListLen;
@@ -1045,17 +2120,6 @@ AddIPv4Rule(uint32 id,                       // IN: requested ID of rule set
       LOG(2, (KERN_INFO "vnet filter address has single don't care rule\n"));
    }
 
-   // ASSERT(rule->portListLen <= 255); /* double-check for data truncation */
-   newRule->portListLen = (uint8)rule->portListLen;
-   if (newRule->portListLen == 1 &&
-       portList[0].localPortLow == ~0 &&
-       portList[0].localPortHigh == ~0 &&
-       portList[0].remotePortLow == ~0 &&
-       portList[0].remotePortHigh == ~0) {
-      newRule->portListLen = 0;
-      LOG(2, (KERN_INFO "vnet filter port has single don't care rule\n"));
-   }
-
    if (newRule->addressListLen > 0) {
       uint32 i;
 
@@ -1075,39 +2139,234 @@ AddIPv4Rule(uint32 id,                       // IN: requested ID of rule set
       }
    }
 
-   if (newRule->portListLen > 0) {
+   if (SetRulePorts(newRule, rule->portListLen, portList) != 0) {
+      DeleteRule(newRule);
+      return -ENOMEM;
+   }
+
+   return AppendRule(curr, newRule);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AddIPv6Rule --
+ *
+ *      Function is used to add an IPv6 rule to a rule set.
+ *      Call will fail if failed to alloc memory, or if specified
+ *      ID was not found.  The actual rule is not sanity checked,
+ *      as it's presumed the caller did this.
+ *
+ * Results:
+ *      Returns 0 on success, errno on failure.
+ *
+ * Side effects:
+ *      Recompiles the rule set if it is the active one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AddIPv6Rule(uint32 id,                       // IN: requested ID of rule set
+            VNet_AddIPv6Rule *rule,          // IN: rule to add
+            VNet_IPv6Address *addressList,   // IN: list of addresses
+            VNet_IPv6Port *portList)         // IN: list of ports
+{
+   Rule *newRule;
+   RuleSet *curr;
+
+   /* locate the rule set with the specified ID */
+   curr = FindRuleSetById(id, NULL);
+   if (curr == NULL) {
+      LOG(2, (KERN_INFO "vnet filter can't find ruleset: %u\n", id));
+      return -ESRCH;
+   }
+
+   /* make sure that we don't have too many rules already */
+   if (curr->numRules >= MAX_RULES_PER_SET) {
+      LOG(2, (KERN_INFO "vnet filter has too many rules in ruleset: %u >= %u\n",
+              curr->numRules, MAX_RULES_PER_SET));
+      return -EOVERFLOW;
+   }
+
+   /* allocate and init rule */
+   newRule = kmalloc(sizeof *newRule, GFP_USER);
+   if (newRule == NULL) {
+      LOG(2, (KERN_INFO "vnet filter mem alloc failed for rule\n"));
+      return -ENOMEM;
+   }
+   memset(newRule, 0, sizeof *newRule);
+
+   newRule->action = (uint16)rule->action;
+   newRule->direction = (uint16)rule->direction;
+   newRule->proto = (uint16)rule->proto;
+   newRule->ipVersion = 6;
+
+   newRule->addressListLen = (uint8)rule->addressListLen;
+   if (newRule->addressListLen == 1 &&
+       addressList[0].ipv6RemotePrefixLen == 0) {
+      newRule->addressListLen = 0;
+      LOG(2, (KERN_INFO "vnet filter address has single don't care rule\n"));
+   }
+
+   if (newRule->addressListLen > 0) {
       uint32 i;
 
-      newRule->portList =
-         kmalloc(sizeof(*newRule->portList) * newRule->portListLen, GFP_USER);
-      if (newRule->portList == NULL) {
-         LOG(2, (KERN_INFO "vnet filter mem alloc failed for rule port\n"));
+      newRule->address6List =
+         kmalloc(sizeof(*newRule->address6List) * newRule->addressListLen,
+                 GFP_USER);
+      if (newRule->address6List == NULL) {
+         LOG(2, (KERN_INFO "vnet filter mem alloc failed for rule address\n"));
          DeleteRule(newRule);
          return -ENOMEM;
       }
 
-      /* could use memcpy(), but this insulates against API changes */
-      for (i = 0; i < newRule->portListLen; ++i) {
-         newRule->portList[i].localPortLow   = portList[i].localPortLow;
-         newRule->portList[i].localPortHigh  = portList[i].localPortHigh;
-         newRule->portList[i].remotePortLow  = portList[i].remotePortLow;
-         newRule->portList[i].remotePortHigh = portList[i].remotePortHigh;
+      for (i = 0; i < newRule->addressListLen; ++i) {
+         RuleAddr6 *addr = newRule->address6List + i;
+         const uint8 *bytes = addressList[i].ipv6RemoteAddr;
+         uint32 prefixLen = addressList[i].ipv6RemotePrefixLen;
+         uint32 j;
+
+         addr->addrHi = 0;
+         addr->addrLo = 0;
+         for (j = 0; j < 8; j++) {
+            addr->addrHi = addr->addrHi << 8 | bytes[j];
+            addr->addrLo = addr->addrLo << 8 | bytes[j + 8];
+         }
+         addr->maskHi = prefixLen >= 64 ? ~(uint64)0 :
+                        prefixLen == 0 ? 0 : ~(uint64)0 << (64 - prefixLen);
+         addr->maskLo = prefixLen >= 128 ? ~(uint64)0 :
+                        prefixLen <= 64 ? 0 : ~(uint64)0 << (128 - prefixLen);
+         addr->addrHi &= addr->maskHi;
+         addr->addrLo &= addr->maskLo;
       }
    }
 
-   LOG(2, (KERN_INFO "adding rule with %u addresses and %u ports\n",
-           newRule->addressListLen, newRule->portListLen));
+   if (SetRulePorts(newRule, rule->portListLen, portList) != 0) {
+      DeleteRule(newRule);
+      return -ENOMEM;
+   }
 
-   /* add rule to rule set */
-   newRule->next = NULL;
-   *(curr->tail) = newRule;
-   curr->tail = &(newRule->next);
-   ++curr->numRules;
+   return AppendRule(curr, newRule);
+}
 
-   LOG(2, (KERN_INFO "Added rule %p to set %p, count now %u\n",
-           newRule, curr, curr->numRules));
 
-   return 0;
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ValidateRuleProtoPorts --
+ *
+ *      Check the protocol and port list of an add rule request. The
+ *      port list format is the same for IPv4 and IPv6 rules.
+ *
+ * Returns:
+ *      TRUE if valid, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+ValidateRuleProtoPorts(uint32 proto,             // IN: protocol of rule
+                       uint32 portListLen,       // IN: entries in portList
+                       VNet_IPv4Port *portList)  // IN: list of ports
+{
+   uint32 i;
+
+   if (proto > 0xFF && proto != (uint16)~0) {
+      LOG(2, (KERN_INFO "add filter rule got invalid proto %u\n", proto));
+      return FALSE;
+   }
+
+   if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+
+      for (i = 0; i < portListLen; i++) {
+
+         if (portList[i].localPortLow > 0xFFFF &&
+             portList[i].localPortLow != ~0) {
+            LOG(2, (KERN_INFO "add filter rule invalid localPortLow %u\n",
+                    portList[i].localPortLow));
+            return FALSE;
+         }
+         if (portList[i].localPortHigh > 0xFFFF &&
+             portList[i].localPortHigh != ~0) {
+            LOG(2, (KERN_INFO "add filter rule invalid localPortHigh %u\n",
+                    portList[i].localPortHigh));
+            return FALSE;
+         }
+         if (portList[i].remotePortLow > 0xFFFF &&
+             portList[i].remotePortLow != ~0) {
+            LOG(2, (KERN_INFO "add filter rule invalid remotePortLow %u\n",
+                    portList[i].remotePortLow));
+            return FALSE;
+         }
+         if (portList[i].remotePortHigh > 0xFFFF &&
+             portList[i].remotePortHigh != ~0) {
+            LOG(2, (KERN_INFO "add filter rule invalid remotePortHigh %u\n",
+                    portList[i].remotePortHigh));
+            return FALSE;
+         }
+
+         /*
+          * Make sure both low and high ports of a port range specify don't
+          * care ports.
+          */
+         if ((portList[i].localPortLow   == ~0 && portList[i].localPortHigh  != ~0) ||
+             (portList[i].localPortLow   != ~0 && portList[i].localPortHigh  == ~0) ||
+             (portList[i].remotePortLow  == ~0 && portList[i].remotePortHigh != ~0) ||
+             (portList[i].remotePortLow  != ~0 && portList[i].remotePortHigh == ~0)) {
+            LOG(2, (KERN_INFO "add filter rule mismatch in don't care "
+                    "status of ports\n"));
+            LOG(2, (KERN_INFO " -- srcLow %u srcHigh %u dstLow %u dstHigh %u\n",
+                    portList[i].localPortLow, portList[i].localPortHigh,
+                    portList[i].remotePortLow, portList[i].remotePortHigh));
+            return FALSE;
+         }
+         if (portList[i].localPortHigh  < portList[i].localPortLow ||
+             portList[i].remotePortHigh < portList[i].remotePortLow) {
+            LOG(2, (KERN_INFO "add filter rule high < low on ports\n"));
+            LOG(2, (KERN_INFO " -- srcLow %u srcHigh %u dstLow %u dstHigh %u\n",
+                    portList[i].localPortLow,  portList[i].localPortHigh,
+                    portList[i].remotePortLow, portList[i].remotePortHigh));
+            return FALSE;
+         }
+         /*
+          * Only allow a don't care on port ranges when it is the only port
+          * range specified.
+          */
+         if (portList[i].localPortLow   == ~0 && portList[i].localPortHigh  == ~0 &&
+             portList[i].remotePortLow  == ~0 && portList[i].remotePortHigh == ~0 &&
+             (i > 0 || portListLen > 1)) {
+            LOG(2, (KERN_INFO "add filter rule incorrect don't "
+                    "care on port list\n"));
+            return FALSE;
+         }
+      }
+
+   } else {                  // proto not TCP or UDP
+      if (portListLen != 1 ||
+          (portList[0].localPortLow   !=  0 &&
+           portList[0].localPortLow   != ~0) ||
+          (portList[0].localPortHigh  !=  0 &&
+           portList[0].localPortHigh  != ~0) ||
+          (portList[0].remotePortLow  !=  0 &&
+           portList[0].remotePortLow  != ~0) ||
+          (portList[0].remotePortHigh !=  0 &&
+           portList[0].remotePortHigh != ~0)) {
+         LOG(2, (KERN_INFO "add filter rule missing/unnecessary port "
+                 "information\n"));
+         for (i = 0; i < portListLen; i++) {
+            LOG(2, (KERN_INFO " -- srcLow %u srcHigh %u dstLow %u dstHigh %u\n",
+                    portList[i].localPortLow,  portList[i].localPortHigh,
+                    portList[i].remotePortLow, portList[i].remotePortHigh));
+         }
+         return FALSE;
+      }
+   }
+   return TRUE;
 }
 
 
@@ -1360,112 +2619,134 @@ VNetFilter_HandleUserCall(VNet_RuleHeader *ruleHeader,      // IN: command heade
             }
          }
 
-         if (addRequest->proto > 0xFF && addRequest->proto != (uint16)~0) {
-            LOG(2, (KERN_INFO "add filter rule got invalid proto %u\n",
-                    addRequest->proto));
+         if (!ValidateRuleProtoPorts(addRequest->proto, addRequest->portListLen,
+                                     portList)) {
             goto out_error;
          }
+         retval = AddIPv4Rule(addRequest->ruleSetId, addRequest,
+                              addressList, portList);
+         kfree(addRequest);
+         goto out_unlock;
+out_error:
+         kfree(addRequest);
+         retval = error;
+         goto out_unlock;
+      }
 
-         if (addRequest->proto == IPPROTO_TCP ||
-             addRequest->proto == IPPROTO_UDP) {
-
-            for (i = 0; i < addRequest->portListLen; i++) {
-
-               if (portList[i].localPortLow > 0xFFFF &&
-                   portList[i].localPortLow != ~0) {
-                  LOG(2, (KERN_INFO "add filter rule invalid localPortLow %u\n",
-                          portList[i].localPortLow));
-                  goto out_error;
-               }
-               if (portList[i].localPortHigh > 0xFFFF &&
-                   portList[i].localPortHigh != ~0) {
-                  LOG(2, (KERN_INFO "add filter rule invalid localPortHigh %u\n",
-                          portList[i].localPortHigh));
-                  goto out_error;
-               }
-               if (portList[i].remotePortLow > 0xFFFF &&
-                   portList[i].remotePortLow != ~0) {
-                  LOG(2, (KERN_INFO "add filter rule invalid remotePortLow %u\n",
-                          portList[i].remotePortLow));
-                  goto out_error;
-               }
-               if (portList[i].remotePortHigh > 0xFFFF &&
-                   portList[i].remotePortHigh != ~0) {
-                  LOG(2, (KERN_INFO "add filter rule invalid remotePortHigh %u\n",
-                          portList[i].remotePortHigh));
-                  goto out_error;
-               }
-
-               /*
-                * Make sure both low and high ports of a port range specify don't
-                * care ports.
-                */
-               if ((portList[i].localPortLow   == ~0 && portList[i].localPortHigh  != ~0) ||
-                   (portList[i].localPortLow   != ~0 && portList[i].localPortHigh  == ~0) ||
-                   (portList[i].remotePortLow  == ~0 && portList[i].remotePortHigh != ~0) ||
-                   (portList[i].remotePortLow  != ~0 && portList[i].remotePortHigh == ~0)) {
-                  LOG(2, (KERN_INFO "add filter rule mismatch in don't care "
-                          "status of ports\n"));
-                  LOG(2, (KERN_INFO " -- srcLow %u srcHigh %u dstLow %u dstHigh %u\n",
-                          portList[i].localPortLow, portList[i].localPortHigh,
-                          portList[i].remotePortLow, portList[i].remotePortHigh));
-                  goto out_error;
-               }
-               if (portList[i].localPortHigh  < portList[i].localPortLow ||
-                   portList[i].remotePortHigh < portList[i].remotePortLow) {
-                  LOG(2, (KERN_INFO "add filter rule high < low on ports\n"));
-                  LOG(2, (KERN_INFO " -- srcLow %u srcHigh %u dstLow %u dstHigh %u\n",
-                          portList[i].localPortLow,  portList[i].localPortHigh,
-                          portList[i].remotePortLow, portList[i].remotePortHigh));
-                  goto out_error;
-               }
-               /*
-                * Only allow a don't care on port ranges when it is the only port
-                * range specified.
-                */
-               if (portList[i].localPortLow   == ~0 && portList[i].localPortHigh  == ~0 &&
-                   portList[i].remotePortLow  == ~0 && portList[i].remotePortHigh == ~0 &&
-                   (i > 0 || addRequest->portListLen > 1)) {
-                  LOG(2, (KERN_INFO "add filter rule incorrect don't "
-                          "care on port list\n"));
-                  goto out_error;
-               }
-            }
+      case VNET_FILTER_CMD_ADD_IPV6_RULE: {
+         VNet_AddIPv6Rule *addRequest;
+         VNet_IPv6Address *addressList = NULL;
+         VNet_IPv6Port *portList = NULL;
+         int error = -EINVAL;
+         uint32 i;
 
-         } else {                  // proto not TCP or UDP
-            if (addRequest->portListLen != 1 ||
-                (portList[0].localPortLow   !=  0 &&
-                 portList[0].localPortLow   != ~0) ||
-                (portList[0].localPortHigh  !=  0 &&
-                 portList[0].localPortHigh  != ~0) ||
-                (portList[0].remotePortLow  !=  0 &&
-                 portList[0].remotePortLow  != ~0) ||
-                (portList[0].remotePortHigh !=  0 &&
-                 portList[0].remotePortHigh != ~0)) {
-               LOG(2, (KERN_INFO "add filter rule missing/unnecessary port "
-                       "information\n"));
-               for (i = 0; i < addRequest->portListLen; i++) {
-                  LOG(2, (KERN_INFO " -- srcLow %u srcHigh %u dstLow %u dstHigh %u\n",
-                          portList[i].localPortLow,  portList[i].localPortHigh,
-                          portList[i].remotePortLow, portList[i].remotePortHigh));
-               }
-               goto out_error;
+         /* Validate size. */
+         if (ruleHeader->len < sizeof *addRequest) {
+            LOG(2, (KERN_INFO "short length %d/%zd for add IPv6 filter rule "
+                    "request\n", ruleHeader->len,
+                    sizeof *addRequest));
+            retval = -EINVAL;
+            goto out_unlock;
+         }
+         if (ruleHeader->len > (sizeof *addRequest +
+                                (sizeof *addressList * MAX_ADDR_PER_RULE) +
+                                (sizeof *portList * MAX_PORT_PER_RULE))) {
+            LOG(2, (KERN_INFO "long length %d for add IPv6 filter rule "
+                    "request\n", ruleHeader->len));
+            retval = -EINVAL;
+            goto out_unlock;
+         }
+         addRequest = kmalloc(ruleHeader->len, GFP_USER);
+         if (!addRequest) {
+            LOG(2, (KERN_INFO "couldn't allocate memory to add filter rule\n"));
+            retval = -ENOMEM;
+            goto out_unlock;
+         }
+
+         if (copy_from_user(addRequest, (void *)ioarg, ruleHeader->len)) {
+            error = -EFAULT;
+            goto out_error6;
+         }
+         if (addRequest->addressListLen <= 0 ||
+             addRequest->addressListLen > MAX_ADDR_PER_RULE) {
+            LOG(2, (KERN_INFO "add IPv6 filter rule: invalid addr list "
+                    "length: %u\n", addRequest->addressListLen));
+            goto out_error6;
+         }
+         if (addRequest->portListLen <= 0 ||
+             addRequest->portListLen > MAX_PORT_PER_RULE) {
+            LOG(2, (KERN_INFO "add IPv6 filter rule: invalid port list "
+                    "length: %u\n", addRequest->portListLen));
+            goto out_error6;
+         }
+         if (addRequest->header.len != ruleHeader->len ||
+             addRequest->header.len !=
+             (sizeof *addRequest +
+              addRequest->addressListLen * sizeof(VNet_IPv6Address) +
+              addRequest->portListLen * sizeof(VNet_IPv6Port))) {
+            LOG(2, (KERN_INFO "add IPv6 filter rule: invalid length: %u\n",
+                    addRequest->header.len));
+            goto out_error6;
+         }
+
+         /*
+          * The address list comes after initial struct, and port
+          * list follows the address list.
+          */
+         addressList = (VNet_IPv6Address *)(addRequest + 1);
+         portList = (VNet_IPv6Port *)(addressList + addRequest->addressListLen);
+
+         if (addRequest->ruleSetId == 0) {
+            LOG(2, (KERN_INFO "add IPv6 filter rule: invalid request id %u\n",
+                    addRequest->ruleSetId));
+            goto out_error6;
+         }
+         if (addRequest->action != VNET_FILTER_RULE_BLOCK &&
+             addRequest->action != VNET_FILTER_RULE_ALLOW) {
+            LOG(2, (KERN_INFO "add IPv6 filter rule: invalid action %u\n",
+                    addRequest->action));
+            goto out_error6;
+         }
+         if (addRequest->direction != VNET_FILTER_DIRECTION_IN &&
+             addRequest->direction != VNET_FILTER_DIRECTION_OUT &&
+             addRequest->direction != VNET_FILTER_DIRECTION_BOTH) {
+            LOG(2, (KERN_INFO "add IPv6 filter rule: invalid direction %u\n",
+                    addRequest->direction));
+            goto out_error6;
+         }
+
+         /*
+          * A zero prefix length (don't care) is only allowed as the sole
+          * element of the address list.
+          */
+         for (i = 0; i < addRequest->addressListLen; i++) {
+            if (addressList[i].ipv6RemotePrefixLen > 128) {
+               LOG(2, (KERN_INFO "add IPv6 filter rule got prefix length %u "
+                       "for %u\n", addressList[i].ipv6RemotePrefixLen, i));
+               goto out_error6;
+            }
+            if (addressList[i].ipv6RemotePrefixLen == 0 &&
+                (i > 0 || addRequest->addressListLen > 1)) {
+               LOG(2, (KERN_INFO "add IPv6 filter rule got violation for zero "
+                       "prefix length\n"));
+               goto out_error6;
             }
          }
-         retval = AddIPv4Rule(addRequest->ruleSetId, addRequest,
+
+         if (!ValidateRuleProtoPorts(addRequest->proto, addRequest->portListLen,
+                                     portList)) {
+            goto out_error6;
+         }
+         retval = AddIPv6Rule(addRequest->ruleSetId, addRequest,
                               addressList, portList);
+         kfree(addRequest);
          goto out_unlock;
-out_error:
+out_error6:
          kfree(addRequest);
          retval = error;
          goto out_unlock;
       }
 
-      case VNET_FILTER_CMD_ADD_IPV6_RULE:
-         LOG(2, (KERN_INFO "add filter rule IPv6 not supported\n"));
-         retval = -EPROTONOSUPPORT;
-         goto out_unlock;
-         
       case VNET_FILTER_CMD_SET_LOG_LEVEL: {
          VNet_SetLogLevel setLogLevel;
          
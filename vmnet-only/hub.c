@@ -33,22 +33,58 @@
 #include <linux/if_ether.h>
 #include <linux/sockios.h>
 #include "compat_sock.h"
+#include "compat_spinlock.h"
 
 #define __KERNEL_SYSCALLS__
 #include <asm/io.h>
 
 #include <linux/proc_fs.h>
 #include <linux/file.h>
+#include <linux/bitmap.h>
+#include <linux/jhash.h>
+#include <linux/seqlock.h>
 
 #include "vnetInt.h"
 
 #define HUB_TYPE_VNET         0x1
 #define HUB_TYPE_PVN          0x2
 
+/*
+ * Forwarding database: source MACs are learned per jack so that known
+ * unicast is sent to a single jack instead of being flooded. The table
+ * is a set-associative hash; entries expire after VNET_HUB_FDB_AGE and
+ * are refreshed at most every VNET_HUB_FDB_REFRESH to keep writes off
+ * the common path.
+ */
+
+#define VNET_HUB_FDB_BUCKETS  256  // must be a power of 2
+#define VNET_HUB_FDB_WAYS     4
+#define VNET_HUB_FDB_AGE      (300 * HZ)
+#define VNET_HUB_FDB_REFRESH  HZ
+
+typedef struct VNetHubFdbEntry {
+   uint8         mac[ETH_ALEN];
+   int16         jack;                     // jack index, -1 if unused
+   uint16        vid;                      // VLAN the address is in
+   unsigned long stamp;                    // jiffies when last learned
+} VNetHubFdbEntry;
+
 typedef struct VNetHubStats {
    unsigned      tx;
+   unsigned      vlanDrop;                 // frames not allowed on the jack
 } VNetHubStats;
 
+/*
+ * VLAN membership of a jack, see VNet_VlanConfig. VLAN-unaware jacks have
+ * none. Published with RCU so that the forwarding path takes no lock.
+ */
+
+typedef struct VNetHubVlan {
+   uint32        mode;                     // VNET_VLAN_ACCESS or _TRUNK
+   uint16        pvid;                     // untagged VLAN, 0 for none
+   unsigned long members[BITS_TO_LONGS(VNET_VLAN_N_VID)]; // tagged VLANs
+} VNetHubVlan;
+
 typedef struct VNetHub {
    uint32        hubType;                  // HUB_TYPE_xxx
    union {
@@ -57,11 +93,17 @@ typedef struct VNetHub {
    } id;
    Bool		 used[NUM_JACKS_PER_HUB];  // tracks which jacks in use
    VNetJack      jack[NUM_JACKS_PER_HUB];  // jacks for the hub
-   VNetHubStats  stats[NUM_JACKS_PER_HUB]; // stats for the jacks
+   VNetHubStats *stats;                    // per-CPU stats for the jacks
    int           totalPorts;               // num devices reachable from hub
    int           myGeneration;             // used for cycle detection
    struct VNetHub *next;                   // next hub in linked list
    VNetEvent_Mechanism *eventMechanism;    // event notification mechanism
+   seqlock_t     fdbLock;                  // writers of fdb, readers retry
+   VNetHubFdbEntry *fdb;                   // forwarding database
+   VNetHubVlan  *vlan[NUM_JACKS_PER_HUB];  // RCU, NULL if VLAN-unaware
+   int           vlanJacks;                // jacks with a VLAN membership
+   VNetTap      *tap;                      // RCU, capture tap or NULL
+   int           tapJack;                  // jack the tap was set through
 } VNetHub;
 
 static VNetJack *VNetHubAlloc(Bool allocPvn, int hubNum,
@@ -69,6 +111,8 @@ static VNetJack *VNetHubAlloc(Bool allocPvn, int hubNum,
 static void VNetHubFree(VNetJack *this);
 static void VNetHubReceive(VNetJack *this, struct sk_buff *skb);
 static Bool VNetHubCycleDetect(VNetJack *this, int generation);
+static void VNetHubFdbFlushJack(VNetHub *hub, int index);
+static void VNetHubDetachTap(VNetHub *hub, int index);
 static void VNetHubPortsChanged(VNetJack *this);
 static int  VNetHubIsBridged(VNetJack *this);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
@@ -315,6 +359,25 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
          LOG(1, (KERN_DEBUG "/dev/vmnet: no memory to allocate hub %d\n", hubNum));
          return NULL;
       }
+      hub->stats = __alloc_percpu(NUM_JACKS_PER_HUB * sizeof *hub->stats,
+                                  __alignof__(VNetHubStats));
+      if (hub->stats == NULL) {
+         LOG(1, (KERN_DEBUG "/dev/vmnet: no memory to allocate hub %d\n", hubNum));
+         kfree(hub);
+         return NULL;
+      }
+      hub->fdb = kmalloc(VNET_HUB_FDB_BUCKETS * VNET_HUB_FDB_WAYS *
+                         sizeof *hub->fdb, GFP_KERNEL);
+      if (hub->fdb == NULL) {
+         LOG(1, (KERN_DEBUG "/dev/vmnet: no memory to allocate hub %d\n", hubNum));
+         VNET_STATS_FREE(hub->stats);
+         kfree(hub);
+         return NULL;
+      }
+      for (i = 0; i < VNET_HUB_FDB_BUCKETS * VNET_HUB_FDB_WAYS; i++) {
+         hub->fdb[i].jack = -1;
+      }
+      seqlock_init(&hub->fdbLock);
       for (i = 0; i < NUM_JACKS_PER_HUB; i++) {
          jack = &hub->jack[i];
 
@@ -340,10 +403,10 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
          jack->cycleDetect = VNetHubCycleDetect;
          jack->portsChanged = VNetHubPortsChanged;
          jack->isBridged = VNetHubIsBridged;
-
-         memset(&hub->stats[i], 0, sizeof hub->stats[i]);
+         jack->isPromisc = NULL;
 
 	 hub->used[i] = FALSE;
+	 hub->vlan[i] = NULL;
       }
 
       if (allocPvn) {
@@ -357,11 +420,16 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
       hub->next = NULL;
       hub->totalPorts = 0;
       hub->myGeneration = 0;
+      hub->vlanJacks = 0;
+      hub->tap = NULL;
+      hub->tapJack = -1;
 
       /* create event mechanism */
       retval = VNetEvent_CreateMechanism(&hub->eventMechanism);
       if (retval != 0) {
          LOG(1, (KERN_DEBUG "can't create event mechanism (%d)\n", retval));
+         kfree(hub->fdb);
+         VNET_STATS_FREE(hub->stats);
          kfree(hub);
          return NULL;
       }
@@ -373,6 +441,8 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
 	  * and use already present hub.
 	  */
 
+	 kfree(hub->fdb);
+	 VNET_STATS_FREE(hub->stats);
 	 kfree(hub);
 	 hub = allocPvn ? VNetHubFindHubByID(id) : VNetHubFindHubByNum(hubNum);
       } else {
@@ -446,6 +516,7 @@ void
 VNetHubFree(VNetJack *this)
 {
    VNetHub *hub = (VNetHub*)this->private;
+   VNetHubVlan *vlan;
    int i = 0;
    int retval;
    unsigned long flags;
@@ -462,6 +533,22 @@ VNetHubFree(VNetJack *this)
 
    this->private = NULL;
 
+   VNetHubFdbFlushJack(hub, this->index);
+
+   spin_lock_irqsave(&vnetHubLock, flags);
+   vlan = hub->vlan[this->index];
+   if (vlan) {
+      rcu_assign_pointer(hub->vlan[this->index], NULL);
+      hub->vlanJacks--;
+   }
+   spin_unlock_irqrestore(&vnetHubLock, flags);
+   if (vlan) {
+      synchronize_rcu();
+      kfree(vlan);
+   }
+
+   VNetHubDetachTap(hub, this->index);
+
    spin_lock_irqsave(&vnetHubLock, flags);
 
    hub->used[this->index] = FALSE;
@@ -483,6 +570,8 @@ VNetHubFree(VNetJack *this)
    }
    hub->eventMechanism = NULL;
 
+   kfree(hub->fdb);
+   VNET_STATS_FREE(hub->stats);
    kfree(hub);
 }
 
@@ -549,6 +638,626 @@ VNetHub_CreateListener(VNetJack *jack,         // IN: a jack to a hub
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubFdbBucket --
+ *
+ *      Find the forwarding database bucket for a MAC address in a VLAN.
+ *
+ * Results:
+ *      Pointer to the first entry of the bucket.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE VNetHubFdbEntry *
+VNetHubFdbBucket(VNetHub *hub,     // IN: hub
+                 const uint8 *mac, // IN: MAC address
+                 uint16 vid)       // IN: VLAN, 0 if none
+{
+   uint32 hash = jhash(mac, ETH_ALEN, vid) & (VNET_HUB_FDB_BUCKETS - 1);
+   return &hub->fdb[hash * VNET_HUB_FDB_WAYS];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubFdbLookup --
+ *
+ *      Find the jack a unicast MAC address was last seen on in a VLAN.
+ *      Does not take any lock.
+ *
+ * Results:
+ *      Index of the jack, or -1 if the address is unknown or expired.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE int
+VNetHubFdbLookup(VNetHub *hub,     // IN: hub
+                 const uint8 *mac, // IN: MAC address
+                 uint16 vid)       // IN: VLAN, 0 if none
+{
+   const VNetHubFdbEntry *bucket = VNetHubFdbBucket(hub, mac, vid);
+   unsigned seq;
+   int jack;
+   int i;
+
+   do {
+      seq = read_seqbegin(&hub->fdbLock);
+      jack = -1;
+      for (i = 0; i < VNET_HUB_FDB_WAYS; i++) {
+         if (bucket[i].jack >= 0 && bucket[i].vid == vid &&
+             MAC_EQ(bucket[i].mac, mac)) {
+            if (time_before(jiffies, bucket[i].stamp + VNET_HUB_FDB_AGE)) {
+               jack = bucket[i].jack;
+            }
+            break;
+         }
+      }
+   } while (read_seqretry(&hub->fdbLock, seq));
+
+   return jack;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubFdbLearn --
+ *
+ *      Record that a source MAC address was seen on a jack in a VLAN.
+ *      Entries that are already up to date are detected without taking
+ *      the lock.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May replace the oldest entry of the bucket.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetHubFdbLearn(VNetHub *hub,     // IN: hub
+                const uint8 *mac, // IN: source MAC address
+                uint16 vid,       // IN: VLAN, 0 if none
+                int index)        // IN: jack the address was seen on
+{
+   VNetHubFdbEntry *bucket;
+   VNetHubFdbEntry *victim;
+   unsigned long flags;
+   unsigned seq;
+   Bool fresh;
+   int i;
+
+   if (mac[0] & 0x1) {
+      return; // never learn group addresses
+   }
+
+   bucket = VNetHubFdbBucket(hub, mac, vid);
+   do {
+      seq = read_seqbegin(&hub->fdbLock);
+      fresh = FALSE;
+      for (i = 0; i < VNET_HUB_FDB_WAYS; i++) {
+         if (bucket[i].jack == index && bucket[i].vid == vid &&
+             MAC_EQ(bucket[i].mac, mac)) {
+            fresh = time_before(jiffies,
+                                  bucket[i].stamp + VNET_HUB_FDB_REFRESH);
+            break;
+         }
+      }
+   } while (read_seqretry(&hub->fdbLock, seq));
+
+   if (fresh) {
+      return;
+   }
+
+   write_seqlock_irqsave(&hub->fdbLock, flags);
+   victim = &bucket[0];
+   for (i = 0; i < VNET_HUB_FDB_WAYS; i++) {
+      if (bucket[i].jack >= 0 && bucket[i].vid == vid &&
+          MAC_EQ(bucket[i].mac, mac)) {
+         victim = &bucket[i];
+         break;
+      }
+      if (bucket[i].jack < 0) {
+         victim = &bucket[i];
+      } else if (victim->jack >= 0 &&
+                 time_before(bucket[i].stamp, victim->stamp)) {
+         victim = &bucket[i];
+      }
+   }
+   memcpy(victim->mac, mac, ETH_ALEN);
+   victim->vid = vid;
+   victim->jack = index;
+   victim->stamp = jiffies;
+   write_sequnlock_irqrestore(&hub->fdbLock, flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubFdbFlushJack --
+ *
+ *      Forget all addresses learned on a jack, in any VLAN.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetHubFdbFlushJack(VNetHub *hub, // IN: hub
+                    int index)    // IN: jack index
+{
+   unsigned long flags;
+   int i;
+
+   write_seqlock_irqsave(&hub->fdbLock, flags);
+   for (i = 0; i < VNET_HUB_FDB_BUCKETS * VNET_HUB_FDB_WAYS; i++) {
+      if (hub->fdb[i].jack == index) {
+         hub->fdb[i].jack = -1;
+      }
+   }
+   write_sequnlock_irqrestore(&hub->fdbLock, flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubFrameTci --
+ *
+ *      Reads the 802.1Q tag of a frame, either from the skb (tags
+ *      stripped by the NIC or the receive path) or from the frame data.
+ *
+ * Results:
+ *      TRUE if the frame is tagged, *tci is set to its tag control
+ *      information. FALSE otherwise, *tci is 0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetHubFrameTci(struct sk_buff *skb, // IN
+                uint16 *tci)         // OUT
+{
+   struct vlan_ethhdr buf;
+   const struct vlan_ethhdr *veth;
+
+   if (compat_skb_vlan_tag_present(skb)) {
+      *tci = compat_skb_vlan_tag_get(skb);
+      return TRUE;
+   }
+   veth = skb_header_pointer(skb, 0, sizeof buf, &buf);
+   if (veth && veth->h_vlan_proto == htons(ETH_P_8021Q)) {
+      *tci = ntohs(veth->h_vlan_TCI);
+      return TRUE;
+   }
+   *tci = 0;
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubVlanIngress --
+ *
+ *      Classifies a frame received on a jack into a VLAN. Untagged and
+ *      priority tagged frames belong to the jack's pvid; tagged frames
+ *      are only accepted by trunks that carry their VLAN. A VLAN-unaware
+ *      jack is an access port of VLAN 0, so it may not send tagged
+ *      frames into the VLANs of the hub.
+ *
+ * Results:
+ *      TRUE and the tag the frame is forwarded with in *tci, or FALSE if
+ *      the jack may not send the frame. A tci with VLAN 0 means the
+ *      frame is in no VLAN and only reaches VLAN-unaware jacks.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetHubVlanIngress(const VNetHubVlan *vlan, // IN: NULL if VLAN-unaware
+                   struct sk_buff *skb,     // IN
+                   uint16 *tci)             // OUT
+{
+   uint16 frameTci;
+   Bool tagged = VNetHubFrameTci(skb, &frameTci);
+   uint16 vid = frameTci & VLAN_VID_MASK;
+
+   if (tagged && vid != 0) {
+      if (vlan == NULL || vlan->mode != VNET_VLAN_TRUNK ||
+          !test_bit(vid, vlan->members)) {
+         return FALSE;
+      }
+      *tci = frameTci;
+      return TRUE;
+   }
+   if (vlan == NULL) {
+      *tci = frameTci;
+      return TRUE;
+   }
+   if (vlan->pvid == 0) {
+      return FALSE;
+   }
+   *tci = (frameTci & ~VLAN_VID_MASK) | vlan->pvid;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubVlanEgress --
+ *
+ *      Decides whether a frame classified with tci goes out on a jack,
+ *      and whether it does so tagged. VLAN-unaware jacks only get the
+ *      frames of VLAN 0, that is those of other VLAN-unaware jacks.
+ *
+ * Results:
+ *      TRUE if the jack is in the frame's VLAN, *tag tells whether the
+ *      frame must carry a tag. FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetHubVlanEgress(const VNetHubVlan *vlan, // IN: NULL if VLAN-unaware
+                  uint16 tci,              // IN
+                  Bool *tag)               // OUT
+{
+   uint16 vid = tci & VLAN_VID_MASK;
+
+   if (vlan == NULL) {
+      *tag = FALSE;
+      return vid == 0;
+   }
+   if (vid == 0) {
+      return FALSE;
+   }
+   if (vid == vlan->pvid) {
+      *tag = FALSE;
+      return TRUE;
+   }
+   if (vlan->mode == VNET_VLAN_TRUNK && test_bit(vid, vlan->members)) {
+      *tag = TRUE;
+      return TRUE;
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubVlanTag --
+ *
+ *      Puts a frame copy into the form a jack expects: with tci as an
+ *      in-band 802.1Q tag, or untagged. An accelerated tag is always
+ *      folded into the frame data, as the peers only look at the data.
+ *      Only the MAC addresses move, so the network header and checksum
+ *      offsets stay valid.
+ *
+ * Results:
+ *      The frame, or NULL if it had to be dropped.
+ *
+ * Side effects:
+ *      Unshares the header of skb if it needs to change. Frees skb on
+ *      failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static struct sk_buff *
+VNetHubVlanTag(struct sk_buff *skb, // IN
+               uint16 tci,          // IN
+               Bool tag)            // IN: TRUE to tag, FALSE to untag
+{
+   struct vlan_ethhdr *veth;
+   uint16 frameTci;
+   Bool inband;
+
+   if (compat_skb_vlan_tag_present(skb)) {
+      compat_skb_vlan_tag_clear(skb);
+      inband = FALSE;
+   } else {
+      inband = VNetHubFrameTci(skb, &frameTci);
+   }
+   if (!inband && !tag) {
+      return skb;
+   }
+
+   if (!pskb_may_pull(skb, inband ? VLAN_ETH_HLEN : ETH_HLEN) ||
+       skb_cow_head(skb, inband ? 0 : VLAN_HLEN)) {
+      dev_kfree_skb(skb);
+      return NULL;
+   }
+   if (inband && !tag) {
+      memmove(skb->data + VLAN_HLEN, skb->data, 2 * ETH_ALEN);
+      __skb_pull(skb, VLAN_HLEN);
+   } else {
+      if (!inband) {
+         __skb_push(skb, VLAN_HLEN);
+         memmove(skb->data, skb->data + VLAN_HLEN, 2 * ETH_ALEN);
+      }
+      veth = (struct vlan_ethhdr *)skb->data;
+      veth->h_vlan_proto = htons(ETH_P_8021Q);
+      veth->h_vlan_TCI = htons(tci);
+   }
+#if defined(CHECKSUM_COMPLETE)
+   if (skb->ip_summed == CHECKSUM_COMPLETE) {
+      skb->ip_summed = CHECKSUM_NONE;
+   }
+#endif
+   skb->protocol = ((struct ethhdr *)skb->data)->h_proto;
+   compat_skb_reset_mac_header(skb);
+   return skb;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHub_SetVlan --
+ *
+ *      Sets the VLAN membership of a hub jack, see VNet_VlanConfig.
+ *
+ * Results:
+ *      0 on success, -EINVAL if the jack is not a hub jack or the
+ *      configuration is invalid, -ENOMEM.
+ *
+ * Side effects:
+ *      Forgets the addresses learned on the jack.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetHub_SetVlan(VNetJack *jack,              // IN: a jack of a hub
+                const VNet_VlanConfig *vc)   // IN: new configuration
+{
+   VNetHub *hub;
+   VNetHubVlan *vlan = NULL;
+   VNetHubVlan *old;
+   unsigned long flags;
+   int i;
+
+   if (jack == NULL || jack->rcv != VNetHubReceive || jack->private == NULL) {
+      return -EINVAL;
+   }
+   hub = (VNetHub*)jack->private;
+
+   if (vc->version != VNET_VLAN_VERSION) {
+      return -EINVAL;
+   }
+   switch (vc->mode) {
+   case VNET_VLAN_NONE:
+      break;
+   case VNET_VLAN_ACCESS:
+      if (vc->pvid == 0) {
+         return -EINVAL;
+      }
+      /* fall thru */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+      fallthrough;
+#endif
+   case VNET_VLAN_TRUNK:
+      if (vc->pvid >= VLAN_VID_MASK) {
+         return -EINVAL;
+      }
+      break;
+   default:
+      return -EINVAL;
+   }
+
+   if (vc->mode != VNET_VLAN_NONE) {
+      vlan = kmalloc(sizeof *vlan, GFP_KERNEL);
+      if (vlan == NULL) {
+         return -ENOMEM;
+      }
+      vlan->mode = vc->mode;
+      vlan->pvid = vc->pvid;
+      bitmap_zero(vlan->members, VNET_VLAN_N_VID);
+      if (vc->mode == VNET_VLAN_TRUNK) {
+         /* VLANs 0 and 4095 are reserved. */
+         for (i = 1; i < VLAN_VID_MASK; i++) {
+            if (vc->members[i / 8] & (1 << (i % 8))) {
+               __set_bit(i, vlan->members);
+            }
+         }
+      }
+   }
+
+   spin_lock_irqsave(&vnetHubLock, flags);
+   old = hub->vlan[jack->index];
+   rcu_assign_pointer(hub->vlan[jack->index], vlan);
+   hub->vlanJacks += (vlan != NULL) - (old != NULL);
+   spin_unlock_irqrestore(&vnetHubLock, flags);
+
+   synchronize_rcu();
+   kfree(old);
+
+   VNetHubFdbFlushJack(hub, jack->index);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHub_SetTap --
+ *
+ *      Attaches a capture tap to the hub of a jack, replacing the tap
+ *      set through the same jack, or detaches it if ts->ringSize is 0.
+ *
+ * Results:
+ *      0 on success, -EINVAL if the jack is not a hub jack or ts is
+ *      invalid, -EBUSY if another jack set the tap, -ENOMEM.
+ *
+ * Side effects:
+ *      Fills in the layout of the rings in ts.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetHub_SetTap(VNetJack *jack,     // IN: a jack of a hub
+               VNet_TapSetup *ts)  // IN/OUT: new configuration
+{
+   VNetHub *hub;
+   VNetTap *tap = NULL;
+   VNetTap *old;
+   unsigned long flags;
+   int retval;
+
+   if (jack == NULL || jack->rcv != VNetHubReceive || jack->private == NULL) {
+      return -EINVAL;
+   }
+   hub = (VNetHub*)jack->private;
+
+   if (ts->ringSize == 0) {
+      VNetHubDetachTap(hub, jack->index);
+      return 0;
+   }
+
+   retval = VNetTap_Create(ts, &tap);
+   if (retval < 0) {
+      return retval;
+   }
+
+   spin_lock_irqsave(&vnetHubLock, flags);
+   old = hub->tap;
+   if (old && hub->tapJack != jack->index) {
+      spin_unlock_irqrestore(&vnetHubLock, flags);
+      VNetTap_Release(tap);
+      return -EBUSY;
+   }
+   rcu_assign_pointer(hub->tap, tap);
+   hub->tapJack = jack->index;
+   spin_unlock_irqrestore(&vnetHubLock, flags);
+
+   if (old) {
+      synchronize_rcu();
+      VNetTap_Release(old);
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubDetachTap --
+ *
+ *      Detaches the capture tap of a hub if it was set through the jack
+ *      of the given index.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetHubDetachTap(VNetHub *hub, // IN
+                 int index)    // IN: jack index
+{
+   VNetTap *tap = NULL;
+   unsigned long flags;
+
+   spin_lock_irqsave(&vnetHubLock, flags);
+   if (hub->tap && hub->tapJack == index) {
+      tap = hub->tap;
+      rcu_assign_pointer(hub->tap, NULL);
+      hub->tapJack = -1;
+   }
+   spin_unlock_irqrestore(&vnetHubLock, flags);
+
+   if (tap) {
+      synchronize_rcu();
+      VNetTap_Release(tap);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHub_MmapTap --
+ *
+ *      Maps the rings of the capture tap of the hub of a jack.
+ *      vnetStructureMutex must be held, so that the jack stays
+ *      connected.
+ *
+ * Results:
+ *      0 on success, -EINVAL if the jack is not a hub jack, -ENXIO if
+ *      the hub has no tap, else -errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetHub_MmapTap(VNetJack *jack,              // IN: a jack of a hub
+                struct vm_area_struct *vma)  // IN
+{
+   VNetHub *hub;
+   VNetTap *tap;
+   unsigned long flags;
+   int retval;
+
+   if (jack == NULL || jack->rcv != VNetHubReceive || jack->private == NULL) {
+      return -EINVAL;
+   }
+   hub = (VNetHub*)jack->private;
+
+   spin_lock_irqsave(&vnetHubLock, flags);
+   tap = hub->tap;
+   if (tap) {
+      VNetTap_Hold(tap);
+   }
+   spin_unlock_irqrestore(&vnetHubLock, flags);
+
+   if (tap == NULL) {
+      return -ENXIO;
+   }
+   retval = VNetTap_Mmap(tap, vma);
+   VNetTap_Release(tap);
+   return retval;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -556,6 +1265,14 @@ VNetHub_CreateListener(VNetJack *jack,         // IN: a jack to a hub
  *
  *      This jack is receiving a packet. Take appropriate action.
  *
+ *      The source MAC is learned on the receiving jack. Unicast to a
+ *      known address goes only to the jack it was learned on (plus any
+ *      promiscuous jacks), everything else is flooded.
+ *
+ *      Once any jack has a VLAN membership, frames are classified into
+ *      a VLAN on the way in, learned and looked up per VLAN, only sent
+ *      to the jacks of that VLAN, and tagged or untagged per jack.
+ *
  * Results:
  *      None.
  *
@@ -570,19 +1287,55 @@ VNetHubReceive(VNetJack       *this, // IN:
                struct sk_buff *skb)  // IN:
 {
    VNetHub *hub = (VNetHub*)this->private;
+   const uint8 *dest = SKB_2_DESTMAC(skb);
    VNetJack *jack;
+   VNetJack *peer;
+   VNetTap *tap;
    struct sk_buff *clone;
+   Bool vlanAware = READ_ONCE(hub->vlanJacks) != 0;
+   Bool tag = FALSE;
+   uint16 tci = 0;
+   int target = -1;
    int i;
 
-   hub->stats[this->index].tx++;
+   VNET_STAT_INC(&hub->stats[this->index], tx);
+
+   if (vlanAware &&
+       !VNetHubVlanIngress(rcu_dereference(hub->vlan[this->index]), skb,
+                           &tci)) {
+      VNET_STAT_INC(&hub->stats[this->index], vlanDrop);
+      dev_kfree_skb(skb);
+      return;
+   }
+
+   /* Only frames the hub forwards are captured. */
+   tap = rcu_dereference(hub->tap);
+   if (tap) {
+      VNetTap_Capture(tap, skb);
+   }
+
+   VNetHubFdbLearn(hub, SKB_2_SRCMAC(skb), tci & VLAN_VID_MASK, this->index);
+   if (!(dest[0] & 0x1)) {
+      target = VNetHubFdbLookup(hub, dest, tci & VLAN_VID_MASK);
+      if (target >= 0 && !rcu_dereference(hub->jack[target].peer)) {
+         target = -1;
+      }
+   }
 
    for (i = 0; i < NUM_JACKS_PER_HUB; i++) {
       jack = &hub->jack[i];
+      peer = rcu_dereference(jack->peer);
       if (jack->private &&   /* allocated */
-          jack->peer &&      /* and connected */
-          jack->peer->rcv && /* and has a receiver */
-          (jack != this)) {  /* and not a loop */
+          peer &&            /* and connected */
+          peer->rcv &&       /* and has a receiver */
+          (jack != this) &&  /* and not a loop */
+          (target < 0 || i == target || VNetIsPromisc(peer)) &&
+          (!vlanAware ||     /* and in the frame's VLAN */
+           VNetHubVlanEgress(rcu_dereference(hub->vlan[i]), tci, &tag))) {
          clone = skb_clone(skb, GFP_ATOMIC);
+         if (clone && vlanAware) {
+            clone = VNetHubVlanTag(clone, tci, tag);
+         }
          if (clone) {
             VNetSend(jack, clone);
          }
@@ -758,6 +1511,8 @@ VNetHubProcRead(char    *page,   // IN/OUT: buffer to write into
 {
    VNetJack *jack = (VNetJack*)data;
    VNetHub *hub;
+   const VNetHubVlan *vlan;
+   const VNetTap *tap;
    int len = 0;
 
    if (!jack || !jack->private) {
@@ -765,10 +1520,26 @@ VNetHubProcRead(char    *page,   // IN/OUT: buffer to write into
    }
    hub = (VNetHub*)jack->private;
 
+   rcu_read_lock();
+   vlan = rcu_dereference(hub->vlan[jack->index]);
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
    VNetPrintJack(jack, seqf);
 
-   seq_printf(seqf, "tx %u ", hub->stats[jack->index].tx);
+   seq_printf(seqf, "tx %u ", VNET_STAT_SUM(&hub->stats[jack->index], tx));
+
+   if (vlan) {
+      seq_printf(seqf, "vlan.%s pvid %u vlans %u vlanDrop %u ",
+                 vlan->mode == VNET_VLAN_TRUNK ? "trunk" : "access",
+                 vlan->pvid, bitmap_weight(vlan->members, VNET_VLAN_N_VID),
+                 VNET_STAT_SUM(&hub->stats[jack->index], vlanDrop));
+   }
+
+   tap = rcu_dereference(hub->tap);
+   if (tap && hub->tapJack == jack->index) {
+      VNetTap_Print(tap, seqf);
+   }
+   rcu_read_unlock();
 
    seq_printf(seqf, "\n");
 
@@ -776,7 +1547,22 @@ VNetHubProcRead(char    *page,   // IN/OUT: buffer to write into
 #else
    len += VNetPrintJack(jack, page+len);
 
-   len += sprintf(page+len, "tx %u ", hub->stats[jack->index].tx);
+   len += sprintf(page+len, "tx %u ",
+                  VNET_STAT_SUM(&hub->stats[jack->index], tx));
+
+   if (vlan) {
+      len += sprintf(page+len, "vlan.%s pvid %u vlans %u vlanDrop %u ",
+                     vlan->mode == VNET_VLAN_TRUNK ? "trunk" : "access",
+                     vlan->pvid,
+                     bitmap_weight(vlan->members, VNET_VLAN_N_VID),
+                     VNET_STAT_SUM(&hub->stats[jack->index], vlanDrop));
+   }
+
+   tap = rcu_dereference(hub->tap);
+   if (tap && hub->tapJack == jack->index) {
+      len += VNetTap_Print(tap, page+len);
+   }
+   rcu_read_unlock();
 
    len += sprintf(page+len, "\n");
 
@@ -38,29 +38,85 @@
 
 #include <linux/proc_fs.h>
 #include <linux/file.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+#include <linux/u64_stats_sync.h>
+#else
+/*
+ * No u64_stats_sync before 2.6.36: the per-CPU counters are plain, and
+ * readers of 32-bit hosts may see a torn 64-bit value.
+ */
+struct u64_stats_sync { };
+#define u64_stats_update_begin(_syncp)        do { } while (0)
+#define u64_stats_update_end(_syncp)          do { } while (0)
+#define u64_stats_fetch_begin(_syncp)         0
+#define u64_stats_fetch_retry(_syncp, _start) 0
+#endif
 
 #include "vnetInt.h"
 #include "compat_netdevice.h"
 #include "vmnetInt.h"
 
 
+/*
+ * The host interface gets one transmit queue per CPU, up to
+ * VNET_NETIF_MAX_QUEUES.  Transmit is lockless (LLTX): VNetSend is safe to
+ * call concurrently, so the queues only exist to let the stack spread
+ * traffic across CPUs without serializing on a single queue lock.
+ */
+
+#define VNET_NETIF_MAX_QUEUES 16
+
+/*
+ * ndo_get_stats64 appeared in 2.6.35; older net_device_ops kernels get
+ * the summed counters through ndo_get_stats instead.
+ */
+
+#if defined(HAVE_NET_DEVICE_OPS) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+#   define VNET_HAVE_GET_STATS64
+#endif
+
+/*
+ * Per-CPU counters.  Receive and transmit are updated with bottom halves
+ * disabled, so one syncp per CPU is enough to give readers consistent
+ * 64-bit values on 32-bit hosts.
+ */
+
+typedef struct VNetNetIFStats {
+   u64                     rxPackets;
+   u64                     rxBytes;
+   u64                     txPackets;
+   u64                     txBytes;
+   struct u64_stats_sync   syncp;
+} VNetNetIFStats;
+
 typedef struct VNetNetIF {
    VNetPort                port;
    struct net_device      *dev;
    char                    devName[VNET_NAME_LEN];
-   struct net_device_stats stats;
+   VNetNetIFStats __percpu *pcpuStats; // per-CPU packet counters
+   struct net_device_stats stats;      // summed up by VNetNetifGetStats
 } VNetNetIF;
 
 
 static void VNetNetIfFree(VNetJack *this);
 static void VNetNetIfReceive(VNetJack *this, struct sk_buff *skb);
 static Bool VNetNetIfCycleDetect(VNetJack *this, int generation);
+static Bool VNetNetIfIsPromisc(VNetJack *this);
 
 static int  VNetNetifOpen(struct net_device *dev);
 static int  VNetNetifProbe(struct net_device *dev);
 static int  VNetNetifClose(struct net_device *dev);
 static int  VNetNetifStartXmit(struct sk_buff *skb, struct net_device *dev);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+static void VNetNetifGetStats64(struct net_device *dev,
+                                struct rtnl_link_stats64 *stats);
+#elif defined(VNET_HAVE_GET_STATS64)
+static struct rtnl_link_stats64 *
+VNetNetifGetStats64(struct net_device *dev, struct rtnl_link_stats64 *stats);
+#else
 static struct net_device_stats *VNetNetifGetStats(struct net_device *dev);
+#endif
 static int  VNetNetifSetMAC(struct net_device *dev, void *addr);
 static void VNetNetifSetMulticast(struct net_device *dev);
 #if 0
@@ -133,7 +189,11 @@ VNetNetIfSetup(struct net_device *dev)  // IN:
       .ndo_open = VNetNetifOpen,
       .ndo_start_xmit = VNetNetifStartXmit,
       .ndo_stop = VNetNetifClose,
+#ifdef VNET_HAVE_GET_STATS64
+      .ndo_get_stats64 = VNetNetifGetStats64,
+#else
       .ndo_get_stats = VNetNetifGetStats,
+#endif
       .ndo_set_mac_address = VNetNetifSetMAC,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 2, 0)
       .ndo_set_rx_mode = VNetNetifSetMulticast,
@@ -151,6 +211,11 @@ VNetNetIfSetup(struct net_device *dev)  // IN:
 #endif /* HAVE_NET_DEVICE_OPS */
 
    ether_setup(dev); // turns on IFF_BROADCAST, IFF_MULTICAST
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+   dev->lltx = true;
+#else
+   dev->features |= NETIF_F_LLTX;
+#endif
 #ifdef HAVE_NET_DEVICE_OPS
    dev->netdev_ops = &vnetNetifOps;
 #else
@@ -257,6 +322,7 @@ VNetNetIf_Create(char *devName,  // IN:
    VNetNetIF *netIf;
    struct net_device *dev;
    int retval = 0;
+   int cpu;
    static unsigned id = 0;
    
    netIf = kmalloc(sizeof *netIf, GFP_KERNEL);
@@ -265,6 +331,22 @@ VNetNetIf_Create(char *devName,  // IN:
       goto out;
    }
 
+   netIf->pcpuStats = VNET_STATS_ALLOC(VNetNetIFStats);
+   if (!netIf->pcpuStats) {
+      kfree(netIf);
+      netIf = NULL;
+      retval = -ENOMEM;
+      goto out;
+   }
+   for_each_possible_cpu(cpu) {
+      VNetNetIFStats *stats = per_cpu_ptr(netIf->pcpuStats, cpu);
+
+      memset(stats, 0, sizeof *stats);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+      u64_stats_init(&stats->syncp);
+#endif
+   }
+
    /*
     * Initialize fields.
     */
@@ -284,6 +366,7 @@ VNetNetIf_Create(char *devName,  // IN:
    netIf->port.jack.cycleDetect = VNetNetIfCycleDetect;
    netIf->port.jack.portsChanged = NULL;
    netIf->port.jack.isBridged = NULL;
+   netIf->port.jack.isPromisc = VNetNetIfIsPromisc;
    
    /*
     * Make proc entry for this jack.
@@ -331,6 +414,9 @@ VNetNetIf_Create(char *devName,  // IN:
    netIf->port.fileOpWrite = NULL;
    netIf->port.fileOpIoctl = NULL;
    netIf->port.fileOpPoll = NULL;
+   netIf->port.setApiFlags = NULL;
+   netIf->port.shaper[VNET_SHAPER_TX] = NULL;
+   netIf->port.shaper[VNET_SHAPER_RX] = NULL;
    
    memset(&netIf->stats, 0, sizeof netIf->stats);
    
@@ -338,7 +424,10 @@ VNetNetIf_Create(char *devName,  // IN:
    NULL_TERMINATE_STRING(netIf->devName);
 
 #ifdef HAVE_NETDEV_PRIV
-   dev = compat_alloc_netdev(sizeof(VNetNetIF *), netIf->devName, VNetNetIfSetup);
+   dev = compat_alloc_netdev_mq(sizeof(VNetNetIF *), netIf->devName,
+                                VNetNetIfSetup,
+                                min_t(unsigned int, num_possible_cpus(),
+                                      VNET_NETIF_MAX_QUEUES));
    if (!dev) {
       retval = -ENOMEM;
       goto out;
@@ -376,6 +465,7 @@ out:
       if (netIf->port.jack.procEntry) {
          VNetProc_RemoveEntry(netIf->port.jack.procEntry);
       }
+      VNET_STATS_FREE(netIf->pcpuStats);
       kfree(netIf);
    }
    return retval;
@@ -408,6 +498,7 @@ VNetNetIfFree(VNetJack *this) // IN: jack
    if (this->procEntry) {
       VNetProc_RemoveEntry(this->procEntry);
    }
+   VNET_STATS_FREE(netIf->pcpuStats);
    kfree(netIf);
 }
 
@@ -434,6 +525,8 @@ VNetNetIfReceive(VNetJack        *this, // IN: jack
 {
    VNetNetIF *netIf = (VNetNetIF*)this->private;
    uint8 *dest = SKB_2_DESTMAC(skb);
+   unsigned int len = skb->len;
+   VNetNetIFStats *stats;
    
    if (!NETDEV_UP_AND_RUNNING(netIf->dev)) {
       goto drop_packet;
@@ -454,7 +547,15 @@ VNetNetIfReceive(VNetJack        *this, // IN: jack
 #else
    netif_rx_ni(skb);
 #endif
-   netIf->stats.rx_packets++;
+
+   /* Packets arrive both from process context and from softirqs. */
+   local_bh_disable();
+   stats = this_cpu_ptr(netIf->pcpuStats);
+   u64_stats_update_begin(&stats->syncp);
+   stats->rxPackets++;
+   stats->rxBytes += len;
+   u64_stats_update_end(&stats->syncp);
+   local_bh_enable();
 
    return;
    
@@ -488,6 +589,30 @@ VNetNetIfCycleDetect(VNetJack *this,       // IN: jack
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetNetIfIsPromisc --
+ *
+ *      Check whether the host interface is in promiscuous mode.
+ * 
+ * Results: 
+ *      TRUE if promiscuous, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetNetIfIsPromisc(VNetJack *this) // IN: jack
+{
+   VNetNetIF *netIf = (VNetNetIF*)this->private;
+   return (netIf->dev->flags & IFF_PROMISC) != 0;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -517,7 +642,7 @@ VNetNetifOpen(struct net_device *dev) // IN:
     *  if so return -EBUSY;
     */
 
-   netif_start_queue(dev);
+   netif_tx_start_all_queues(dev);
    // xxx need to change flags
    return 0;
 }
@@ -565,7 +690,7 @@ VNetNetifProbe(struct net_device *dev) // IN: unused
 int
 VNetNetifClose(struct net_device *dev) // IN:
 {
-   netif_stop_queue(dev);
+   netif_tx_stop_all_queues(dev);
    // xxx need to change flags
    return 0;
 }
@@ -576,7 +701,9 @@ VNetNetifClose(struct net_device *dev) // IN:
  *
  * VNetNetifStartXmit --
  *
- *      The virtual network's start xmit dev operation. 
+ *      The virtual network's start xmit dev operation.  The device is
+ *      LLTX, so this runs concurrently on all CPUs without the queue
+ *      lock, with bottom halves disabled by the caller.
  *
  * Results: 
  *      ???, 0.
@@ -592,27 +719,23 @@ VNetNetifStartXmit(struct sk_buff    *skb, // IN:
                    struct net_device *dev) // IN:
 {
    VNetNetIF *netIf;
+   VNetNetIFStats *stats;
+   unsigned int len;
 
    if(skb == NULL) {
       return 0;
    }
 
    netIf = VNetNetIfNetDeviceToNetIf(dev);
-
-   /* 
-    * Block a timer-based transmit from overlapping.  This could better be
-    * done with atomic_swap(1, dev->tbusy), but set_bit() works as well.
-    * If this ever occurs the queue layer is doing something evil!
-    */
+   len = skb->len;
 
    VNetSend(&netIf->port.jack, skb);
 
-   netIf->stats.tx_packets++;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
-   netif_trans_update(dev);
-#else
-   dev->trans_start = jiffies;
-#endif
+   stats = this_cpu_ptr(netIf->pcpuStats);
+   u64_stats_update_begin(&stats->syncp);
+   stats->txPackets++;
+   stats->txBytes += len;
+   u64_stats_update_end(&stats->syncp);
 
    return 0;
 }
@@ -682,18 +805,105 @@ VNetNetifSetMulticast(struct net_device *dev) // IN: unused
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetNetIfSumStats --
+ *
+ *      Add up the per-CPU packet and byte counters.
+ *
+ * Results:
+ *      Totals in 'sum' (syncp is not touched).
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetNetIfSumStats(VNetNetIF *netIf,     // IN:
+                  VNetNetIFStats *sum)  // OUT:
+{
+   int cpu;
+
+   sum->rxPackets = sum->rxBytes = 0;
+   sum->txPackets = sum->txBytes = 0;
+   for_each_possible_cpu(cpu) {
+      const VNetNetIFStats *stats = per_cpu_ptr(netIf->pcpuStats, cpu);
+      u64 rxPackets, rxBytes, txPackets, txBytes;
+      unsigned int start;
+
+      do {
+         start = u64_stats_fetch_begin(&stats->syncp);
+         rxPackets = stats->rxPackets;
+         rxBytes = stats->rxBytes;
+         txPackets = stats->txPackets;
+         txBytes = stats->txBytes;
+      } while (u64_stats_fetch_retry(&stats->syncp, start));
+
+      sum->rxPackets += rxPackets;
+      sum->rxBytes += rxBytes;
+      sum->txPackets += txPackets;
+      sum->txBytes += txBytes;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetNetifGetStats64 --
+ *
+ *      The virtual network's get stats64 dev operation.
+ *
+ * Results:
+ *      64-bit stats in 'stats' (also returned before 4.11).
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+static void
+#elif defined(VNET_HAVE_GET_STATS64)
+static struct rtnl_link_stats64 *
+#endif
+#if defined(VNET_HAVE_GET_STATS64)
+VNetNetifGetStats64(struct net_device *dev,          // IN:
+                    struct rtnl_link_stats64 *stats) // OUT:
+{
+   VNetNetIF *netIf = VNetNetIfNetDeviceToNetIf(dev);
+   VNetNetIFStats sum;
+
+   VNetNetIfSumStats(netIf, &sum);
+   stats->rx_packets = sum.rxPackets;
+   stats->rx_bytes = sum.rxBytes;
+   stats->tx_packets = sum.txPackets;
+   stats->tx_bytes = sum.txBytes;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+   return stats;
+#endif
+}
+#endif
+
+
+#ifndef VNET_HAVE_GET_STATS64
 /*
  *----------------------------------------------------------------------
  *
  * VNetNetifGetStats --
  *
- *      The virtual network's get stats dev operation. 
+ *      The virtual network's get stats dev operation, for kernels
+ *      without ndo_get_stats64.
  *
- * Results: 
+ * Results:
  *      A struct full of stats.
  *
  * Side effects:
- *      None.
+ *      Packet counts are summed up from the per-CPU counters.
  *
  *----------------------------------------------------------------------
  */
@@ -702,9 +912,16 @@ static struct net_device_stats *
 VNetNetifGetStats(struct net_device *dev) // IN:
 {
    VNetNetIF *netIf = VNetNetIfNetDeviceToNetIf(dev);
+   VNetNetIFStats sum;
 
+   VNetNetIfSumStats(netIf, &sum);
+   netIf->stats.rx_packets = sum.rxPackets;
+   netIf->stats.rx_bytes = sum.rxBytes;
+   netIf->stats.tx_packets = sum.txPackets;
+   netIf->stats.tx_bytes = sum.txBytes;
    return &netIf->stats;
 }
+#endif
 
 
 /*
@@ -277,14 +277,6 @@ ntohs(uint16 i) {
  * IP corresonds to which MAC
  */
 
-#ifdef _WIN32
-typedef uint64 SmacLastAccess;
-#define LAST_ACCESS_FORMAT "%"FMT64"u" // format of lastAccess for printf()
-#else
-typedef unsigned long SmacLastAccess;
-#define LAST_ACCESS_FORMAT "%lu"      // format of lastAccess for printf()
-#endif /* _WIN32 */
-
 typedef union IPAddrUnion {
    uint32 ipv4Addr;
    IPv6Addr ipv6Addr;
@@ -297,9 +289,10 @@ typedef struct IPAddrContainer {
 
 typedef struct IPmacLookupEntry {
    struct IPmacLookupEntry *ipNext;   // pointer to next item in bucket in IP hash table
+   struct IPmacLookupEntry *lruPrev;  // more recently used neighbour in LRU list
+   struct IPmacLookupEntry *lruNext;  // less recently used neighbour in LRU list
    IPAddrContainer addrContainer;     // Struct holding the v4/v6 address
    uint8 mac[ETH_ALEN];               // ethernet MAC address
-   SmacLastAccess lastAccess;         // estimated time of entry's last use
 } IPmacLookupEntry;
 
 /*
@@ -334,8 +327,16 @@ typedef enum {
  * SMACState: encapsulates all wireless state for a specific host adapter
  */
 
-#define SMAC_HASH_TABLE_SIZE 256 // length of table, must be power of 2
-#define SMAC_HASH_MASK       (SMAC_HASH_TABLE_SIZE - 1) // hash bits
+/*
+ * The IP hash table starts at SMAC_HASH_TABLE_MIN_SIZE buckets and doubles
+ * whenever the number of entries exceeds the number of buckets, up to
+ * SMAC_HASH_TABLE_MAX_SIZE.  Once SMAC_MAX_ENTRIES pairs are known the least
+ * recently used one is evicted for every new one.
+ */
+
+#define SMAC_HASH_TABLE_MIN_SIZE 256  // initial # of buckets, must be power of 2
+#define SMAC_HASH_TABLE_MAX_SIZE 4096 // largest # of buckets, must be power of 2
+#define SMAC_MAX_ENTRIES         4096 // # of IP/MAC pairs kept before evicting
 
 typedef struct SMACState {
 #ifdef _WIN32
@@ -343,9 +344,11 @@ typedef struct SMACState {
 #else /* _WIN32 */
    void            	 *smacSpinLock;       // spinlock that protects wireless state
 #endif /* _WIN32 */
-   SmacLastAccess	 lastUptimeRead;     // used to track uptime counter overflow
-   struct IPmacLookupEntry * IPlookupTable[SMAC_HASH_TABLE_SIZE];  // IP hash table IP->MAC
+   struct IPmacLookupEntry **IPlookupTable;  // IP hash table IP->MAC
+   uint32 hashTableSize;		     // # of buckets in IP hash table
    uint32 numberOfIPandMACEntries;	     // # of hash table entries
+   struct IPmacLookupEntry * lruHead;	     // most recently used entry
+   struct IPmacLookupEntry * lruTail;	     // least recently used entry (evicted first)
    IPAddrContainer lastIPadded;		     // last IP added to hash
    uint8  lastMACadded[ETH_ALEN];	     // last MAC added to hash
    struct IPmacLookupEntry * lastEntryAdded; // ptr to cache entry (to update timestamp)
@@ -372,6 +375,7 @@ static INLINE Bool LookupByIPv4(SMACState *state, uint32 ipv4Addr,
 static INLINE Bool RemoveIPfromHashTableNoAcquireLock(SMACState *state,
 						      IPmacLookupEntry *entryToRemove);
 
+static void GrowLookupTableIfNecessary(SMACState *state);
 static void TrimLookupTableIfNecessary(SMACState *state);
 
 static INLINE void SetCacheEntry(SMACState *state, IPmacLookupEntry *entry);
@@ -395,7 +399,6 @@ PatchMacAddrFixChecksum(SMACPacket *packet, const uint32 packetLen,
 static void ProcessIncomingIPv4Packet(SMACPacket *packet, 
 				      Bool knownMacForIp);
 #endif
-static SmacLastAccess GetSystemUptime(SMACState *state);
 
 /* get information from packet */
 static INLINE uint32 GetPacketLength(SMACPacket *packet);
@@ -432,11 +435,12 @@ static EthClass LookupTypeName(uint16 typeValue, char *type);
  * IPv4Hash --
  * IPv6Hash -- 
  *
- *      Returns a one byte hash of an IPv4 (IPv6) address by adding
- *      all the octets in the address.
+ *      Returns a 32-bit multiplicative hash of an IPv4 (IPv6) address.
+ *      Callers mask the result down to the current table size, so all
+ *      bits of the address need to reach the low bits of the hash.
  *
  * Results:
- *      One byte hash value.
+ *      32-bit hash value.
  *
  * Side effects:
  *      None.
@@ -444,24 +448,22 @@ static EthClass LookupTypeName(uint16 typeValue, char *type);
  *----------------------------------------------------------------------
  */
 
-static INLINE uint8
+#define SMAC_HASH_MULTIPLIER 0x9e3779b1 // 2^32 / golden ratio
+
+static INLINE uint32
 IPv4Hash(uint32 addr) // IN:
 {
-   return ((addr >> 24 & 0xff) + (addr >> 16 & 0xff) + (addr >> 8 & 0xff) +
-           (addr & 0xff)) & SMAC_HASH_MASK;
+   uint32 hash = addr * SMAC_HASH_MULTIPLIER;
+
+   return hash ^ (hash >> 16);
 }
 
-static INLINE uint8
+static INLINE uint32
 IPv6Hash(const IPv6Addr *addr) // IN:
 {
-   int i;
-   uint8 hash = (uint8)(addr->addrLo & 0xff) + (uint8)(addr->addrHi & 0xff);
+   uint64 fold = addr->addrHi ^ addr->addrLo;
 
-   for (i = 1; i < 4; i++) {
-      hash += (uint8)(addr->addrLo >> (i * 8) & 0xff) +
-              (uint8)(addr->addrHi >> (i * 8) & 0xff);
-   }
-   return hash & SMAC_HASH_MASK;
+   return IPv4Hash((uint32)(fold >> 32) ^ (uint32)fold);
 }
 
 
@@ -628,7 +630,7 @@ LookupEntrySetIPAddrContainer(IPmacLookupEntry *entry,              // OUT:
  *      entry) structure.
  *
  * Results:
- *      One byte hash of the IP address.
+ *      32-bit hash of the IP address.
  *
  * Side effects:
  *      None.
@@ -636,7 +638,7 @@ LookupEntrySetIPAddrContainer(IPmacLookupEntry *entry,              // OUT:
  *----------------------------------------------------------------------
  */
 
-static INLINE uint8
+static INLINE uint32
 IPAddrContainerHash(const IPAddrContainer *addrContainer) // IN:
 {
    return IsIPAddrContainerV4(addrContainer) ?
@@ -644,7 +646,7 @@ IPAddrContainerHash(const IPAddrContainer *addrContainer) // IN:
       IPv6Hash(ContainerGetIPv6Addr(addrContainer));
 }
 
-static INLINE uint8
+static INLINE uint32
 LookupEntryIPAddrHash(const IPmacLookupEntry *entry) // IN:
 {
    return IPAddrContainerHash(&entry->addrContainer);
@@ -854,6 +856,10 @@ PrintMACAddrToString(char *str,        // OUT:
  * writing data in the hash table.  A read/write lock might be better
  * but the locks are usually held for a brief period of time.  
  *
+ * Every entry is also linked on an LRU list ordered by the last time the
+ * IP/MAC pair was seen in an outgoing packet, so the entry to evict when the
+ * table is full is always state->lruTail and never needs a table scan.
+ *
  * 'lastIPadded' and 'lastMACadded' are used to cache the last entry that
  * was added to the hash table.  For most packets we attempt to add IP/MAC
  * information from that packet to the hash table.  In most cases (especially
@@ -863,6 +869,84 @@ PrintMACAddrToString(char *str,        // OUT:
  */
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * LookupBucket --
+ *
+ *      Returns the head of the IP hash table bucket for a given hash.
+ *
+ * Results:
+ *      Pointer to the bucket's list head.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE IPmacLookupEntry **
+LookupBucket(SMACState *state, // IN: smac state
+             uint32 hash)      // IN: hash of IP address
+{
+   ASSERT((state->hashTableSize & (state->hashTableSize - 1)) == 0);
+   return &state->IPlookupTable[hash & (state->hashTableSize - 1)];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LruUnlink --
+ * LruInsertHead --
+ *
+ *      Remove an entry from the LRU list / insert an entry at the
+ *      most recently used end of the LRU list.
+ *
+ *      Functions are called with state->smacSpinLock held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Modifies the LRU list.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+LruUnlink(SMACState *state,        // IN: smac state
+          IPmacLookupEntry *entry) // IN: entry to unlink
+{
+   if (entry->lruPrev) {
+      entry->lruPrev->lruNext = entry->lruNext;
+   } else {
+      state->lruHead = entry->lruNext;
+   }
+   if (entry->lruNext) {
+      entry->lruNext->lruPrev = entry->lruPrev;
+   } else {
+      state->lruTail = entry->lruPrev;
+   }
+   entry->lruPrev = NULL;
+   entry->lruNext = NULL;
+}
+
+static INLINE void
+LruInsertHead(SMACState *state,        // IN: smac state
+              IPmacLookupEntry *entry) // IN: entry to insert
+{
+   entry->lruPrev = NULL;
+   entry->lruNext = state->lruHead;
+   if (state->lruHead) {
+      state->lruHead->lruPrev = entry;
+   } else {
+      state->lruTail = entry;
+   }
+   state->lruHead = entry;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -889,16 +973,15 @@ static INLINE IPmacLookupEntry *
 LookupByIPNoAcquireLock(SMACState *state,                     // IN: state
                         const IPAddrContainer *addrContainer) // IN: v4/v6 addr
 {
-   uint8 hash = IPAddrContainerHash(addrContainer);
    IPmacLookupEntry *curr;
 
-   ASSERT(SMAC_HASH_TABLE_SIZE == 256);
-
    /*
     * Search thru bucket for match.
     */
 
-   for (curr = state->IPlookupTable[hash]; curr; curr = curr->ipNext) {
+   for (curr = *LookupBucket(state, IPAddrContainerHash(addrContainer));
+        curr;
+        curr = curr->ipNext) {
       if (AddrContainersMatch(&curr->addrContainer, addrContainer)) {
          break;
       }
@@ -971,10 +1054,11 @@ LookupByIPv4(SMACState *state,  // IN:
  *      Locking and no-locking version of function are provided
  *
  *      This function doesn't check whether the cached entry is
- *      being removed (and thus won't reset the cached entry). This
- *      code is primarily used to remove the oldest entry, and by
- *      definition the cached entry is the newest (i.e., it's never
- *      the oldest and thus won't be removed).
+ *      being removed (and thus won't reset the cached entry), nor
+ *      does it unlink the entry from the LRU list. This code is
+ *      primarily used to remove the oldest entry, and by definition
+ *      the cached entry is the newest (i.e., it's never the oldest
+ *      and thus won't be removed).
  *
  * Results:
  *      TRUE if entry removed, FALSE otherwise.
@@ -990,14 +1074,13 @@ static INLINE Bool
 RemoveIPfromHashTableNoAcquireLock(SMACState *state,                 // IN: state
 				   IPmacLookupEntry * entryToRemove) // IN: packet
 {
-   uint8 ipHashToRemove;
+   IPmacLookupEntry **bucket;
    IPmacLookupEntry * prev = NULL, *entry;
 
    ASSERT(entryToRemove);
-   ASSERT(SMAC_HASH_TABLE_SIZE == 256);
 
-   ipHashToRemove = LookupEntryIPAddrHash(entryToRemove);
-   entry = state->IPlookupTable[ipHashToRemove]; // get bucket
+   bucket = LookupBucket(state, LookupEntryIPAddrHash(entryToRemove));
+   entry = *bucket; // get bucket
       
    /*
     * locate and remove old IP entry from bucket
@@ -1012,7 +1095,7 @@ RemoveIPfromHashTableNoAcquireLock(SMACState *state,                 // IN: stat
 	 } else {
 	    W_VNETKdPrint((MODULE_NAME "RemoveIPfromHashTable: removed IP "
 			   "entry from front of bucket\n"));
-	    state->IPlookupTable[ipHashToRemove] = entry->ipNext;
+	    *bucket = entry->ipNext;
 	 }
 	 return TRUE;
       } else {
@@ -1024,17 +1107,85 @@ RemoveIPfromHashTableNoAcquireLock(SMACState *state,                 // IN: stat
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * GrowLookupTableIfNecessary --
+ *
+ *      If the number of entries in the IP table exceeds the number of
+ *      buckets, then the table is doubled (up to
+ *      SMAC_HASH_TABLE_MAX_SIZE buckets) and all entries are rehashed.
+ *      A failed allocation is not an error: the current table keeps
+ *      working, just with longer buckets.
+ *
+ *      Function presumes that state lock is held while this function
+ *      is called.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May replace the IP hash table.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+GrowLookupTableIfNecessary(SMACState *state) // IN: smac state
+{
+   IPmacLookupEntry **newTable;
+   IPmacLookupEntry *entry;
+   uint32 newSize;
+
+   ASSERTLOCKHELD();
+
+   if (state->numberOfIPandMACEntries <= state->hashTableSize ||
+       state->hashTableSize >= SMAC_HASH_TABLE_MAX_SIZE) {
+      return;
+   }
+
+   newSize = state->hashTableSize * 2;
+   newTable = ALLOCATEMEMORY(newSize * sizeof *newTable, REORDER_TAG('SMht'));
+   if (!newTable) {
+      VNETKdPrint((MODULE_NAME "GrowLookupTableIfNecessary: failed to "
+                   "allocate %u buckets\n", newSize));
+      return;
+   }
+   MEMSET(newTable, 0, newSize * sizeof *newTable);
+
+   /*
+    * Every entry is on the LRU list, so walk that instead of the old
+    * buckets.
+    */
+
+   for (entry = state->lruHead; entry; entry = entry->lruNext) {
+      uint32 i = LookupEntryIPAddrHash(entry) & (newSize - 1);
+
+      entry->ipNext = newTable[i];
+      newTable[i] = entry;
+   }
+
+   FREEMEMORY(state->IPlookupTable);
+   state->IPlookupTable = newTable;
+   state->hashTableSize = newSize;
+
+   VNETKdPrint((MODULE_NAME "GrowLookupTableIfNecessary: grew table to %u "
+                "buckets for %u entries\n", newSize,
+                state->numberOfIPandMACEntries));
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
  * TrimLookupTableIfNecessary --
  *
- *      If the number of entries in the IP and MAC tables exceeds a
- *      specified value (currently 20), then we remove and deallocate
- *      an entry--ideally the entry which has been used least recently
- *      is removed.  The code presumes that this function will be called
- *      anytime a new entry is added, thus we should never need to
- *      remove more than one entry per function call.
+ *      If the number of entries in the IP and MAC tables exceeds
+ *      SMAC_MAX_ENTRIES, then we remove and deallocate the entry which
+ *      has been used least recently (the tail of the LRU list).  The
+ *      code presumes that this function will be called anytime a new
+ *      entry is added, thus we should never need to remove more than
+ *      one entry per function call.
  *
  *      Function presumes that state lock is held while this function
  *      is called.
@@ -1052,108 +1203,41 @@ RemoveIPfromHashTableNoAcquireLock(SMACState *state,                 // IN: stat
 static void
 TrimLookupTableIfNecessary(SMACState *state) // IN: smac state
 {
-   IPmacLookupEntry * oldestEntry = NULL; // oldest entry found
-   SmacLastAccess oldestUpdate = ~0;	  // age of oldest entry
-   SmacLastAccess currentUptime = 0;      // time since the system was booted
-   int i;
+   IPmacLookupEntry *oldestEntry;
+   DEVEL_ONLY(char ipStr[IP_STRING_SIZE];)
 
    VNETKdPrintCall(("TrimLookupTableIfNecessary"));
    ASSERT(state);
-   ASSERT(SMAC_HASH_TABLE_SIZE == 256);
    ASSERTLOCKHELD();
 
-   if (state->numberOfIPandMACEntries <= 20) { // if not too many entries
-      VNETKdPrint((MODULE_NAME "TrimLookupTableIfNeccessary: number of "
-                   "entries is small: %u.\n", state->numberOfIPandMACEntries));
+   if (state->numberOfIPandMACEntries <= SMAC_MAX_ENTRIES) {
       return;
    }
 
-   VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: "
-		 "reducing # of entries\n"));
-   
-   currentUptime = GetSystemUptime(state); /* must be called with lock held */
-   
-   VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: current uptime is "
-		LAST_ACCESS_FORMAT "\n", currentUptime));
-
    /*
-    * NOTE: this code presumes that no system will ever be up long enough
-    * for the uptime to wrap.  To get around this assumption we could try to
-    * determine "oldest" by computing which entry has the largest difference
-    * from the current updtime.  However, there are no guarantees that this
-    * metric is any more accurate.  Given that we never expect more than 20
-    * entries to ever exist, I won't implement a more sophisiticated 
-    * mechanism at this time.
+    * The cached entry was just moved to the head of the LRU list, and
+    * there is more than one entry, so the tail is never the cached entry.
     */
 
-   /*
-    * Search thru entire table to find oldest uptime, and remove it
-    */
+   oldestEntry = state->lruTail;
+   ASSERT(oldestEntry);
+   ASSERT(oldestEntry != state->lastEntryAdded);
 
-   for (i = 0; i < SMAC_HASH_TABLE_SIZE; ++i) {
-      IPmacLookupEntry *currentEntry = state->IPlookupTable[i];
-      while (currentEntry) {
-	 if (currentEntry->lastAccess < oldestUpdate) { // if older than candidate
+   VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: removing least "
+                "recently used entry %s\n",
+                LookupEntryPrintIPAddrToString(ipStr, sizeof ipStr,
+                                               oldestEntry)));
 
-	    /* 
-	     * Skip cached entry since the entry was used most recently, but its
-	     * timestamp might be old since the timestamp is only updated after
-	     * the entry is no longer cached (i.e., something else is now the newest)
-	     *
-	     * This code will only be executed if at least 20 entries exist, so there
-	     * must be some much better candidates elsewhere in the table.
-	     */
-
-	    if (currentEntry == state->lastEntryAdded) {
-	       VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: oldest "
-		  "candidate is the cached entry, so skipping\n"));
-	    } else {
-	       DEVEL_ONLY(char ipStr[IP_STRING_SIZE];)
-
-	       VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: current "
-	                    "oldest candidate: %s time " LAST_ACCESS_FORMAT "\n",
-	                    LookupEntryPrintIPAddrToString(ipStr, sizeof ipStr,
-	                                                   currentEntry),
-	                    currentEntry->lastAccess));
-	       oldestEntry = currentEntry;
-	       oldestUpdate = currentEntry->lastAccess;
-	    }
-	 }
-	 if (currentEntry->lastAccess > currentUptime) {
-	    VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: "
-			 "ERROR: last access " LAST_ACCESS_FORMAT 
-			 " > current uptime " LAST_ACCESS_FORMAT "\n", 
-			 currentEntry->lastAccess, currentUptime));
-	 }
-	 
-	 currentEntry = currentEntry->ipNext;
-      }
-   }
-
-   if (oldestEntry) {
-      DEVEL_ONLY(char ipStr[IP_STRING_SIZE];)
-
-      VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: found oldest "
-                   "candidate: %s time " LAST_ACCESS_FORMAT "\n",
-                   LookupEntryPrintIPAddrToString(ipStr, sizeof ipStr,
-                                                  oldestEntry),
-                   oldestEntry->lastAccess));
-      if (!RemoveIPfromHashTableNoAcquireLock(state, oldestEntry)) {
-	 VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: could not "
-		      "find entry in IP table\n"));
-	 ASSERT(0); // should never occur
-      } else {
-	 FREEMEMORY(oldestEntry);
-	 --state->numberOfIPandMACEntries;
-      }
-   }
-   else {
-      VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: "
-		   "found no entry to remove!!\n"));
+   if (!RemoveIPfromHashTableNoAcquireLock(state, oldestEntry)) {
+      VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: could not "
+                   "find entry in IP table\n"));
+      ASSERT(0); // should never occur
    }
+   LruUnlink(state, oldestEntry);
+   FREEMEMORY(oldestEntry);
+   --state->numberOfIPandMACEntries;
 
    VNETKdPrintReturn(("TrimLookupTableIfNecessary"));   
-   return;
 }
 
 
@@ -1162,11 +1246,11 @@ TrimLookupTableIfNecessary(SMACState *state) // IN: smac state
  *
  * SetCacheEntry --
  *
- *      Sets the cached MAC/IP entry for an adapter, and updates the
- *      access time for the previous cache entry (if any).  The cache
+ *      Sets the cached MAC/IP entry for an adapter, and moves the
+ *      entry to the most recently used end of the LRU list.  The cache
  *      is used to avoid the overhead of checking for the existance of,
  *      for the purposes of adding, a MAC/IP entry that has already
- *      been added recently.
+ *      been added recently.  The entry must already be on the LRU list.
  *
  *      Function is called with state->smacSpinLock held.
  *
@@ -1174,8 +1258,7 @@ TrimLookupTableIfNecessary(SMACState *state) // IN: smac state
  *      None.
  *
  * Side effects:
- *      Modified the cached entry for the adapter, and updates the
- *      access time for the previous cache entry (if any)
+ *      Modified the cached entry for the adapter and the LRU list.
  *
  *----------------------------------------------------------------------
  */
@@ -1187,19 +1270,14 @@ SetCacheEntry(SMACState *state,         // IN: smac state
    ASSERT(state);
    ASSERT(entry);
 
-   /* 
-    * Set new cached entry, but first set the current cache entry's
-    * access time to the current time
-    */
-
-   if (state->lastEntryAdded) {
-      state->lastEntryAdded->lastAccess = GetSystemUptime(state);
+   if (state->lruHead != entry) {
+      LruUnlink(state, entry);
+      LruInsertHead(state, entry);
    }
 
    state->lastIPadded = entry->addrContainer;
    MEMCPY(state->lastMACadded, entry->mac, ETH_ALEN);
    state->lastEntryAdded = entry;
-   entry->lastAccess = GetSystemUptime(state);
 }
 
 
@@ -1243,7 +1321,6 @@ AddIPandMACcombo(SMACState *state,                     // IN: smac state
                 PrintMACAddrToString(macStr, sizeof macStr, mac)));
 
    ASSERTLOCKHELD();
-   ASSERT(SMAC_HASH_TABLE_SIZE == 256);
 
    if (AddrContainersMatch(&state->lastIPadded, addrContainer) &&
        MAC_EQ(mac, state->lastMACadded)) {
@@ -1313,8 +1390,7 @@ AddIPandMACcombo(SMACState *state,                     // IN: smac state
     */
 
    if (!entryIP) {
-      uint8 ipHash = IPAddrContainerHash(addrContainer);
-      
+      IPmacLookupEntry **bucket;
       IPmacLookupEntry *entry = ALLOCATEMEMORY(sizeof *entry,
                                                REORDER_TAG('SMle'));
       VNETKdPrint((MODULE_NAME "AddIPMACnew:  neither MAC or IP is in table, "
@@ -1335,17 +1411,18 @@ AddIPandMACcombo(SMACState *state,                     // IN: smac state
 
       // initialize the contents of the table entry
       LookupEntrySetIPAddrContainer(entry, addrContainer);
-      entry->lastAccess = 0; /* initialize to 0 for sanity, although it's not vital */
-
       MEMCPY(entry->mac, mac, ETH_ALEN);
 
-      // add entry to IP hash table
-      entry->ipNext = state->IPlookupTable[ipHash];
-      state->IPlookupTable[ipHash] = entry;
+      // add entry to IP hash table and LRU list
+      bucket = LookupBucket(state, IPAddrContainerHash(addrContainer));
+      entry->ipNext = *bucket;
+      *bucket = entry;
+      LruInsertHead(state, entry);
 
       VNETKdPrint((MODULE_NAME "AddIPMACnew: entry allocated, and added\n"));
       SetCacheEntry(state, entry);
       TrimLookupTableIfNecessary(state);
+      GrowLookupTableIfNecessary(state);
 
    } else {
 
@@ -4034,11 +4111,24 @@ SMAC_InitState(SMACState **ptr) // OUT: pointer to alloced/inited state
 
    VNETKdPrint((MODULE_NAME "SMAC_InitState: state %p\n", state));
 
+   state->IPlookupTable = ALLOCATEMEMORY(SMAC_HASH_TABLE_MIN_SIZE *
+                                         sizeof *state->IPlookupTable,
+                                         REORDER_TAG('SMht'));
+   if (state->IPlookupTable == NULL) {
+      FREEMEMORY(state);
+      *ptr = NULL;
+      return;
+   }
+   MEMSET(state->IPlookupTable, 0,
+          SMAC_HASH_TABLE_MIN_SIZE * sizeof *state->IPlookupTable);
+   state->hashTableSize = SMAC_HASH_TABLE_MIN_SIZE;
+
    INITSPINLOCK(&(state->smacSpinLock));
 #ifndef _WIN32
    if (state->smacSpinLock == NULL) {
       VNETKdPrint((MODULE_NAME "SMAC_InitState: coudln't initialize spinlock."
                    "Freeing state.\n"));
+      FREEMEMORY(state->IPlookupTable);
       FREEMEMORY(state);
       state = NULL;
    }
@@ -4150,8 +4240,8 @@ SMAC_SetForwardUnknownPackets(SMACState *state,    // IN: pointer to smac state
 void SMACINT
 SMAC_CleanupState(SMACState **ptr) // IN: state to dealloc
 {
-   uint32 i = 0;
    SMACState *state;
+   IPmacLookupEntry *entry;
 #ifdef _WIN32
    KIRQL irql;
 #endif
@@ -4169,15 +4259,13 @@ SMAC_CleanupState(SMACState **ptr) // IN: state to dealloc
    RAISEIRQL();
    ACQUIRESPINLOCK(&state->smacSpinLock);
 
-   for (i = 0; i < SMAC_HASH_TABLE_SIZE; ++i) {
-      IPmacLookupEntry * entry = state->IPlookupTable[i];
-      while (entry) {
-	 IPmacLookupEntry * next = entry->ipNext;
-	 VNETKdPrintCall(("--deleted entry\n"));
-	 FREEMEMORY(entry);
-	 --state->numberOfIPandMACEntries;
-	 entry = next;
-      }
+   entry = state->lruHead;
+   while (entry) {
+      IPmacLookupEntry * next = entry->lruNext;
+      VNETKdPrintCall(("--deleted entry\n"));
+      FREEMEMORY(entry);
+      --state->numberOfIPandMACEntries;
+      entry = next;
    }
    if (state->numberOfIPandMACEntries != 0) {
       VNETKdPrint((MODULE_NAME "SMAC_CleanupState: "
@@ -4189,6 +4277,7 @@ SMAC_CleanupState(SMACState **ptr) // IN: state to dealloc
    RELEASESPINLOCK(&state->smacSpinLock);
    FREESPINLOCK(&state->smacSpinLock);
    LOWERIRQL();
+   FREEMEMORY(state->IPlookupTable);
    FREEMEMORY(state);
 
    VNETKdPrintReturn(("SMAC_CleanupState"));
@@ -4503,77 +4592,6 @@ UpdateSum(uint16 oricheck, // IN: old checksum
 }
 
 
-/*
- *----------------------------------------------------------------------
- *
- * GetSystemUptime --
- *
- *      Return current uptime of system, this is essentially a wrapper
- *      that checks for overflow.  When 
- *      overflow occurs the existing last used times reduced by half.
- *      As part of the solution, the returned value always has the 
- *      highest bit turned on.
- *
- *      Previously, this was a wrapper for NdisGetSystemUptime().
- *      Recent updates to the DDK/WDK have confused this function - there
- *      is now a depricated 32-bit version and a 64-bit version only 
- *      available on newer version of the OS.  Rather than trying to be
- *      clever, we will use KeQueryTickCount instead.
- *
- *      This function should only be called with the lock held.
- *
- * Results:
- *      Returns uptime of system (skewed so always in upper half 
- *      of numeric range for 32-bits)
- *
- * Side effects:
- *      Updates the "last uptime" stored in adapter struct, and may
- *      modify the uptimes of all entries in the hash table.
- *
- *----------------------------------------------------------------------
- */
-
-static SmacLastAccess 
-GetSystemUptime(SMACState *state) // IN: smac state
-{
-   SmacLastAccess currentUptime;
-
-#ifdef _WIN32
-   {
-      LARGE_INTEGER arg;
-      KeQueryTickCount(&arg);
-      currentUptime = arg.QuadPart;
-   }
-#else
-   currentUptime = SMACL_GetUptime();
-#endif
-   /*
-    * Force on the highest bit.  This basically means that recent 
-    * values have the high bit turned on, while values that were 
-    * obtained prior to the last overflow will have the highest bit
-    * (and potentially other neighboring bits) turned off.
-    */
-
-   currentUptime |= (SmacLastAccess)1 << (sizeof currentUptime * 8 - 1);
-
-   /* If overflow occurred, then reduce all existing values by half */
-   if (currentUptime < state->lastUptimeRead) {
-      uint32 i;
-      VNETKdPrint((MODULE_NAME "GetSystemUptime: overflow detected, "
-		   "adjusting counters\n"));
-      for (i = 0; i < SMAC_HASH_TABLE_SIZE; ++i) {
-	 IPmacLookupEntry *entry = state->IPlookupTable[i];
-	 while (entry) {
-	    entry->lastAccess >>= 1; /* reduce value by half */
-	    entry = entry->ipNext;
-	 }
-      }
-   }
-   state->lastUptimeRead = currentUptime;
-   return currentUptime;
-}
-
-
 /*
  *----------------------------------------------------------------------
  *
@@ -62,27 +62,6 @@
 
 
 
-/*
- *----------------------------------------------------------------------
- * SMACL_GetUptime --
- *
- *      Wrapper for jiffies.
- *
- * Results:
- *      Uptime in ticks
- *
- * Side effects:
- *      None
- *
- *----------------------------------------------------------------------
- */
-
-unsigned long SMACINT
-SMACL_GetUptime()
-{
-   return jiffies;
-}
-
 /*
  *----------------------------------------------------------------------
  * SMACL_Memcpy --
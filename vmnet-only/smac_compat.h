@@ -41,8 +41,6 @@ void   SMACINT SMACL_Memset(void *p1, int val, size_t l);
 void*  SMACINT SMACL_Alloc(size_t s);
 void   SMACINT SMACL_Free(void *p);
 
-unsigned long SMACINT SMACL_GetUptime(void);
-
 void   SMACINT SMACL_InitSpinlock(void **s);
 void   SMACINT SMACL_AcquireSpinlock(void **s, unsigned long *flags);
 void   SMACINT SMACL_ReleaseSpinlock(void  **s, unsigned long *flags);
@@ -29,13 +29,18 @@
 
 #include <linux/slab.h>
 #include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
 
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
+#include <linux/tcp.h>
 #include "compat_skbuff.h"
 #include <linux/if_ether.h>
 #include <linux/sockios.h>
 #include "compat_sock.h"
+#include "compat_spinlock.h"
 
 #define __KERNEL_SYSCALLS__
 #include <asm/io.h>
@@ -57,6 +62,12 @@
 #include "vmnetInt.h"
 #include "vm_atomic.h"
 
+/*
+ * Receive queue depth histogram: bucket 0 counts arrivals at an empty
+ * queue, bucket n > 0 those at a depth of 2^(n-1) to 2^n - 1.
+ */
+#define VNET_QDEPTH_BUCKETS 14
+
 typedef struct VNetUserIFStats {
    unsigned    read;
    unsigned    written;
@@ -65,11 +76,49 @@ typedef struct VNetUserIFStats {
    unsigned    droppedMismatch;
    unsigned    droppedOverflow;
    unsigned    droppedLargePacket;
+   unsigned    droppedByteLimit;
+   unsigned    droppedEarly;
+   unsigned    queueDepth[VNET_QDEPTH_BUCKETS];
 } VNetUserIFStats;
 
+typedef struct VNetUserIfRing {
+   char                  *base;      // kernel mapping of the ring
+   struct page          **pages;     // pinned user pages backing the ring
+   unsigned               numPages;
+   uint32                 numSlots;
+   uint32                 head;      // next slot we produce/consume
+   uint32                 last;      // first slot of the last RX frame
+} VNetUserIfRing;
+
+typedef struct VNetUserIfCoalesce {
+   spinlock_t             lock;      // guards everything below
+   struct hrtimer         timer;     // notification deadline
+   uint32                 maxFrames; // tunables, see VNet_Coalesce
+   uint32                 maxUsecs;
+   uint32                 rateLow;
+   uint32                 rateHigh;
+   uint32                 frames;    // current packets per notification
+   uint32                 usecs;     // current deadline
+   uint32                 pending;   // packets since the last notification
+   Bool                   armed;     // timer is pending
+   uint64                 sampleStart; // ns, start of the rate sample
+   uint32                 sampleCount; // packets in the rate sample
+   uint32                 rate;      // packets/s of the last sample
+   unsigned               notified;  // notifications sent
+   unsigned               expired;   // ... of which by the timer
+} VNetUserIfCoalesce;
+
+/* Length of the window the packet rate is measured over. */
+#define VNET_COALESCE_SAMPLE_NS   (NSEC_PER_SEC / 250)
+
 typedef struct VNetUserIF {
    VNetPort               port;
    struct sk_buff_head    packetQueue;
+   atomic_t               queuedBytes;     // bytes on packetQueue
+   uint32                 maxQueuePackets; // limits, see VNet_QueueLimits
+   uint32                 maxQueueBytes;
+   uint32                 queueLowWater;
+   uint32                 earlyDropCredit; // spreads early drops evenly
    uint32*                pollPtr;
    Atomic_uint32*         actPtr;
    uint32                 pollMask;
@@ -79,11 +128,25 @@ typedef struct VNetUserIF {
    struct page*           actPage;
    struct page*           pollPage;
    struct page*           recvClusterPage;
-   VNetUserIFStats        stats;
+   uint32                 vnetHdrLen; // sizeof(VNet_VnetHdr) if negotiated
+   spinlock_t             ringLock;  // guards the rings below
+   uint32                 slotSize;
+   uint32                 ringVersion;
+   VNetUserIfRing         rxRing;
+   VNetUserIfRing         txRing;
+   VNetUserIfCoalesce     coalesce;
+   VNetUserIFStats       *stats;     // per-CPU
 } VNetUserIF;
 
+/* Most TX ring slots handled per hold of ringLock. */
+#define VNET_RING_KICK_BUDGET     64
+
+#define VNET_RING_SLOT(_ring, _slotSize, _i) \
+   ((VNet_RingSlot *)((_ring)->base + (_i) * (_slotSize)))
+
 static void VNetUserIfUnsetupNotify(VNetUserIF *userIf);
 static int  VNetUserIfSetupNotify(VNetUserIF *userIf, VNet_Notify *vn);
+static void VNetUserIfUnsetupRing(VNetUserIF *userIf);
 
 /*
  *-----------------------------------------------------------------------------
@@ -274,6 +337,10 @@ static INLINE int
 VNetUserIfSetupNotify(VNetUserIF *userIf, // IN
                       VNet_Notify *vn)           // IN
 {
+   uint32 *pollPtr = NULL;
+   uint32 *actPtr = NULL;
+   uint32 *recvClusterCount = NULL;
+   unsigned long flags;
    int retval;
 
    if (userIf->pollPtr || userIf->actPtr || userIf->recvClusterCount) {
@@ -282,25 +349,31 @@ VNetUserIfSetupNotify(VNetUserIF *userIf, // IN
    }
 
    if ((retval = VNetUserIfMapUint32Ptr((VA)vn->pollPtr, &userIf->pollPage, 
-                                       &userIf->pollPtr)) < 0) {
+                                       &pollPtr)) < 0) {
       return retval;
    }
    
    if ((retval = VNetUserIfMapUint32Ptr((VA)vn->actPtr, &userIf->actPage,
-                                       (uint32 **)&userIf->actPtr)) < 0) {
+                                       &actPtr)) < 0) {
       VNetUserIfUnsetupNotify(userIf);
       return retval;
    }
 
    if ((retval = VNetUserIfMapUint32Ptr((VA)vn->recvClusterPtr, 
 					&userIf->recvClusterPage,
-					&userIf->recvClusterCount)) < 0) {
+					&recvClusterCount)) < 0) {
       VNetUserIfUnsetupNotify(userIf);
       return retval;
    }
 
+   /* Notifiers see either no pointers or all of them, see UnsetupNotify. */
+   spin_lock_irqsave(&userIf->coalesce.lock, flags);
    userIf->pollMask = vn->pollMask;
    userIf->actMask = vn->actMask;
+   userIf->recvClusterCount = recvClusterCount;
+   userIf->actPtr = (Atomic_uint32 *)actPtr;
+   userIf->pollPtr = pollPtr;
+   spin_unlock_irqrestore(&userIf->coalesce.lock, flags);
    return 0;
 }
 
@@ -324,6 +397,23 @@ VNetUserIfSetupNotify(VNetUserIF *userIf, // IN
 static void
 VNetUserIfUnsetupNotify(VNetUserIF *userIf) // IN
 {
+   unsigned long flags;
+
+   /*
+    * pollPtr, actPtr and recvClusterCount are only dereferenced under
+    * coalesce.lock (VNetUserIfPacketPending, VNetUserIfClearPending and
+    * the coalescing timer), so once they are cleared here and the timer
+    * has finished, nothing can reach the pages unmapped below.
+    */
+   spin_lock_irqsave(&userIf->coalesce.lock, flags);
+   userIf->pollPtr = NULL;
+   userIf->actPtr = NULL;
+   userIf->recvClusterCount = NULL;
+   userIf->pollMask = 0;
+   userIf->actMask = 0;
+   spin_unlock_irqrestore(&userIf->coalesce.lock, flags);
+   hrtimer_cancel(&userIf->coalesce.timer);
+
    if (userIf->pollPage) {
       kunmap(userIf->pollPage);
       put_page(userIf->pollPage);
@@ -336,62 +426,1117 @@ VNetUserIfUnsetupNotify(VNetUserIF *userIf) // IN
    } else {
       LOG(0, (KERN_DEBUG "vmnet: actPtr was already deactivated\n"));
    }
-   if (userIf->recvClusterPage) {
-      kunmap(userIf->recvClusterPage);
-      put_page(userIf->recvClusterPage);
-   } else {
-      LOG(0, (KERN_DEBUG "vmnet: recvClusterPtr was already deactivated\n"));
+   if (userIf->recvClusterPage) {
+      kunmap(userIf->recvClusterPage);
+      put_page(userIf->recvClusterPage);
+   } else {
+      LOG(0, (KERN_DEBUG "vmnet: recvClusterPtr was already deactivated\n"));
+   }
+   userIf->pollPage = NULL;
+   userIf->actPage = NULL;
+   userIf->recvClusterPage = NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfUnmapRing --
+ *
+ *    Destroys the kernel mapping of a shared ring and unpins its pages.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The ring is cleared.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfUnmapRing(VNetUserIfRing *ring) // IN/OUT
+{
+   unsigned i;
+
+   if (ring->base) {
+      vunmap(ring->base);
+   }
+   if (ring->pages) {
+      for (i = 0; i < ring->numPages; i++) {
+         if (ring->pages[i]) {
+            put_page(ring->pages[i]);
+         }
+      }
+      kfree(ring->pages);
+   }
+   memset(ring, 0, sizeof *ring);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfMapRing --
+ *
+ *    Pins the user pages backing a shared ring and maps them contiguously
+ *    into the kernel. All slot headers are reset to VNET_RING_SLOT_EMPTY.
+ *
+ * Results:
+ *    0 on success
+ *    < 0 on failure: the actual value determines the type of failure
+ *
+ * Side effects:
+ *    Might sleep.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfMapRing(VA uAddr,             // IN: page aligned user VA
+                  uint32 numSlots,      // IN: number of slots
+                  uint32 slotSize,      // IN: size of each slot
+                  VNetUserIfRing *ring) // OUT: mapped ring
+{
+   size_t size = (size_t)numSlots * slotSize;
+   unsigned i;
+
+   memset(ring, 0, sizeof *ring);
+   if (numSlots == 0) {
+      return 0;
+   }
+
+   if ((uAddr & (PAGE_SIZE - 1)) || (size & (PAGE_SIZE - 1)) ||
+       VNetUserIfInvalidPointer(uAddr, size)) {
+      return -EINVAL;
+   }
+
+   ring->numPages = size / PAGE_SIZE;
+   ring->pages = kmalloc(ring->numPages * sizeof *ring->pages, GFP_KERNEL);
+   if (ring->pages == NULL) {
+      return -ENOMEM;
+   }
+   memset(ring->pages, 0, ring->numPages * sizeof *ring->pages);
+
+   for (i = 0; i < ring->numPages; i++) {
+      ring->pages[i] = UserifLockPage(uAddr + i * PAGE_SIZE);
+      if (ring->pages[i] == NULL) {
+         VNetUserIfUnmapRing(ring);
+         return -EAGAIN;
+      }
+   }
+
+   ring->base = vmap(ring->pages, ring->numPages, VM_MAP, PAGE_KERNEL);
+   if (ring->base == NULL) {
+      VNetUserIfUnmapRing(ring);
+      return -ENOMEM;
+   }
+
+   ring->numSlots = numSlots;
+   ring->head = 0;
+   for (i = 0; i < numSlots; i++) {
+      VNET_RING_SLOT(ring, slotSize, i)->status = VNET_RING_SLOT_EMPTY;
+      VNET_RING_SLOT(ring, slotSize, i)->len = 0;
+   }
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfSetupRing --
+ *
+ *    Sets up the shared RX and/or TX packet rings. Once the RX ring is
+ *    active, received packets are copied straight into it instead of
+ *    being queued on packetQueue.
+ *
+ * Results:
+ *    0 on success
+ *    < 0 on failure: the actual value determines the type of failure
+ *
+ * Side effects:
+ *    Pending packets on packetQueue are left for read().
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfSetupRing(VNetUserIF *userIf,  // IN
+                    VNet_RingSetup *rs)  // IN
+{
+   VNetUserIfRing rxRing;
+   VNetUserIfRing txRing;
+   unsigned long flags;
+   int retval;
+
+   if (rs->version != VNET_RING_VERSION &&
+       rs->version != VNET_RING_VERSION_V1) {
+      return -EINVAL;
+   }
+   if (rs->slotSize < VNET_RING_MIN_SLOT_SIZE || rs->slotSize > PAGE_SIZE ||
+       (rs->slotSize & (rs->slotSize - 1)) ||
+       rs->rxSlots > VNET_RING_MAX_SLOTS || rs->txSlots > VNET_RING_MAX_SLOTS ||
+       (rs->rxSlots == 0 && rs->txSlots == 0)) {
+      return -EINVAL;
+   }
+   if (userIf->rxRing.base || userIf->txRing.base) {
+      LOG(0, (KERN_DEBUG "vmnet: Packet ring already active\n"));
+      return -EBUSY;
+   }
+
+   retval = VNetUserIfMapRing((VA)rs->rxRing, rs->rxSlots, rs->slotSize,
+                              &rxRing);
+   if (retval < 0) {
+      return retval;
+   }
+   retval = VNetUserIfMapRing((VA)rs->txRing, rs->txSlots, rs->slotSize,
+                              &txRing);
+   if (retval < 0) {
+      VNetUserIfUnmapRing(&rxRing);
+      return retval;
+   }
+
+   spin_lock_irqsave(&userIf->ringLock, flags);
+   userIf->slotSize = rs->slotSize;
+   userIf->ringVersion = rs->version;
+   userIf->rxRing = rxRing;
+   userIf->txRing = txRing;
+   spin_unlock_irqrestore(&userIf->ringLock, flags);
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfUnsetupRing --
+ *
+ *    Tears down the shared packet rings. After ringLock is dropped no
+ *    receiver can be using them anymore, so they can be unmapped.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Packets are queued on packetQueue again.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfUnsetupRing(VNetUserIF *userIf) // IN
+{
+   VNetUserIfRing rxRing;
+   VNetUserIfRing txRing;
+   unsigned long flags;
+
+   spin_lock_irqsave(&userIf->ringLock, flags);
+   rxRing = userIf->rxRing;
+   txRing = userIf->txRing;
+   memset(&userIf->rxRing, 0, sizeof userIf->rxRing);
+   memset(&userIf->txRing, 0, sizeof userIf->txRing);
+   spin_unlock_irqrestore(&userIf->ringLock, flags);
+
+   VNetUserIfUnmapRing(&rxRing);
+   VNetUserIfUnmapRing(&txRing);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfFillVnetHdr --
+ *
+ *    Describes the checksum and segmentation offload state of skb in the
+ *    header that precedes it when VNET_API_FLAG_VNET_HDR is negotiated.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfFillVnetHdr(const struct sk_buff *skb, // IN
+                      VNet_VnetHdr *hdr)         // OUT
+{
+   memset(hdr, 0, sizeof *hdr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 4)
+   if (skb->ip_summed == VM_TX_CHECKSUM_PARTIAL) {
+      hdr->flags = VNET_HDR_F_NEEDS_CSUM;
+      hdr->csumStart = compat_skb_csum_start(skb);
+      hdr->csumOffset = compat_skb_csum_offset(skb);
+   }
+#endif
+#if defined(NETIF_F_GSO)
+   if (skb_shinfo(skb)->gso_size) {
+      unsigned int gsoType = skb_shinfo(skb)->gso_type;
+
+      if (gsoType & SKB_GSO_TCPV4) {
+         hdr->gsoType = VNET_HDR_GSO_TCPV4;
+      } else if (gsoType & SKB_GSO_TCPV6) {
+         hdr->gsoType = VNET_HDR_GSO_TCPV6;
+      }
+      if (hdr->gsoType != VNET_HDR_GSO_NONE) {
+         if (gsoType & SKB_GSO_TCP_ECN) {
+            hdr->gsoType |= VNET_HDR_GSO_ECN;
+         }
+         hdr->gsoSize = skb_shinfo(skb)->gso_size;
+         /* Ethernet, IP and TCP headers, not whatever is linear. */
+         hdr->hdrLen = compat_skb_transport_offset(skb) +
+                       (compat_skb_tcp_header(skb)->doff << 2);
+      }
+   }
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfRingData --
+ *
+ *    Locates byte 'pos' of a frame that starts in RX slot 'first' and may
+ *    span the following slots.
+ *
+ * Results:
+ *    Pointer into the ring; *avail is set to the number of bytes that
+ *    are contiguous from there.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static INLINE uint8 *
+VNetUserIfRingData(VNetUserIF *userIf, // IN
+                   uint32 first,       // IN: first slot of the frame
+                   uint32 pos,         // IN: offset in the frame
+                   uint32 *avail)      // OUT: contiguous bytes at pos
+{
+   VNetUserIfRing *ring = &userIf->rxRing;
+   uint32 dataSize = userIf->slotSize - sizeof(VNet_RingSlot);
+   uint32 idx = (first + pos / dataSize) % ring->numSlots;
+
+   *avail = dataSize - pos % dataSize;
+   return (uint8 *)(VNET_RING_SLOT(ring, userIf->slotSize, idx) + 1) +
+          pos % dataSize;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfRingCopy --
+ *
+ *    Copies 'len' bytes at 'offset' of skb to offset 'pad' + 'offset' of
+ *    a frame starting in RX slot 'first'. skb_copy_bits and
+ *    skb_copy_and_csum_bits read the paged fragments in place, so a
+ *    non-linear skb is never linearized. If csum is not NULL the data is
+ *    checksummed during the copy and the sum, relative to csumStart, is
+ *    accumulated in *csum.
+ *
+ * Results:
+ *    0 on success, -EFAULT if skb is shorter than expected.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfRingCopy(VNetUserIF *userIf,         // IN
+                   uint32 first,               // IN: first slot of the frame
+                   uint32 pad,                 // IN: bytes in front of skb
+                   const struct sk_buff *skb,  // IN
+                   uint32 offset,              // IN
+                   uint32 len,                 // IN
+                   uint32 csumStart,           // IN
+                   unsigned int *csum)         // IN/OUT: may be NULL
+{
+   while (len > 0) {
+      uint32 avail;
+      uint8 *to = VNetUserIfRingData(userIf, first, pad + offset, &avail);
+      uint32 chunk = min(len, avail);
+
+      if (csum) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+         unsigned int part = skb_copy_and_csum_bits(skb, offset, to, chunk);
+#else
+         unsigned int part = skb_copy_and_csum_bits(skb, offset, to, chunk,
+                                                     0);
+#endif
+         *csum = csum_block_add(*csum, part, offset - csumStart);
+      } else if (skb_copy_bits(skb, offset, to, chunk)) {
+         return -EFAULT;
+      }
+      offset += chunk;
+      len -= chunk;
+   }
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfRingWrite --
+ *
+ *    Stores 'len' bytes at offset 'pos' of a frame starting in RX slot
+ *    'first'. Used for small fields that may straddle two slots.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfRingWrite(VNetUserIF *userIf, // IN
+                    uint32 first,       // IN: first slot of the frame
+                    uint32 pos,         // IN: offset in the frame
+                    const void *src,    // IN
+                    uint32 len)         // IN
+{
+   while (len > 0) {
+      uint32 avail;
+      uint8 *to = VNetUserIfRingData(userIf, first, pos, &avail);
+      uint32 chunk = min(len, avail);
+
+      memcpy(to, src, chunk);
+      src = (const uint8 *)src + chunk;
+      pos += chunk;
+      len -= chunk;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfRingReceive --
+ *
+ *    Copies a received packet into the next RX ring slot(s), straight
+ *    from its linear area and page fragments into the pinned ring pages.
+ *    Partial checksums of outgoing host packets are computed during that
+ *    same copy, instead of in a separate skb_checksum_help pass over the
+ *    data, unless a VNet_VnetHdr hands them to the VMX. Frames that do
+ *    not fit in one slot span consecutive slots on version 2 rings.
+ *    ringLock must be held and the RX ring must be active.
+ *
+ * Results:
+ *    0 if the packet was placed in the ring, -ENOSPC if the ring is full,
+ *    -EMSGSIZE if the frame can never fit, -EFAULT if the copy failed.
+ *
+ * Side effects:
+ *    None. The caller still owns skb.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfRingReceive(VNetUserIF *userIf,  // IN
+                      struct sk_buff *skb) // IN
+{
+   VNetUserIfRing *ring = &userIf->rxRing;
+   uint32 dataSize = userIf->slotSize - sizeof(VNet_RingSlot);
+   uint32 hdrLen = userIf->vnetHdrLen;
+   uint32 len = hdrLen + skb->len;
+   uint32 numSlots = (len + dataSize - 1) / dataSize;
+   uint32 first = ring->head;
+   uint32 csumStart = skb->len;
+   uint32 csumField = 0;
+   unsigned int csum = 0;
+   uint32 i;
+   int retval;
+
+   if (numSlots == 0) {
+      numSlots = 1;
+   }
+   if (numSlots > ring->numSlots ||
+       (numSlots > 1 && userIf->ringVersion < VNET_RING_VERSION)) {
+      return -EMSGSIZE;
+   }
+   for (i = 0; i < numSlots; i++) {
+      uint32 idx = (first + i) % ring->numSlots;
+
+      if (VNET_RING_SLOT(ring, userIf->slotSize, idx)->status !=
+          VNET_RING_SLOT_EMPTY) {
+         return -ENOSPC;
+      }
+   }
+
+   if (hdrLen != 0) {
+      VNet_VnetHdr hdr;
+
+      VNetUserIfFillVnetHdr(skb, &hdr);
+      VNetUserIfRingWrite(userIf, first, 0, &hdr, sizeof hdr);
+   }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 4)
+   if (hdrLen == 0 &&
+       skb->pkt_type == PACKET_OUTGOING &&
+       skb->ip_summed == VM_TX_CHECKSUM_PARTIAL) {
+      csumStart = compat_skb_csum_start(skb);
+      csumField = csumStart + compat_skb_csum_offset(skb);
+      if (csumStart > skb->len || csumField + sizeof(uint16) > skb->len) {
+         return -EFAULT;
+      }
+   }
+#endif
+
+   retval = VNetUserIfRingCopy(userIf, first, hdrLen, skb, 0, csumStart, 0,
+                               NULL);
+   if (retval == 0 && csumStart < skb->len) {
+      uint16 sum;
+
+      retval = VNetUserIfRingCopy(userIf, first, hdrLen, skb, csumStart,
+                                  skb->len - csumStart, csumStart, &csum);
+      /* 0xFFFF is the same sum as 0 and is also valid for UDP. */
+      sum = csum_fold(csum) ?: 0xFFFF;
+      VNetUserIfRingWrite(userIf, first, csumField, &sum, sizeof sum);
+   }
+   if (retval < 0) {
+      return retval;
+   }
+
+   for (i = 0; i < numSlots; i++) {
+      VNet_RingSlot *slot =
+         VNET_RING_SLOT(ring, userIf->slotSize, (first + i) % ring->numSlots);
+
+      slot->len = i == 0 ? len : min(len - i * dataSize, dataSize);
+      if (i > 0) {
+         slot->status = VNET_RING_SLOT_CONT;
+      }
+   }
+   wmb();
+   VNET_RING_SLOT(ring, userIf->slotSize, first)->status =
+      VNET_RING_SLOT_READY;
+
+   ring->last = first;
+   ring->head = (first + numSlots) % ring->numSlots;
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfShape --
+ *
+ *      Runs a frame of len bytes through the shaper of direction dir,
+ *      if the port has one.
+ *
+ * Results:
+ *      TRUE if the frame may pass, FALSE if it is over the rate limit.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetUserIfShape(VNetUserIF *userIf, // IN
+                int dir,            // IN: VNET_SHAPER_TX or VNET_SHAPER_RX
+                unsigned int len)   // IN
+{
+   VNetShaper *shaper;
+   Bool pass = TRUE;
+
+   rcu_read_lock();
+   shaper = rcu_dereference(userIf->port.shaper[dir]);
+   if (shaper) {
+      pass = VNetShaper_Admit(shaper, len);
+   }
+   rcu_read_unlock();
+   return pass;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfRingKick --
+ *
+ *    Handler for SIOCRINGKICK. Sends all READY slots of the TX ring,
+ *    starting at the last consumed one, to the peer jack in batches of
+ *    at most VNET_RING_KICK_BUDGET frames.
+ *
+ * Results:
+ *    Number of frames consumed, or -errno.
+ *
+ * Side effects:
+ *    Consumed slots are handed back as VNET_RING_SLOT_EMPTY.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfRingKick(VNetUserIF *userIf) // IN
+{
+   VNetUserIfRing *ring = &userIf->txRing;
+   struct sk_buff_head batch;
+   struct sk_buff *skb;
+   unsigned long flags;
+   Bool down = !UP_AND_RUNNING(userIf->port.flags);
+   Bool more = TRUE;
+   int consumed = 0;
+   int budget;
+
+   __skb_queue_head_init(&batch);
+
+   while (more) {
+      /*
+       * Interrupts are off while ringLock is held, so the ring is drained
+       * VNET_RING_KICK_BUDGET slots at a time and each chunk is sent
+       * before the lock is taken again.
+       */
+      spin_lock_irqsave(&userIf->ringLock, flags);
+      if (ring->base == NULL) {
+         spin_unlock_irqrestore(&userIf->ringLock, flags);
+         return consumed > 0 ? consumed : -EINVAL;
+      }
+
+      for (budget = VNET_RING_KICK_BUDGET; budget > 0; budget--) {
+         VNet_RingSlot *slot;
+         uint32 len;
+
+         if (consumed >= ring->numSlots) {
+            more = FALSE;
+            break;
+         }
+         slot = VNET_RING_SLOT(ring, userIf->slotSize, ring->head);
+         if (slot->status != VNET_RING_SLOT_READY) {
+            more = FALSE;
+            break;
+         }
+         rmb();
+         len = slot->len;
+
+         if (down) {
+            VNET_STAT_INC(userIf->stats, droppedDown);
+         } else if (len < sizeof (struct ethhdr) ||
+                    len > ETHER_MAX_QUEUED_PACKET ||
+                    len > userIf->slotSize - sizeof *slot) {
+            VNET_STAT_INC(userIf->stats, droppedLargePacket);
+         } else if (!VNetUserIfShape(userIf, VNET_SHAPER_TX, len)) {
+            /* Over the rate limit, consumed like a frame sent while down. */
+         } else {
+            skb = dev_alloc_skb(len + 7);
+            if (skb == NULL) {
+               /* Leave the slot READY, the VMX will kick again. */
+               more = FALSE;
+               break;
+            }
+            skb_reserve(skb, 2);
+            memcpy(skb_put(skb, len), slot + 1, len);
+            __skb_queue_tail(&batch, skb);
+         }
+
+         mb();
+         slot->status = VNET_RING_SLOT_EMPTY;
+         if (++ring->head == ring->numSlots) {
+            ring->head = 0;
+         }
+         consumed++;
+      }
+      spin_unlock_irqrestore(&userIf->ringLock, flags);
+
+      VNET_STAT_ADD(userIf->stats, written, skb_queue_len(&batch));
+      VNetSendList(&userIf->port.jack, &batch);
+   }
+   return consumed;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfWake --
+ *
+ *      Tells the VMX that packets are pending: optionally sets actMask
+ *      in its action word and wakes up readers and pollers.
+ *      coalesce.lock must be held, it keeps actPtr mapped.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfWake(VNetUserIF *userIf, // IN
+               Bool act)           // IN: set actMask too
+{
+   if (act && userIf->pollPtr) {
+      Atomic_Or(userIf->actPtr, userIf->actMask);
+   }
+   wake_up(&userIf->waitQueue);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfClearPending --
+ *
+ *      Clears pollMask in the VMX's poll word once packetQueue is empty.
+ *      The check is made under coalesce.lock, which keeps pollPtr
+ *      mapped and orders it against VNetUserIfPacketPending setting the
+ *      bit for a packet queued meanwhile.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfClearPending(VNetUserIF *userIf) // IN
+{
+   unsigned long flags;
+
+   spin_lock_irqsave(&userIf->coalesce.lock, flags);
+   if (userIf->pollPtr && skb_queue_empty(&userIf->packetQueue)) {
+      *userIf->pollPtr &= ~userIf->pollMask;
+   }
+   spin_unlock_irqrestore(&userIf->coalesce.lock, flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfCoalesceTimer --
+ *
+ *      Coalescing deadline: notifies the VMX about the packets that did
+ *      not reach the packet threshold in time.
+ *
+ * Results:
+ *      HRTIMER_NORESTART.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static enum hrtimer_restart
+VNetUserIfCoalesceTimer(struct hrtimer *timer) // IN
+{
+   VNetUserIF *userIf = container_of(timer, VNetUserIF, coalesce.timer);
+   VNetUserIfCoalesce *c = &userIf->coalesce;
+   unsigned long flags;
+   Bool notify;
+
+   spin_lock_irqsave(&c->lock, flags);
+   notify = c->pending != 0;
+   c->pending = 0;
+   c->armed = FALSE;
+   if (notify) {
+      c->notified++;
+      c->expired++;
+      VNetUserIfWake(userIf, TRUE);
+   }
+   spin_unlock_irqrestore(&c->lock, flags);
+   return HRTIMER_NORESTART;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfCoalesceAdapt --
+ *
+ *      Accounts one packet in the rate sample. When the sample window is
+ *      over, derives the packet threshold and deadline from the measured
+ *      rate: none at or below rateLow, the configured maxima at or above
+ *      rateHigh, linear in between. The first packet after an idle
+ *      period therefore always goes out immediately.
+ *      coalesce.lock must be held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates frames, usecs and rate.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfCoalesceAdapt(VNetUserIfCoalesce *c) // IN/OUT
+{
+   uint64 now = ktime_to_ns(ktime_get());
+   uint64 elapsed = now - c->sampleStart;
+   uint64 scale;
+   uint64 range;
+
+   c->sampleCount++;
+   if (elapsed < VNET_COALESCE_SAMPLE_NS) {
+      return;
+   }
+
+   c->rate = (uint32)min_t(uint64, div64_u64((uint64)c->sampleCount *
+                                             NSEC_PER_SEC, elapsed),
+                           0xFFFFFFFF);
+   c->sampleStart = now;
+   c->sampleCount = 0;
+
+   if (c->rate <= c->rateLow) {
+      c->frames = 1;
+      c->usecs = 0;
+   } else if (c->rate >= c->rateHigh) {
+      c->frames = c->maxFrames;
+      c->usecs = c->maxUsecs;
+   } else {
+      scale = c->rate - c->rateLow;
+      range = c->rateHigh - c->rateLow;
+      c->frames = 1 + (uint32)div64_u64((uint64)(c->maxFrames - 1) * scale,
+                                        range);
+      c->usecs = (uint32)div64_u64((uint64)c->maxUsecs * scale, range);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfPacketPending --
+ *
+ *      Called once a packet was queued or placed in the RX ring. Sets
+ *      pollMask right away and, unless coalescing defers it, notifies
+ *      the VMX. Without coalescing actMask is set for RX ring frames and
+ *      once recvClusterCount packets are queued.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May arm the coalescing timer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfPacketPending(VNetUserIF *userIf, // IN
+                        Bool ring)          // IN: placed in the RX ring
+{
+   VNetUserIfCoalesce *c = &userIf->coalesce;
+   unsigned long flags;
+   Bool notify = TRUE;
+   Bool act = FALSE;
+
+   /* coalesce.lock keeps the notify pages mapped, see UnsetupNotify. */
+   spin_lock_irqsave(&c->lock, flags);
+   if (userIf->pollPtr) {
+      *userIf->pollPtr |= userIf->pollMask;
+      act = ring || skb_queue_len(&userIf->packetQueue) >=
+                    *userIf->recvClusterCount;
+   }
+
+   if (c->maxFrames > 1) {
+      act = TRUE;
+      VNetUserIfCoalesceAdapt(c);
+      if (++c->pending >= c->frames || c->usecs == 0) {
+         c->pending = 0;
+         if (c->armed && hrtimer_try_to_cancel(&c->timer) >= 0) {
+            c->armed = FALSE;
+         }
+      } else {
+         if (!c->armed) {
+            c->armed = TRUE;
+            hrtimer_start(&c->timer, ns_to_ktime(c->usecs * NSEC_PER_USEC),
+                          HRTIMER_MODE_REL);
+         }
+         notify = FALSE;
+      }
+      if (notify) {
+         c->notified++;
+      }
+   }
+   if (notify) {
+      VNetUserIfWake(userIf, act);
+   }
+   spin_unlock_irqrestore(&c->lock, flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfSetCoalesce --
+ *
+ *      Handler for SIOCSETCOALESCE.
+ *
+ * Results:
+ *      0 on success, -errno on failure.
+ *
+ * Side effects:
+ *      Restarts rate measurement. Packets waiting for a deadline are
+ *      notified at once when coalescing is turned off.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfSetCoalesce(VNetUserIF *userIf,  // IN
+                      unsigned long ioarg) // IN: VNet_Coalesce
+{
+   VNetUserIfCoalesce *c = &userIf->coalesce;
+   VNet_Coalesce vc;
+   unsigned long flags;
+   Bool flush;
+
+   if (copy_from_user(&vc, (void *)ioarg, sizeof vc)) {
+      return -EFAULT;
+   }
+   if (vc.version != VNET_COALESCE_VERSION) {
+      return -EINVAL;
+   }
+   if (vc.maxFrames > 1 &&
+       (vc.maxFrames > VNET_QUEUE_MAX_PACKETS || vc.maxUsecs == 0 ||
+        vc.maxUsecs > VNET_COALESCE_MAX_USECS || vc.rateLow >= vc.rateHigh)) {
+      return -EINVAL;
+   }
+
+   spin_lock_irqsave(&c->lock, flags);
+   WRITE_ONCE(c->maxFrames, vc.maxFrames);
+   c->maxUsecs = vc.maxUsecs;
+   c->rateLow = vc.rateLow;
+   c->rateHigh = vc.rateHigh;
+   c->frames = 1;
+   c->usecs = 0;
+   c->rate = 0;
+   c->sampleStart = ktime_to_ns(ktime_get());
+   c->sampleCount = 0;
+   flush = c->pending != 0;
+   c->pending = 0;
+   if (flush) {
+      VNetUserIfWake(userIf, TRUE);
+   }
+   spin_unlock_irqrestore(&c->lock, flags);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfFree --
+ *
+ *      Free the user interface port.
+ *
+ * Results: 
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfFree(VNetJack *this) // IN
+{
+   VNetUserIF *userIf = (VNetUserIF*)this;
+   struct sk_buff *skb;
+
+   for (;;) {
+      skb = skb_dequeue(&userIf->packetQueue);
+      if (skb == NULL) {
+	 break;
+      }
+      dev_kfree_skb(skb);
+   }
+   
+   if (userIf->pollPtr) {
+      VNetUserIfUnsetupNotify(userIf);
+   }
+   hrtimer_cancel(&userIf->coalesce.timer);
+
+   VNetUserIfUnsetupRing(userIf);
+
+   VNetShaper_Free(userIf->port.shaper[VNET_SHAPER_TX]);
+   VNetShaper_Free(userIf->port.shaper[VNET_SHAPER_RX]);
+
+   if (this->procEntry) {
+      VNetProc_RemoveEntry(this->procEntry);
+   }
+
+   VNET_STATS_FREE(userIf->stats);
+   kfree(userIf);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfDequeued --
+ *
+ *      Accounts for skb having been taken off packetQueue.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+VNetUserIfDequeued(VNetUserIF *userIf,         // IN
+                   const struct sk_buff *skb)  // IN
+{
+   atomic_sub(skb->len, &userIf->queuedBytes);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfEarlyDrop --
+ *
+ *      Decides whether a packet arriving at a queue holding qlen packets
+ *      is dropped early. Above the low watermark the share of dropped
+ *      arrivals grows linearly up to all of them at the packet limit.
+ *      A credit counter spreads those drops evenly over the arrivals
+ *      rather than drawing random numbers.
+ *
+ * Results:
+ *      TRUE if the packet must be dropped.
+ *
+ * Side effects:
+ *      Updates earlyDropCredit.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetUserIfEarlyDrop(VNetUserIF *userIf, // IN
+                    uint32 qlen)        // IN
+{
+   uint32 low = READ_ONCE(userIf->queueLowWater);
+   uint32 max = READ_ONCE(userIf->maxQueuePackets);
+   uint32 credit;
+
+   if (low == 0 || qlen <= low || max <= low) {
+      return FALSE;
+   }
+   credit = userIf->earlyDropCredit + (qlen - low);
+   if (credit >= max - low) {
+      userIf->earlyDropCredit = credit - (max - low);
+      return TRUE;
+   }
+   userIf->earlyDropCredit = credit;
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfSetQueueLimits --
+ *
+ *      Handler for SIOCSETQUEUELIMITS.
+ *
+ * Results:
+ *      0 on success, -errno on failure.
+ *
+ * Side effects:
+ *      Packets already queued are kept even if they exceed the new
+ *      limits.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfSetQueueLimits(VNetUserIF *userIf,  // IN
+                         unsigned long ioarg) // IN: VNet_QueueLimits
+{
+   VNet_QueueLimits ql;
+
+   if (copy_from_user(&ql, (void *)ioarg, sizeof ql)) {
+      return -EFAULT;
+   }
+   if (ql.version != VNET_QUEUE_LIMITS_VERSION ||
+       ql.maxPackets == 0 || ql.maxPackets > VNET_QUEUE_MAX_PACKETS ||
+       ql.lowWater >= ql.maxPackets ||
+       (ql.maxBytes != 0 && ql.maxBytes < ETHER_MAX_QUEUED_PACKET)) {
+      return -EINVAL;
    }
-   userIf->pollPtr = NULL;
-   userIf->pollPage = NULL;
-   userIf->actPtr = NULL;
-   userIf->actPage = NULL;
-   userIf->recvClusterCount = NULL;
-   userIf->recvClusterPage = NULL;
-   userIf->pollMask = 0;
-   userIf->actMask = 0;
+
+   WRITE_ONCE(userIf->maxQueuePackets, ql.maxPackets);
+   WRITE_ONCE(userIf->maxQueueBytes, ql.maxBytes);
+   WRITE_ONCE(userIf->queueLowWater, ql.lowWater);
+   userIf->earlyDropCredit = 0;
+   return 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfFree --
+ * VNetUserIfSetShaper --
  *
- *      Free the user interface port.
+ *      Handler for SIOCSETSHAPER. Replaces the shaper of one direction
+ *      of the port, or removes it if the rate is 0.
  *
- * Results: 
- *      None.
+ * Results:
+ *      0 on success, else -errno.
  *
  * Side effects:
- *      None.
+ *      The new shaper starts with a full bucket.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-VNetUserIfFree(VNetJack *this) // IN
+static int
+VNetUserIfSetShaper(VNetUserIF *userIf,  // IN
+                    unsigned long ioarg) // IN: VNet_Shaper
 {
-   VNetUserIF *userIf = (VNetUserIF*)this;
-   struct sk_buff *skb;
+   VNet_Shaper vs;
+   VNetShaper *shaper = NULL;
+   VNetShaper *old;
 
-   for (;;) {
-      skb = skb_dequeue(&userIf->packetQueue);
-      if (skb == NULL) {
-	 break;
-      }
-      dev_kfree_skb(skb);
+   if (copy_from_user(&vs, (void *)ioarg, sizeof vs)) {
+      return -EFAULT;
    }
-   
-   if (userIf->pollPtr) {
-      VNetUserIfUnsetupNotify(userIf);
+   if (vs.version != VNET_SHAPER_VERSION ||
+       vs.direction >= VNET_SHAPER_DIRS || vs.pad != 0 ||
+       (vs.rate != 0 && vs.burst < VNET_SHAPER_MIN_BURST)) {
+      return -EINVAL;
    }
 
-   if (this->procEntry) {
-      VNetProc_RemoveEntry(this->procEntry);
+   if (vs.rate != 0) {
+      shaper = VNetShaper_Create(vs.rate, vs.burst);
+      if (shaper == NULL) {
+         return -ENOMEM;
+      }
    }
 
-   kfree(userIf);
+   /* xchg() is a full barrier, so it publishes the shaper safely. */
+   old = xchg(&userIf->port.shaper[vs.direction], shaper);
+   synchronize_rcu();
+   VNetShaper_Free(old);
+   return 0;
 }
 
 
@@ -417,9 +1562,11 @@ VNetUserIfReceive(VNetJack       *this, // IN
 {
    VNetUserIF *userIf = (VNetUserIF*)this->private;
    uint8 *dest = SKB_2_DESTMAC(skb);
+   uint32 qlen;
+   uint32 maxBytes;
    
    if (!UP_AND_RUNNING(userIf->port.flags)) {
-      userIf->stats.droppedDown++;
+      VNET_STAT_INC(userIf->stats, droppedDown);
       goto drop_packet;
    }
    
@@ -427,30 +1574,69 @@ VNetUserIfReceive(VNetJack       *this, // IN
                         userIf->port.paddr,
                         userIf->port.ladrf,
                         userIf->port.flags)) {
-      userIf->stats.droppedMismatch++;
+      VNET_STAT_INC(userIf->stats, droppedMismatch);
       goto drop_packet;
    }
    
-   if (skb_queue_len(&userIf->packetQueue) >= VNET_MAX_QLEN) {
-      userIf->stats.droppedOverflow++;
+   if (!VNetUserIfShape(userIf, VNET_SHAPER_RX, skb->len)) {
       goto drop_packet;
    }
-   
+
+   /*
+    * The RX ring is not limited to ETHER_MAX_QUEUED_PACKET: version 2
+    * rings take anything that fits in the ring, spanning slots.
+    */
+   if (userIf->rxRing.base) {
+      unsigned long flags;
+      int retval = -ENOSPC;
+
+      spin_lock_irqsave(&userIf->ringLock, flags);
+      if (userIf->rxRing.base) {
+         retval = VNetUserIfRingReceive(userIf, skb);
+      }
+      spin_unlock_irqrestore(&userIf->ringLock, flags);
+
+      if (retval == -EMSGSIZE) {
+         VNET_STAT_INC(userIf->stats, droppedLargePacket);
+         goto drop_packet;
+      } else if (retval < 0) {
+         VNET_STAT_INC(userIf->stats, droppedOverflow);
+         goto drop_packet;
+      }
+      VNET_STAT_INC(userIf->stats, queued);
+      dev_kfree_skb(skb);
+      VNetUserIfPacketPending(userIf, TRUE);
+      return;
+   }
+
    if (skb->len > ETHER_MAX_QUEUED_PACKET) {
-      userIf->stats.droppedLargePacket++;
+      VNET_STAT_INC(userIf->stats, droppedLargePacket);
+      goto drop_packet;
+   }
+
+   qlen = skb_queue_len(&userIf->packetQueue);
+   VNET_STAT_INC(userIf->stats,
+                 queueDepth[min(qlen ? fls(qlen) : 0, VNET_QDEPTH_BUCKETS - 1)]);
+   if (qlen >= READ_ONCE(userIf->maxQueuePackets)) {
+      VNET_STAT_INC(userIf->stats, droppedOverflow);
+      goto drop_packet;
+   }
+   maxBytes = READ_ONCE(userIf->maxQueueBytes);
+   if (maxBytes != 0 &&
+       atomic_read(&userIf->queuedBytes) + skb->len > maxBytes) {
+      VNET_STAT_INC(userIf->stats, droppedByteLimit);
+      goto drop_packet;
+   }
+   if (VNetUserIfEarlyDrop(userIf, qlen)) {
+      VNET_STAT_INC(userIf->stats, droppedEarly);
       goto drop_packet;
    }
 
-   userIf->stats.queued++;
+   VNET_STAT_INC(userIf->stats, queued);
 
+   atomic_add(skb->len, &userIf->queuedBytes);
    skb_queue_tail(&userIf->packetQueue, skb);
-   if (userIf->pollPtr) {
-      *userIf->pollPtr |= userIf->pollMask;
-      if (skb_queue_len(&userIf->packetQueue) >= (*userIf->recvClusterCount)) {
-         Atomic_Or(userIf->actPtr, userIf->actMask);
-      }
-   }
-   wake_up(&userIf->waitQueue);
+   VNetUserIfPacketPending(userIf, FALSE);
    return;
    
  drop_packet:
@@ -458,6 +1644,30 @@ VNetUserIfReceive(VNetJack       *this, // IN
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfIsPromisc --
+ *
+ *      Check whether the port was put in promiscuous mode.
+ *
+ * Results: 
+ *      TRUE if promiscuous, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetUserIfIsPromisc(VNetJack *this) // IN
+{
+   VNetUserIF *userIf = (VNetUserIF*)this->private;
+   return (userIf->port.flags & IFF_PROMISC) != 0;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -490,6 +1700,7 @@ VNetUserIfProcRead(char    *page,  // IN/OUT: buffer to write into
 {
    VNetUserIF *userIf = (VNetUserIF*)data; 
    int len = 0;
+   int i;
    
    if (!userIf) {
       return len;
@@ -506,9 +1717,9 @@ VNetUserIfProcRead(char    *page,  // IN/OUT: buffer to write into
 #else
    len += sprintf(page+len, "read %u written %u queued %u ",
 #endif
-                  userIf->stats.read,
-                  userIf->stats.written,
-                  userIf->stats.queued);
+                  VNET_STAT_SUM(userIf->stats, read),
+                  VNET_STAT_SUM(userIf->stats, written),
+                  VNET_STAT_SUM(userIf->stats, queued));
    
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
    seq_printf(seqf,
@@ -517,10 +1728,48 @@ VNetUserIfProcRead(char    *page,  // IN/OUT: buffer to write into
 #endif
 		  "dropped.down %u dropped.mismatch %u "
 		  "dropped.overflow %u dropped.largePacket %u",
-                  userIf->stats.droppedDown,
-                  userIf->stats.droppedMismatch,
-                  userIf->stats.droppedOverflow,
-		  userIf->stats.droppedLargePacket);
+                  VNET_STAT_SUM(userIf->stats, droppedDown),
+                  VNET_STAT_SUM(userIf->stats, droppedMismatch),
+                  VNET_STAT_SUM(userIf->stats, droppedOverflow),
+		  VNET_STAT_SUM(userIf->stats, droppedLargePacket));
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+   seq_printf(seqf,
+#else
+   len += sprintf(page+len,
+#endif
+                  " dropped.byteLimit %u dropped.early %u "
+                  "queue.limit %u queue.byteLimit %u queue.lowWater %u "
+                  "queue.len %u queue.bytes %u queue.depth",
+                  VNET_STAT_SUM(userIf->stats, droppedByteLimit),
+                  VNET_STAT_SUM(userIf->stats, droppedEarly),
+                  userIf->maxQueuePackets, userIf->maxQueueBytes,
+                  userIf->queueLowWater,
+                  skb_queue_len(&userIf->packetQueue),
+                  atomic_read(&userIf->queuedBytes));
+   for (i = 0; i < VNET_QDEPTH_BUCKETS; i++) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+      seq_printf(seqf,
+#else
+      len += sprintf(page+len,
+#endif
+                     " %u:%u", i ? 1U << (i - 1) : 0,
+                     VNET_STAT_SUM(userIf->stats, queueDepth[i]));
+   }
+
+   if (READ_ONCE(userIf->coalesce.maxFrames) > 1) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+      seq_printf(seqf,
+#else
+      len += sprintf(page+len,
+#endif
+                     " coalesce.rate %u coalesce.frames %u "
+                     "coalesce.usecs %u coalesce.notified %u "
+                     "coalesce.expired %u",
+                     userIf->coalesce.rate, userIf->coalesce.frames,
+                     userIf->coalesce.usecs, userIf->coalesce.notified,
+                     userIf->coalesce.expired);
+   }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
    seq_printf(seqf, "\n");
@@ -723,7 +1972,9 @@ VNetCsumCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
  * VNetCopyDatagramToUser --
  *
  *      Copy complete datagram to the user space. Fill correct checksum
- *	into the copied datagram if nobody did it yet.
+ *	into the copied datagram if nobody did it yet, or describe the
+ *	missing checksum in a leading VNet_VnetHdr if hdrLen is not 0.
+ *	count must be at least hdrLen.
  *
  * Results: 
  *      On success byte count, on failure -EFAULT.
@@ -734,11 +1985,30 @@ VNetCsumCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
  *----------------------------------------------------------------------
  */
 
-static INLINE_SINGLE_CALLER int
+static INLINE int
 VNetCopyDatagramToUser(const struct sk_buff *skb,	// IN
+		       uint32 hdrLen,			// IN: 0 or VNet_VnetHdr
 		       char *buf,			// OUT
 		       size_t count)			// IN
 {
+   if (hdrLen != 0) {
+      VNet_VnetHdr hdr;
+
+      VNetUserIfFillVnetHdr(skb, &hdr);
+      if (copy_to_user(buf, &hdr, sizeof hdr)) {
+	 return -EFAULT;
+      }
+      count = min(count - hdrLen, (size_t)skb->len);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 4, 4)
+      if (copy_to_user(buf + hdrLen, skb->data, count)) {
+#else
+      if (VNetCopyDatagram(skb, buf + hdrLen, count)) {
+#endif
+	 return -EFAULT;
+      }
+      return hdrLen + count;
+   }
+
    if (count > skb->len) {
       count = skb->len;
    }
@@ -809,6 +2079,7 @@ VNetUserIfRead(VNetPort    *port, // IN
                size_t      count) // IN
 {
    VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
+   uint32 hdrLen = READ_ONCE(userIf->vnetHdrLen);
    struct sk_buff *skb;
    int ret;
    DECLARE_WAITQUEUE(wait, current);
@@ -817,31 +2088,31 @@ VNetUserIfRead(VNetPort    *port, // IN
    for (;;) {
       set_current_state(TASK_INTERRUPTIBLE);
       skb = skb_peek(&userIf->packetQueue);
-      if (skb && (skb->len > count)) {
+      if (skb && (hdrLen + skb->len > count)) {
          skb = NULL;
          ret = -EMSGSIZE;
          break;
       }
       ret = -EAGAIN;
       skb = skb_dequeue(&userIf->packetQueue);
+      if (skb) {
+         VNetUserIfDequeued(userIf, skb);
+      }
 
-      if (userIf->pollPtr) {
-         if (skb_queue_empty(&userIf->packetQueue)) {
-            *userIf->pollPtr &= ~userIf->pollMask;
-         }
+      VNetUserIfClearPending(userIf);
 #if 0
-         /*
-          * Disable this for now since the monitor likes to assert that
-          * actions are present and thus can't cope with them disappearing
-          * out from under it.  See bug 47760.  -Jeremy. 22 July 2004
-          */
-
-         if (skb_queue_len(&userIf->packetQueue) < (*userIf->recvClusterCount) &&
-             (Atomic_Read(userIf->actPtr) & userIf->actMask) != 0) {
-            Atomic_And(userIf->actPtr, ~userIf->actMask);
-         }
-#endif
+      /*
+       * Disable this for now since the monitor likes to assert that
+       * actions are present and thus can't cope with them disappearing
+       * out from under it.  See bug 47760.  -Jeremy. 22 July 2004
+       */
+
+      if (userIf->pollPtr &&
+          skb_queue_len(&userIf->packetQueue) < (*userIf->recvClusterCount) &&
+          (Atomic_Read(userIf->actPtr) & userIf->actMask) != 0) {
+         Atomic_And(userIf->actPtr, ~userIf->actMask);
       }
+#endif
 
       if (skb != NULL || filp->f_flags & O_NONBLOCK) {
          break;
@@ -858,14 +2129,114 @@ VNetUserIfRead(VNetPort    *port, // IN
       return ret;
    }
 
-   userIf->stats.read++;
+   VNET_STAT_INC(userIf->stats, read);
 
-   count = VNetCopyDatagramToUser(skb, buf, count);
+   count = VNetCopyDatagramToUser(skb, hdrLen, buf, count);
    dev_kfree_skb(skb);
    return count;
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfRecvBatch --
+ *
+ *      Handler for SIOCRECVBATCH. Dequeues as many pending packets as
+ *      fit into the user buffer (up to maxPackets) under a single hold
+ *      of the queue lock, then copies them out as length-prefixed
+ *      frames. Never sleeps waiting for packets: the caller is expected
+ *      to use poll() or the notify page to learn about pending packets.
+ *
+ * Results:
+ *      0 on success (numPackets may be 0 if nothing was pending),
+ *      -EMSGSIZE if the first pending packet does not fit into buf,
+ *      else -errno.
+ *
+ * Side effects:
+ *      Clears pollMask in *pollPtr once the queue is drained, see
+ *      VNetUserIfClearPending.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfRecvBatch(VNetUserIF *userIf, // IN
+                    unsigned long ioarg) // IN/OUT: VNet_RecvBatch
+{
+   VNet_RecvBatch rb;
+   struct sk_buff_head batch;
+   struct sk_buff *skb;
+   unsigned long flags;
+   char *buf;
+   uint32 hdrLen = READ_ONCE(userIf->vnetHdrLen);
+   uint32 used = 0;
+   int retval = 0;
+
+   if (copy_from_user(&rb, (void *)ioarg, sizeof rb)) {
+      return -EFAULT;
+   }
+   if (rb.version != VNET_RECVBATCH_VERSION) {
+      return -EINVAL;
+   }
+   buf = (char *)(VA)rb.buf;
+   if (VNetUserIfInvalidPointer((VA)buf, rb.bufLen)) {
+      return -EFAULT;
+   }
+
+   rb.numPackets = 0;
+   rb.nextLen = 0;
+   __skb_queue_head_init(&batch);
+
+   spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+   while ((skb = skb_peek(&userIf->packetQueue)) != NULL) {
+      if (skb_queue_len(&batch) >= rb.maxPackets ||
+          rb.bufLen - used < VNET_BATCH_FRAME_SIZE(hdrLen + skb->len)) {
+         rb.nextLen = hdrLen + skb->len;
+         break;
+      }
+      __skb_unlink(skb, &userIf->packetQueue);
+      VNetUserIfDequeued(userIf, skb);
+      __skb_queue_tail(&batch, skb);
+      used += VNET_BATCH_FRAME_SIZE(hdrLen + skb->len);
+   }
+   spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+   VNetUserIfClearPending(userIf);
+
+   if (skb_queue_empty(&batch) && rb.nextLen != 0 && rb.maxPackets != 0) {
+      retval = -EMSGSIZE;
+   }
+
+   used = 0;
+   while ((skb = __skb_dequeue(&batch)) != NULL) {
+      VNet_BatchFrame frame;
+      int len;
+
+      if (retval == 0) {
+         frame.len = hdrLen + skb->len;
+         len = VNetCopyDatagramToUser(skb, hdrLen, buf + used + sizeof frame,
+                                      frame.len);
+         if (len < 0) {
+            retval = len;
+         } else if (copy_to_user(buf + used, &frame, sizeof frame)) {
+            retval = -EFAULT;
+         } else {
+            used += VNET_BATCH_FRAME_SIZE(frame.len);
+            rb.numPackets++;
+         }
+      }
+      dev_kfree_skb(skb);
+   }
+
+   VNET_STAT_ADD(userIf->stats, read, rb.numPackets);
+   rb.bytesUsed = used;
+   if (copy_to_user((void *)ioarg, &rb, sizeof rb)) {
+      retval = -EFAULT;
+   }
+   return retval;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -906,7 +2277,14 @@ VNetUserIfWrite(VNetPort    *port, // IN
     * layer. --hpreg
     */
    if (!UP_AND_RUNNING(userIf->port.flags)) {
-      userIf->stats.droppedDown++;
+      VNET_STAT_INC(userIf->stats, droppedDown);
+      return count;
+   }
+
+   /*
+    * Frames over the rate limit are consumed the same way.
+    */
+   if (!VNetUserIfShape(userIf, VNET_SHAPER_TX, count)) {
       return count;
    }
 
@@ -926,7 +2304,7 @@ VNetUserIfWrite(VNetPort    *port, // IN
     * Copy the data and send it.
     */
    
-   userIf->stats.written++;
+   VNET_STAT_INC(userIf->stats, written);
    if (copy_from_user(skb_put(skb, count), buf, count)) {
       dev_kfree_skb(skb);
       return -EFAULT;
@@ -938,6 +2316,106 @@ VNetUserIfWrite(VNetPort    *port, // IN
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfSendBatch --
+ *
+ *      Handler for SIOCSENDBATCH. Copies every length-prefixed frame of
+ *      the user buffer into its own sk_buff first, then hands the whole
+ *      batch to the peer jack with a single VNetSendList call.
+ *
+ * Results:
+ *      0 if at least one frame was consumed (numSent tells how many),
+ *      -EINVAL if the batch has more than VNET_SENDBATCH_MAX frames,
+ *      else -errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfSendBatch(VNetUserIF *userIf, // IN
+                    unsigned long ioarg) // IN/OUT: VNet_SendBatch
+{
+   VNet_SendBatch sb;
+   struct sk_buff_head batch;
+   struct sk_buff *skb;
+   const char *buf;
+   Bool down;
+   uint32 off = 0;
+   uint32 i;
+   int retval = 0;
+
+   if (copy_from_user(&sb, (void *)ioarg, sizeof sb)) {
+      return -EFAULT;
+   }
+   if (sb.version != VNET_SENDBATCH_VERSION ||
+       sb.numPackets > VNET_SENDBATCH_MAX) {
+      return -EINVAL;
+   }
+   buf = (const char *)(VA)sb.buf;
+
+   /*
+    * As for write(), frames sent while the port is down are silently
+    * consumed to enforce the downWhenAddrMismatch policy.
+    */
+   down = !UP_AND_RUNNING(userIf->port.flags);
+
+   __skb_queue_head_init(&batch);
+   for (i = 0; i < sb.numPackets; i++) {
+      VNet_BatchFrame frame;
+
+      if (sb.bufLen - off < sizeof frame) {
+         retval = -EINVAL;
+         break;
+      }
+      if (copy_from_user(&frame, buf + off, sizeof frame)) {
+         retval = -EFAULT;
+         break;
+      }
+      if (frame.len < sizeof (struct ethhdr) ||
+          frame.len > ETHER_MAX_QUEUED_PACKET ||
+          sb.bufLen - off < VNET_BATCH_FRAME_SIZE(frame.len)) {
+         retval = -EINVAL;
+         break;
+      }
+
+      if (down) {
+         VNET_STAT_INC(userIf->stats, droppedDown);
+      } else if (!VNetUserIfShape(userIf, VNET_SHAPER_TX, frame.len)) {
+         /* Over the rate limit, consumed like a frame sent while down. */
+      } else {
+         skb = dev_alloc_skb(frame.len + 7);
+         if (skb == NULL) {
+            retval = -ENOBUFS;
+            break;
+         }
+         skb_reserve(skb, 2);
+         if (copy_from_user(skb_put(skb, frame.len), buf + off + sizeof frame,
+                            frame.len)) {
+            dev_kfree_skb(skb);
+            retval = -EFAULT;
+            break;
+         }
+         __skb_queue_tail(&batch, skb);
+      }
+      off += VNET_BATCH_FRAME_SIZE(frame.len);
+   }
+
+   VNET_STAT_ADD(userIf->stats, written, skb_queue_len(&batch));
+   VNetSendList(&userIf->port.jack, &batch);
+
+   sb.numSent = i;
+   if (copy_to_user((void *)ioarg, &sb, sizeof sb)) {
+      return -EFAULT;
+   }
+   return i > 0 ? 0 : retval;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -1007,6 +2485,41 @@ VNetUserIfIoctl(VNetPort      *port,  // IN
       VNetUserIfUnsetupNotify(userIf);
       break;
 
+   case SIOCRECVBATCH:
+      return VNetUserIfRecvBatch(userIf, ioarg);
+
+   case SIOCSENDBATCH:
+      return VNetUserIfSendBatch(userIf, ioarg);
+
+   case SIOCSETRING:
+      {
+         VNet_RingSetup rs;
+
+         if (copy_from_user(&rs, (void *)ioarg, sizeof rs)) {
+            return -EFAULT;
+         }
+         return VNetUserIfSetupRing(userIf, &rs);
+      }
+
+   case SIOCUNSETRING:
+      if (!userIf->rxRing.base && !userIf->txRing.base) {
+         return -EINVAL;
+      }
+      VNetUserIfUnsetupRing(userIf);
+      break;
+
+   case SIOCRINGKICK:
+      return VNetUserIfRingKick(userIf);
+
+   case SIOCSETCOALESCE:
+      return VNetUserIfSetCoalesce(userIf, ioarg);
+
+   case SIOCSETQUEUELIMITS:
+      return VNetUserIfSetQueueLimits(userIf, ioarg);
+
+   case SIOCSETSHAPER:
+      return VNetUserIfSetShaper(userIf, ioarg);
+
    case SIOCSIFFLAGS:
       /* 
        * Drain queue when interface is no longer active. We drain the queue to 
@@ -1017,13 +2530,12 @@ VNetUserIfIoctl(VNetPort      *port,  // IN
          struct sk_buff *skb;
          
          while ((skb = skb_dequeue(&userIf->packetQueue)) != NULL) {
+            VNetUserIfDequeued(userIf, skb);
             dev_kfree_skb(skb);
          }
          
-         if (userIf->pollPtr) {
-            /* Clear the pending bit as no packets are pending at this point. */
-            *userIf->pollPtr &= ~userIf->pollMask;
-         }
+         /* Clear the pending bit as no packets are pending at this point. */
+         VNetUserIfClearPending(userIf);
       }
       break;
 
@@ -1065,10 +2577,68 @@ VNetUserIfPoll(VNetPort     *port, // IN
       return POLLIN;
    }
 
+   /*
+    * With the RX ring active, report input while the first slot of the
+    * most recently produced frame has not been handed back by the VMX.
+    * The slot before head may be a continuation slot of that frame.
+    */
+   if (userIf->rxRing.base) {
+      unsigned long flags;
+      int ret = 0;
+
+      spin_lock_irqsave(&userIf->ringLock, flags);
+      if (userIf->rxRing.base) {
+         VNetUserIfRing *ring = &userIf->rxRing;
+
+         if (VNET_RING_SLOT(ring, userIf->slotSize, ring->last)->status ==
+             VNET_RING_SLOT_READY) {
+            ret = POLLIN;
+         }
+      }
+      spin_unlock_irqrestore(&userIf->ringLock, flags);
+      return ret;
+   }
+
    return 0;
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfSetApiFlags --
+ *
+ *      Called from SIOCGETAPIVERSION2 with the VNET_API_FLAG_xxx modes
+ *      the VMX asked for. Only VNET_API_FLAG_VNET_HDR is supported.
+ *
+ * Results:
+ *      The flags that are now enabled.
+ *
+ * Side effects:
+ *      Frames handed to the VMX from now on carry a VNet_VnetHdr, or
+ *      stop carrying one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+VNetUserIfSetApiFlags(VNetPort *port, // IN
+                      uint32 flags)   // IN: VNET_API_FLAG_xxx
+{
+   VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
+   unsigned long irqFlags;
+
+   flags &= VNET_API_FLAG_VNET_HDR;
+
+   /* ringLock keeps the mode stable across one RX ring frame. */
+   spin_lock_irqsave(&userIf->ringLock, irqFlags);
+   WRITE_ONCE(userIf->vnetHdrLen,
+              (flags & VNET_API_FLAG_VNET_HDR) ? sizeof(VNet_VnetHdr) : 0);
+   spin_unlock_irqrestore(&userIf->ringLock, irqFlags);
+   return flags;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1099,6 +2669,12 @@ VNetUserIf_Create(VNetPort **ret) // OUT
       return -ENOMEM;
    }
 
+   userIf->stats = VNET_STATS_ALLOC(VNetUserIFStats);
+   if (!userIf->stats) {
+      kfree(userIf);
+      return -ENOMEM;
+   }
+
    /*
     * Initialize fields.
     */
@@ -1117,6 +2693,7 @@ VNetUserIf_Create(VNetPort **ret) // OUT
    userIf->port.jack.cycleDetect = NULL;
    userIf->port.jack.portsChanged = NULL;
    userIf->port.jack.isBridged = NULL;
+   userIf->port.jack.isPromisc = VNetUserIfIsPromisc;
    userIf->pollPtr = NULL;
    userIf->actPtr = NULL;
    userIf->recvClusterCount = NULL;
@@ -1124,6 +2701,20 @@ VNetUserIf_Create(VNetPort **ret) // OUT
    userIf->actPage = NULL;
    userIf->recvClusterPage = NULL;
    userIf->pollMask = userIf->actMask = 0;
+   userIf->vnetHdrLen = 0;
+   memset(&userIf->coalesce, 0, sizeof userIf->coalesce);
+   spin_lock_init(&userIf->coalesce.lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+   hrtimer_setup(&userIf->coalesce.timer, VNetUserIfCoalesceTimer,
+                 CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+   hrtimer_init(&userIf->coalesce.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   userIf->coalesce.timer.function = VNetUserIfCoalesceTimer;
+#endif
+   spin_lock_init(&userIf->ringLock);
+   userIf->slotSize = 0;
+   memset(&userIf->rxRing, 0, sizeof userIf->rxRing);
+   memset(&userIf->txRing, 0, sizeof userIf->txRing);
 
    /*
     * Make proc entry for this jack.
@@ -1139,6 +2730,7 @@ VNetUserIf_Create(VNetPort **ret) // OUT
       if (retval == -ENXIO) {
          userIf->port.jack.procEntry = NULL;
       } else {
+         VNET_STATS_FREE(userIf->stats);
          kfree(userIf);
          return retval;
       }
@@ -1164,11 +2756,18 @@ VNetUserIf_Create(VNetPort **ret) // OUT
    userIf->port.fileOpWrite = VNetUserIfWrite;
    userIf->port.fileOpIoctl = VNetUserIfIoctl;
    userIf->port.fileOpPoll = VNetUserIfPoll;
+   userIf->port.setApiFlags = VNetUserIfSetApiFlags;
+   userIf->port.shaper[VNET_SHAPER_TX] = NULL;
+   userIf->port.shaper[VNET_SHAPER_RX] = NULL;
    
    skb_queue_head_init(&(userIf->packetQueue));
+   atomic_set(&userIf->queuedBytes, 0);
+   userIf->maxQueuePackets = VNET_MAX_QLEN;
+   userIf->maxQueueBytes = 0;
+   userIf->queueLowWater = 0;
+   userIf->earlyDropCredit = 0;
    init_waitqueue_head(&userIf->waitQueue);
 
-   memset(&userIf->stats, 0, sizeof userIf->stats);
    
    *ret = (VNetPort*)userIf;
    return 0;
@@ -46,15 +46,19 @@
 #endif
 
 
+/*
+ * SKB_CLONE_KEY identifies the data area shared by an skb and all of its
+ * clones; SKB_IS_CLONE_OF compares two of them.
+ */
+
 #ifdef skb_shinfo
-#  define SKB_IS_CLONE_OF(clone, skb)   (  \
-      skb_shinfo(clone) == skb_shinfo(skb) \
-   )
+#  define SKB_CLONE_KEY(skb)   ((const void *)skb_shinfo(skb))
 #else
-#  define SKB_IS_CLONE_OF(clone, skb)   (      \
-      skb_datarefp(clone) == skb_datarefp(skb) \
-   )
+#  define SKB_CLONE_KEY(skb)   ((const void *)skb_datarefp(skb))
 #endif
+#define SKB_IS_CLONE_OF(clone, skb)   (      \
+   SKB_CLONE_KEY(clone) == SKB_CLONE_KEY(skb) \
+)
 #define DEV_QUEUE_XMIT(skb, dev, pri)   (                 \
     (skb)->dev = (dev),                                   \
     (skb)->priority = (pri),                              \
@@ -90,6 +90,317 @@ struct VNet_BridgeParams {
 VNet_BridgeParams;
 
 #define SIOCSPEER3         _IOW(0x99, 0xE4, VNet_BridgeParams)
+
+/*
+ * Batched receive: SIOCRECVBATCH drains up to maxPackets queued frames
+ * into the user buffer in one call.  Every frame is stored as a
+ * VNet_BatchFrame header followed by the frame data, and the next header
+ * starts at the following VNET_BATCH_ALIGN boundary.
+ */
+
+#define VNET_RECVBATCH_VERSION    1
+#define VNET_BATCH_ALIGN          4
+#define VNET_BATCH_FRAME_SIZE(len) \
+   (((uint32)sizeof (VNet_BatchFrame) + (len) + VNET_BATCH_ALIGN - 1) & \
+    ~(VNET_BATCH_ALIGN - 1))
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_BatchFrame {
+   uint32 len;                     // length of the frame data that follows
+}
+#include "vmware_pack_end.h"
+VNet_BatchFrame;
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_RecvBatch {
+   uint32 version;                 // IN: VNET_RECVBATCH_VERSION
+   uint32 maxPackets;              // IN: max number of frames to return
+   VA64   buf;                     // IN: user VA of the frame buffer
+   uint32 bufLen;                  // IN: size of the frame buffer
+   uint32 numPackets;              // OUT: number of frames returned
+   uint32 bytesUsed;               // OUT: bytes of buf filled in
+   uint32 nextLen;                 // OUT: length of next queued frame, or 0
+}
+#include "vmware_pack_end.h"
+VNet_RecvBatch;
+
+#define SIOCRECVBATCH      _IOWR(0x99, 0xE5, VNet_RecvBatch)
+
+/*
+ * Batched transmit: SIOCSENDBATCH sends numPackets frames laid out in buf
+ * the same way SIOCRECVBATCH returns them.  A batch holds at most
+ * VNET_SENDBATCH_MAX frames.
+ */
+
+#define VNET_SENDBATCH_VERSION    1
+#define VNET_SENDBATCH_MAX        256
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_SendBatch {
+   uint32 version;                 // IN: VNET_SENDBATCH_VERSION
+   uint32 numPackets;              // IN: number of frames in buf
+   VA64   buf;                     // IN: user VA of the frame buffer
+   uint32 bufLen;                  // IN: size of the frame buffer
+   uint32 numSent;                 // OUT: number of frames consumed
+}
+#include "vmware_pack_end.h"
+VNet_SendBatch;
+
+#define SIOCSENDBATCH      _IOWR(0x99, 0xE6, VNet_SendBatch)
+
+/*
+ * Shared packet rings: SIOCSETRING registers page-aligned user memory
+ * holding an RX and/or a TX ring of fixed-size slots.  Each slot starts
+ * with a VNet_RingSlot header followed by the frame data.  The producer
+ * fills a slot whose status is VNET_RING_SLOT_EMPTY and then sets it to
+ * VNET_RING_SLOT_READY; the consumer hands it back by setting it to
+ * VNET_RING_SLOT_EMPTY.  The driver produces RX slots and consumes TX
+ * slots when the VMX issues SIOCRINGKICK.  While the RX ring is active
+ * the VMX is responsible for clearing pollMask in its notify word.
+ *
+ * From VNET_RING_VERSION 2 on an RX frame longer than one slot spans
+ * consecutive slots: the first slot's len is the full frame length, the
+ * data continues after the header of each following slot and those
+ * slots are marked VNET_RING_SLOT_CONT before the first one becomes
+ * READY.  The consumer hands every slot back individually.  Version 1
+ * rings only receive frames that fit in a single slot; TX frames always
+ * must.
+ */
+
+#define VNET_RING_VERSION         2
+#define VNET_RING_VERSION_V1      1
+#define VNET_RING_SLOT_EMPTY      0
+#define VNET_RING_SLOT_READY      1
+#define VNET_RING_SLOT_CONT       2
+#define VNET_RING_MIN_SLOT_SIZE   2048
+#define VNET_RING_MAX_SLOTS       4096
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_RingSlot {
+   volatile uint32 status;         // VNET_RING_SLOT_xxx
+   uint32          len;            // length of the frame that follows
+}
+#include "vmware_pack_end.h"
+VNet_RingSlot;
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_RingSetup {
+   uint32 version;                 // IN: VNET_RING_VERSION or _V1
+   uint32 slotSize;                // IN: power of 2, MIN_SLOT_SIZE..page size
+   uint32 rxSlots;                 // IN: number of RX slots, 0 for none
+   uint32 txSlots;                 // IN: number of TX slots, 0 for none
+   VA64   rxRing;                  // IN: page aligned user VA of RX ring
+   VA64   txRing;                  // IN: page aligned user VA of TX ring
+}
+#include "vmware_pack_end.h"
+VNet_RingSetup;
+
+#define SIOCSETRING        _IOW(0x99, 0xE7, VNet_RingSetup)
+#define SIOCUNSETRING      _IO(0x99, 0xE8)
+#define SIOCRINGKICK       _IO(0x99, 0xE9)
+
+/*
+ * Adaptive notification coalescing for a userif port.  Below rateLow
+ * packets/s every packet notifies the VMX (actMask and wakeup) at once.
+ * At or above rateHigh a notification is sent every maxFrames packets or
+ * maxUsecs after the first pending one, whichever comes first; in
+ * between both limits scale with the measured rate.  pollMask is always
+ * set immediately.  maxFrames of 0 or 1 turns coalescing off, which is
+ * the default, and restores the recvClusterCount behavior.
+ */
+
+#define VNET_COALESCE_VERSION     1
+#define VNET_COALESCE_MAX_USECS   10000
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_Coalesce {
+   uint32 version;                 // IN: VNET_COALESCE_VERSION
+   uint32 maxFrames;               // IN: packets per notification at high rate
+   uint32 maxUsecs;                // IN: deadline at high rate, 1..MAX_USECS
+   uint32 rateLow;                 // IN: packets/s, no coalescing below
+   uint32 rateHigh;                // IN: packets/s, full coalescing above
+}
+#include "vmware_pack_end.h"
+VNet_Coalesce;
+
+#define SIOCSETCOALESCE    _IOW(0x99, 0xEA, VNet_Coalesce)
+
+/*
+ * Receive queue limits of a userif port.  Packets wait for read() and
+ * SIOCRECVBATCH until maxPackets or, if not 0, maxBytes is reached.
+ * Above lowWater packets a growing share of arrivals is dropped early,
+ * from none at lowWater to all at maxPackets, so that a burst thins out
+ * instead of hitting a hard wall; lowWater of 0 disables early drop.
+ * The default is VNET_MAX_QLEN packets, no byte limit and no early drop.
+ */
+
+#define VNET_QUEUE_LIMITS_VERSION 1
+#define VNET_QUEUE_MAX_PACKETS    4096
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_QueueLimits {
+   uint32 version;                 // IN: VNET_QUEUE_LIMITS_VERSION
+   uint32 maxPackets;              // IN: 1..VNET_QUEUE_MAX_PACKETS
+   uint32 maxBytes;                // IN: 0 for no byte limit
+   uint32 lowWater;                // IN: 0 or less than maxPackets
+}
+#include "vmware_pack_end.h"
+VNet_QueueLimits;
+
+#define SIOCSETQUEUELIMITS _IOW(0x99, 0xEB, VNet_QueueLimits)
+
+/*
+ * 802.1Q VLANs on a hub.  SIOCSETVLAN configures the hub jack the port is
+ * connected to.  A VNET_VLAN_NONE jack, the default, is VLAN-unaware.  As
+ * long as no jack of the hub has a VLAN membership, frames pass between
+ * jacks as they are.  Once one does, VLAN-unaware jacks are access ports
+ * of VLAN 0, which stands for no VLAN: tagged frames they send are
+ * dropped, and they only receive the untagged frames of other
+ * VLAN-unaware jacks.  A VNET_VLAN_ACCESS jack is a member of VLAN pvid only and
+ * sends and receives that VLAN untagged.  A VNET_VLAN_TRUNK jack carries
+ * the VLANs set in members tagged, and VLAN pvid untagged unless pvid is
+ * 0.  The hub inserts and strips tags as frames cross between jacks, and
+ * learns addresses per VLAN.
+ */
+
+#define VNET_VLAN_VERSION         1
+#define VNET_VLAN_NONE            0
+#define VNET_VLAN_ACCESS          1
+#define VNET_VLAN_TRUNK           2
+#define VNET_VLAN_N_VID           4096
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_VlanConfig {
+   uint32 version;                 // IN: VNET_VLAN_VERSION
+   uint32 mode;                    // IN: VNET_VLAN_xxx
+   uint32 pvid;                    // IN: access or native VLAN, 1..4094
+   uint8  members[VNET_VLAN_N_VID / 8]; // IN: trunk VLANs, bit n is VLAN n
+}
+#include "vmware_pack_end.h"
+VNet_VlanConfig;
+
+#define SIOCSETVLAN        _IOW(0x99, 0xEC, VNet_VlanConfig)
+
+/*
+ * Token bucket rate limit of a port, per direction.  VNET_SHAPER_TX
+ * limits the frames the port sends into its hub, VNET_SHAPER_RX the
+ * frames it receives from it.  Up to burst bytes pass back to back, and
+ * rate bytes/s in the long run; frames over the limit are dropped.  A
+ * rate of 0 removes the limit, which is the default.
+ */
+
+#define VNET_SHAPER_VERSION       1
+#define VNET_SHAPER_TX            0
+#define VNET_SHAPER_RX            1
+#define VNET_SHAPER_DIRS          2
+#define VNET_SHAPER_MIN_BURST     1518
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_Shaper {
+   uint32 version;                 // IN: VNET_SHAPER_VERSION
+   uint32 direction;               // IN: VNET_SHAPER_TX or VNET_SHAPER_RX
+   uint64 rate;                    // IN: bytes/s, 0 for no limit
+   uint32 burst;                   // IN: bytes, at least VNET_SHAPER_MIN_BURST
+   uint32 pad;                     // IN: 0
+}
+#include "vmware_pack_end.h"
+VNet_Shaper;
+
+#define SIOCSETSHAPER      _IOW(0x99, 0xED, VNet_Shaper)
+
+/*
+ * Capture tap of a hub.  SIOCSETTAP, issued on a port, attaches a tap to
+ * the hub the port is connected to; ringSize of 0 detaches it again, as
+ * does disconnecting the port.  The hub keeps one tap at a time.
+ * Attaching a tap requires CAP_NET_ADMIN, and all rings together may not
+ * take more than VNET_TAP_MAX_TOTAL_SIZE bytes.
+ *
+ * Every frame the hub forwards is captured, truncated to snapLen bytes,
+ * into the ring of the CPU that forwards it.  The rings are mapped by
+ * mmap() of the device at offset 0: numRings areas of ringStride bytes,
+ * each a VNet_TapRing header followed, at dataOffset, by ringSize bytes
+ * of pcap records.  The kernel advances head once a record is complete
+ * and never overwrites data the reader has not released by advancing
+ * tail; records that do not fit are counted in dropped instead.
+ *
+ * A record is a VNet_TapRecord, which is a pcap record header, and capLen
+ * bytes of frame, padded to VNET_TAP_ALIGN.  A record never wraps: if
+ * the record at a position has capLen 0 the reader skips to the start of
+ * the data.  Writing pcapHeader followed by the records, without their
+ * padding, yields a pcap file.
+ */
+
+#define VNET_TAP_VERSION          1
+#define VNET_TAP_ALIGN            16
+#define VNET_TAP_MIN_SNAPLEN      14
+#define VNET_TAP_MAX_RING_SIZE    (16 << 20)
+#define VNET_TAP_MAX_TOTAL_SIZE   (64 << 20)
+
+#define VNET_PCAP_MAGIC           0xa1b2c3d4
+#define VNET_PCAP_VERSION_MAJOR   2
+#define VNET_PCAP_VERSION_MINOR   4
+#define VNET_PCAP_LINKTYPE_ETHER  1
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_PcapHeader {
+   uint32 magic;                   // VNET_PCAP_MAGIC
+   uint16 versionMajor;
+   uint16 versionMinor;
+   int32  thisZone;                // 0, timestamps are UTC
+   uint32 sigFigs;                 // 0
+   uint32 snapLen;
+   uint32 linkType;                // VNET_PCAP_LINKTYPE_ETHER
+}
+#include "vmware_pack_end.h"
+VNet_PcapHeader;
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_TapRecord {
+   uint32 tsSec;                   // UTC time the hub forwarded the frame
+   uint32 tsUsec;
+   uint32 capLen;                  // bytes captured, 0 for end of data
+   uint32 len;                     // length of the frame
+}
+#include "vmware_pack_end.h"
+VNet_TapRecord;
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_TapRing {
+   volatile uint64 head;           // bytes produced, written by the kernel
+   volatile uint64 tail;           // bytes consumed, written by the reader
+   uint32 dropped;                 // records lost because the ring was full
+   uint32 pad;
+   VNet_PcapHeader pcapHeader;
+}
+#include "vmware_pack_end.h"
+VNet_TapRing;
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_TapSetup {
+   uint32 version;                 // IN: VNET_TAP_VERSION
+   uint32 snapLen;                 // IN: bytes kept per frame, at least MIN
+   uint32 ringSize;                // IN: bytes of data per ring, power of 2
+   uint32 numRings;                // OUT: number of rings
+   uint32 ringStride;              // OUT: distance between rings
+   uint32 dataOffset;              // OUT: offset of the data in a ring
+}
+#include "vmware_pack_end.h"
+VNet_TapSetup;
+
+#define SIOCSETTAP         _IOWR(0x99, 0xEE, VNet_TapSetup)
 #endif
 
 #ifdef __APPLE__
@@ -159,7 +470,7 @@ typedef struct VNet_Read {
  */
 
 #ifdef linux
-#define VNET_API_VERSION		(3 << 16 | 0)
+#define VNET_API_VERSION		(3 << 16 | 5)
 #elif defined __APPLE__
 #define VNET_API_VERSION                (6 << 16 | 0)
 #else
@@ -168,6 +479,38 @@ typedef struct VNet_Read {
 #define VNET_API_VERSION_MAJOR(v)	((uint32) (v) >> 16)
 #define VNET_API_VERSION_MINOR(v)	((uint16) (v))
 
+/*
+ * Offload metadata: the VMX may OR VNET_API_FLAG_VNET_HDR into the version
+ * it passes to SIOCGETAPIVERSION2.  If the port supports it, the flag is
+ * echoed back in the returned version and from then on every frame handed
+ * to the VMX (read, SIOCRECVBATCH and the RX ring) is preceded by a
+ * VNet_VnetHdr, laid out like the legacy struct virtio_net_hdr.  Partial
+ * checksums are then left to the VMX instead of being completed by the
+ * driver.  Passing a version without the flag turns the mode off again.
+ */
+
+#define VNET_API_FLAG_VNET_HDR          0x8000
+#define VNET_API_FLAGS                  VNET_API_FLAG_VNET_HDR
+
+#define VNET_HDR_F_NEEDS_CSUM           1
+#define VNET_HDR_GSO_NONE               0
+#define VNET_HDR_GSO_TCPV4              1
+#define VNET_HDR_GSO_TCPV6              4
+#define VNET_HDR_GSO_ECN                0x80
+
+typedef
+#include "vmware_pack_begin.h"
+struct VNet_VnetHdr {
+   uint8  flags;                   // VNET_HDR_F_xxx
+   uint8  gsoType;                 // VNET_HDR_GSO_xxx
+   uint16 hdrLen;                  // bytes of headers before the payload
+   uint16 gsoSize;                 // payload bytes per segment
+   uint16 csumStart;               // checksum covers csumStart to the end
+   uint16 csumOffset;              // and goes to csumStart + csumOffset
+}
+#include "vmware_pack_end.h"
+VNet_VnetHdr;
+
 /* version 1 structure */
 
 typedef struct VNet_SetMacAddrIOCTL {
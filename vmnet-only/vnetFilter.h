@@ -47,7 +47,7 @@
 #define VNET_FILTER_CMD_CREATE_RULE_SET     0x1000
 #define VNET_FILTER_CMD_DELETE_RULE_SET     0x1001
 #define VNET_FILTER_CMD_ADD_IPV4_RULE       0x1002
-#define VNET_FILTER_CMD_ADD_IPV6_RULE       0x1003 /* not implemented */
+#define VNET_FILTER_CMD_ADD_IPV6_RULE       0x1003
 #define VNET_FILTER_CMD_CHANGE_RULE_SET     0x1004
 #define VNET_FILTER_CMD_SET_LOG_LEVEL       0x1005
 #define VNET_FILTER_CMD_MAX	            0x1005 /* equal to largest sub-command */
@@ -55,6 +55,7 @@
 /* action for a rule or rule set */
 /* VNet_CreateRuleSet.defaultAction */
 /* VNet_AddIPv4Rule.action */
+/* VNet_AddIPv6Rule.action */
 /* VNet_ChangeRuleSet.defaultAction */
 #define VNET_FILTER_RULE_NO_CHANGE  0x2000
 #define VNET_FILTER_RULE_BLOCK      0x2001
@@ -62,6 +63,7 @@
 
 /* direction that should apply to a rule */
 /* VNet_AddIPv4Rule.direction */
+/* VNet_AddIPv6Rule.direction */
 #define VNET_FILTER_DIRECTION_IN   0x3001
 #define VNET_FILTER_DIRECTION_OUT  0x3002
 #define VNET_FILTER_DIRECTION_BOTH 0x3003
@@ -174,7 +176,52 @@ struct VNet_IPv4Port {
 #include "vmware_pack_end.h"
 VNet_IPv4Port;
 
-// typedef struct VNet_IPv4Port VNet_IPv6Port;
+typedef 
+#include "vmware_pack_begin.h"
+struct VNet_AddIPv6Rule {
+   VNet_RuleHeader header; /* type = VNET_FILTER_CMD_ADD_IPV6_RULE, ver = 1, 
+			      len = sizeof(VNet_AddIPv6Rule) + 
+			            addrListLen * sizeof(VNet_IPv6Address) +
+				    portListLen * sizeof(VNet_IPv6Port) */
+
+   uint32 ruleSetId;	/* rule set (from VNet_CreateRuleSet.ruleSetId) */
+   uint32 action;	/* VNET_FILTER_RULE_DROP or VNET_FILTER_RULE_PERMIT */
+   uint32 direction;	/* VNET_FILTER_DIRECTION_IN, VNET_FILTER_DIRECTION_OUT, or 
+			   VNET_FILTER_DIRECTION_BOTH */
+
+   uint32 addressListLen; /* Number of VNet_IPv6Address's that follow.
+			     Must be at least one.  Must equal 1 if prefixLen==0. */
+
+   uint32 proto;	  /* ~0 is don't care, otherwise upper layer protocol
+			     (the last IPv6 next header) */
+
+   uint32 portListLen;	   /* Number of VNet_IPv6Port's that follow the 
+			      VNet_IPv6Address's.  Same rules as for
+			      VNet_AddIPv4Rule.portListLen. */
+} 
+#include "vmware_pack_end.h"
+VNet_AddIPv6Rule;
+
+/* 
+ * VNet_AddIPv6Rule is immediately followed by 1 or more VNet_IPv6Address.
+ * The last VNet_IPv6Address is immediately followed by 1 or more VNet_IPv6Port.
+ *
+ * A rule set without any IPv6 rule lets all IPv6 traffic through, whatever
+ * its default action.
+ */
+
+typedef 
+#include "vmware_pack_begin.h"
+struct VNet_IPv6Address {
+   /* can specify don't care on IP address via prefixLen==0, 
+      but only for a list with 1 item */
+   uint8  ipv6RemoteAddr[16];  /* remote entity's address (dst on outbound, src on inbound) */
+   uint32 ipv6RemotePrefixLen; /* remote entity's prefix length (0-128) */
+} 
+#include "vmware_pack_end.h"
+VNet_IPv6Address;
+
+typedef struct VNet_IPv4Port VNet_IPv6Port;
 
 typedef 
 #include "vmware_pack_begin.h"
@@ -35,6 +35,13 @@ typedef struct RuleAddr {
    uint32 ipv4Mask; /* remote entity's mask    (dst on outbound, src on inbound) */
 } RuleAddr;
 
+typedef struct RuleAddr6 {
+   uint64 addrHi;   /* remote entity's address, host order, masked */
+   uint64 addrLo;
+   uint64 maskHi;   /* remote entity's prefix mask, host order */
+   uint64 maskLo;
+} RuleAddr6;
+
 typedef struct RulePort {
    uint32 localPortLow;    /* ~0 is don't care, otherwise low local range (inclusive)  */
    uint32 localPortHigh;   /* ~0 is don't care, otherwise high local range (inclusive) */
@@ -56,7 +63,11 @@ typedef struct Rule {
    uint16 proto;	   /* IP protocol that rule applies to (e.g., TCP or UDP) */
                            /* ~0 mean don't care, in which case "portList" is ignored */
 
-   RuleAddr *addressList;  /* list of IP addresses for rule */
+   uint8 ipVersion;        /* 4 or 6, selects addressList or address6List */
+
+   RuleAddr *addressList;  /* list of IPv4 addresses for rule */
+
+   RuleAddr6 *address6List; /* list of IPv6 addresses for rule */
 
    RulePort *portList;	   /* list of port ranges for rule (if proto is TCP or UDP) */
 } Rule;
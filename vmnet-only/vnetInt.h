@@ -27,6 +27,8 @@
 #include "vnetEvent.h"
 
 #include <asm/page.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 
 #include "compat_mutex.h"
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
@@ -58,6 +60,28 @@
 
 #define MAX(_a, _b)   (((_a) > (_b)) ? (_a) : (_b))
 
+/*
+ * Per-CPU statistics
+ *
+ * Packet counters are kept per CPU so that concurrent senders on
+ * different CPUs do not bounce a shared cache line. They are only
+ * summed up when reported.
+ */
+
+#define VNET_STATS_ALLOC(_type)           alloc_percpu(_type)
+#define VNET_STATS_FREE(_stats)           free_percpu(_stats)
+#define VNET_STAT_INC(_stats, _field)     this_cpu_inc((_stats)->_field)
+#define VNET_STAT_ADD(_stats, _field, _n) this_cpu_add((_stats)->_field, (_n))
+#define VNET_STAT_SUM(_stats, _field)                   \
+   ({                                                   \
+      typeof((_stats)->_field) _sum = 0;                \
+      int _cpu;                                         \
+      for_each_possible_cpu(_cpu) {                     \
+         _sum += per_cpu_ptr((_stats), _cpu)->_field;   \
+      }                                                 \
+      _sum;                                             \
+   })
+
 /*
  * Ethernet
  */
@@ -105,6 +129,8 @@ typedef struct proc_dir_entry VNetProcEntry;
 
 typedef struct VNetJack VNetJack;
 typedef struct VNetPort VNetPort;
+typedef struct VNetShaper VNetShaper;
+typedef struct VNetTap VNetTap;
 
 /*
  *  The jack is the basic mechanism for connecting to objects
@@ -114,7 +140,7 @@ typedef struct VNetPort VNetPort;
 extern compat_mutex_t vnetStructureMutex;
 
 struct VNetJack {
-   VNetJack      *peer;
+   VNetJack      *peer;        // RCU protected, see VNetConnect
    int            numPorts;
    char           name[VNET_MAX_JACK_NAME_LEN];
    void          *private;     // private field for containing object
@@ -126,6 +152,7 @@ struct VNetJack {
    Bool         (*cycleDetect)(VNetJack *this, int generation);
    void         (*portsChanged)(VNetJack *this);
    int          (*isBridged)(VNetJack *this);
+   Bool         (*isPromisc)(VNetJack *this);
 };
 
 
@@ -141,6 +168,7 @@ struct VNetPort {
    uint32      flags;
    uint8       paddr[ETH_ALEN];
    uint8       ladrf[VNET_LADRF_LEN];
+   VNetShaper *shaper[VNET_SHAPER_DIRS]; // RCU protected, see SIOCSETSHAPER
    
    VNetPort   *next;
    
@@ -152,6 +180,7 @@ struct VNetPort {
                             unsigned int iocmd, unsigned long ioarg);   
    int       (*fileOpPoll)(VNetPort *this, struct file *filp,
                            poll_table *wait);
+   uint32    (*setApiFlags)(VNetPort *this, uint32 flags);
 };
 
 
@@ -163,6 +192,9 @@ struct VNetPort {
 VNetJack *VNetHub_AllocVnet(int hubNum);
 VNetJack *VNetHub_AllocPvn(uint8 id[VNET_PVN_ID_LEN]);
 int VNetHub_CreateSender(VNetJack *jack, VNetEvent_Sender **s);
+int VNetHub_SetVlan(VNetJack *jack, const VNet_VlanConfig *vc);
+int VNetHub_SetTap(VNetJack *jack, VNet_TapSetup *ts);
+int VNetHub_MmapTap(VNetJack *jack, struct vm_area_struct *vma);
 int VNetHub_CreateListener(VNetJack *jack, VNetEvent_Handler h, void* data,
                            uint32 classMask, VNetEvent_Listener **l);
 
@@ -172,6 +204,8 @@ VNetJack *VNetDisconnect(VNetJack *jack);
 
 void VNetSend(const VNetJack *jack, struct sk_buff *skb);
 
+void VNetSendList(const VNetJack *jack, struct sk_buff_head *list);
+
 int VNetProc_MakeEntry(char *name, int mode,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
                        VNetProcEntry **ret,
@@ -218,6 +252,43 @@ int VNetPrintPort(const VNetPort *port, char *buf);
 
 int VNetSnprintf(char *str, size_t size, const char *format, ...);
 
+/*
+ *  Traffic shaping
+ */
+
+VNetShaper *VNetShaper_Create(uint64 rate, uint32 burst);
+
+void VNetShaper_Free(VNetShaper *shaper);
+
+Bool VNetShaper_Admit(VNetShaper *shaper, unsigned int len);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+void VNetShaper_Print(const VNetShaper *shaper, const char *name,
+                      struct seq_file *seqf);
+#else
+int VNetShaper_Print(const VNetShaper *shaper, const char *name, char *buf);
+#endif
+
+/*
+ *  Capture taps
+ */
+
+int VNetTap_Create(VNet_TapSetup *ts, VNetTap **ret);
+
+void VNetTap_Hold(VNetTap *tap);
+
+void VNetTap_Release(VNetTap *tap);
+
+int VNetTap_Mmap(VNetTap *tap, struct vm_area_struct *vma);
+
+void VNetTap_Capture(VNetTap *tap, const struct sk_buff *skb);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+void VNetTap_Print(const VNetTap *tap, struct seq_file *seqf);
+#else
+int VNetTap_Print(const VNetTap *tap, char *buf);
+#endif
+
 /*
  *  Procfs file system
  */
@@ -287,7 +358,7 @@ VNetPortsChanged(VNetJack *jack) // IN:
  * VNetIsBridged --
  *
  *      Check whether we are bridged.
- *      vnetPeerLock must be held.
+ *      Must be called inside an RCU read-side critical section.
  *
  * Results:
  *      0 - not bridged
@@ -312,6 +383,35 @@ VNetIsBridged(VNetJack *jack) // IN: jack
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetIsPromisc --
+ *
+ *      Check whether the jack wants to see unicast packets addressed
+ *      to other stations, e.g. because a sniffer is attached to it.
+ *      Must be called inside an RCU read-side critical section.
+ *
+ * Results:
+ *      TRUE if the jack is promiscuous, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetIsPromisc(VNetJack *jack) // IN: jack
+{
+   if (jack && jack->isPromisc) {
+      return jack->isPromisc(jack);
+   }
+
+   return FALSE;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -0,0 +1,297 @@
+/*********************************************************
+ * Copyright (C) 2026 old-vmware-modules contributors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * vnetShaper.c --
+ *
+ *    Token bucket rate limiting of the frames a port sends or receives.
+ *
+ *    The bucket of a shaper is an atomic counter that is refilled lazily
+ *    from the elapsed time by whoever finds it stale. Each CPU takes
+ *    tokens from it a quantum at a time and spends them locally, so the
+ *    common case only touches per-CPU data and no lock is ever taken.
+ *    Tokens cached by idle CPUs make the effective burst at most one
+ *    quantum per CPU larger than configured.
+ *
+ *    vmnet has no queue to hold frames back, so frames over the rate
+ *    are dropped (policed) rather than delayed.
+ */
+
+#include "driver-config.h" /* must be first */
+#include <linux/netdevice.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include "compat_skbuff.h"
+#include "vnetInt.h"
+
+/* Refill the shared bucket at most this often. */
+#define VNET_SHAPER_REFILL_NS     (100 * NSEC_PER_USEC)
+
+/* Bounds of the amount of tokens a CPU takes from the bucket at once. */
+#define VNET_SHAPER_MIN_QUANTUM   ETH_FRAME_LEN
+#define VNET_SHAPER_MAX_QUANTUM   (64 * 1024)
+
+typedef struct VNetShaperCpu {
+   long          tokens;                   // bytes this CPU may still pass
+   unsigned      passed;
+   unsigned      dropped;
+   uint64        droppedBytes;
+} VNetShaperCpu;
+
+struct VNetShaper {
+   uint64        rate;                     // bytes per second
+   uint32        burst;                    // bucket depth in bytes
+   uint32        quantum;                  // bytes a CPU takes at once
+   uint64        fillNs;                   // time to fill an empty bucket
+   atomic64_t    tokens;                   // shared bucket
+   atomic64_t    stamp;                    // ns of the last refill
+   VNetShaperCpu *cpu;                     // per-CPU
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetShaper_Create --
+ *
+ *      Creates a shaper passing 'rate' bytes per second with bursts of
+ *      up to 'burst' bytes. The bucket starts full.
+ *
+ * Results:
+ *      The shaper, or NULL if out of memory.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VNetShaper *
+VNetShaper_Create(uint64 rate,  // IN: bytes per second, not 0
+                  uint32 burst) // IN: bucket depth in bytes
+{
+   VNetShaper *shaper = kmalloc(sizeof *shaper, GFP_KERNEL);
+
+   if (shaper == NULL) {
+      return NULL;
+   }
+   shaper->cpu = VNET_STATS_ALLOC(VNetShaperCpu);
+   if (shaper->cpu == NULL) {
+      kfree(shaper);
+      return NULL;
+   }
+
+   shaper->rate = rate;
+   shaper->burst = burst;
+   shaper->quantum = clamp_t(uint32, burst / 16, VNET_SHAPER_MIN_QUANTUM,
+                             VNET_SHAPER_MAX_QUANTUM);
+   shaper->fillNs = div64_u64((uint64)burst * NSEC_PER_SEC, rate) + 1;
+   atomic64_set(&shaper->tokens, burst);
+   atomic64_set(&shaper->stamp, ktime_to_ns(ktime_get()));
+   return shaper;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetShaper_Free --
+ *
+ *      Frees a shaper. No CPU may be using it anymore.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetShaper_Free(VNetShaper *shaper) // IN
+{
+   if (shaper) {
+      VNET_STATS_FREE(shaper->cpu);
+      kfree(shaper);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetShaperRefill --
+ *
+ *      Adds the tokens earned since the last refill to the bucket. Only
+ *      the caller that moves the refill stamp forward adds them.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetShaperRefill(VNetShaper *shaper) // IN
+{
+   uint64 now = ktime_to_ns(ktime_get());
+   uint64 last = atomic64_read(&shaper->stamp);
+   uint64 elapsed = now - last;
+   int64 old;
+   int64 new;
+
+   if ((int64)elapsed < VNET_SHAPER_REFILL_NS ||
+       atomic64_cmpxchg(&shaper->stamp, last, now) != last) {
+      return;
+   }
+
+   /* Bounding elapsed also keeps the product below from overflowing. */
+   elapsed = min(elapsed, shaper->fillNs);
+   new = div64_u64(elapsed * shaper->rate, NSEC_PER_SEC);
+   do {
+      old = atomic64_read(&shaper->tokens);
+   } while (atomic64_cmpxchg(&shaper->tokens, old,
+                             min_t(int64, old + new, shaper->burst)) != old);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetShaperTake --
+ *
+ *      Takes up to 'want' tokens from the shared bucket.
+ *
+ * Results:
+ *      Number of tokens taken.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static long
+VNetShaperTake(VNetShaper *shaper, // IN
+               long want)          // IN
+{
+   int64 avail;
+   long got;
+
+   VNetShaperRefill(shaper);
+   do {
+      avail = atomic64_read(&shaper->tokens);
+      if (avail <= 0) {
+         return 0;
+      }
+      got = min_t(int64, avail, want);
+   } while (atomic64_cmpxchg(&shaper->tokens, avail, avail - got) != avail);
+   return got;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetShaper_Admit --
+ *
+ *      Decides whether a frame of 'len' bytes may pass. The tokens are
+ *      spent from the current CPU's share, which is topped up from the
+ *      shared bucket when it runs out.
+ *
+ * Results:
+ *      TRUE if the frame conforms to the rate, FALSE if it must be
+ *      dropped.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+VNetShaper_Admit(VNetShaper *shaper, // IN
+                 unsigned int len)   // IN: frame length
+{
+   long left = this_cpu_add_return(shaper->cpu->tokens, -(long)len);
+
+   if (left < 0) {
+      left = this_cpu_add_return(shaper->cpu->tokens,
+                                 VNetShaperTake(shaper,
+                                                -left + shaper->quantum));
+      if (left < 0) {
+         this_cpu_add(shaper->cpu->tokens, len);
+         VNET_STAT_INC(shaper->cpu, dropped);
+         VNET_STAT_ADD(shaper->cpu, droppedBytes, len);
+         return FALSE;
+      }
+   }
+   VNET_STAT_INC(shaper->cpu, passed);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetShaper_Print --
+ *
+ *      Print the configuration and counters of a shaper to a buffer.
+ *
+ * Results:
+ *      Length of the write.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+void
+VNetShaper_Print(const VNetShaper *shaper, // IN
+                 const char *name,         // IN: "tx" or "rx"
+                 struct seq_file *seqf)    // OUT
+{
+   seq_printf(seqf, "shaper.%s rate %llu burst %u passed %u dropped %u "
+              "droppedBytes %llu ", name,
+              (unsigned long long)shaper->rate, shaper->burst,
+              VNET_STAT_SUM(shaper->cpu, passed),
+              VNET_STAT_SUM(shaper->cpu, dropped),
+              (unsigned long long)VNET_STAT_SUM(shaper->cpu, droppedBytes));
+}
+#else
+int
+VNetShaper_Print(const VNetShaper *shaper, // IN
+                 const char *name,         // IN: "tx" or "rx"
+                 char *buf)                // OUT
+{
+   return sprintf(buf, "shaper.%s rate %llu burst %u passed %u dropped %u "
+                  "droppedBytes %llu ", name,
+                  (unsigned long long)shaper->rate, shaper->burst,
+                  VNET_STAT_SUM(shaper->cpu, passed),
+                  VNET_STAT_SUM(shaper->cpu, dropped),
+                  (unsigned long long)VNET_STAT_SUM(shaper->cpu,
+                                                    droppedBytes));
+}
+#endif
@@ -0,0 +1,345 @@
+/*********************************************************
+ * Copyright (C) 2026 old-vmware-modules contributors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * vnetTap.c --
+ *
+ *    Capture of the frames a hub forwards into per-CPU rings of pcap
+ *    records that user space maps, see VNet_TapSetup.
+ *
+ *    Each CPU only ever writes its own ring, with interrupts off, so
+ *    producers need no lock and never share a cache line. The frame is
+ *    not cloned: its first snapLen bytes are copied straight into the
+ *    ring, which bounds the cost of the tap per frame.
+ */
+
+#include "driver-config.h" /* must be first */
+#include <linux/netdevice.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include "compat_skbuff.h"
+#include "compat_spinlock.h"
+#include "vnetInt.h"
+
+typedef struct VNetTapCpu {
+   uint64        head;                     // trusted copy of ring->head
+   unsigned      captured;
+   unsigned      dropped;
+} VNetTapCpu;
+
+struct VNetTap {
+   atomic_t      refCount;
+   uint32        snapLen;
+   uint32        ringSize;                 // bytes of data per ring
+   uint32        ringStride;               // bytes between rings
+   uint32        numRings;                 // one per CPU id
+   uint8        *area;                     // vmalloc_user, shared with user
+   VNetTapCpu   *cpu;                      // per-CPU
+};
+
+#define VNET_TAP_DATA_OFFSET   PAGE_ALIGN(sizeof (VNet_TapRing))
+#define VNET_TAP_RECORD_LEN(_capLen) \
+   ALIGN(sizeof (VNet_TapRecord) + (_capLen), VNET_TAP_ALIGN)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetTap_Create --
+ *
+ *      Creates a tap with empty rings as described by ts, and fills in
+ *      the layout of the rings in ts.
+ *
+ * Results:
+ *      0 on success, -EINVAL if ts is invalid or the rings of all CPUs
+ *      would exceed VNET_TAP_MAX_TOTAL_SIZE, -ENOMEM.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetTap_Create(VNet_TapSetup *ts, // IN/OUT
+               VNetTap **ret)     // OUT
+{
+   VNetTap *tap;
+   uint32 i;
+
+   if (ts->version != VNET_TAP_VERSION ||
+       ts->snapLen < VNET_TAP_MIN_SNAPLEN ||
+       ts->snapLen > ETHER_MAX_QUEUED_PACKET ||
+       ts->ringSize < PAGE_SIZE || ts->ringSize > VNET_TAP_MAX_RING_SIZE ||
+       (ts->ringSize & (ts->ringSize - 1)) ||
+       ts->ringSize < 2 * VNET_TAP_RECORD_LEN(ts->snapLen) ||
+       (uint64)nr_cpu_ids * (VNET_TAP_DATA_OFFSET + ts->ringSize) >
+       VNET_TAP_MAX_TOTAL_SIZE) {
+      return -EINVAL;
+   }
+
+   tap = kmalloc(sizeof *tap, GFP_KERNEL);
+   if (tap == NULL) {
+      return -ENOMEM;
+   }
+   tap->cpu = VNET_STATS_ALLOC(VNetTapCpu);
+   if (tap->cpu == NULL) {
+      kfree(tap);
+      return -ENOMEM;
+   }
+
+   atomic_set(&tap->refCount, 1);
+   tap->snapLen = ts->snapLen;
+   tap->ringSize = ts->ringSize;
+   tap->ringStride = VNET_TAP_DATA_OFFSET + ts->ringSize;
+   tap->numRings = nr_cpu_ids;
+   tap->area = vmalloc_user((unsigned long)tap->numRings * tap->ringStride);
+   if (tap->area == NULL) {
+      VNET_STATS_FREE(tap->cpu);
+      kfree(tap);
+      return -ENOMEM;
+   }
+
+   for (i = 0; i < tap->numRings; i++) {
+      VNet_TapRing *ring = (VNet_TapRing *)(tap->area + i * tap->ringStride);
+
+      ring->pcapHeader.magic = VNET_PCAP_MAGIC;
+      ring->pcapHeader.versionMajor = VNET_PCAP_VERSION_MAJOR;
+      ring->pcapHeader.versionMinor = VNET_PCAP_VERSION_MINOR;
+      ring->pcapHeader.snapLen = tap->snapLen;
+      ring->pcapHeader.linkType = VNET_PCAP_LINKTYPE_ETHER;
+   }
+
+   ts->numRings = tap->numRings;
+   ts->ringStride = tap->ringStride;
+   ts->dataOffset = VNET_TAP_DATA_OFFSET;
+   *ret = tap;
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetTap_Hold --
+ *
+ *      Takes a reference to a tap.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetTap_Hold(VNetTap *tap) // IN
+{
+   atomic_inc(&tap->refCount);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetTap_Release --
+ *
+ *      Drops a reference to a tap, and frees it with the last one.
+ *      Mappings of the rings keep their pages until they are unmapped.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetTap_Release(VNetTap *tap) // IN
+{
+   if (tap && atomic_dec_and_test(&tap->refCount)) {
+      vfree(tap->area);
+      VNET_STATS_FREE(tap->cpu);
+      kfree(tap);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetTap_Mmap --
+ *
+ *      Maps the rings of a tap into user space.
+ *
+ * Results:
+ *      0 on success, else -errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetTap_Mmap(VNetTap *tap,                // IN
+             struct vm_area_struct *vma)  // IN
+{
+   unsigned long size = vma->vm_end - vma->vm_start;
+
+   if (vma->vm_pgoff != 0 ||
+       size > PAGE_ALIGN((unsigned long)tap->numRings * tap->ringStride)) {
+      return -EINVAL;
+   }
+   return remap_vmalloc_range(vma, tap->area, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetTap_Capture --
+ *
+ *      Appends a record of skb to the ring of the current CPU, unless
+ *      the reader has not made room for it.
+ *
+ *      The reader may write anything into the shared ring header, so
+ *      the kernel keeps its own copy of head, and a tail that is off
+ *      makes the ring look full rather than letting the record land
+ *      outside of it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetTap_Capture(VNetTap *tap,                // IN
+                const struct sk_buff *skb)   // IN
+{
+   uint32 capLen = min_t(uint32, skb->len, tap->snapLen);
+   uint32 recLen = VNET_TAP_RECORD_LEN(capLen);
+   VNetTapCpu *cpu;
+   VNet_TapRing *ring;
+   VNet_TapRecord *rec;
+   uint8 *data;
+   unsigned long flags;
+   uint64 head;
+   uint64 used;
+   uint32 pos;
+   uint32 pad;
+   uint32 usec;
+   uint64 sec;
+
+   sec = div_u64_rem(ktime_to_ns(ktime_get_real()), NSEC_PER_SEC, &usec);
+   usec /= NSEC_PER_USEC;
+
+   local_irq_save(flags);
+   cpu = this_cpu_ptr(tap->cpu);
+   ring = (VNet_TapRing *)(tap->area + smp_processor_id() * tap->ringStride);
+   data = (uint8 *)ring + VNET_TAP_DATA_OFFSET;
+
+   head = cpu->head;
+   pos = head & (tap->ringSize - 1);
+   pad = tap->ringSize - pos < recLen ? tap->ringSize - pos : 0;
+   used = head - READ_ONCE(ring->tail);
+   if (used > tap->ringSize || tap->ringSize - used < pad + recLen) {
+      cpu->dropped++;
+      ring->dropped = cpu->dropped;
+      local_irq_restore(flags);
+      return;
+   }
+
+   if (pad) {
+      /* Rest of the data is too short, mark it as skipped. */
+      rec = (VNet_TapRecord *)(data + pos);
+      rec->capLen = 0;
+      rec->len = 0;
+      head += pad;
+      pos = 0;
+   }
+
+   rec = (VNet_TapRecord *)(data + pos);
+   rec->tsSec = (uint32)sec;
+   rec->tsUsec = usec;
+   rec->capLen = capLen;
+   rec->len = skb->len;
+   if (skb_copy_bits(skb, 0, rec + 1, capLen) < 0) {
+      cpu->dropped++;
+      ring->dropped = cpu->dropped;
+      local_irq_restore(flags);
+      return;
+   }
+
+   /* The record must be complete before the reader can see it. */
+   smp_wmb();
+   cpu->head = head + recLen;
+   ring->head = cpu->head;
+   cpu->captured++;
+   local_irq_restore(flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetTap_Print --
+ *
+ *      Print the configuration and counters of a tap to a buffer.
+ *
+ * Results:
+ *      Length of the write.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+void
+VNetTap_Print(const VNetTap *tap,    // IN
+              struct seq_file *seqf) // OUT
+{
+   seq_printf(seqf, "tap snaplen %u rings %u size %u captured %u "
+              "dropped %u ", tap->snapLen, tap->numRings, tap->ringSize,
+              VNET_STAT_SUM(tap->cpu, captured),
+              VNET_STAT_SUM(tap->cpu, dropped));
+}
+#else
+int
+VNetTap_Print(const VNetTap *tap, // IN
+              char *buf)          // OUT
+{
+   return sprintf(buf, "tap snaplen %u rings %u size %u captured %u "
+                  "dropped %u ", tap->snapLen, tap->numRings, tap->ringSize,
+                  VNET_STAT_SUM(tap->cpu, captured),
+                  VNET_STAT_SUM(tap->cpu, dropped));
+}
+#endif
@@ -107,6 +107,7 @@ VNetUserListener_Create(uint32 classMask,  // IN: the listener's class mask
    userListener->port.jack.cycleDetect = NULL;
    userListener->port.jack.portsChanged = NULL;
    userListener->port.jack.isBridged = NULL;
+   userListener->port.jack.isPromisc = NULL;
 
    /* initialize port */
    userListener->port.id = id++;
@@ -118,6 +119,9 @@ VNetUserListener_Create(uint32 classMask,  // IN: the listener's class mask
    userListener->port.fileOpWrite = NULL;
    userListener->port.fileOpIoctl = NULL;
    userListener->port.fileOpPoll = VNetUserListenerPoll;
+   userListener->port.setApiFlags = NULL;
+   userListener->port.shaper[VNET_SHAPER_TX] = NULL;
+   userListener->port.shaper[VNET_SHAPER_RX] = NULL;
 
    /* initialize user listener */
    userListener->eventListener = NULL;